@@ -26,10 +26,15 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "md5.h"
 
 #include "tapdisk.h"
 #include "tapdisk-utils.h"
@@ -58,6 +63,14 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+#define BLOCK_CACHE_SSD_DIR_ENV         "TAPDISK2_CACHE_DIR"
+#define BLOCK_CACHE_SSD_SIZE_ENV        "TAPDISK2_CACHE_SIZE"
+#define BLOCK_CACHE_SSD_SIZE            1024 /* MB */
+#define BLOCK_CACHE_SSD_MAGIC           0x7464736b63616368ULL /* "tdskcach" */
+#define BLOCK_CACHE_SSD_VERSION         2
+#define BLOCK_CACHE_SSD_WAYS            8
+#define BLOCK_CACHE_SSD_BUSY            (~0ULL)
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -67,6 +80,9 @@ typedef struct radix_tree_page          radix_tree_page_t;
 typedef struct block_cache              block_cache_t;
 typedef struct block_cache_request      block_cache_request_t;
 typedef struct block_cache_stats        block_cache_stats_t;
+typedef struct block_cache_ssd          block_cache_ssd_t;
+typedef struct block_cache_ssd_slot     block_cache_ssd_slot_t;
+typedef struct block_cache_ssd_header   block_cache_ssd_header_t;
 
 struct radix_tree_page {
 	char                           *buf;
@@ -108,6 +124,11 @@ struct block_cache_request {
 	uint64_t                        secs;
 	td_request_t                    treq;
 	block_cache_t                  *cache;
+
+	struct tiocb                    tiocb;
+	uint64_t                        block;
+	uint64_t                        slot;
+	uint32_t                        gen;
 };
 
 struct block_cache_stats {
@@ -115,11 +136,42 @@ struct block_cache_stats {
 	uint64_t                        hits;
 	uint64_t                        misses;
 	uint64_t                        prunes;
+	uint64_t                        ssd_hits;      /* in 4K blocks */
+	uint64_t                        ssd_misses;
+	uint64_t                        ssd_fills;
+};
+
+struct block_cache_ssd_header {
+	uint64_t                        magic;
+	uint32_t                        version;
+	uint32_t                        ways;
+	uint64_t                        sets;
+	uint64_t                        sectors;
+	uint64_t                        mtime;
+	uint64_t                        dirty;
+	char                            parent[256];
+};
+
+/* tag is block + 1, 0 if empty */
+struct block_cache_ssd_slot {
+	uint64_t                        tag;
+	uint32_t                        gen;
+	uint32_t                        atime;
+};
+
+struct block_cache_ssd {
+	int                             fd;
+	int                             pending;
+	uint64_t                        sets;
+	uint64_t                        data_offset;
+	size_t                          index_size;
+	block_cache_ssd_slot_t         *slots;
 };
 
 struct block_cache {
 	int                             ptype;
 	char                           *name;
+	td_driver_t                    *driver;
 
 	uint64_t                        sectors;
 
@@ -130,6 +182,7 @@ struct block_cache {
 	event_id_t                      timeout_id;
 
 	radix_tree_t                    tree;
+	block_cache_ssd_t               ssd;
 
 	block_cache_stats_t             stats;
 };
@@ -516,6 +569,460 @@ block_cache_put_request(block_cache_t *cache, block_cache_request_t *breq)
 	cache->request_free_list[cache->requests_free++] = breq;
 }
 
+static void block_cache_forward_miss(block_cache_t *, td_request_t);
+
+/*
+ * SSD tier
+ *
+ * If TAPDISK2_CACHE_DIR names a directory, normally on a local SSD, the
+ * RAM cache sits on top of a cache file there: misses are looked up in
+ * the file before going to the parent, and blocks read from the parent
+ * are written to it.  The file is named after the parent image, so all
+ * tapdisks reading the same parent share it, and it is kept across
+ * restarts.  It is reset when the parent's size or modification time
+ * changes; parents are read-only, so there are no writes to pass on.
+ *
+ * The file caches aligned 4K blocks in sets of BLOCK_CACHE_SSD_WAYS
+ * slots, replacing the least recently used slot of a set.  Its index is
+ * mapped shared by all users.  A writer claims a slot by swapping its tag
+ * to BLOCK_CACHE_SSD_BUSY and bumping its generation, and readers check
+ * that neither tag nor generation changed while they read the data.
+ *
+ * Neither data nor index are synced while the file is in use, so the
+ * header is marked dirty by every user that opens it, and only marked
+ * clean again by the last user to close it, after flushing everything and dropping slots left
+ * busy by users that died.  A file found dirty by the first user to open
+ * it was not closed cleanly and is reset.
+ */
+
+static inline uint64_t
+block_cache_ssd_data_offset(block_cache_ssd_t *ssd, uint64_t slot)
+{
+	return ssd->data_offset + (slot << RADIX_TREE_PAGE_SHIFT);
+}
+
+static inline block_cache_ssd_slot_t *
+block_cache_ssd_set(block_cache_ssd_t *ssd, uint64_t block)
+{
+	/* spread runs of blocks over all the sets */
+	uint64_t hash = block * 0x9e37fffffffc0001ULL;
+
+	return ssd->slots + (hash >> 20) % ssd->sets * BLOCK_CACHE_SSD_WAYS;
+}
+
+static block_cache_ssd_slot_t *
+block_cache_ssd_lookup(block_cache_ssd_t *ssd, uint64_t block)
+{
+	block_cache_ssd_slot_t *set;
+	int i;
+
+	set = block_cache_ssd_set(ssd, block);
+	for (i = 0; i < BLOCK_CACHE_SSD_WAYS; i++)
+		if (set[i].tag == block + 1)
+			return set + i;
+
+	return NULL;
+}
+
+static inline int
+block_cache_ssd_block(td_request_t treq, uint64_t *block)
+{
+	if (treq.sec / BLOCK_CACHE_NODES_PER_PAGE !=
+	    (treq.sec + treq.secs - 1) / BLOCK_CACHE_NODES_PER_PAGE)
+		return 0;
+
+	*block = treq.sec / BLOCK_CACHE_NODES_PER_PAGE;
+	return 1;
+}
+
+static void
+block_cache_ssd_read_done(void *arg, struct tiocb *tiocb, int err)
+{
+	block_cache_request_t *breq = arg;
+	block_cache_t *cache = breq->cache;
+	block_cache_ssd_t *ssd = &cache->ssd;
+	block_cache_ssd_slot_t *slot = ssd->slots + breq->slot;
+	td_request_t treq = breq->treq;
+	char *buf = breq->buf;
+	uint64_t sec;
+
+	ssd->pending--;
+
+	__sync_synchronize();
+	if (err || slot->tag != breq->block + 1 || slot->gen != breq->gen) {
+		/* replaced while we read it */
+		free(buf);
+		block_cache_put_request(cache, breq);
+		cache->stats.ssd_misses++;
+		block_cache_forward_miss(cache, treq);
+		return;
+	}
+
+	cache->stats.ssd_hits++;
+
+	sec = breq->block * BLOCK_CACHE_NODES_PER_PAGE;
+	memcpy(treq.buf, buf + ((treq.sec - sec) << RADIX_TREE_NODE_SHIFT),
+	       treq.secs << RADIX_TREE_NODE_SHIFT);
+
+	if (radix_tree_size(&cache->tree) + RADIX_TREE_PAGE_SIZE >=
+	    BLOCK_CACHE_MAX_SIZE ||
+	    radix_tree_add_leaves(&cache->tree, buf, sec,
+				  BLOCK_CACHE_NODES_PER_PAGE))
+		free(buf);
+
+	block_cache_put_request(cache, breq);
+	td_complete_request(treq, 0);
+}
+
+/*
+ * returns 0 if the read was queued, and the request will be completed
+ */
+static int
+block_cache_ssd_read(block_cache_t *cache, td_request_t treq)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+	block_cache_ssd_slot_t *slot;
+	block_cache_request_t *breq;
+	struct timeval now;
+	uint64_t block;
+	char *buf;
+
+	if (ssd->fd < 0 || !block_cache_ssd_block(treq, &block))
+		return -EINVAL;
+
+	slot = block_cache_ssd_lookup(ssd, block);
+	if (!slot) {
+		cache->stats.ssd_misses++;
+		return -ENOENT;
+	}
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return -EBUSY;
+
+	if (posix_memalign((void **)&buf,
+			   RADIX_TREE_PAGE_SIZE, RADIX_TREE_PAGE_SIZE)) {
+		block_cache_put_request(cache, breq);
+		return -ENOMEM;
+	}
+
+	gettimeofday(&now, NULL);
+	slot->atime = now.tv_sec;
+
+	breq->treq  = treq;
+	breq->buf   = buf;
+	breq->cache = cache;
+	breq->block = block;
+	breq->slot  = slot - ssd->slots;
+	breq->gen   = slot->gen;
+	__sync_synchronize();
+
+	ssd->pending++;
+	td_prep_read(&breq->tiocb, ssd->fd, buf, RADIX_TREE_PAGE_SIZE,
+		     block_cache_ssd_data_offset(ssd, breq->slot),
+		     block_cache_ssd_read_done, breq);
+	td_queue_tiocb(cache->driver, &breq->tiocb);
+
+	return 0;
+}
+
+static void
+block_cache_ssd_write_done(void *arg, struct tiocb *tiocb, int err)
+{
+	block_cache_request_t *breq = arg;
+	block_cache_t *cache = breq->cache;
+	block_cache_ssd_slot_t *slot = cache->ssd.slots + breq->slot;
+
+	cache->ssd.pending--;
+
+	__sync_synchronize();
+	slot->tag = err ? 0 : breq->block + 1;
+
+	if (!err)
+		cache->stats.ssd_fills++;
+
+	free(breq->buf);
+	block_cache_put_request(cache, breq);
+}
+
+static void
+block_cache_ssd_fill(block_cache_t *cache, uint64_t block, char *data)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+	block_cache_ssd_slot_t *set, *victim;
+	block_cache_request_t *breq;
+	struct timeval now;
+	uint64_t tag;
+	int i;
+
+	if (block_cache_ssd_lookup(ssd, block))
+		return;
+
+	set    = block_cache_ssd_set(ssd, block);
+	victim = NULL;
+	for (i = 0; i < BLOCK_CACHE_SSD_WAYS; i++) {
+		if (set[i].tag == BLOCK_CACHE_SSD_BUSY)
+			continue;
+		if (!victim || !set[i].tag ||
+		    (victim->tag && set[i].atime < victim->atime))
+			victim = set + i;
+	}
+
+	if (!victim)
+		return;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		return;
+
+	if (posix_memalign((void **)&breq->buf,
+			   RADIX_TREE_PAGE_SIZE, RADIX_TREE_PAGE_SIZE)) {
+		block_cache_put_request(cache, breq);
+		return;
+	}
+
+	/* someone else may be replacing the same slot */
+	tag = victim->tag;
+	if (tag == BLOCK_CACHE_SSD_BUSY ||
+	    !__sync_bool_compare_and_swap(&victim->tag, tag,
+					  BLOCK_CACHE_SSD_BUSY)) {
+		free(breq->buf);
+		block_cache_put_request(cache, breq);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	victim->gen++;
+	victim->atime = now.tv_sec;
+	__sync_synchronize();
+
+	memcpy(breq->buf, data, RADIX_TREE_PAGE_SIZE);
+	breq->cache = cache;
+	breq->block = block;
+	breq->slot  = victim - ssd->slots;
+
+	ssd->pending++;
+	td_prep_write(&breq->tiocb, ssd->fd, breq->buf, RADIX_TREE_PAGE_SIZE,
+		      block_cache_ssd_data_offset(ssd, breq->slot),
+		      block_cache_ssd_write_done, breq);
+	td_queue_tiocb(cache->driver, &breq->tiocb);
+}
+
+static int
+block_cache_ssd_path(block_cache_t *cache, const char *dir, char **path)
+{
+	uint8_t md5[16];
+	char hex[33];
+	int i;
+
+	md5_sum((const uint8_t *)cache->name, strlen(cache->name), md5);
+	for (i = 0; i < sizeof(md5); i++)
+		sprintf(hex + 2 * i, "%02x", md5[i]);
+
+	if (asprintf(path, "%s/%s.cache", dir, hex) == -1)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * with an exclusive lock on the file, set it up again if the header
+ * doesn't match; otherwise the header must match
+ */
+static int
+block_cache_ssd_check_header(block_cache_t *cache,
+			     const block_cache_ssd_header_t *want,
+			     int exclusive)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+	block_cache_ssd_header_t hdr;
+	off_t size;
+
+	size = ssd->data_offset + (want->sets * BLOCK_CACHE_SSD_WAYS <<
+				   RADIX_TREE_PAGE_SHIFT);
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (pread(ssd->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+		/* other users keep the file dirty while they have it open */
+		if (!exclusive)
+			hdr.dirty = want->dirty;
+		if (!memcmp(&hdr, want, sizeof(hdr)))
+			return 0;
+	}
+
+	if (!exclusive)
+		return -EBUSY;
+
+	DPRINTF("%s: setting up cache file%s\n", cache->name,
+		hdr.dirty ? ", was not closed cleanly" : "");
+
+	if (ftruncate(ssd->fd, 0) || ftruncate(ssd->fd, size))
+		return -errno;
+
+	if (pwrite(ssd->fd, want, sizeof(*want), 0) != sizeof(*want) ||
+	    fsync(ssd->fd))
+		return -errno;
+
+	return 0;
+}
+
+static int
+block_cache_ssd_mark(block_cache_ssd_t *ssd, uint64_t dirty)
+{
+	off_t off = offsetof(block_cache_ssd_header_t, dirty);
+
+	if (pwrite(ssd->fd, &dirty, sizeof(dirty), off) != sizeof(dirty) ||
+	    fsync(ssd->fd))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * called by the last user of the file: nobody is filling slots any more,
+ * so flush what was written and mark the file clean
+ */
+static void
+block_cache_ssd_clean(block_cache_t *cache)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+	uint64_t i;
+
+	for (i = 0; i < ssd->sets * BLOCK_CACHE_SSD_WAYS; i++)
+		if (ssd->slots[i].tag == BLOCK_CACHE_SSD_BUSY)
+			ssd->slots[i].tag = 0;
+
+	if (msync(ssd->slots, ssd->index_size, MS_SYNC) ||
+	    fsync(ssd->fd) ||
+	    block_cache_ssd_mark(ssd, 0))
+		DPRINTF("%s: failed to flush SSD cache: %d\n",
+			cache->name, -errno);
+}
+
+static void
+block_cache_ssd_close(block_cache_t *cache)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+
+	/* fills complete in the background */
+	while (ssd->pending)
+		tapdisk_server_iterate();
+
+	/*
+	 * The lock is dropped if it can't be converted, which is fine
+	 * since the file is not touched again.
+	 */
+	if (ssd->slots && !flock(ssd->fd, LOCK_EX | LOCK_NB))
+		block_cache_ssd_clean(cache);
+
+	if (ssd->slots) {
+		munmap(ssd->slots, ssd->index_size);
+		ssd->slots = NULL;
+	}
+
+	if (ssd->fd >= 0) {
+		close(ssd->fd);
+		ssd->fd = -1;
+	}
+}
+
+static int
+block_cache_ssd_open(block_cache_t *cache)
+{
+	block_cache_ssd_t *ssd = &cache->ssd;
+	block_cache_ssd_header_t hdr;
+	const char *dir, *size;
+	uint64_t mb;
+	struct stat st;
+	char *path;
+	int err, exclusive;
+
+	ssd->fd = -1;
+
+	dir = getenv(BLOCK_CACHE_SSD_DIR_ENV);
+	if (!dir)
+		return 0;
+
+	size = getenv(BLOCK_CACHE_SSD_SIZE_ENV);
+	mb   = size ? strtoull(size, NULL, 0) : BLOCK_CACHE_SSD_SIZE;
+	if (!mb)
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic   = BLOCK_CACHE_SSD_MAGIC;
+	hdr.version = BLOCK_CACHE_SSD_VERSION;
+	hdr.ways    = BLOCK_CACHE_SSD_WAYS;
+	hdr.sets    = (mb << 20) /
+		(RADIX_TREE_PAGE_SIZE * BLOCK_CACHE_SSD_WAYS);
+	hdr.sectors = cache->sectors;
+	if (!stat(cache->name, &st))
+		hdr.mtime = st.st_mtime;
+	strncpy(hdr.parent, cache->name, sizeof(hdr.parent) - 1);
+
+	ssd->sets        = hdr.sets;
+	ssd->index_size  = hdr.sets * BLOCK_CACHE_SSD_WAYS *
+		sizeof(block_cache_ssd_slot_t);
+	ssd->data_offset = RADIX_TREE_PAGE_SIZE +
+		((ssd->index_size + RADIX_TREE_PAGE_SIZE - 1) &
+		 ~((uint64_t)RADIX_TREE_PAGE_SIZE - 1));
+
+	err = block_cache_ssd_path(cache, dir, &path);
+	if (err)
+		return err;
+
+	ssd->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (ssd->fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	/*
+	 * The file can only be reset if nobody else is using it; users
+	 * keep a shared lock for as long as they have it open.
+	 */
+	exclusive = !flock(ssd->fd, LOCK_EX | LOCK_NB);
+	if (!exclusive && flock(ssd->fd, LOCK_SH)) {
+		err = -errno;
+		goto out;
+	}
+
+	err = block_cache_ssd_check_header(cache, &hdr, exclusive);
+	if (err)
+		goto out;
+
+	/*
+	 * Mark the file dirty even when sharing it: the last user may have
+	 * marked it clean while we waited for the lock.
+	 */
+	err = block_cache_ssd_mark(ssd, 1);
+	if (err)
+		goto out;
+
+	if (exclusive && flock(ssd->fd, LOCK_SH)) {
+		err = -errno;
+		goto out;
+	}
+
+	ssd->slots = mmap(NULL, ssd->index_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, ssd->fd, RADIX_TREE_PAGE_SIZE);
+	if (ssd->slots == MAP_FAILED) {
+		ssd->slots = NULL;
+		err = -errno;
+		goto out;
+	}
+
+	DPRINTF("%s: SSD cache %s, %"PRIu64" MB\n", cache->name, path, mb);
+
+out:
+	if (err) {
+		DPRINTF("%s: not using SSD cache %s: %d\n",
+			cache->name, path, err);
+		block_cache_ssd_close(cache);
+	}
+	free(path);
+	return 0;
+}
+
 static int
 block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 {
@@ -535,6 +1042,7 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		return -ENOMEM;
 
 	cache->sectors = driver->info.size;
+	cache->driver  = driver;
 
 	tree = &cache->tree;
 	err  = radix_tree_initialize(tree, cache->sectors);
@@ -558,6 +1066,8 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
+	block_cache_ssd_open(cache);
+
 	if (mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
@@ -581,6 +1091,7 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	block_cache_ssd_close(cache);
 	radix_tree_free(tree);
 	free(cache->name);
 
@@ -654,6 +1165,13 @@ block_cache_populate_cache(td_request_t clone, int err)
 		       breq->buf + off, RADIX_TREE_NODE_SIZE);
 	}
 
+	if (cache->ssd.fd >= 0 &&
+	    breq->treq.secs == BLOCK_CACHE_NODES_PER_PAGE &&
+	    !(breq->treq.sec % BLOCK_CACHE_NODES_PER_PAGE))
+		block_cache_ssd_fill(cache,
+				     breq->treq.sec / BLOCK_CACHE_NODES_PER_PAGE,
+				     breq->buf);
+
 	if (radix_tree_add_leaves(tree, breq->buf,
 				  breq->treq.sec, breq->treq.secs))
 		free(breq->buf);
@@ -664,7 +1182,7 @@ out:
 }
 
 static void
-block_cache_miss(block_cache_t *cache, td_request_t treq)
+block_cache_forward_miss(block_cache_t *cache, td_request_t treq)
 {
 	char *buf;
 	size_t size;
@@ -672,14 +1190,10 @@ block_cache_miss(block_cache_t *cache, td_request_t treq)
 	radix_tree_t *tree;
 	block_cache_request_t *breq;
 
-	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
-
 	clone = treq;
 	tree  = &cache->tree;
 	size  = treq.secs << RADIX_TREE_NODE_SHIFT;
 
-	cache->stats.misses += treq.secs;
-
 	if (radix_tree_size(tree) + size >= BLOCK_CACHE_MAX_SIZE)
 		goto out;
 
@@ -706,6 +1220,19 @@ out:
 	td_forward_request(clone);
 }
 
+static void
+block_cache_miss(block_cache_t *cache, td_request_t treq)
+{
+	DBG("%s: block cache miss: sec 0x%08llx\n", cache->name, treq.sec);
+
+	cache->stats.misses += treq.secs;
+
+	if (!block_cache_ssd_read(cache, treq))
+		return;
+
+	block_cache_forward_miss(cache, treq);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -771,6 +1298,10 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+	if (cache->ssd.fd >= 0)
+		WARN("ssd hits: %"PRIu64", ssd misses: %"PRIu64", "
+		     "ssd fills: %"PRIu64"\n",
+		     stats->ssd_hits, stats->ssd_misses, stats->ssd_fills);
 }
 
 struct tap_disk tapdisk_block_cache = {
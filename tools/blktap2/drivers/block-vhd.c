@@ -41,6 +41,15 @@
  *     writes and the zero-bitmap write complete, the BAT and bitmap writes
  *     are started in parallel.  The transaction is completed only after both
  *     the BAT and bitmap writes successfully return.
+ *
+ * A note on read-only images:
+ * The bitmaps of read-only images, typically the parents in a chain, never
+ * change.  If they fit in VHD_BM_INDEX_MAX bytes, all of them are read into
+ * an in-memory index in the background after open, so that once it is
+ * loaded, reads are resolved without any metadata I/O, and forwarding a
+ * read up the chain costs no more than a lookup per image.  Until then, and
+ * for writable images, bitmaps go through the LRU bitmap cache, which
+ * prefetches the bitmaps of the next few blocks on sequential reads.
  */
 
 #include <errno.h>
@@ -57,6 +66,7 @@
 #include "libvhd.h"
 #include "tapdisk.h"
 #include "tapdisk-driver.h"
+#include "tapdisk-server.h"
 #include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 
@@ -111,6 +121,13 @@ unsigned int SPB;
 /******VHD DEFINES******/
 #define VHD_CACHE_SIZE               32
 
+#define VHD_BM_INDEX_MAX             (32 << 20)
+#define VHD_BM_INDEX_READS           4
+
+#define VHD_PREFETCH_TRIGGER         2 /* sequential reads before prefetch */
+#define VHD_PREFETCH_BLOCKS          4
+#define VHD_PREFETCH_RESERVE         8 /* bitmap slots kept for demand reads */
+
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
 #define VHD_REQS_TOTAL               (VHD_REQS_DATA + VHD_REQS_META)
@@ -121,6 +138,7 @@ unsigned int SPB;
 #define VHD_OP_BITMAP_READ           3
 #define VHD_OP_BITMAP_WRITE          4
 #define VHD_OP_ZERO_BM_WRITE         5
+#define VHD_OP_BITMAP_INDEX_READ     6
 
 #define VHD_BM_BAT_LOCKED            0
 #define VHD_BM_BAT_CLEAR             1
@@ -148,6 +166,7 @@ unsigned int SPB;
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_PREFETCH        16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
@@ -215,6 +234,17 @@ struct vhd_bitmap {
 	struct vhd_request        req;
 };
 
+struct vhd_bitmap_index {
+	char                     *maps;        /* bitmaps of all allocated,
+						* not completely full blocks */
+	char                    **map;         /* per block, NULL if none */
+	uint8_t                  *valid;       /* map has been read */
+	uint32_t                  loaded;
+	uint32_t                  next;        /* next block to load */
+	int                       pending;
+	struct vhd_request        req[VHD_BM_INDEX_READS];
+};
+
 struct vhd_state {
 	vhd_flag_t                flags;
 
@@ -235,6 +265,13 @@ struct vhd_state {
 	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
 	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
 
+	struct vhd_bitmap_index   bm_index;
+
+	u64                       seq_next;    /* sector a sequential read
+						* would start at */
+	int                       seq_count;
+	int                       prefetch_pending;
+
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
 	struct vhd_request        vreq_list[VHD_REQS_DATA];
@@ -248,6 +285,7 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+	uint64_t                  prefetches;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -258,6 +296,7 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void load_bitmap_index(struct vhd_state *, struct vhd_request *);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -505,6 +544,108 @@ fail:
 	return err;
 }
 
+static inline int
+bitmap_index_valid(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	return idx->valid && (idx->valid[blk >> 3] & (1 << (blk & 7)));
+}
+
+static inline void
+set_bitmap_index_valid(struct vhd_state *s, uint32_t blk)
+{
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	if (!bitmap_index_valid(s, blk)) {
+		idx->valid[blk >> 3] |= 1 << (blk & 7);
+		idx->loaded++;
+	}
+}
+
+static void
+vhd_free_bitmap_index(struct vhd_state *s)
+{
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	free(idx->maps);
+	free(idx->map);
+	free(idx->valid);
+	memset(idx, 0, sizeof(struct vhd_bitmap_index));
+}
+
+/*
+ * for read-only images only: the index is never written to disk
+ */
+static int
+vhd_initialize_bitmap_index(struct vhd_state *s)
+{
+	int err;
+	char *map;
+	uint32_t i, n;
+	size_t map_size;
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	memset(idx, 0, sizeof(struct vhd_bitmap_index));
+
+	n        = 0;
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
+
+	for (i = 0; i < s->bat.bat.entries; i++)
+		if (bat_entry(s, i) != DD_BLK_UNUSED && !test_batmap(s, i))
+			n++;
+
+	if (!n || (uint64_t)n * map_size > VHD_BM_INDEX_MAX)
+		return 0;
+
+	err = posix_memalign((void **)&idx->maps, 512, n * map_size);
+	if (err) {
+		idx->maps = NULL;
+		return -err;
+	}
+
+	idx->map   = calloc(s->bat.bat.entries, sizeof(char *));
+	idx->valid = calloc((s->bat.bat.entries + 7) >> 3, 1);
+	if (!idx->map || !idx->valid) {
+		vhd_free_bitmap_index(s);
+		return -ENOMEM;
+	}
+
+	map = idx->maps;
+	for (i = 0; i < s->bat.bat.entries; i++)
+		if (bat_entry(s, i) != DD_BLK_UNUSED && !test_batmap(s, i)) {
+			idx->map[i] = map;
+			map += map_size;
+		}
+
+	return 0;
+}
+
+static void
+vhd_start_bitmap_index(struct vhd_state *s)
+{
+	int i;
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	if (!idx->map)
+		return;
+
+	for (i = 0; i < VHD_BM_INDEX_READS; i++)
+		load_bitmap_index(s, idx->req + i);
+}
+
+static void
+vhd_stop_bitmap_index(struct vhd_state *s)
+{
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	idx->next = s->bat.bat.entries;
+
+	/* neither index loads nor prefetches belong to any request */
+	while (idx->pending || s->prefetch_pending)
+		tapdisk_server_iterate();
+}
+
 static int
 vhd_initialize_dynamic_disk(struct vhd_state *s)
 {
@@ -540,6 +681,12 @@ vhd_initialize_dynamic_disk(struct vhd_state *s)
 		return err;
 	}
 
+	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY)) {
+		err = vhd_initialize_bitmap_index(s);
+		if (err)
+			EPRINTF("%s: no bitmap index: %d\n", s->vhd.file, err);
+	}
+
 	return 0;
 }
 
@@ -588,9 +735,10 @@ vhd_log_open(struct vhd_state *s)
 			full++;
 	}
 
-	DPRINTF("%s version: %s 0x%08x, b: %u, a: %u, f: %u, n: %"PRIu64"\n",
+	DPRINTF("%s version: %s 0x%08x, b: %u, a: %u, f: %u, n: %"PRIu64"%s\n",
 		s->vhd.file, buf, s->vhd.footer.crtr_ver, s->bat.bat.entries,
-		allocated, full, s->next_db);
+		allocated, full, s->next_db,
+		s->bm_index.map ? ", indexed" : "");
 }
 
 static int
@@ -664,9 +812,12 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	vhd_start_bitmap_index(s);
+
         return 0;
 
  fail:
+	vhd_free_bitmap_index(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -717,8 +868,9 @@ vhd_log_close(struct vhd_state *s)
 			full++;
 	}
 
-	DPRINTF("%s: b: %u, a: %u, f: %u, n: %"PRIu64"\n",
-		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db);
+	DPRINTF("%s: b: %u, a: %u, f: %u, n: %"PRIu64", i: %u, p: %"PRIu64"\n",
+		s->vhd.file, s->bat.bat.entries, allocated, full, s->next_db,
+		s->bm_index.loaded, s->prefetches);
 }
 
 static int
@@ -731,6 +883,8 @@ _vhd_close(td_driver_t *driver)
 	DBG(TLOG_WARN, "vhd_close\n");
 	s = (struct vhd_state *)driver->data;
 
+	vhd_stop_bitmap_index(s);
+
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
@@ -758,6 +912,7 @@ _vhd_close(td_driver_t *driver)
 
  free:
 	vhd_log_close(s);
+	vhd_free_bitmap_index(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
 	vhd_close(&s->vhd);
@@ -1167,6 +1322,10 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 		return VHD_BM_BIT_SET;
 	}
 
+	if (bitmap_index_valid(s, blk))
+		return ((vhd_bitmap_test(&s->vhd, s->bm_index.map[blk], sec)) ?
+			VHD_BM_BIT_SET : VHD_BM_BIT_CLEAR);
+
 	bm = get_bitmap(s, blk);
 	if (!bm)
 		return VHD_BM_NOT_CACHED;
@@ -1187,6 +1346,7 @@ read_bitmap_cache_span(struct vhd_state *s,
 {
 	int ret;
 	u32 blk, sec;
+	char *map;
 	struct vhd_bitmap *bm;
 
 	/* in fixed disks, every block is present */
@@ -1199,12 +1359,16 @@ read_bitmap_cache_span(struct vhd_state *s,
 	if (test_batmap(s, blk))
 		return MIN(nr_secs, s->spb - sec);
 
-	bm  = get_bitmap(s, blk);
-	
-	ASSERT(bm && bitmap_valid(bm));
+	if (bitmap_index_valid(s, blk))
+		map = s->bm_index.map[blk];
+	else {
+		bm  = get_bitmap(s, blk);
+		ASSERT(bm && bitmap_valid(bm));
+		map = bm->map;
+	}
 
 	for (ret = 0; sec < s->spb && ret < nr_secs; sec++, ret++)
-		if (vhd_bitmap_test(&s->vhd, bm->map, sec) != value)
+		if (vhd_bitmap_test(&s->vhd, map, sec) != value)
 			break;
 
 	return ret;
@@ -1461,7 +1625,8 @@ schedule_data_read(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 	offset = bat_entry(s, blk);
 
 	ASSERT(offset != DD_BLK_UNUSED);
-	ASSERT(test_batmap(s, blk) || (bm && bitmap_valid(bm)));
+	ASSERT(test_batmap(s, blk) || bitmap_index_valid(s, blk) ||
+	       (bm && bitmap_valid(bm)));
 
 	offset += s->bm_secs + sec;
 	offset  = vhd_sectors_to_bytes(offset);
@@ -1634,6 +1799,98 @@ schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 	    req->treq.secs, offset);
 }
 
+/*
+ * number of bitmap slots that are free, or hold a bitmap that may be
+ * pushed out of the cache
+ */
+static int
+bitmap_slots_available(struct vhd_state *s)
+{
+	int i, n;
+
+	n = s->bm_free_count;
+	for (i = 0; i < VHD_CACHE_SIZE; i++)
+		if (s->bitmap[i] && !bitmap_locked(s->bitmap[i]))
+			n++;
+
+	return n;
+}
+
+/*
+ * read the bitmaps of the blocks following a sequential read before
+ * they are needed.  prefetched bitmaps are not locked once read, and
+ * may be pushed out of the cache again like any other.  prefetching
+ * stops short of the slots demand reads may need.
+ */
+static void
+prefetch_bitmaps(struct vhd_state *s, td_request_t treq)
+{
+	u32 blk, end;
+	struct vhd_bitmap *bm;
+
+	if (s->vhd.footer.type == HD_TYPE_FIXED)
+		return;
+
+	if (treq.sec == s->seq_next)
+		s->seq_count++;
+	else
+		s->seq_count = 0;
+
+	s->seq_next = treq.sec + treq.secs;
+
+	if (s->seq_count < VHD_PREFETCH_TRIGGER)
+		return;
+
+	blk = s->seq_next / s->spb;
+	end = MIN(blk + VHD_PREFETCH_BLOCKS, s->bat.bat.entries);
+
+	for (; blk < end; blk++) {
+		if (bat_entry(s, blk) == DD_BLK_UNUSED ||
+		    test_batmap(s, blk) || bitmap_index_valid(s, blk) ||
+		    get_bitmap(s, blk))
+			continue;
+
+		if (bitmap_slots_available(s) <= VHD_PREFETCH_RESERVE ||
+		    schedule_bitmap_read(s, blk))
+			break;
+
+		bm = get_bitmap(s, blk);
+		set_vhd_flag(bm->req.flags, VHD_FLAG_REQ_PREFETCH);
+		s->prefetch_pending++;
+		s->prefetches++;
+	}
+}
+
+static void
+load_bitmap_index(struct vhd_state *s, struct vhd_request *req)
+{
+	u32 blk;
+	struct vhd_bitmap_index *idx = &s->bm_index;
+
+	for (blk = idx->next; blk < s->bat.bat.entries; blk++)
+		if (idx->map[blk] && !bitmap_index_valid(s, blk))
+			break;
+
+	if (blk >= s->bat.bat.entries) {
+		idx->next = s->bat.bat.entries;
+		return;
+	}
+
+	idx->next = blk + 1;
+
+	init_vhd_request(s, req);
+
+	req->treq.sec  = blk * s->spb;
+	req->treq.secs = s->bm_secs;
+	req->treq.buf  = idx->map[blk];
+	req->treq.cb   = NULL;
+	req->op        = VHD_OP_BITMAP_INDEX_READ;
+	req->next      = NULL;
+
+	idx->pending++;
+	aio_read(s, req, vhd_sectors_to_bytes(bat_entry(s, blk)));
+}
+
 /* 
  * queued requests will be submitted once the bitmap
  * describing them is read and the requests are validated. 
@@ -1671,10 +1928,8 @@ __vhd_queue_request(struct vhd_state *s, uint8_t op, td_request_t treq)
 }
 
 static void
-vhd_queue_read(td_driver_t *driver, td_request_t treq)
+__vhd_queue_read(struct vhd_state *s, td_request_t treq)
 {
-	struct vhd_state *s = (struct vhd_state *)driver->data;
-
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", secs: 0x%04x (seg: %d)\n",
 	    s->vhd.file, treq.sec, treq.secs, treq.sidx);
 
@@ -1743,6 +1998,20 @@ vhd_queue_read(td_driver_t *driver, td_request_t treq)
 	}
 }
 
+/*
+ * reads queued again once their bitmap arrives go straight to
+ * __vhd_queue_read(), so they don't disturb the sequential read
+ * detection in prefetch_bitmaps().
+ */
+static void
+vhd_queue_read(td_driver_t *driver, td_request_t treq)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	__vhd_queue_read(s, treq);
+	prefetch_bitmaps(s, treq);
+}
+
 static void
 vhd_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -2075,6 +2344,9 @@ finish_bitmap_read(struct vhd_request *req)
 	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
 	ASSERT(bm && test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING));
 
+	if (test_vhd_flag(req->flags, VHD_FLAG_REQ_PREFETCH))
+		s->prefetch_pending--;
+
 	r = bm->waiting.head;
 	clear_req_list(&bm->waiting);
 	clear_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
@@ -2082,6 +2354,13 @@ finish_bitmap_read(struct vhd_request *req)
 	if (!req->error) {
 		memcpy(bm->shadow, bm->map, vhd_sectors_to_bytes(s->bm_secs));
 
+		if (s->bm_index.map && s->bm_index.map[blk] &&
+		    !bitmap_index_valid(s, blk)) {
+			memcpy(s->bm_index.map[blk], bm->map,
+			       vhd_sectors_to_bytes(s->bm_secs));
+			set_bitmap_index_valid(s, blk);
+		}
+
 		while (r) {
 			struct vhd_request tmp;
 
@@ -2093,7 +2372,7 @@ finish_bitmap_read(struct vhd_request *req)
 			       tmp.op == VHD_OP_DATA_WRITE);
 
 			if (tmp.op == VHD_OP_DATA_READ)
-				vhd_queue_read(s->driver, tmp.treq);
+				__vhd_queue_read(s, tmp.treq);
 			else if (tmp.op == VHD_OP_DATA_WRITE)
 				vhd_queue_write(s->driver, tmp.treq);
 
@@ -2110,6 +2389,26 @@ finish_bitmap_read(struct vhd_request *req)
 		unlock_bitmap(bm);
 }
 
+static void
+finish_bitmap_index_read(struct vhd_request *req)
+{
+	u32 blk;
+	struct vhd_state *s = req->state;
+
+	s->returned++;
+	s->bm_index.pending--;
+
+	blk = req->treq.sec / s->spb;
+
+	DBG(TLOG_DBG, "blk: 0x%04x\n", blk);
+
+	/* blocks that failed to load keep going through the cache */
+	if (!req->error)
+		set_bitmap_index_valid(s, blk);
+
+	load_bitmap_index(s, req);
+}
+
 static void
 finish_bitmap_write(struct vhd_request *req)
 {
@@ -2222,6 +2521,10 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		finish_bitmap_write(req);
 		break;
 
+	case VHD_OP_BITMAP_INDEX_READ:
+		finish_bitmap_index_read(req);
+		break;
+
 	case VHD_OP_ZERO_BM_WRITE:
 		finish_zero_bm_write(req);
 		break;
@@ -2249,6 +2552,9 @@ vhd_debug(td_driver_t *driver)
 	    s->writes, (s->writes ? ((float)s->write_size / s->writes) : 0.0));
 	DBG(TLOG_WARN, "READS: 0x%08"PRIx64", AVG_READ_SIZE: %f\n",
 	    s->reads, (s->reads ? ((float)s->read_size / s->reads) : 0.0));
+	DBG(TLOG_WARN, "PREFETCHES: 0x%08"PRIx64", PENDING: %d, "
+	    "INDEXED: %u, PENDING: %d\n", s->prefetches, s->prefetch_pending,
+	    s->bm_index.loaded, s->bm_index.pending);
 
 	DBG(TLOG_WARN, "ALLOCATED REQUESTS: (%lu total)\n", VHD_REQS_DATA);
 	for (i = 0; i < VHD_REQS_DATA; i++) {
@@ -27,12 +27,20 @@
 */
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "tapdisk.h"
 #include "tapdisk-log.h"
@@ -547,6 +555,690 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+#ifdef HAVE_IO_URING
+/*
+ * io_uring
+ *
+ * Requests are spread over several rings by file descriptor, so all
+ * requests for one image go through the same ring.  Each ring signals
+ * completions through its own eventfd, registered as a separate event
+ * with the server, and completions are read straight from the shared
+ * completion ring.
+ *
+ * Options are taken from TAPDISK_IO_URING_ENV, separated by commas:
+ *   queues=N  number of rings (default 1)
+ *   poll      polled completions (IORING_SETUP_IOPOLL), for NVMe devices
+ *             opened with O_DIRECT; the server loop then doesn't sleep
+ *             while requests are in flight
+ *   sqpoll    a kernel thread per ring picks up submissions, which saves
+ *             the system calls and spreads submission over several CPUs
+ *
+ * Buffers registered with tapdisk_queue_register_buffer() are used for
+ * fixed buffer I/O, which saves mapping the pages for each request.
+ */
+
+#define IOUR_MAX_RINGS          8
+#define IOUR_MAX_BUFS           16
+
+#define IOUR_FLAG_POLL          (1<<0)
+#define IOUR_FLAG_SQPOLL        (1<<1)
+
+#define iour_mb()               __sync_synchronize()
+
+struct iour_ring {
+	struct tqueue        *queue;
+
+	int                   fd;
+	int                   event_fd;
+	int                   event_id;
+
+	void                 *sq_ptr;
+	size_t                sq_size;
+	void                 *cq_ptr;
+	size_t                cq_size;
+	struct io_uring_sqe  *sqes;
+	size_t                sqes_size;
+
+	unsigned             *sq_head;
+	unsigned             *sq_tail;
+	unsigned             *sq_mask;
+	unsigned             *sq_flags;
+	unsigned             *cq_head;
+	unsigned             *cq_tail;
+	unsigned             *cq_mask;
+	struct io_uring_cqe  *cqes;
+
+	/* tail of the SQEs filled in, but not yet made visible */
+	unsigned              sqe_tail;
+	int                   inflight;
+};
+
+struct iour_req {
+	struct iocb          *iocb;
+	struct iovec          iov;
+};
+
+struct iour {
+	int                   flags;
+	int                   nr_rings;
+	struct iour_ring      rings[IOUR_MAX_RINGS];
+
+	/* one per iocb in flight, indexed by the SQE user_data */
+	struct iour_req      *reqs;
+	int                  *free_reqs;
+	int                   nr_free;
+
+	struct io_event      *aio_events;
+
+	struct iovec          bufs[IOUR_MAX_BUFS];
+	int                   nr_bufs;
+};
+
+static inline int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		   unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+tapdisk_iour_parse_options(struct iour *iour)
+{
+	char *opts, *opt, *next;
+	int queues;
+
+	iour->nr_rings = 1;
+
+	if (!getenv(TAPDISK_IO_URING_ENV))
+		return;
+
+	opts = strdup(getenv(TAPDISK_IO_URING_ENV));
+	if (!opts)
+		return;
+
+	for (opt = strtok_r(opts, ",", &next); opt;
+	     opt = strtok_r(NULL, ",", &next)) {
+		if (sscanf(opt, "queues=%d", &queues) == 1) {
+			if (queues < 1)
+				queues = 1;
+			if (queues > IOUR_MAX_RINGS)
+				queues = IOUR_MAX_RINGS;
+			iour->nr_rings = queues;
+		} else if (!strcmp(opt, "poll"))
+			iour->flags |= IOUR_FLAG_POLL;
+		else if (!strcmp(opt, "sqpoll"))
+			iour->flags |= IOUR_FLAG_SQPOLL;
+		else
+			WARN("unknown io_uring option '%s'\n", opt);
+	}
+
+	free(opts);
+}
+
+static void
+tapdisk_iour_destroy_ring(struct iour_ring *ring)
+{
+	if (ring->event_id >= 0) {
+		tapdisk_server_unregister_event(ring->event_id);
+		ring->event_id = -1;
+	}
+
+	if (ring->event_fd >= 0) {
+		close(ring->event_fd);
+		ring->event_fd = -1;
+	}
+
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+		ring->sqes = NULL;
+	}
+
+	if (ring->cq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_size);
+		ring->cq_ptr = NULL;
+	}
+
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_size);
+		ring->sq_ptr = NULL;
+	}
+
+	if (ring->fd >= 0) {
+		close(ring->fd);
+		ring->fd = -1;
+	}
+}
+
+static void *
+tapdisk_iour_map(int fd, size_t size, off_t off)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, fd, off);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static void tapdisk_iour_event(event_id_t, char, void *);
+
+static int
+tapdisk_iour_setup_ring(struct tqueue *queue, struct iour_ring *ring,
+			int qlen)
+{
+	struct iour *iour = queue->tio_data;
+	struct io_uring_params p;
+	unsigned *sq_array;
+	unsigned i;
+	int err;
+
+	ring->queue = queue;
+
+	memset(&p, 0, sizeof(p));
+	if (iour->flags & IOUR_FLAG_POLL)
+		p.flags |= IORING_SETUP_IOPOLL;
+	if (iour->flags & IOUR_FLAG_SQPOLL)
+		p.flags |= IORING_SETUP_SQPOLL;
+
+	ring->fd = sys_io_uring_setup(qlen, &p);
+	if (ring->fd < 0) {
+		err = -errno;
+		ERR(err, "io_uring_setup failed");
+		return err;
+	}
+
+	ring->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size   = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = tapdisk_iour_map(ring->fd, ring->sq_size,
+					IORING_OFF_SQ_RING);
+	ring->cq_ptr = tapdisk_iour_map(ring->fd, ring->cq_size,
+					IORING_OFF_CQ_RING);
+	ring->sqes   = tapdisk_iour_map(ring->fd, ring->sqes_size,
+					IORING_OFF_SQES);
+	if (!ring->sq_ptr || !ring->cq_ptr || !ring->sqes)
+		return -errno;
+
+	ring->sq_head  = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail  = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask  = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_flags = ring->sq_ptr + p.sq_off.flags;
+	ring->cq_head  = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail  = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask  = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes     = ring->cq_ptr + p.cq_off.cqes;
+	ring->sqe_tail = *ring->sq_tail;
+
+	/* SQEs are used in order, so the index array never changes. */
+	sq_array = ring->sq_ptr + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	/* Polled rings can't signal completions, we look for them. */
+	if (iour->flags & IOUR_FLAG_POLL)
+		return 0;
+
+	ring->event_fd = tapdisk_sys_eventfd(0);
+	if (ring->event_fd < 0)
+		return -errno;
+
+	if (sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+				  &ring->event_fd, 1) < 0) {
+		err = -errno;
+		ERR(err, "io_uring eventfd registration failed");
+		return err;
+	}
+
+	ring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      ring->event_fd, 0,
+					      tapdisk_iour_event,
+					      ring);
+	if (ring->event_id < 0)
+		return ring->event_id;
+
+	return 0;
+}
+
+static void
+tapdisk_iour_destroy(struct tqueue *queue)
+{
+	struct iour *iour = queue->tio_data;
+	int i;
+
+	if (!iour)
+		return;
+
+	for (i = 0; i < iour->nr_rings; i++)
+		tapdisk_iour_destroy_ring(&iour->rings[i]);
+
+	free(iour->aio_events);
+	iour->aio_events = NULL;
+
+	free(iour->free_reqs);
+	iour->free_reqs = NULL;
+
+	free(iour->reqs);
+	iour->reqs = NULL;
+}
+
+static int
+tapdisk_iour_setup(struct tqueue *queue, int qlen)
+{
+	struct iour *iour = queue->tio_data;
+	int i, err;
+
+	tapdisk_iour_parse_options(iour);
+
+	for (i = 0; i < iour->nr_rings; i++) {
+		iour->rings[i].fd       = -1;
+		iour->rings[i].event_fd = -1;
+		iour->rings[i].event_id = -1;
+	}
+
+	iour->reqs       = calloc(qlen, sizeof(struct iour_req));
+	iour->free_reqs  = calloc(qlen, sizeof(int));
+	iour->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!iour->reqs || !iour->free_reqs || !iour->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	for (i = 0; i < qlen; i++)
+		iour->free_reqs[i] = i;
+	iour->nr_free = qlen;
+
+	/*
+	 * Every ring is as large as the whole queue: the number of
+	 * requests in flight is limited by the queue, and this way a
+	 * ring never runs out of SQEs, whatever the files being used.
+	 */
+	for (i = 0; i < iour->nr_rings; i++) {
+		err = tapdisk_iour_setup_ring(queue, &iour->rings[i], qlen);
+		if (err)
+			goto fail;
+	}
+
+	DPRINTF("io_uring: %d rings%s%s\n", iour->nr_rings,
+		iour->flags & IOUR_FLAG_POLL ? ", polled" : "",
+		iour->flags & IOUR_FLAG_SQPOLL ? ", sqpoll" : "");
+
+	return 0;
+
+fail:
+	tapdisk_iour_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_iour_find_buf(struct iour *iour, char *buf, size_t size)
+{
+	int i;
+
+	for (i = 0; i < iour->nr_bufs; i++) {
+		char *start = iour->bufs[i].iov_base;
+
+		if (buf >= start &&
+		    buf + size <= start + iour->bufs[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static int
+tapdisk_iour_update_bufs(struct iour *iour)
+{
+	int i, err = 0;
+
+	for (i = 0; i < iour->nr_rings; i++) {
+		struct iour_ring *ring = &iour->rings[i];
+
+		/* ENXIO just means nothing was registered yet. */
+		if (sys_io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS,
+					  NULL, 0) < 0 && errno != ENXIO)
+			err = -errno;
+
+		if (!err && iour->nr_bufs &&
+		    sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+					  iour->bufs, iour->nr_bufs) < 0)
+			err = -errno;
+	}
+
+	return err;
+}
+
+static void
+tapdisk_iour_drop_bufs(struct iour *iour)
+{
+	iour->nr_bufs = 0;
+	tapdisk_iour_update_bufs(iour);
+}
+
+static int
+tapdisk_iour_register(struct tqueue *queue, void *buf, size_t size)
+{
+	struct iour *iour = queue->tio_data;
+	int err;
+
+	if (iour->nr_bufs == IOUR_MAX_BUFS)
+		return -ENOSPC;
+
+	iour->bufs[iour->nr_bufs].iov_base = buf;
+	iour->bufs[iour->nr_bufs].iov_len  = size;
+	iour->nr_bufs++;
+
+	err = tapdisk_iour_update_bufs(iour);
+	if (err) {
+		/*
+		 * The pages may not be suitable (e.g. foreign mappings), so
+		 * carry on with the other buffers and normal I/O for these.
+		 */
+		DPRINTF("io_uring: can't register buffer %p: %d\n", buf, err);
+		iour->nr_bufs--;
+		if (tapdisk_iour_update_bufs(iour))
+			tapdisk_iour_drop_bufs(iour);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_iour_unregister(struct tqueue *queue, void *buf)
+{
+	struct iour *iour = queue->tio_data;
+	int i;
+
+	for (i = 0; i < iour->nr_bufs; i++)
+		if (iour->bufs[i].iov_base == buf)
+			break;
+
+	if (i == iour->nr_bufs)
+		return;
+
+	iour->bufs[i] = iour->bufs[--iour->nr_bufs];
+
+	if (tapdisk_iour_update_bufs(iour))
+		tapdisk_iour_drop_bufs(iour);
+}
+
+static void
+tapdisk_iour_queue_iocb(struct iour *iour, struct iocb *iocb)
+{
+	struct iour_ring *ring;
+	struct io_uring_sqe *sqe;
+	struct iour_req *req;
+	int idx, buf, write;
+
+	ring = &iour->rings[iocb->aio_fildes % iour->nr_rings];
+	sqe  = &ring->sqes[ring->sqe_tail++ & *ring->sq_mask];
+	idx  = iour->free_reqs[--iour->nr_free];
+	req  = &iour->reqs[idx];
+
+	req->iocb = iocb;
+	ring->inflight++;
+
+	write = iocb->aio_lio_opcode == IO_CMD_PWRITE;
+	buf   = tapdisk_iour_find_buf(iour, iocb->u.c.buf, iocb->u.c.nbytes);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd        = iocb->aio_fildes;
+	sqe->off       = iocb->u.c.offset;
+	sqe->user_data = idx;
+
+	if (buf >= 0) {
+		sqe->opcode    = write ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr      = (unsigned long)iocb->u.c.buf;
+		sqe->len       = iocb->u.c.nbytes;
+		sqe->buf_index = buf;
+	} else {
+		/* the iovec must stay around until the request completes */
+		req->iov.iov_base = iocb->u.c.buf;
+		req->iov.iov_len  = iocb->u.c.nbytes;
+
+		sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr      = (unsigned long)&req->iov;
+		sqe->len       = 1;
+	}
+}
+
+static void tapdisk_iour_complete(struct tqueue *queue, int ret);
+
+/*
+ * take the SQEs the kernel didn't consume back off the ring, and fail
+ * them, as the libaio queue does when io_submit fails
+ */
+static void
+tapdisk_iour_fail(struct iour *iour, struct iour_ring *ring, int err)
+{
+	struct io_uring_sqe *sqe;
+	struct io_event *ep;
+	unsigned head;
+	int n = 0;
+
+	/* without an SQ thread, the kernel only consumes SQEs on enter */
+	head = *ring->sq_head;
+	iour_mb();
+
+	for (; head != ring->sqe_tail; head++) {
+		sqe = &ring->sqes[head & *ring->sq_mask];
+		ep  = &iour->aio_events[n++];
+
+		ep->obj  = iour->reqs[sqe->user_data].iocb;
+		ep->res  = err;
+		ep->res2 = 0;
+
+		iour->free_reqs[iour->nr_free++] = sqe->user_data;
+	}
+
+	ring->sqe_tail = *ring->sq_head;
+	iour_mb();
+	*ring->sq_tail = ring->sqe_tail;
+
+	ring->inflight -= n;
+
+	if (n)
+		tapdisk_iour_complete(ring->queue, n);
+}
+
+static void
+tapdisk_iour_enter(struct iour *iour, struct iour_ring *ring)
+{
+	unsigned to_submit;
+	int ret, err;
+
+	if (ring->sqe_tail != *ring->sq_tail) {
+		iour_mb();
+		*ring->sq_tail = ring->sqe_tail;
+		iour_mb();
+	}
+
+	if (iour->flags & IOUR_FLAG_SQPOLL) {
+		if (*ring->sq_flags & IORING_SQ_NEED_WAKEUP)
+			sys_io_uring_enter(ring->fd, 0, 0,
+					   IORING_ENTER_SQ_WAKEUP);
+		return;
+	}
+
+	to_submit = ring->sqe_tail - *ring->sq_head;
+	if (!to_submit)
+		return;
+
+	/*
+	 * Whatever isn't taken now on a transient failure stays on the
+	 * ring and is retried on the next round.  Anything else fails the
+	 * requests, rather than retrying them forever.
+	 */
+	ret = sys_io_uring_enter(ring->fd, to_submit, 0, 0);
+	if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+		err = -errno;
+		ERR(err, "io_uring_enter error: %u requests failed",
+		    ring->sqe_tail - *ring->sq_head);
+		tapdisk_iour_fail(iour, ring, err);
+		return;
+	}
+
+	if (ring->sqe_tail != *ring->sq_head)
+		tapdisk_server_set_max_timeout(0);
+}
+
+static int
+tapdisk_iour_reap(struct iour *iour, struct iour_ring *ring)
+{
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	unsigned head, tail;
+	int n = 0;
+
+	head = *ring->cq_head;
+	tail = *ring->cq_tail;
+	iour_mb();
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		ep  = &iour->aio_events[n++];
+
+		ep->obj  = iour->reqs[cqe->user_data].iocb;
+		ep->res  = cqe->res;
+		ep->res2 = 0;
+
+		iour->free_reqs[iour->nr_free++] = cqe->user_data;
+	}
+
+	iour_mb();
+	*ring->cq_head = head;
+
+	ring->inflight -= n;
+
+	return n;
+}
+
+static void
+tapdisk_iour_complete(struct tqueue *queue, int ret)
+{
+	struct iour *iour = queue->tio_data;
+	int i, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	split = io_split(&queue->opioctx, iour->aio_events, ret);
+	tapdisk_filter_events(queue->filter, iour->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = iour->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static void
+tapdisk_iour_event(event_id_t id, char mode, void *private)
+{
+	struct iour_ring *ring = private;
+	struct tqueue *queue = ring->queue;
+	uint64_t val;
+	int ret;
+
+	read_exact(ring->event_fd, &val, sizeof(val));
+
+	ret = tapdisk_iour_reap(queue->tio_data, ring);
+	if (ret)
+		tapdisk_iour_complete(queue, ret);
+}
+
+static void
+tapdisk_iour_poll(struct tqueue *queue)
+{
+	struct iour *iour = queue->tio_data;
+	struct iour_ring *ring;
+	int i, ret;
+
+	for (i = 0; i < iour->nr_rings; i++) {
+		ring = &iour->rings[i];
+		if (!ring->inflight)
+			continue;
+
+		/* the SQ thread does the polling for us */
+		if (!(iour->flags & IOUR_FLAG_SQPOLL))
+			sys_io_uring_enter(ring->fd, 0, 0,
+					   IORING_ENTER_GETEVENTS);
+
+		ret = tapdisk_iour_reap(iour, ring);
+		if (ret)
+			tapdisk_iour_complete(queue, ret);
+	}
+}
+
+static int
+tapdisk_iour_submit(struct tqueue *queue)
+{
+	struct iour *iour = queue->tio_data;
+	int i, merged = 0;
+
+	if (iour->flags & IOUR_FLAG_POLL)
+		tapdisk_iour_poll(queue);
+
+	if (queue->queued) {
+		tapdisk_filter_iocbs(queue->filter,
+				     queue->iocbs, queue->queued);
+		merged = io_merge(&queue->opioctx,
+				  queue->iocbs, queue->queued);
+
+		for (i = 0; i < merged; i++)
+			tapdisk_iour_queue_iocb(iour, queue->iocbs[i]);
+
+		DBG("queued: %d, merged: %d\n", queue->queued, merged);
+
+		queue->iocbs_pending  += merged;
+		queue->tiocbs_pending += queue->queued;
+		queue->queued          = 0;
+	}
+
+	/* one system call per ring for the whole batch */
+	for (i = 0; i < iour->nr_rings; i++)
+		tapdisk_iour_enter(iour, &iour->rings[i]);
+
+	if ((iour->flags & IOUR_FLAG_POLL) && queue->iocbs_pending)
+		tapdisk_server_set_max_timeout(0);
+
+	return merged;
+}
+
+static const struct tio td_tio_iour = {
+	.name           = "io_uring",
+	.data_size      = sizeof(struct iour),
+	.tio_setup      = tapdisk_iour_setup,
+	.tio_destroy    = tapdisk_iour_destroy,
+	.tio_submit     = tapdisk_iour_submit,
+	.tio_register   = tapdisk_iour_register,
+	.tio_unregister = tapdisk_iour_unregister,
+};
+#endif /* HAVE_IO_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1267,11 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef HAVE_IO_URING
+	case TIO_DRV_IOURING:
+		tio = &td_tio_iour;
+		break;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -673,6 +1370,22 @@ tapdisk_debug_queue(struct tqueue *queue)
 	}
 }
 
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register)
+		return -EOPNOTSUPP;
+
+	return queue->tio->tio_register(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister)
+		queue->tio->tio_unregister(queue, buf);
+}
+
 void
 tapdisk_prep_tiocb(struct tiocb *tiocb, int fd, int rw, char *buf, size_t size,
 		   long long offset, td_queue_callback_t cb, void *arg)
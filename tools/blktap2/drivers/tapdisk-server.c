@@ -101,6 +101,18 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -208,6 +220,17 @@ tapdisk_server_stop_vbds(void)
 static int
 tapdisk_server_init_aio(void)
 {
+	int err;
+
+	if (getenv(TAPDISK_IO_URING_ENV)) {
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_IOURING, NULL);
+		if (!err)
+			return 0;
+
+		EPRINTF("io_uring not available (%d), using libaio\n", err);
+	}
+
 	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
 				  TIO_DRV_LIO, NULL);
 }
@@ -629,6 +629,10 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 	ring->vstart =
 		(unsigned long)ring->mem + (BLKTAP_RING_PAGES * psize);
 
+	/* Requests are done in place, try to have the pages mapped once. */
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       psize * MMAP_PAGES);
+
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
 	return 0;
@@ -652,8 +656,10 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	if (vbd->ring.fd != -1)
 		close(vbd->ring.fd);
-	if (vbd->ring.mem > 0)
+	if (vbd->ring.mem > 0) {
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
 		munmap(vbd->ring.mem, psize * BLKTAP_MMAP_REGION_SIZE);
+	}
 
 	return 0;
 }
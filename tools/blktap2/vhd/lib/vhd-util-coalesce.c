@@ -28,131 +28,393 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 
 #include "libvhd.h"
 
+/*
+ * Blocks are copied by several threads at once.  Reading the child and
+ * writing a raw parent only needs pread/pwrite, but writes to a VHD
+ * parent may have to allocate blocks, so they are serialized.  Where the
+ * filesystem supports it, data goes from the child to a raw parent with
+ * copy_file_range, which can share extents instead of copying them.
+ */
+
+#define VHD_COALESCE_JOBS       4
+
+struct vhd_coalesce {
+	vhd_context_t          *vhd;
+	vhd_context_t          *parent;        /* NULL if the parent is raw */
+	int                     parent_fd;
+
+	int                     jobs;
+	int                     progress;
+	uint64_t                rate;          /* bytes/s, 0 if unlimited */
+
+	pthread_mutex_t         lock;
+	int                     copy_range;
+	int                     err;
+	uint64_t                next;          /* next block to look at */
+	uint64_t                done;
+	uint64_t                total;
+	uint64_t                bytes;
+	int                     percent;
+	struct timeval          start;
+};
+
 static int
 __raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
 {
-	off_t off;
-	size_t ret;
+	ssize_t ret;
 
 	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
-	}
-
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
+	ret = pwrite(fd, buf, vhd_sectors_to_bytes(secs),
+		     vhd_sectors_to_bytes(sec));
 	if (ret == vhd_sectors_to_bytes(secs))
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
+	printf("raw parent: write of 0x%"PRIx64" at 0x%08"PRIx64" "
+	       "returned %zd, errno: %d\n", vhd_sectors_to_bytes(secs),
+	       vhd_sectors_to_bytes(sec), ret, -errno);
 	return (errno ? -errno : -EIO);
 }
 
+static int
+__raw_io_copy(struct vhd_coalesce *c, uint64_t off, uint64_t sec,
+	      uint32_t secs)
+{
+#ifdef __NR_copy_file_range
+	ssize_t ret;
+	size_t size;
+	loff_t in, out;
+
+	in   = off;
+	out  = vhd_sectors_to_bytes(sec);
+	size = vhd_sectors_to_bytes(secs);
+
+	while (size) {
+		ret = syscall(__NR_copy_file_range, c->vhd->fd, &in,
+			      c->parent_fd, &out, size, 0);
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return -ENODATA; /* block truncated at end of file */
+
+		size -= ret;
+	}
+
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * finds the next run of sectors present in @map at or after @start
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_util_coalesce_next_run(vhd_context_t *vhd, char *map,
+			   uint32_t *start, uint32_t *secs)
 {
-	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+	uint32_t i, n;
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	for (i = *start; i < vhd->spb; i++)
+		if (!map || vhd_bitmap_test(vhd, map, i))
+			break;
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	if (i >= vhd->spb)
 		return 0;
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	for (n = 0; i + n < vhd->spb; n++)
+		if (map && !vhd_bitmap_test(vhd, map, i + n))
+			break;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	*start = i;
+	*secs  = n;
+	return 1;
+}
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+/*
+ * returns 0 with *bytes set once the block has been copied, and -EAGAIN
+ * if it has to be copied through a buffer instead
+ */
+static int
+vhd_util_coalesce_copy_block(struct vhd_coalesce *c, uint64_t block,
+			     char *map, uint64_t *bytes)
+{
+	int err;
+	uint32_t i, secs;
+	uint64_t sec, off;
+	vhd_context_t *vhd = c->vhd;
+
+	sec = block * vhd->spb;
+	off = vhd_sectors_to_bytes(vhd->bat.bat[block] + vhd->bm_secs);
+
+	for (i = 0; vhd_util_coalesce_next_run(vhd, map, &i, &secs); i += secs) {
+		err = __raw_io_copy(c, off + vhd_sectors_to_bytes(i),
+				    sec + i, secs);
+		if (err == -ENODATA)
+			return -EAGAIN;
+		if (err == -EXDEV || err == -EINVAL ||
+		    err == -ENOSYS || err == -EOPNOTSUPP) {
+			pthread_mutex_lock(&c->lock);
+			c->copy_range = 0;
+			pthread_mutex_unlock(&c->lock);
+			return -EAGAIN;
+		}
+		if (err)
+			return err;
+
+		*bytes += vhd_sectors_to_bytes(secs);
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	return 0;
+}
+
+static int
+vhd_util_coalesce_block(struct vhd_coalesce *c, uint64_t block,
+			char *buf, char *map, uint64_t *bytes)
+{
+	int err, copy_range;
+	ssize_t ret;
+	size_t size;
+	uint32_t i, secs;
+	uint64_t sec, off;
+	vhd_context_t *vhd = c->vhd;
+
+	*bytes = 0;
+	sec    = block * vhd->spb;
+	off    = vhd_sectors_to_bytes(vhd->bat.bat[block]);
+
+	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block))
+		map = NULL;
+	else {
+		size = vhd_sectors_to_bytes(vhd->bm_secs);
+		ret  = pread(vhd->fd, map, size, off);
+		if (ret != size)
+			return (ret < 0 ? -errno : -EIO);
+	}
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
-			continue;
+	off += vhd_sectors_to_bytes(vhd->bm_secs);
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
+	pthread_mutex_lock(&c->lock);
+	copy_range = c->copy_range;
+	pthread_mutex_unlock(&c->lock);
+
+	if (!c->parent && copy_range) {
+		err = vhd_util_coalesce_copy_block(c, block, map, bytes);
+		if (err != -EAGAIN)
+			return err;
+		*bytes = 0;
+	}
+
+	size = vhd->header.block_size;
+	ret  = pread(vhd->fd, buf, size, off);
+	if (ret < 0)
+		return -errno;
+	if (ret < size)
+		memset(buf + ret, 0, size - ret);
 
-		if (parent->file)
-			err = vhd_io_write(parent,
+	for (i = 0; vhd_util_coalesce_next_run(vhd, map, &i, &secs); i += secs) {
+		if (c->parent) {
+			pthread_mutex_lock(&c->lock);
+			err = vhd_io_write(c->parent,
 					   buf + vhd_sectors_to_bytes(i),
 					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
+			pthread_mutex_unlock(&c->lock);
+		} else
+			err = __raw_io_write(c->parent_fd,
 					     buf + vhd_sectors_to_bytes(i),
 					     sec + i, secs);
 		if (err)
-			goto done;
+			return err;
 
-		i += secs;
+		*bytes += vhd_sectors_to_bytes(secs);
 	}
 
-	err = 0;
+	return 0;
+}
+
+static void
+vhd_util_coalesce_account(struct vhd_coalesce *c, uint64_t bytes)
+{
+	int percent;
+	int64_t delay;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&c->lock);
+
+	c->done++;
+	c->bytes += bytes;
+
+	percent = c->done * 100 / c->total;
+	if (c->progress && percent != c->percent) {
+		printf("\r%3d%% (%"PRIu64"/%"PRIu64" blocks)",
+		       percent, c->done, c->total);
+		fflush(stdout);
+	}
+	c->percent = percent;
+
+	delay = 0;
+	if (c->rate)
+		delay = (int64_t)(c->bytes * 1000000 / c->rate) -
+			((now.tv_sec - c->start.tv_sec) * 1000000LL +
+			 now.tv_usec - c->start.tv_usec);
+
+	pthread_mutex_unlock(&c->lock);
+
+	if (delay > 0)
+		usleep(delay);
+}
+
+static void *
+vhd_util_coalesce_worker(void *arg)
+{
+	int err;
+	char *buf, *map;
+	uint64_t block, bytes;
+	struct vhd_coalesce *c = arg;
+	vhd_context_t *vhd = c->vhd;
+
+	buf = NULL;
+	map = NULL;
+
+	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
+	if (err) {
+		buf = NULL;
+		err = -err;
+		goto out;
+	}
+
+	err = posix_memalign((void **)&map, 4096,
+			     vhd_sectors_to_bytes(vhd->bm_secs));
+	if (err) {
+		map = NULL;
+		err = -err;
+		goto out;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		for (block = c->next; block < vhd->bat.entries; block++)
+			if (vhd->bat.bat[block] != DD_BLK_UNUSED)
+				break;
+		c->next = block + 1;
+		if (c->err)
+			block = vhd->bat.entries;
+		pthread_mutex_unlock(&c->lock);
+
+		if (block >= vhd->bat.entries)
+			break;
+
+		err = vhd_util_coalesce_block(c, block, buf, map, &bytes);
+		if (err) {
+			printf("error coalescing block 0x%"PRIx64": %d\n",
+			       block, err);
+			goto out;
+		}
+
+		vhd_util_coalesce_account(c, bytes);
+	}
+
+out:
+	if (err) {
+		pthread_mutex_lock(&c->lock);
+		if (!c->err)
+			c->err = err;
+		pthread_mutex_unlock(&c->lock);
+	}
 
-done:
 	free(buf);
 	free(map);
-	return err;
+	return NULL;
 }
 
-int
-vhd_util_coalesce(int argc, char **argv)
+static int
+vhd_util_coalesce_run(struct vhd_coalesce *c)
 {
-	int err, c;
-	uint64_t i;
-	char *name, *pname;
-	vhd_context_t vhd, parent;
-	int parent_fd = -1;
+	int i, err;
+	uint64_t b;
+	pthread_t *threads;
+	vhd_context_t *vhd = c->vhd;
 
-	name  = NULL;
-	pname = NULL;
-	parent.file = NULL;
+	err = vhd_get_bat(vhd);
+	if (err)
+		return err;
 
-	if (!argc || !argv)
-		goto usage;
+	if (vhd_has_batmap(vhd)) {
+		err = vhd_get_batmap(vhd);
+		if (err)
+			return err;
+	}
 
-	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
-		switch (c) {
-		case 'n':
-			name = optarg;
+	c->total = 0;
+	for (b = 0; b < vhd->bat.entries; b++)
+		if (vhd->bat.bat[b] != DD_BLK_UNUSED)
+			c->total++;
+
+	if (!c->total)
+		return 0;
+
+	c->err     = 0;
+	c->next    = 0;
+	c->done    = 0;
+	c->bytes   = 0;
+	c->percent = -1;
+	gettimeofday(&c->start, NULL);
+
+	if (c->jobs <= 1) {
+		vhd_util_coalesce_worker(c);
+		goto out;
+	}
+
+	threads = calloc(c->jobs, sizeof(pthread_t));
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 0; i < c->jobs; i++) {
+		err = pthread_create(threads + i, NULL,
+				     vhd_util_coalesce_worker, c);
+		if (err) {
+			pthread_mutex_lock(&c->lock);
+			if (!c->err)
+				c->err = -err;
+			pthread_mutex_unlock(&c->lock);
 			break;
-		case 'h':
-		default:
-			goto usage;
 		}
 	}
 
-	if (!name || optind != argc)
-		goto usage;
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+out:
+	if (c->progress)
+		printf("\n");
+
+	return c->err;
+}
+
+/*
+ * coalesce @name into @pname, which is raw if @raw is set
+ */
+static int
+__vhd_util_coalesce(const char *name, const char *pname, int raw,
+		    struct vhd_coalesce *c)
+{
+	int err;
+	vhd_context_t vhd, parent;
+
+	c->parent    = NULL;
+	c->parent_fd = -1;
 
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
 	if (err) {
@@ -160,16 +422,9 @@ vhd_util_coalesce(int argc, char **argv)
 		return err;
 	}
 
-	err = vhd_parent_locator_get(&vhd, &pname);
-	if (err) {
-		printf("error finding %s parent: %d\n", name, err);
-		vhd_close(&vhd);
-		return err;
-	}
-
-	if (vhd_parent_raw(&vhd)) {
-		parent_fd = open(pname, O_RDWR | O_DIRECT | O_LARGEFILE, 0644);
-		if (parent_fd == -1) {
+	if (raw) {
+		c->parent_fd = open(pname, O_RDWR | O_DIRECT | O_LARGEFILE, 0644);
+		if (c->parent_fd == -1) {
 			err = -errno;
 			printf("failed to open parent %s: %d\n", pname, err);
 			vhd_close(&vhd);
@@ -179,40 +434,202 @@ vhd_util_coalesce(int argc, char **argv)
 		err = vhd_open(&parent, pname, VHD_OPEN_RDWR);
 		if (err) {
 			printf("error opening %s: %d\n", pname, err);
-			free(pname);
 			vhd_close(&vhd);
 			return err;
 		}
+		c->parent = &parent;
+	}
+
+	if (c->progress)
+		printf("coalescing %s into %s\n", name, pname);
+
+	c->vhd = &vhd;
+	err = vhd_util_coalesce_run(c);
+
+	vhd_close(&vhd);
+	if (c->parent)
+		vhd_close(c->parent);
+	else
+		close(c->parent_fd);
+	return err;
+}
+
+static void
+vhd_util_coalesce_free_chain(char **chain, int n)
+{
+	while (n--)
+		free(chain[n]);
+	free(chain);
+}
+
+/*
+ * lists the images from @name up to, but not including, @ancestor
+ */
+static int
+vhd_util_coalesce_chain(const char *name, const char *ancestor,
+			char ***_chain, int *_n, int *raw)
+{
+	int err, n;
+	char **chain, **tmp, *cur, *pname;
+	struct stat a, st;
+	vhd_context_t vhd;
+
+	*_chain = NULL;
+	*_n     = 0;
+
+	if (stat(ancestor, &a)) {
+		err = -errno;
+		printf("error finding %s: %d\n", ancestor, err);
+		return err;
 	}
 
-	err = vhd_get_bat(&vhd);
+	n     = 0;
+	chain = NULL;
+	cur   = strdup(name);
+	if (!cur)
+		return -ENOMEM;
+
+	for (;;) {
+		tmp = realloc(chain, (n + 1) * sizeof(char *));
+		if (!tmp) {
+			free(cur);
+			err = -ENOMEM;
+			goto fail;
+		}
+		chain      = tmp;
+		chain[n++] = cur;
+
+		err = vhd_open(&vhd, cur, VHD_OPEN_RDONLY);
+		if (err) {
+			printf("error opening %s: %d\n", cur, err);
+			goto fail;
+		}
+
+		err  = vhd_parent_locator_get(&vhd, &pname);
+		*raw = vhd_parent_raw(&vhd);
+		vhd_close(&vhd);
+
+		if (err) {
+			printf("%s is not an ancestor of %s\n", ancestor, name);
+			goto fail;
+		}
+
+		if (!stat(pname, &st) &&
+		    st.st_dev == a.st_dev && st.st_ino == a.st_ino) {
+			free(pname);
+			break;
+		}
+
+		if (*raw) {
+			printf("%s is not an ancestor of %s\n", ancestor, name);
+			free(pname);
+			err = -EINVAL;
+			goto fail;
+		}
+
+		cur = pname;
+	}
+
+	*_chain = chain;
+	*_n     = n;
+	return 0;
+
+fail:
+	vhd_util_coalesce_free_chain(chain, n);
+	return err;
+}
+
+int
+vhd_util_coalesce(int argc, char **argv)
+{
+	int err, c, i, n, raw;
+	char *name, *pname, *ancestor, **chain;
+	struct vhd_coalesce coalesce;
+	vhd_context_t vhd;
+
+	name     = NULL;
+	pname    = NULL;
+	ancestor = NULL;
+
+	memset(&coalesce, 0, sizeof(coalesce));
+	coalesce.jobs       = VHD_COALESCE_JOBS;
+	coalesce.copy_range = 1;
+
+	if (!argc || !argv)
+		goto usage;
+
+	optind = 0;
+	while ((c = getopt(argc, argv, "n:a:j:t:ph")) != -1) {
+		switch (c) {
+		case 'n':
+			name = optarg;
+			break;
+		case 'a':
+			ancestor = optarg;
+			break;
+		case 'j':
+			coalesce.jobs = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			coalesce.rate = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'p':
+			coalesce.progress = 1;
+			break;
+		case 'h':
+		default:
+			goto usage;
+		}
+	}
+
+	if (!name || optind != argc || coalesce.jobs < 1)
+		goto usage;
+
+	err = pthread_mutex_init(&coalesce.lock, NULL);
 	if (err)
-		goto done;
+		return -err;
 
-	if (vhd_has_batmap(&vhd)) {
-		err = vhd_get_batmap(&vhd);
+	if (ancestor) {
+		err = vhd_util_coalesce_chain(name, ancestor, &chain, &n, &raw);
 		if (err)
-			goto done;
+			goto out;
+
+		/* oldest first, so that newer data overwrites it */
+		for (i = n - 1; i >= 0; i--) {
+			err = __vhd_util_coalesce(chain[i], ancestor,
+						  raw, &coalesce);
+			if (err)
+				break;
+		}
+
+		vhd_util_coalesce_free_chain(chain, n);
+		goto out;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
-		if (err)
-			goto done;
+	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
+	if (err) {
+		printf("error opening %s: %d\n", name, err);
+		goto out;
 	}
 
-	err = 0;
+	err = vhd_parent_locator_get(&vhd, &pname);
+	raw = vhd_parent_raw(&vhd);
+	vhd_close(&vhd);
 
- done:
+	if (err) {
+		printf("error finding %s parent: %d\n", name, err);
+		goto out;
+	}
+
+	err = __vhd_util_coalesce(name, pname, raw, &coalesce);
 	free(pname);
-	vhd_close(&vhd);
-	if (parent.file)
-		vhd_close(&parent);
-	else
-		close(parent_fd);
+
+ out:
+	pthread_mutex_destroy(&coalesce.lock);
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-a ancestor] [-j jobs] "
+	       "[-t throttle MB/s] [-p progress] [-h help]\n");
 	return -EINVAL;
 }
@@ -1234,6 +1234,7 @@ typedef struct xen_sysctl_cputopo xc_cputopo_t;
 typedef struct xen_sysctl_numainfo xc_numainfo_t;
 typedef struct xen_sysctl_meminfo xc_meminfo_t;
 typedef struct xen_sysctl_pcitopoinfo xc_pcitopoinfo_t;
+typedef struct xen_sysctl_gnttab_stats xc_gnttab_stats_t;
 
 typedef uint32_t xc_cpu_to_node_t;
 typedef uint32_t xc_cpu_to_socket_t;
@@ -1250,6 +1251,10 @@ int xc_numainfo(xc_interface *xch, unsigned *max_nodes,
 int xc_pcitopoinfo(xc_interface *xch, unsigned num_devs,
                    physdev_pci_device_t *devs, uint32_t *nodes);
 
+/* Grant table usage statistics of a domain. */
+int xc_gnttab_stats(xc_interface *xch, uint32_t domid,
+                    xc_gnttab_stats_t *stats);
+
 int xc_sched_id(xc_interface *xch,
                 int *sched_id);
 
@@ -1973,6 +1978,14 @@ int xc_mem_paging_evict(xc_interface *xch, uint32_t domain_id, uint64_t gfn);
 int xc_mem_paging_prep(xc_interface *xch, uint32_t domain_id, uint64_t gfn);
 int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                        uint64_t gfn, void *buffer);
+/*
+ * Put a gfn straight into the paged-out state, discarding any current
+ * contents.  The gfn must be unpopulated, or populated with a page which
+ * could have been nominated.  Used by the restore side of a post-copy
+ * migration, which supplies page contents on demand.
+ */
+int xc_mem_paging_discard(xc_interface *xch, uint32_t domain_id,
+                          uint64_t gfn);
 
 /** 
  * Access tracking operations.
@@ -2203,6 +2216,22 @@ int xc_memshr_share_grefs(xc_interface *xch,
                     grant_ref_t client_gref,
                     uint64_t client_handle);
 
+/* As xc_memshr_share_gfns(), but the hypervisor compares the contents of
+ * the two pages and only shares them if they are identical.  As nominated
+ * pages cannot be modified without invalidating their handle, this is safe
+ * against the guests writing to the pages after a tool has selected them by
+ * hash.
+ *
+ * May additionally fail with ENODATA if the contents differ.
+ */
+int xc_memshr_share_gfns_identical(xc_interface *xch,
+                    uint32_t source_domain,
+                    unsigned long source_gfn,
+                    uint64_t source_handle,
+                    uint32_t client_domain,
+                    unsigned long client_gfn,
+                    uint64_t client_handle);
+
 /* Allows to add to the guest physmap of the client domain a shared frame
  * directly.
  *
@@ -2234,6 +2263,23 @@ int xc_memshr_range_share(xc_interface *xch,
                           uint64_t first_gfn,
                           uint64_t last_gfn);
 
+/* Allows to deduplicate an arbitrary set of pages in a single call. Each
+ * entry names a source gfn of source_domain and a client domain and gfn; using
+ * this function is equivalent of calling xc_memshr_nominate_gfn for both gfns
+ * followed by xc_memshr_share_gfns (or xc_memshr_share_gfns_identical if flags
+ * contains XENMEM_SHARING_BATCH_IDENTICAL).
+ *
+ * The result for each entry is written back to its rc field. The call itself
+ * only fails for errors affecting the whole batch, e.g. with -EINVAL if memory
+ * sharing is not enabled on the source domain, or with -ENOMEM if there isn't
+ * enough memory available to store the sharing metadata.
+ */
+int xc_memshr_share_batch(xc_interface *xch,
+                          uint32_t source_domain,
+                          xen_mem_sharing_batch_entry_t *entries,
+                          unsigned int nr_entries,
+                          uint32_t flags);
+
 /* Debug calls: return the number of pages referencing the shared frame backing
  * the input argument. Should be one or greater. 
  *
@@ -29,6 +29,9 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+#define XCFLAGS_PIPELINE               (1 << 5)
+#define XCFLAGS_STREAM_COMPRESS        (1 << 6)
+#define XCFLAGS_POSTCOPY               (1 << 7)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -111,6 +114,17 @@ struct save_callbacks {
     /* Enable qemu-dm logging dirty pages to xen */
     int (*switch_qemu_logdirty)(uint32_t domid, unsigned enable, void *data); /* HVM only */
 
+    /*
+     * Called with XCFLAGS_POSTCOPY, once the POSTCOPY_TRANSITION record has
+     * been written, for the toolstack to send the rest of the guest's state
+     * (e.g. the device model's) ahead of the outstanding pages.
+     *
+     * returns:
+     * 0: terminate the migration
+     * 1: carry on sending the outstanding pages
+     */
+    int (*postcopy_transition)(void* data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -129,7 +143,18 @@ typedef enum {
  * @parm dom the id of the domain
  * @param stream_type XC_MIG_STREAM_NONE if the far end of the stream
  *        doesn't use checkpointing
+ * @param recv_fd the back channel from the far end, for COLO streams,
+ *        XCFLAGS_POSTCOPY and XCFLAGS_STREAM_COMPRESS
  * @return 0 on success, -1 on failure
+ *
+ * With XCFLAGS_STREAM_COMPRESS and a back channel, page data is only
+ * compressed if the far end advertises support for it.  Without a back
+ * channel, the caller vouches that the far end can decompress.
+ *
+ * With XCFLAGS_POSTCOPY (live HVM only), the pages dirtied during the last
+ * iteration are sent after the guest has been started at the far end,
+ * which fetches them on demand through mem_paging.  This is only done if
+ * the far end advertises support for it over the back channel.
  */
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
                    uint32_t flags /* XCFLAGS_xxx */,
@@ -172,6 +197,20 @@ struct restore_callbacks {
     void (*restore_results)(xen_pfn_t store_gfn, xen_pfn_t console_gfn,
                             void *data);
 
+    /*
+     * Called at the post-copy transition, once the domain is ready to run
+     * apart from the pages still to arrive, and after restore_results.  The
+     * toolstack reads the rest of its own state from the stream, sets up
+     * the device model and unpauses the guest.  Faults on outstanding pages
+     * are only serviced once this returns.  If NULL, the sender is told
+     * that post-copy is not supported.
+     *
+     * returns:
+     * 0: terminate the restore
+     * 1: carry on receiving the outstanding pages
+     */
+    int (*postcopy_transition)(void* data);
+
     /* to be provided as the last argument to each callback function */
     void* data;
 };
@@ -191,7 +230,13 @@ struct restore_callbacks {
  * @parm stream_type non-zero if the far end of the stream is using checkpointing
  * @parm callbacks non-NULL to receive a callback to restore toolstack
  *       specific data
+ * @parm send_back_fd the back channel to the sender, for COLO streams,
+ *       post-copy and advertising stream capabilities
  * @return 0 on success, -1 on failure
+ *
+ * If the sender switches to post-copy, the domain is started by the
+ * postcopy_transition callback while the remaining pages arrive, and is left
+ * in whatever state the toolstack put it in.
  */
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
@@ -89,6 +89,13 @@ int xc_mem_paging_prep(xc_interface *xch, uint32_t domain_id, uint64_t gfn)
                                gfn, NULL);
 }
 
+int xc_mem_paging_discard(xc_interface *xch, uint32_t domain_id, uint64_t gfn)
+{
+    return xc_mem_paging_memop(xch, domain_id,
+                               XENMEM_paging_op_discard,
+                               gfn, NULL);
+}
+
 int xc_mem_paging_load(xc_interface *xch, uint32_t domain_id,
                        uint64_t gfn, void *buffer)
 {
@@ -137,6 +137,29 @@ int xc_memshr_share_gfns(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_share_gfns_identical(xc_interface *xch,
+                                   uint32_t source_domain,
+                                   unsigned long source_gfn,
+                                   uint64_t source_handle,
+                                   uint32_t client_domain,
+                                   unsigned long client_gfn,
+                                   uint64_t client_handle)
+{
+    xen_mem_sharing_op_t mso;
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_share_identical;
+
+    mso.u.share.source_handle = source_handle;
+    mso.u.share.source_gfn    = source_gfn;
+    mso.u.share.client_domain = client_domain;
+    mso.u.share.client_gfn    = client_gfn;
+    mso.u.share.client_handle = client_handle;
+
+    return xc_memshr_memop(xch, source_domain, &mso);
+}
+
 int xc_memshr_share_grefs(xc_interface *xch,
                           uint32_t source_domain,
                           grant_ref_t source_gref,
@@ -200,6 +223,38 @@ int xc_memshr_range_share(xc_interface *xch,
     return xc_memshr_memop(xch, source_domain, &mso);
 }
 
+int xc_memshr_share_batch(xc_interface *xch,
+                          uint32_t source_domain,
+                          xen_mem_sharing_batch_entry_t *entries,
+                          unsigned int nr_entries,
+                          uint32_t flags)
+{
+    int rc;
+    xen_mem_sharing_op_t mso;
+    DECLARE_HYPERCALL_BOUNCE(entries, nr_entries * sizeof(*entries),
+                             XC_HYPERCALL_BUFFER_BOUNCE_BOTH);
+
+    if ( xc_hypercall_bounce_pre(xch, entries) )
+    {
+        PERROR("Could not bounce memory for XENMEM_sharing_op_share_batch");
+        return -1;
+    }
+
+    memset(&mso, 0, sizeof(mso));
+
+    mso.op = XENMEM_sharing_op_share_batch;
+
+    set_xen_guest_handle(mso.u.batch.entries, entries);
+    mso.u.batch.nr_entries = nr_entries;
+    mso.u.batch.flags = flags;
+
+    rc = xc_memshr_memop(xch, source_domain, &mso);
+
+    xc_hypercall_bounce_post(xch, entries);
+
+    return rc;
+}
+
 int xc_memshr_domain_resume(xc_interface *xch,
                             uint32_t domid)
 {
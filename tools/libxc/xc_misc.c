@@ -226,6 +226,24 @@ int xc_physinfo(xc_interface *xch,
     return 0;
 }
 
+int xc_gnttab_stats(xc_interface *xch, uint32_t domid,
+                    xc_gnttab_stats_t *stats)
+{
+    int ret;
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_gnttab_stats;
+    memset(&sysctl.u.gnttab_stats, 0, sizeof(sysctl.u.gnttab_stats));
+    sysctl.u.gnttab_stats.domid = domid;
+
+    if ( (ret = do_sysctl(xch, &sysctl)) != 0 )
+        return ret;
+
+    *stats = sysctl.u.gnttab_stats;
+
+    return 0;
+}
+
 int xc_cputopoinfo(xc_interface *xch, unsigned *max_cpus,
                    xc_cputopo_t *cputopo)
 {
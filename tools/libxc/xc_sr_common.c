@@ -38,6 +38,11 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_COMPRESSED_PAGE_DATA]         = "Compressed page data",
+    [REC_TYPE_POSTCOPY_PFNS]                = "Post-copy pfns",
+    [REC_TYPE_POSTCOPY_TRANSITION]          = "Post-copy transition",
+    [REC_TYPE_POSTCOPY_FAULT]               = "Post-copy fault",
+    [REC_TYPE_CAPABILITIES]                 = "Capabilities",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -48,6 +53,8 @@ const char *rec_type_to_str(uint32_t type)
              (mandatory_rec_types[type]) )
             return mandatory_rec_types[type];
     }
+    else if ( type == REC_TYPE_CAPABILITIES_QUERY )
+        return "Capabilities query";
 
     return "Reserved";
 }
@@ -147,6 +154,8 @@ static void __attribute__((unused)) build_assertions(void)
     BUILD_BUG_ON(sizeof(struct xc_sr_rhdr) != 8);
 
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_page_data_header)  != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_compressed_page)   != 8);
+    BUILD_BUG_ON(sizeof(struct xc_sr_rec_capabilities)      != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_info)       != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_p2m_frames) != 8);
     BUILD_BUG_ON(sizeof(struct xc_sr_rec_x86_pv_vcpu_hdr)   != 8);
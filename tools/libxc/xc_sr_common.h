@@ -18,6 +18,10 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_save_batch;
+struct xc_sr_save_pipeline;
+struct xc_sr_restore_postcopy;
+struct xc_sr_restore_pipeline;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -202,11 +206,44 @@ struct xc_sr_context
 
             struct precopy_stats stats;
 
+            /* Send pages through the multi-threaded save pipeline. */
+            bool pipelined;
+
+            /*
+             * Send COMPRESSED_PAGE_DATA rather than PAGE_DATA records.  Over
+             * a back channel, compression is only switched on if the
+             * receiver advertises support for it.
+             */
+            bool want_compress, compress;
+            bool query_capabilities;
+            struct
+            {
+                unsigned long raw, deflated, zero, duplicate;
+                uint64_t bytes;
+            } compress_stats;
+
+            /* Send the final dirty pages after the guest has resumed. */
+            bool postcopy;
+            unsigned long nr_postcopy_pfns;
+
             xen_pfn_t *batch_pfns;
             unsigned nr_batch_pfns;
+            struct xc_sr_save_batch *batch;
+            struct xc_sr_save_pipeline *pipeline;
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
+
+            /*
+             * Dirty pfns harvested with XEN_DOMCTL_SHADOW_OP_CLEAN_LIST,
+             * used instead of the bitmap during the live phase when Xen
+             * supports it.  nr_dirty_list is -1 when the last harvest fell
+             * back to the bitmap.
+             */
+            bool use_dirty_list;
+            unsigned long dirty_list_size;
+            long nr_dirty_list;
+            xc_hypercall_buffer_t dirty_list_hbuf;
         } save;
 
         struct /* Restore data. */
@@ -258,6 +295,12 @@ struct xc_sr_context
 
             /* Sender has invoked verify mode on the stream. */
             bool verify;
+
+            /* Post-copy state, from the first POSTCOPY_PFNS record. */
+            struct xc_sr_restore_postcopy *postcopy;
+
+            /* Worker threads populating and filling guest pages, if any. */
+            struct xc_sr_restore_pipeline *pipeline;
         } restore;
     };
 
@@ -1,6 +1,12 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <xenevtchn.h>
+#include <xen/vm_event.h>
 
 #include "xc_sr_common.h"
 
@@ -194,6 +200,487 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
     return rc;
 }
 
+/*
+ * Post-copy.
+ *
+ * The sender lists the pfns it has yet to send in POSTCOPY_PFNS records.  On
+ * the POSTCOPY_TRANSITION record, the stream is completed early: the listed
+ * pfns are put into the paged-out state with mem_paging, and the toolstack
+ * is handed the domain through the postcopy_transition callback to read its
+ * own records, set up the device model and unpause the guest.  Guest accesses
+ * to the paged-out pfns raise requests on the paging ring, which are
+ * forwarded to the sender as POSTCOPY_FAULT records over the back channel.
+ * Page data then arriving in the stream is loaded with xc_mem_paging_load(),
+ * and any vcpus waiting on it are resumed.
+ */
+struct xc_sr_restore_postcopy
+{
+    /* Bitmap of pfns whose contents are still to arrive. */
+    unsigned long *outstanding;
+    unsigned long nr_outstanding;
+
+    /* Set once the guest has been handed to the toolstack to start. */
+    bool active;
+
+    /* Paging ring. */
+    void *ring_page;
+    vm_event_back_ring_t back_ring;
+    xenevtchn_handle *xce;
+    uint32_t remote_port;
+    int local_port;
+
+    /* Paging requests waiting on outstanding pfns. */
+    vm_event_request_t *waiting;
+    unsigned nr_waiting, max_waiting;
+
+    /* Page aligned buffer for xc_mem_paging_load(). */
+    void *buffer;
+};
+
+static bool postcopy_active(const struct xc_sr_context *ctx)
+{
+    return ctx->restore.postcopy && ctx->restore.postcopy->active;
+}
+
+/*
+ * Put a response for a paging request on the ring.  The caller is
+ * responsible for notifying Xen.
+ */
+static void postcopy_put_response(struct xc_sr_restore_postcopy *pc,
+                                  const vm_event_request_t *req)
+{
+    vm_event_response_t *rsp;
+
+    rsp = RING_GET_RESPONSE(&pc->back_ring, pc->back_ring.rsp_prod_pvt);
+    *rsp = *req;
+    rsp->version = VM_EVENT_INTERFACE_VERSION;
+    pc->back_ring.rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(&pc->back_ring);
+}
+
+/*
+ * Resume any waiting requests whose pfns are no longer outstanding.
+ */
+static int postcopy_resume_waiting(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    unsigned i, j;
+
+    for ( i = 0, j = 0; i < pc->nr_waiting; ++i )
+    {
+        uint64_t gfn = pc->waiting[i].u.mem_paging.gfn;
+
+        if ( test_bit(gfn, pc->outstanding) )
+            pc->waiting[j++] = pc->waiting[i];
+        else
+            postcopy_put_response(pc, &pc->waiting[i]);
+    }
+
+    if ( j == pc->nr_waiting )
+        return 0;
+
+    pc->nr_waiting = j;
+
+    if ( xenevtchn_notify(pc->xce, pc->local_port) )
+    {
+        PERROR("Failed to notify paging ring");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Load a block of page data from the stream into outstanding pfns.  Pfns
+ * which are not outstanding have already been loaded, so are skipped.
+ */
+static int postcopy_load_pages(struct xc_sr_context *ctx, unsigned count,
+                               const xen_pfn_t *pfns, const uint32_t *types,
+                               void *page_data)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    xen_pfn_t gfn;
+    unsigned i;
+    bool has_data;
+    int rc;
+
+    for ( i = 0; i < count; ++i, page_data += has_data ? PAGE_SIZE : 0 )
+    {
+        has_data = types[i] != XEN_DOMCTL_PFINFO_XTAB &&
+                   types[i] != XEN_DOMCTL_PFINFO_BROKEN &&
+                   types[i] != XEN_DOMCTL_PFINFO_XALLOC;
+
+        if ( pfns[i] >= ctx->restore.p2m_size ||
+             !test_and_clear_bit(pfns[i], pc->outstanding) )
+            continue;
+
+        --pc->nr_outstanding;
+        gfn = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+
+        if ( !has_data )
+        {
+            /* Not backed on the sending side either; drop the paged gfn. */
+            if ( xc_domain_decrease_reservation_exact(xch, ctx->domid,
+                                                      1, 0, &gfn) )
+            {
+                PERROR("Failed to drop post-copy pfn %#"PRIpfn, pfns[i]);
+                return -1;
+            }
+            continue;
+        }
+
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            return -1;
+        }
+
+        memcpy(pc->buffer, page_data, PAGE_SIZE);
+
+        /* ENOENT means the guest has released the gfn in the meantime. */
+        if ( xc_mem_paging_load(xch, ctx->domid, gfn, pc->buffer) &&
+             errno != ENOENT )
+        {
+            PERROR("Failed to load post-copy pfn %#"PRIpfn, pfns[i]);
+            return -1;
+        }
+    }
+
+    return postcopy_resume_waiting(ctx);
+}
+
+/*
+ * Pull requests off the paging ring.  Requests for outstanding pfns are
+ * queued until their page data arrives, and the pfns requested from the
+ * sender.  Everything else is resumed straight away.
+ */
+static int postcopy_handle_requests(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    uint64_t pfns[RING_SIZE(&pc->back_ring)];
+    vm_event_request_t req;
+    unsigned count = 0;
+    bool notify = false;
+    struct xc_sr_rhdr rhdr = { REC_TYPE_POSTCOPY_FAULT, 0 };
+    struct iovec iov[2];
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&pc->back_ring) &&
+            count < ARRAY_SIZE(pfns) )
+    {
+        req = *RING_GET_REQUEST(&pc->back_ring, pc->back_ring.req_cons);
+        pc->back_ring.req_cons++;
+        pc->back_ring.sring->req_event = pc->back_ring.req_cons + 1;
+
+        if ( (req.u.mem_paging.flags & MEM_PAGING_DROP_PAGE) ||
+             req.u.mem_paging.gfn >= ctx->restore.p2m_size ||
+             !test_bit(req.u.mem_paging.gfn, pc->outstanding) )
+        {
+            postcopy_put_response(pc, &req);
+            notify = true;
+            continue;
+        }
+
+        if ( pc->nr_waiting == pc->max_waiting )
+        {
+            unsigned new_max = pc->max_waiting ? pc->max_waiting * 2 : 64;
+            vm_event_request_t *p = realloc(pc->waiting,
+                                            new_max * sizeof(*p));
+
+            if ( !p )
+            {
+                ERROR("Unable to allocate memory for paging requests");
+                return -1;
+            }
+
+            pc->waiting = p;
+            pc->max_waiting = new_max;
+        }
+
+        pc->waiting[pc->nr_waiting++] = req;
+        pfns[count++] = req.u.mem_paging.gfn;
+    }
+
+    if ( notify && xenevtchn_notify(pc->xce, pc->local_port) )
+    {
+        PERROR("Failed to notify paging ring");
+        return -1;
+    }
+
+    if ( !count )
+        return 0;
+
+    rhdr.length = count * sizeof(*pfns);
+
+    iov[0].iov_base = &rhdr;
+    iov[0].iov_len = sizeof(rhdr);
+    iov[1].iov_base = pfns;
+    iov[1].iov_len = rhdr.length;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to send post-copy faults");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait until the next record is available in the stream, servicing the
+ * paging ring meanwhile.
+ */
+static int postcopy_wait_for_record(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    struct pollfd pfd[2] =
+    {
+        { .fd = ctx->fd, .events = POLLIN },
+        { .fd = xenevtchn_fd(pc->xce), .events = POLLIN },
+    };
+    int port;
+
+    for ( ; ; )
+    {
+        if ( poll(pfd, ARRAY_SIZE(pfd), -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll post-copy stream");
+            return -1;
+        }
+
+        if ( pfd[1].revents & POLLIN )
+        {
+            port = xenevtchn_pending(pc->xce);
+            if ( port < 0 || xenevtchn_unmask(pc->xce, port) )
+            {
+                PERROR("Failed to handle paging ring event");
+                return -1;
+            }
+
+            if ( postcopy_handle_requests(ctx) )
+                return -1;
+        }
+
+        /* Requests may have raced with the unmask. */
+        if ( RING_HAS_UNCONSUMED_REQUESTS(&pc->back_ring) &&
+             postcopy_handle_requests(ctx) )
+            return -1;
+
+        if ( pfd[0].revents & (POLLIN | POLLHUP | POLLERR) )
+            return 0;
+    }
+}
+
+/*
+ * Process a POSTCOPY_PFNS record, noting the pfns whose contents will follow
+ * after the guest has been started.
+ */
+static int handle_postcopy_pfns(struct xc_sr_context *ctx,
+                                struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    const uint64_t *pfns = rec->data;
+    unsigned i, count;
+
+    if ( pc && pc->active )
+    {
+        ERROR("POSTCOPY_PFNS record after post-copy transition");
+        return -1;
+    }
+
+    if ( rec->length % sizeof(*pfns) )
+    {
+        ERROR("Invalid POSTCOPY_PFNS record length %u", rec->length);
+        return -1;
+    }
+
+    if ( !pc )
+    {
+        pc = calloc(1, sizeof(*pc));
+        if ( !pc )
+            goto enomem;
+
+        pc->local_port = -1;
+        ctx->restore.postcopy = pc;
+
+        pc->outstanding = bitmap_alloc(ctx->restore.p2m_size);
+        if ( !pc->outstanding )
+            goto enomem;
+    }
+
+    count = rec->length / sizeof(*pfns);
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfns[i] >= ctx->restore.p2m_size ||
+             !ctx->restore.ops.pfn_is_valid(ctx, pfns[i]) )
+        {
+            ERROR("Invalid post-copy pfn %#"PRIx64, pfns[i]);
+            return -1;
+        }
+
+        if ( !test_and_set_bit(pfns[i], pc->outstanding) )
+            ++pc->nr_outstanding;
+    }
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for post-copy state");
+    errno = ENOMEM;
+    return -1;
+}
+
+/*
+ * Process a POSTCOPY_TRANSITION record.  Completes the stream, hands the
+ * outstanding pfns over to mem_paging and starts the guest.
+ */
+static int handle_postcopy_transition(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    xen_pfn_t pfn;
+    int rc;
+
+    if ( !pc || pc->active )
+    {
+        ERROR("Unexpected POSTCOPY_TRANSITION record");
+        return -1;
+    }
+
+    if ( ctx->restore.guest_type != DHDR_TYPE_X86_HVM ||
+         ctx->restore.checkpointed != XC_MIG_STREAM_NONE ||
+         ctx->restore.send_back_fd < 0 ||
+         !ctx->restore.callbacks ||
+         !ctx->restore.callbacks->postcopy_transition ||
+         !ctx->restore.callbacks->restore_results )
+    {
+        ERROR("Post-copy requires a non-checkpointed HVM stream with a"
+              " back channel, and toolstack support");
+        return -1;
+    }
+
+    rc = ctx->restore.ops.stream_complete(ctx);
+    if ( rc )
+        return rc;
+
+    pc->buffer = xc_memalign(xch, PAGE_SIZE, PAGE_SIZE);
+    if ( !pc->buffer )
+    {
+        ERROR("Unable to allocate post-copy page buffer");
+        return -1;
+    }
+
+    pc->ring_page = xc_vm_event_enable(xch, ctx->domid,
+                                       HVM_PARAM_PAGING_RING_PFN,
+                                       &pc->remote_port);
+    if ( !pc->ring_page )
+    {
+        PERROR("Failed to enable paging");
+        return -1;
+    }
+
+    pc->xce = xenevtchn_open(NULL, 0);
+    if ( !pc->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    pc->local_port = xenevtchn_bind_interdomain(pc->xce, ctx->domid,
+                                                pc->remote_port);
+    if ( pc->local_port < 0 )
+    {
+        PERROR("Failed to bind paging event channel");
+        return -1;
+    }
+
+    SHARED_RING_INIT((vm_event_sring_t *)pc->ring_page);
+    BACK_RING_INIT(&pc->back_ring, (vm_event_sring_t *)pc->ring_page,
+                   PAGE_SIZE);
+
+    for ( pfn = 0; pfn < ctx->restore.p2m_size; ++pfn )
+    {
+        if ( !test_bit(pfn, pc->outstanding) )
+            continue;
+
+        if ( xc_mem_paging_discard(xch, ctx->domid,
+                                   ctx->restore.ops.pfn_to_gfn(ctx, pfn)) )
+        {
+            PERROR("Failed to page out post-copy pfn %#"PRIpfn, pfn);
+            return -1;
+        }
+    }
+
+    pc->active = true;
+
+    /*
+     * The toolstack finishes building the domain, including its device
+     * model, from the records it reads from the stream now, and starts it.
+     */
+    ctx->restore.callbacks->restore_results(ctx->restore.xenstore_gfn,
+                                            ctx->restore.console_gfn,
+                                            ctx->restore.callbacks->data);
+
+    if ( ctx->restore.callbacks->postcopy_transition(
+             ctx->restore.callbacks->data) != 1 )
+    {
+        ERROR("Toolstack failed to start the guest for post-copy");
+        return -1;
+    }
+
+    IPRINTF("Guest started with %lu pages still to arrive",
+            pc->nr_outstanding);
+
+    return 0;
+}
+
+/*
+ * Release the post-copy state.
+ */
+static int postcopy_teardown(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_postcopy *pc = ctx->restore.postcopy;
+    int rc = 0;
+
+    if ( !pc )
+        return 0;
+
+    if ( pc->ring_page )
+    {
+        if ( xc_mem_paging_disable(xch, ctx->domid) )
+        {
+            PERROR("Failed to disable paging");
+            rc = -1;
+        }
+        xenforeignmemory_unmap(xch->fmem, pc->ring_page, 1);
+    }
+
+    if ( pc->xce )
+    {
+        if ( pc->local_port >= 0 )
+            xenevtchn_unbind(pc->xce, pc->local_port);
+        xenevtchn_close(pc->xce);
+    }
+
+    free(pc->buffer);
+    free(pc->waiting);
+    free(pc->outstanding);
+    free(pc);
+    ctx->restore.postcopy = NULL;
+
+    return rc;
+}
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
@@ -219,141 +706,795 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         goto err;
     }
 
-    rc = populate_pfns(ctx, count, pfns, types);
-    if ( rc )
+    rc = populate_pfns(ctx, count, pfns, types);
+    if ( rc )
+    {
+        ERROR("Failed to populate pfns for batch of %u pages", count);
+        goto err;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
+
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_NOTAB:
+
+        case XEN_DOMCTL_PFINFO_L1TAB:
+        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L2TAB:
+        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L3TAB:
+        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+        case XEN_DOMCTL_PFINFO_L4TAB:
+        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+
+            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            break;
+        }
+    }
+
+    /* Nothing to do? */
+    if ( nr_pages == 0 )
+        goto done;
+
+    mapping = guest_page = xenforeignmemory_map(xch->fmem,
+        ctx->domid, PROT_READ | PROT_WRITE,
+        nr_pages, mfns, map_errs);
+    if ( !mapping )
+    {
+        rc = -1;
+        PERROR("Unable to map %u mfns for %u pages of data",
+               nr_pages, count);
+        goto err;
+    }
+
+    for ( i = 0, j = 0; i < count; ++i )
+    {
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+            /* No page data to deal with. */
+            continue;
+        }
+
+        if ( map_errs[j] )
+        {
+            rc = -1;
+            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
+                  pfns[i], mfns[j], types[i], map_errs[j]);
+            goto err;
+        }
+
+        /* Undo page normalisation done by the saver. */
+        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        if ( rc )
+        {
+            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
+                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            goto err;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            /* Verify mode - compare incoming data to what we already have. */
+            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
+                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+        }
+        else
+        {
+            /* Regular mode - copy incoming data into place. */
+            memcpy(guest_page, page_data, PAGE_SIZE);
+        }
+
+        ++j;
+        guest_page += PAGE_SIZE;
+        page_data += PAGE_SIZE;
+    }
+
+ done:
+    rc = 0;
+
+ err:
+    if ( mapping )
+        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+
+    free(map_errs);
+    free(mfns);
+
+    return rc;
+}
+
+/*
+ * The restore pipeline.
+ *
+ * For HVM guests, loading a PAGE_DATA record is split between the thread
+ * reading the stream, which decodes records and tracks which pfns have been
+ * populated, and a set of worker threads which populate the physmap, map the
+ * guest frames and copy the page data in.  This is possible because the
+ * set_gfn(), set_page_type() and localise_page() hooks are no-ops for HVM
+ * guests, so nothing other than the populated_pfns bitmap is shared.
+ *
+ * Each pfn is always handled by the same worker, and each worker handles its
+ * work in order, so a pfn is populated before it is written to, and later
+ * copies of a page overwrite earlier ones.  pipeline_drain() must be called
+ * before processing any record other than page data.
+ *
+ * If the domain has a vNUMA layout, there is one worker per virtual node,
+ * which allocates memory from the physical node backing it.  As Xen does not
+ * report the vnode to pnode mapping, vnodes are assumed to be placed in
+ * order on the nodes of the domain's node affinity, and memory is allocated
+ * without a node preference if the counts do not match.  Without vNUMA, pfns
+ * are striped across the workers in 2MB chunks.
+ */
+#define SR_RESTORE_MAX_WORKERS  8
+#define SR_RESTORE_MAX_VNODES   64
+#define SR_RESTORE_QUEUE_DEPTH  8
+#define SR_RESTORE_STRIPE_SHIFT (21 - PAGE_SHIFT)
+
+/* Page data of a record, shared by the work items it was split into. */
+struct xc_sr_restore_data
+{
+    void *buffer;
+    unsigned refs;
+};
+
+/* The part of a record handled by a single worker. */
+struct xc_sr_restore_work
+{
+    struct xc_sr_restore_work *next;
+    struct xc_sr_restore_data *data;
+
+    unsigned nr_populate, nr_pages;
+    xen_pfn_t *populate;    /* pfns to populate first... */
+    xen_pfn_t *mfns;        /* ... with the resulting mfns written here. */
+    xen_pfn_t *gfns;        /* gfns to copy page data into... */
+    const void **pages;     /* ... from these pages of data. */
+    int *map_errs;
+};
+
+struct xc_sr_restore_worker
+{
+    struct xc_sr_restore_pipeline *pl;
+    pthread_t thread;
+    pthread_cond_t cond;
+    bool started;
+
+    unsigned memflags;      /* XENMEMF_node(), or 0. */
+    unsigned vnode;         /* vNUMA node, or XC_NUMA_NO_NODE. */
+
+    /* Queued work, protected by the pipeline lock. */
+    struct xc_sr_restore_work *head, *tail;
+    unsigned queued;
+};
+
+struct xc_sr_restore_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    unsigned long in_flight;
+    int rc, err;
+    bool stop;
+
+    unsigned nr_workers;
+    struct xc_sr_restore_worker *workers;
+
+    /* vNUMA layout of the guest, used to pick the worker for a pfn. */
+    xen_vmemrange_t *vmemranges;
+    unsigned nr_vmemranges;
+
+    /* Per-worker scratch space for pipeline_queue_page_data(). */
+    unsigned *nr_populate, *nr_pages;
+    struct xc_sr_restore_work **work;
+};
+
+static unsigned pipeline_pick_worker(const struct xc_sr_restore_pipeline *pl,
+                                     xen_pfn_t pfn)
+{
+    uint64_t addr = (uint64_t)pfn << PAGE_SHIFT;
+    unsigned i;
+
+    for ( i = 0; i < pl->nr_vmemranges; ++i )
+        if ( addr >= pl->vmemranges[i].start && addr < pl->vmemranges[i].end )
+            return pl->vmemranges[i].nid;
+
+    return (pfn >> SR_RESTORE_STRIPE_SHIFT) % pl->nr_workers;
+}
+
+/*
+ * Populate and fill the pages of a work item.  Returns 0, or -1 with errno
+ * set.
+ */
+static int pipeline_process_work(struct xc_sr_restore_worker *w,
+                                 struct xc_sr_restore_work *work)
+{
+    struct xc_sr_context *ctx = w->pl->ctx;
+    xc_interface *xch = ctx->xch;
+    void *mapping, *guest_page;
+    unsigned i;
+    int rc;
+
+    if ( work->nr_populate )
+    {
+        memcpy(work->mfns, work->populate,
+               work->nr_populate * sizeof(*work->mfns));
+
+        rc = xc_domain_populate_physmap_exact(
+            xch, ctx->domid, work->nr_populate, 0, w->memflags,
+            work->mfns);
+        if ( rc )
+        {
+            PERROR("Failed to populate physmap (vnode %d)", (int)w->vnode);
+            return -1;
+        }
+
+        for ( i = 0; i < work->nr_populate; ++i )
+        {
+            if ( work->mfns[i] == INVALID_MFN )
+            {
+                ERROR("Populate physmap failed for pfn %#"PRI_xen_pfn,
+                      work->populate[i]);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    }
+
+    if ( !work->nr_pages )
+        return 0;
+
+    mapping = guest_page = xenforeignmemory_map(
+        xch->fmem, ctx->domid, PROT_READ | PROT_WRITE,
+        work->nr_pages, work->gfns, work->map_errs);
+    if ( !mapping )
+    {
+        PERROR("Unable to map %u gfns of page data", work->nr_pages);
+        return -1;
+    }
+
+    for ( i = 0, rc = 0; i < work->nr_pages; ++i, guest_page += PAGE_SIZE )
+    {
+        if ( work->map_errs[i] )
+        {
+            ERROR("Mapping gfn %#"PRIpfn" failed with %d",
+                  work->gfns[i], work->map_errs[i]);
+            errno = -work->map_errs[i];
+            rc = -1;
+            break;
+        }
+
+        if ( ctx->restore.verify )
+        {
+            if ( memcmp(guest_page, work->pages[i], PAGE_SIZE) )
+                ERROR("verify gfn %#"PRIpfn" failed", work->gfns[i]);
+        }
+        else
+            memcpy(guest_page, work->pages[i], PAGE_SIZE);
+    }
+
+    xenforeignmemory_unmap(xch->fmem, mapping, work->nr_pages);
+
+    return rc;
+}
+
+/*
+ * Drop a work item's reference on its record data.  Called with the pipeline
+ * lock held; returns the data to free, if this was the last reference.
+ */
+static struct xc_sr_restore_data *pipeline_put_work(
+    struct xc_sr_restore_work *work)
+{
+    struct xc_sr_restore_data *data = work->data;
+
+    free(work);
+
+    return --data->refs ? NULL : data;
+}
+
+static void free_restore_data(struct xc_sr_restore_data *data)
+{
+    if ( data )
+    {
+        free(data->buffer);
+        free(data);
+    }
+}
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_restore_worker *w = arg;
+    struct xc_sr_restore_pipeline *pl = w->pl;
+    struct xc_sr_restore_work *work;
+    struct xc_sr_restore_data *data;
+    bool failed;
+    int rc;
+
+    pthread_mutex_lock(&pl->lock);
+    for ( ; ; )
+    {
+        while ( !pl->stop && !w->head )
+            pthread_cond_wait(&w->cond, &pl->lock);
+
+        if ( !w->head )
+            break;
+
+        work = w->head;
+        w->head = work->next;
+        if ( !w->head )
+            w->tail = NULL;
+        failed = pl->rc || pl->stop;
+        pthread_mutex_unlock(&pl->lock);
+
+        /* After a failure, or when tearing down, work is just discarded. */
+        rc = failed ? 0 : pipeline_process_work(w, work);
+
+        pthread_mutex_lock(&pl->lock);
+        if ( rc && !pl->rc )
+        {
+            pl->rc = rc;
+            pl->err = errno;
+        }
+        data = pipeline_put_work(work);
+        w->queued--;
+        pl->in_flight--;
+        pthread_cond_broadcast(&pl->done_cond);
+
+        if ( data )
+        {
+            pthread_mutex_unlock(&pl->lock);
+            free_restore_data(data);
+            pthread_mutex_lock(&pl->lock);
+        }
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/*
+ * Wait for all queued work to complete.  Returns 0, or -1 with errno set if a
+ * worker failed.
+ */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    int rc;
+
+    if ( !pl )
+        return 0;
+
+    pthread_mutex_lock(&pl->lock);
+    while ( pl->in_flight )
+        pthread_cond_wait(&pl->done_cond, &pl->lock);
+    rc = pl->rc;
+    if ( rc )
+        errno = pl->err;
+    pthread_mutex_unlock(&pl->lock);
+
+    return rc;
+}
+
+static struct xc_sr_restore_work *alloc_work(unsigned nr_populate,
+                                             unsigned nr_pages)
+{
+    struct xc_sr_restore_work *work;
+
+    work = calloc(1, sizeof(*work) +
+                  nr_populate * (sizeof(*work->populate) +
+                                 sizeof(*work->mfns)) +
+                  nr_pages * (sizeof(*work->gfns) + sizeof(*work->pages) +
+                              sizeof(*work->map_errs)));
+    if ( !work )
+        return NULL;
+
+    work->populate = (xen_pfn_t *)&work[1];
+    work->mfns = &work->populate[nr_populate];
+    work->gfns = &work->mfns[nr_populate];
+    work->pages = (const void **)&work->gfns[nr_pages];
+    work->map_errs = (int *)&work->pages[nr_pages];
+
+    return work;
+}
+
+/*
+ * Pipelined counterpart of process_page_data().  Splits the pages between the
+ * workers and queues them.  Takes ownership of buffer, which holds
+ * page_data.
+ */
+static int pipeline_queue_page_data(struct xc_sr_context *ctx, unsigned count,
+                                    const xen_pfn_t *pfns,
+                                    const uint32_t *types,
+                                    const uint8_t *page_data, void *buffer)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    struct xc_sr_restore_data *data = calloc(1, sizeof(*data));
+    struct xc_sr_restore_work *work;
+    unsigned *dest = malloc(count * sizeof(*dest));
+    bool *populate = malloc(count * sizeof(*populate));
+    unsigned i, w, nr_work = 0;
+    bool full;
+    int rc = -1;
+
+    memset(pl->work, 0, pl->nr_workers * sizeof(*pl->work));
+
+    if ( !data || !dest || !populate )
+    {
+        ERROR("Failed to allocate memory to queue %u pages", count);
+        goto err;
+    }
+
+    data->buffer = buffer;
+    data->refs = 0;
+    buffer = NULL;
+
+    memset(pl->nr_populate, 0, pl->nr_workers * sizeof(*pl->nr_populate));
+    memset(pl->nr_pages, 0, pl->nr_workers * sizeof(*pl->nr_pages));
+
+    /* Track populated pfns here, so the workers need not. */
+    for ( i = 0; i < count; ++i )
+    {
+        dest[i] = w = pipeline_pick_worker(pl, pfns[i]);
+        populate[i] = false;
+
+        if ( types[i] == XEN_DOMCTL_PFINFO_XTAB ||
+             types[i] == XEN_DOMCTL_PFINFO_BROKEN )
+            continue;
+
+        if ( !pfn_is_populated(ctx, pfns[i]) )
+        {
+            if ( pfn_set_populated(ctx, pfns[i]) )
+                goto err;
+            populate[i] = true;
+            pl->nr_populate[w]++;
+        }
+
+        if ( types[i] < XEN_DOMCTL_PFINFO_BROKEN )
+            pl->nr_pages[w]++;
+    }
+
+    for ( w = 0; w < pl->nr_workers; ++w )
+    {
+        if ( !pl->nr_populate[w] && !pl->nr_pages[w] )
+            continue;
+
+        pl->work[w] = alloc_work(pl->nr_populate[w], pl->nr_pages[w]);
+        if ( !pl->work[w] )
+        {
+            ERROR("Failed to allocate memory to queue %u pages", count);
+            goto err;
+        }
+        pl->work[w]->data = data;
+        nr_work++;
+    }
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( types[i] == XEN_DOMCTL_PFINFO_XTAB ||
+             types[i] == XEN_DOMCTL_PFINFO_BROKEN )
+            continue;
+
+        work = pl->work[dest[i]];
+
+        if ( populate[i] )
+            work->populate[work->nr_populate++] = pfns[i];
+
+        if ( types[i] < XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            work->gfns[work->nr_pages] =
+                ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
+            work->pages[work->nr_pages++] = page_data;
+            page_data += PAGE_SIZE;
+        }
+    }
+
+    if ( !nr_work )
+    {
+        rc = 0;
+        goto err;
+    }
+
+    /* Wait for room on all the workers involved, bailing early on failure. */
+    pthread_mutex_lock(&pl->lock);
+    do {
+        for ( w = 0, full = false; w < pl->nr_workers && !full; ++w )
+            full = pl->work[w] &&
+                pl->workers[w].queued >= SR_RESTORE_QUEUE_DEPTH;
+
+        if ( full && !pl->rc )
+            pthread_cond_wait(&pl->done_cond, &pl->lock);
+    } while ( full && !pl->rc );
+
+    if ( pl->rc )
+    {
+        errno = pl->err;
+        pthread_mutex_unlock(&pl->lock);
+        goto err;
+    }
+
+    data->refs = nr_work;
+    data = NULL;
+
+    for ( w = 0; w < pl->nr_workers; ++w )
+    {
+        struct xc_sr_restore_worker *worker = &pl->workers[w];
+
+        work = pl->work[w];
+        if ( !work )
+            continue;
+
+        if ( worker->tail )
+            worker->tail->next = work;
+        else
+            worker->head = work;
+        worker->tail = work;
+        worker->queued++;
+        pl->in_flight++;
+        pl->work[w] = NULL;
+
+        pthread_cond_signal(&worker->cond);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    rc = 0;
+
+ err:
+    for ( w = 0; w < pl->nr_workers; ++w )
+    {
+        free(pl->work[w]);
+        pl->work[w] = NULL;
+    }
+    free_restore_data(data);
+    free(buffer);
+    free(populate);
+    free(dest);
+
+    return rc;
+}
+
+/*
+ * Find the guest's vNUMA layout, and the node each vnode should be allocated
+ * from.  Returns the number of vnodes, or 0 if the guest has no usable vNUMA
+ * layout.
+ */
+static unsigned pipeline_get_vnuma(struct xc_sr_context *ctx,
+                                   struct xc_sr_restore_pipeline *pl,
+                                   unsigned **vnode_to_pnode)
+{
+    xc_interface *xch = ctx->xch;
+    uint32_t nr_vnodes = 0, nr_vmemranges = 0, nr_vcpus = 0;
+    unsigned *vdistance = NULL, *vcpu_to_vnode = NULL, *pnodes = NULL;
+    xen_vmemrange_t *vmemranges = NULL;
+    xc_nodemap_t nodemap = NULL;
+    int max_nodes, node;
+    unsigned i, nr_pnodes = 0;
+
+    *vnode_to_pnode = NULL;
+
+    /* Query the sizes first. */
+    if ( !xc_domain_getvnuma(xch, ctx->domid, &nr_vnodes, &nr_vmemranges,
+                             &nr_vcpus, NULL, NULL, NULL) ||
+         errno != ENOBUFS )
+        return 0;
+
+    if ( !nr_vnodes || nr_vnodes > SR_RESTORE_MAX_VNODES )
+        return 0;
+
+    vmemranges = calloc(nr_vmemranges, sizeof(*vmemranges));
+    vdistance = calloc(nr_vnodes * nr_vnodes, sizeof(*vdistance));
+    vcpu_to_vnode = calloc(nr_vcpus, sizeof(*vcpu_to_vnode));
+    pnodes = calloc(nr_vnodes, sizeof(*pnodes));
+    nodemap = xc_nodemap_alloc(xch);
+    max_nodes = xc_get_max_nodes(xch);
+    if ( !vmemranges || !vdistance || !vcpu_to_vnode || !pnodes ||
+         !nodemap || max_nodes <= 0 )
+        goto out;
+
+    if ( xc_domain_getvnuma(xch, ctx->domid, &nr_vnodes, &nr_vmemranges,
+                            &nr_vcpus, vmemranges, vdistance,
+                            vcpu_to_vnode) )
+    {
+        PERROR("Unable to get vNUMA layout");
+        nr_vnodes = 0;
+        goto out;
+    }
+
+    for ( i = 0; i < nr_vmemranges; ++i )
     {
-        ERROR("Failed to populate pfns for batch of %u pages", count);
-        goto err;
+        if ( vmemranges[i].nid >= nr_vnodes )
+        {
+            ERROR("vmemrange %u on vnode %u of %u", i, vmemranges[i].nid,
+                  nr_vnodes);
+            nr_vnodes = 0;
+            goto out;
+        }
     }
 
-    for ( i = 0; i < count; ++i )
+    if ( !xc_domain_node_getaffinity(xch, ctx->domid, nodemap) )
     {
-        ctx->restore.ops.set_page_type(ctx, pfns[i], types[i]);
-
-        switch ( types[i] )
+        for ( node = 0; node < max_nodes; ++node )
         {
-        case XEN_DOMCTL_PFINFO_NOTAB:
+            if ( !test_bit(node, (unsigned long *)nodemap) )
+                continue;
+            if ( nr_pnodes < nr_vnodes )
+                pnodes[nr_pnodes] = node;
+            nr_pnodes++;
+        }
+    }
 
-        case XEN_DOMCTL_PFINFO_L1TAB:
-        case XEN_DOMCTL_PFINFO_L1TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    if ( nr_pnodes != nr_vnodes )
+        for ( i = 0; i < nr_vnodes; ++i )
+            pnodes[i] = XC_NUMA_NO_NODE;
 
-        case XEN_DOMCTL_PFINFO_L2TAB:
-        case XEN_DOMCTL_PFINFO_L2TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    pl->vmemranges = vmemranges;
+    pl->nr_vmemranges = nr_vmemranges;
+    vmemranges = NULL;
+    *vnode_to_pnode = pnodes;
+    pnodes = NULL;
 
-        case XEN_DOMCTL_PFINFO_L3TAB:
-        case XEN_DOMCTL_PFINFO_L3TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+ out:
+    free(nodemap);
+    free(pnodes);
+    free(vcpu_to_vnode);
+    free(vdistance);
+    free(vmemranges);
 
-        case XEN_DOMCTL_PFINFO_L4TAB:
-        case XEN_DOMCTL_PFINFO_L4TAB | XEN_DOMCTL_PFINFO_LPINTAB:
+    return *vnode_to_pnode ? nr_vnodes : 0;
+}
 
-            mfns[nr_pages++] = ctx->restore.ops.pfn_to_gfn(ctx, pfns[i]);
-            break;
-        }
-    }
+static void pipeline_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_restore_pipeline *pl = ctx->restore.pipeline;
+    unsigned i;
 
-    /* Nothing to do? */
-    if ( nr_pages == 0 )
-        goto done;
+    if ( !pl )
+        return;
 
-    mapping = guest_page = xenforeignmemory_map(xch->fmem,
-        ctx->domid, PROT_READ | PROT_WRITE,
-        nr_pages, mfns, map_errs);
-    if ( !mapping )
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = true;
+    for ( i = 0; i < pl->nr_workers; ++i )
+        pthread_cond_signal(&pl->workers[i].cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for ( i = 0; i < pl->nr_workers; ++i )
     {
-        rc = -1;
-        PERROR("Unable to map %u mfns for %u pages of data",
-               nr_pages, count);
-        goto err;
+        if ( pl->workers[i].started )
+            pthread_join(pl->workers[i].thread, NULL);
+        pthread_cond_destroy(&pl->workers[i].cond);
     }
 
-    for ( i = 0, j = 0; i < count; ++i )
+    pthread_cond_destroy(&pl->done_cond);
+    pthread_mutex_destroy(&pl->lock);
+
+    free(pl->work);
+    free(pl->nr_pages);
+    free(pl->nr_populate);
+    free(pl->vmemranges);
+    free(pl->workers);
+    free(pl);
+    ctx->restore.pipeline = NULL;
+}
+
+static int pipeline_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_restore_pipeline *pl;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i, nr_workers, *vnode_to_pnode = NULL;
+    int rc;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+        goto enomem;
+
+    pl->ctx = ctx;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->done_cond, NULL);
+    ctx->restore.pipeline = pl;
+
+    nr_workers = pipeline_get_vnuma(ctx, pl, &vnode_to_pnode);
+    if ( !nr_workers )
     {
-        switch ( types[i] )
+        /* The reading thread occupies a cpu already. */
+        nr_workers = nr_cpus > 2
+            ? min_t(long, nr_cpus - 1, SR_RESTORE_MAX_WORKERS) : 0;
+        if ( !nr_workers )
         {
-        case XEN_DOMCTL_PFINFO_XTAB:
-        case XEN_DOMCTL_PFINFO_BROKEN:
-        case XEN_DOMCTL_PFINFO_XALLOC:
-            /* No page data to deal with. */
-            continue;
+            /* Not worth it: process page data inline. */
+            pipeline_destroy(ctx);
+            return 0;
         }
+    }
 
-        if ( map_errs[j] )
-        {
-            rc = -1;
-            ERROR("Mapping pfn %#"PRIpfn" (mfn %#"PRIpfn", type %#"PRIx32") failed with %d",
-                  pfns[i], mfns[j], types[i], map_errs[j]);
-            goto err;
-        }
+    pl->workers = calloc(nr_workers, sizeof(*pl->workers));
+    pl->nr_populate = calloc(nr_workers, sizeof(*pl->nr_populate));
+    pl->nr_pages = calloc(nr_workers, sizeof(*pl->nr_pages));
+    pl->work = calloc(nr_workers, sizeof(*pl->work));
+    if ( !pl->workers || !pl->nr_populate || !pl->nr_pages || !pl->work )
+        goto enomem;
 
-        /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+    for ( i = 0; i < nr_workers; ++i )
+    {
+        struct xc_sr_restore_worker *w = &pl->workers[i];
+
+        w->pl = pl;
+        pthread_cond_init(&w->cond, NULL);
+        pl->nr_workers++;
+
+        w->vnode = vnode_to_pnode ? i : XC_NUMA_NO_NODE;
+        if ( vnode_to_pnode && vnode_to_pnode[i] != XC_NUMA_NO_NODE )
+            w->memflags = XENMEMF_node(vnode_to_pnode[i]);
+
+        rc = pthread_create(&w->thread, NULL, pipeline_worker, w);
         if ( rc )
         {
-            ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
-                  pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
+            errno = rc;
+            PERROR("Unable to create restore worker thread");
             goto err;
         }
-
-        if ( ctx->restore.verify )
-        {
-            /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
-                ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
-                      pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
-        }
-        else
-        {
-            /* Regular mode - copy incoming data into place. */
-            memcpy(guest_page, page_data, PAGE_SIZE);
-        }
-
-        ++j;
-        guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+        w->started = true;
     }
 
- done:
-    rc = 0;
-
- err:
-    if ( mapping )
-        xenforeignmemory_unmap(xch->fmem, mapping, nr_pages);
+    DPRINTF("Restore pipeline: %u workers%s", pl->nr_workers,
+            vnode_to_pnode ? ", one per vnode" : "");
+    free(vnode_to_pnode);
 
-    free(map_errs);
-    free(mfns);
+    return 0;
 
-    return rc;
+ enomem:
+    ERROR("Unable to allocate memory for the restore pipeline");
+    errno = ENOMEM;
+ err:
+    free(vnode_to_pnode);
+    pipeline_destroy(ctx);
+    return -1;
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate the header and pfn list common to PAGE_DATA and
+ * COMPRESSED_PAGE_DATA records.  On success, *pfns and *types are arrays
+ * allocated with malloc() which the caller must free(), and *pages_of_data is
+ * the number of pfns which carry page data.
  */
-static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+static int decode_page_data_pfns(struct xc_sr_context *ctx,
+                                 struct xc_sr_record *rec, xen_pfn_t **pfns_p,
+                                 uint32_t **types_p, unsigned *pages_of_data)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
-    unsigned i, pages_of_data = 0;
-    int rc = -1;
+    unsigned i;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
+    *pages_of_data = 0;
+
     if ( rec->length < sizeof(*pages) )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("%s record truncated: length %u, min %zu",
+              rec_type_to_str(rec->type), rec->length, sizeof(*pages));
         goto err;
     }
     else if ( pages->count < 1 )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Expected at least 1 pfn in %s record",
+              rec_type_to_str(rec->type));
         goto err;
     }
     else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("%s record (length %u) too short to contain %u"
+              " pfns worth of information", rec_type_to_str(rec->type),
+              rec->length, pages->count);
         goto err;
     }
 
@@ -386,12 +1527,41 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         else if ( type < XEN_DOMCTL_PFINFO_BROKEN )
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
-            pages_of_data++;
+            (*pages_of_data)++;
 
         pfns[i] = pfn;
         types[i] = type;
     }
 
+    *pfns_p = pfns;
+    *types_p = types;
+
+    return 0;
+
+ err:
+    free(types);
+    free(pfns);
+
+    return -1;
+}
+
+/*
+ * Validate a PAGE_DATA record from the stream, and pass the results to
+ * process_page_data() to actually perform the legwork.
+ */
+static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    unsigned pages_of_data;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( decode_page_data_pfns(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
     if ( rec->length != (sizeof(*pages) +
                          (sizeof(uint64_t) * pages->count) +
                          (PAGE_SIZE * pages_of_data)) )
@@ -402,9 +1572,148 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         goto err;
     }
 
-    rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+    if ( postcopy_active(ctx) )
+        rc = postcopy_load_pages(ctx, pages->count, pfns, types,
+                                 &pages->pfn[pages->count]);
+    else if ( ctx->restore.pipeline )
+    {
+        /* The record data now belongs to the pipeline. */
+        rc = pipeline_queue_page_data(ctx, pages->count, pfns, types,
+                                      (void *)&pages->pfn[pages->count],
+                                      rec->data);
+        rec->data = NULL;
+    }
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types,
+                               &pages->pfn[pages->count]);
+ err:
+    free(types);
+    free(pfns);
+
+    return rc;
+}
+
+/*
+ * Expand page i of a COMPRESSED_PAGE_DATA record into page_data[], consuming
+ * its payload (if any) from *payload.  Returns 0, or -1 if the page info is
+ * inconsistent with the record.
+ */
+static int expand_compressed_page(const struct xc_sr_rec_compressed_page *info,
+                                  unsigned i, uint8_t *page_data,
+                                  const uint8_t **payload, size_t *remaining)
+{
+    uint8_t *page = &page_data[i * PAGE_SIZE];
+    uLongf len = PAGE_SIZE;
+
+    switch ( info->encoding )
+    {
+    case COMPRESSED_PAGE_RAW:
+        if ( info->param != PAGE_SIZE || *remaining < PAGE_SIZE )
+            return -1;
+        memcpy(page, *payload, PAGE_SIZE);
+        break;
+
+    case COMPRESSED_PAGE_ZERO:
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+
+    case COMPRESSED_PAGE_DUPLICATE:
+        if ( info->param >= i )
+            return -1;
+        memcpy(page, &page_data[info->param * PAGE_SIZE], PAGE_SIZE);
+        return 0;
+
+    case COMPRESSED_PAGE_DEFLATE:
+        if ( info->param > *remaining ||
+             uncompress(page, &len, *payload, info->param) != Z_OK ||
+             len != PAGE_SIZE )
+            return -1;
+        break;
+
+    default:
+        return -1;
+    }
+
+    *payload += info->param;
+    *remaining -= info->param;
+
+    return 0;
+}
+
+/*
+ * Validate a COMPRESSED_PAGE_DATA record from the stream, expand its page
+ * data and pass the results to process_page_data().
+ */
+static int handle_compressed_page_data(struct xc_sr_context *ctx,
+                                       struct xc_sr_record *rec)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_page_data_header *pages = rec->data;
+    const struct xc_sr_rec_compressed_page *info;
+    const uint8_t *payload;
+    uint8_t *page_data = NULL;
+    unsigned i, pages_of_data;
+    size_t offset, remaining;
+    int rc = -1;
+
+    xen_pfn_t *pfns = NULL;
+    uint32_t *types = NULL;
+
+    if ( decode_page_data_pfns(ctx, rec, &pfns, &types, &pages_of_data) )
+        return -1;
+
+    offset = sizeof(*pages) + (sizeof(uint64_t) * pages->count) +
+        (sizeof(*info) * pages_of_data);
+    if ( rec->length < offset )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record (length %u) too short to contain"
+              " %u pages worth of information", rec->length, pages_of_data);
+        goto err;
+    }
+
+    info = (const void *)&pages->pfn[pages->count];
+    payload = (const uint8_t *)&info[pages_of_data];
+    remaining = rec->length - offset;
+
+    page_data = malloc(pages_of_data * PAGE_SIZE);
+    if ( pages_of_data && !page_data )
+    {
+        ERROR("Unable to allocate %lu bytes of page data",
+              pages_of_data * PAGE_SIZE);
+        goto err;
+    }
+
+    for ( i = 0; i < pages_of_data; ++i )
+    {
+        if ( expand_compressed_page(&info[i], i, page_data,
+                                    &payload, &remaining) )
+        {
+            ERROR("Bad page %u in COMPRESSED_PAGE_DATA record: encoding %#x,"
+                  " param %#x, %zu bytes remaining", i, info[i].encoding,
+                  info[i].param, remaining);
+            goto err;
+        }
+    }
+
+    if ( remaining )
+    {
+        ERROR("COMPRESSED_PAGE_DATA record has %zu trailing bytes", remaining);
+        goto err;
+    }
+
+    if ( postcopy_active(ctx) )
+        rc = postcopy_load_pages(ctx, pages->count, pfns, types, page_data);
+    else if ( ctx->restore.pipeline )
+    {
+        /* The expanded page data now belongs to the pipeline. */
+        rc = pipeline_queue_page_data(ctx, pages->count, pfns, types,
+                                      page_data, page_data);
+        page_data = NULL;
+    }
+    else
+        rc = process_page_data(ctx, pages->count, pfns, types, page_data);
  err:
+    free(page_data);
     free(types);
     free(pfns);
 
@@ -626,11 +1935,68 @@ static int buffer_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
     return 0;
 }
 
+/*
+ * Answer a CAPABILITIES_QUERY from the sender over the back channel.  Without
+ * a back channel the sender gets no answer, and keeps to the features every
+ * receiver understands.
+ */
+static int handle_capabilities_query(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_rec_capabilities caps =
+        {
+            .caps = CAPABILITY_COMPRESSED_PAGE_DATA,
+        };
+    struct xc_sr_rhdr rhdr =
+        {
+            .type = REC_TYPE_CAPABILITIES,
+            .length = sizeof(caps),
+        };
+    struct iovec iov[] =
+    {
+        { &rhdr, sizeof(rhdr) },
+        { &caps, sizeof(caps) },
+    };
+
+    if ( ctx->restore.send_back_fd < 0 )
+    {
+        DPRINTF("No back channel to answer the capabilities query");
+        return 0;
+    }
+
+    /* Post-copy needs the toolstack to start the guest part way through. */
+    if ( ctx->restore.guest_type == DHDR_TYPE_X86_HVM &&
+         ctx->restore.checkpointed == XC_MIG_STREAM_NONE &&
+         ctx->restore.callbacks &&
+         ctx->restore.callbacks->postcopy_transition )
+        caps.caps |= CAPABILITY_POSTCOPY;
+
+    if ( writev_exact(ctx->restore.send_back_fd, iov, ARRAY_SIZE(iov)) )
+    {
+        PERROR("Failed to send capabilities");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     int rc = 0;
 
+    /* Everything else may depend on the page data having been loaded. */
+    if ( rec->type != REC_TYPE_PAGE_DATA &&
+         rec->type != REC_TYPE_COMPRESSED_PAGE_DATA )
+    {
+        rc = pipeline_drain(ctx);
+        if ( rc )
+        {
+            PERROR("Failed to load page data");
+            goto out;
+        }
+    }
+
     switch ( rec->type )
     {
     case REC_TYPE_END:
@@ -640,6 +2006,10 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_page_data(ctx, rec);
         break;
 
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
+        rc = handle_compressed_page_data(ctx, rec);
+        break;
+
     case REC_TYPE_VERIFY:
         DPRINTF("Verify mode enabled");
         ctx->restore.verify = true;
@@ -649,11 +2019,24 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         rc = handle_checkpoint(ctx);
         break;
 
+    case REC_TYPE_POSTCOPY_PFNS:
+        rc = handle_postcopy_pfns(ctx, rec);
+        break;
+
+    case REC_TYPE_POSTCOPY_TRANSITION:
+        rc = handle_postcopy_transition(ctx);
+        break;
+
+    case REC_TYPE_CAPABILITIES_QUERY:
+        rc = handle_capabilities_query(ctx);
+        break;
+
     default:
         rc = ctx->restore.ops.process_record(ctx, rec);
         break;
     }
 
+ out:
     free(rec->data);
     rec->data = NULL;
 
@@ -704,6 +2087,13 @@ static int setup(struct xc_sr_context *ctx)
     }
     ctx->restore.allocated_rec_num = DEFAULT_BUF_RECORDS;
 
+    /*
+     * Checkpointed streams keep page data back until a checkpoint and are
+     * small after the first one, so only plain HVM streams are pipelined.
+     */
+    if ( ctx->dominfo.hvm && ctx->restore.checkpointed == XC_MIG_STREAM_NONE )
+        rc = pipeline_create(ctx);
+
  err:
     return rc;
 }
@@ -721,6 +2111,8 @@ static void cleanup(struct xc_sr_context *ctx)
     if ( ctx->restore.checkpointed == XC_MIG_STREAM_COLO )
         xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->restore.p2m_size)));
+    pipeline_destroy(ctx);
+    postcopy_teardown(ctx);
     free(ctx->restore.buffered_records);
     free(ctx->restore.populated_pfns);
     if ( ctx->restore.ops.cleanup(ctx) )
@@ -744,6 +2136,13 @@ static int restore(struct xc_sr_context *ctx)
 
     do
     {
+        if ( postcopy_active(ctx) )
+        {
+            rc = postcopy_wait_for_record(ctx);
+            if ( rc )
+                goto err;
+        }
+
         rc = read_record(ctx, ctx->fd, &rec);
         if ( rc )
         {
@@ -795,6 +2194,32 @@ static int restore(struct xc_sr_context *ctx)
         goto done;
     }
 
+    if ( ctx->restore.postcopy )
+    {
+        /* The stream was completed at the post-copy transition. */
+        if ( !ctx->restore.postcopy->active )
+        {
+            ERROR("Stream ended without a post-copy transition");
+            rc = -1;
+            goto err;
+        }
+
+        if ( ctx->restore.postcopy->nr_outstanding )
+        {
+            ERROR("Stream ended with %lu post-copy pages outstanding",
+                  ctx->restore.postcopy->nr_outstanding);
+            rc = -1;
+            goto err;
+        }
+
+        rc = postcopy_teardown(ctx);
+        if ( rc )
+            goto err;
+
+        IPRINTF("Restore successful");
+        goto done;
+    }
+
     /*
      * With Remus, if we reach here, there must be some error on primary,
      * failover from the last checkpoint state.
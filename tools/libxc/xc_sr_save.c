@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <zlib.h>
 #include <arpa/inet.h>
 
 #include "xc_sr_common.h"
@@ -67,215 +70,940 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
- *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * A batch of pages making its way into the stream as a PAGE_DATA (or
+ * COMPRESSED_PAGE_DATA) record.  Each batch is mapped, normalised and written
+ * in turn, either synchronously by write_batch(), or by successive stages of
+ * the save pipeline.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_batch
+{
+    unsigned nr_pfns;           /* Pfns in the batch. */
+    unsigned nr_pages;          /* Pages with data in the stream. */
+    unsigned nr_pages_mapped;   /* Pages in guest_mapping. */
+
+    xen_pfn_t *pfns;            /* Pfns of the batch. */
+    xen_pfn_t *mfns;            /* Mfns of the batch pfns. */
+    xen_pfn_t *types;           /* Types of the batch pfns. */
+    int *errors;                /* Errors from attempting to map the gfns. */
+    int *normalise_errno;       /* Non-zero if normalise_page() failed. */
+    void *guest_mapping;
+    void **guest_data;          /* Mapped gfns or local allocations to send. */
+    void **local_pages;         /* Locally allocated pages.  Need freeing. */
+
+    /* COMPRESSED_PAGE_DATA only. */
+    struct xc_sr_rec_compressed_page *page_info;
+    uint64_t *page_hash;
+    unsigned *page_ordinal;     /* Index of each pfn's page in the record. */
+    int *dup_table;             /* Hash table of pfn indices. */
+    uint8_t *deflate_buf;       /* PAGE_SIZE of deflate output per pfn. */
+
+    uint64_t *rec_pfns;
+    struct iovec *iov;          /* iovec[] for writev(). */
+    int iovcnt;
+    struct xc_sr_rec_page_data_header hdr;
+    struct xc_sr_record rec;
+};
+
+/* Size of the hash table used for duplicate page detection in a batch. */
+#define SR_DUP_TABLE_SIZE (2 * MAX_BATCH_SIZE)
+
+/* Only send deflated pages if they save at least an eighth of a page. */
+#define SR_DEFLATE_MAX_LEN (PAGE_SIZE - (PAGE_SIZE / 8))
+
+static void free_batch(struct xc_sr_save_batch *batch)
+{
+    if ( !batch )
+        return;
+
+    free(batch->iov);
+    free(batch->rec_pfns);
+    free(batch->deflate_buf);
+    free(batch->dup_table);
+    free(batch->page_ordinal);
+    free(batch->page_hash);
+    free(batch->page_info);
+    free(batch->local_pages);
+    free(batch->guest_data);
+    free(batch->normalise_errno);
+    free(batch->errors);
+    free(batch->types);
+    free(batch->mfns);
+    free(batch->pfns);
+    free(batch);
+}
+
+static struct xc_sr_save_batch *alloc_batch(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    struct xc_sr_save_batch *batch = calloc(1, sizeof(*batch));
 
-    assert(nr_pfns != 0);
+    if ( !batch )
+        goto err;
 
-    /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
-    /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
-    /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
-    /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
-    /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
-
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
-    {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
+    batch->pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->pfns));
+    batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
+    batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
+    batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+    batch->normalise_errno = calloc(MAX_BATCH_SIZE,
+                                    sizeof(*batch->normalise_errno));
+    batch->guest_data = calloc(MAX_BATCH_SIZE, sizeof(*batch->guest_data));
+    batch->local_pages = calloc(MAX_BATCH_SIZE, sizeof(*batch->local_pages));
+    batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
+    /* Header, pfns, page info, page data and padding. */
+    batch->iov = malloc((MAX_BATCH_SIZE + 6) * sizeof(*batch->iov));
+
+    if ( !batch->pfns || !batch->mfns || !batch->types || !batch->errors ||
+         !batch->normalise_errno || !batch->guest_data ||
+         !batch->local_pages || !batch->rec_pfns || !batch->iov )
         goto err;
+
+    if ( ctx->save.want_compress )
+    {
+        batch->page_info = malloc(MAX_BATCH_SIZE * sizeof(*batch->page_info));
+        batch->page_hash = malloc(MAX_BATCH_SIZE * sizeof(*batch->page_hash));
+        batch->page_ordinal = malloc(MAX_BATCH_SIZE *
+                                     sizeof(*batch->page_ordinal));
+        batch->dup_table = malloc(SR_DUP_TABLE_SIZE *
+                                  sizeof(*batch->dup_table));
+        batch->deflate_buf = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+
+        if ( !batch->page_info || !batch->page_hash ||
+             !batch->page_ordinal || !batch->dup_table ||
+             !batch->deflate_buf )
+            goto err;
     }
 
+    return batch;
+
+ err:
+    ERROR("Unable to allocate arrays for a batch of %u pages",
+          MAX_BATCH_SIZE);
+    free_batch(batch);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/*
+ * Release the guest mapping and any local pages of a batch, leaving it ready
+ * to be reused for the next one.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
+        batch->guest_data[i] = NULL;
+        batch->normalise_errno[i] = 0;
+    }
+
+    batch->nr_pfns = batch->nr_pages = 0;
+}
+
+static bool page_type_has_data(xen_pfn_t type)
+{
+    switch ( type )
+    {
+    case XEN_DOMCTL_PFINFO_BROKEN:
+    case XEN_DOMCTL_PFINFO_XALLOC:
+    case XEN_DOMCTL_PFINFO_XTAB:
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Take the pfns accumulated in ctx->save.batch_pfns, get the types for each
+ * of them and map every pfn with real data.  On return, guest_data[] points
+ * at the unmodified guest mapping of each such pfn.
+ */
+static int map_batch(struct xc_sr_context *ctx,
+                     struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i, p, nr_pages = 0;
+    unsigned nr_pfns = ctx->save.nr_batch_pfns;
+    int rc;
+
+    assert(nr_pfns != 0);
+
+    batch->nr_pfns = nr_pfns;
+    memcpy(batch->pfns, ctx->save.batch_pfns, nr_pfns * sizeof(*batch->pfns));
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        batch->types[i] = batch->mfns[i] =
+            ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
-        if ( mfns[i] == INVALID_MFN )
+        if ( batch->mfns[i] == INVALID_MFN )
         {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
+            set_bit(batch->pfns[i], ctx->save.deferred_pages);
             ++ctx->save.nr_deferred_pages;
         }
     }
 
-    rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
+    rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, batch->types);
     if ( rc )
     {
         PERROR("Failed to get types for pfn batch");
-        goto err;
+        return -1;
     }
-    rc = -1;
 
     for ( i = 0; i < nr_pfns; ++i )
     {
-        switch ( types[i] )
-        {
-        case XEN_DOMCTL_PFINFO_BROKEN:
-        case XEN_DOMCTL_PFINFO_XALLOC:
-        case XEN_DOMCTL_PFINFO_XTAB:
+        if ( page_type_has_data(batch->types[i]) )
+            batch->mfns[nr_pages++] = batch->mfns[i];
+    }
+
+    batch->nr_pages = nr_pages;
+    if ( nr_pages == 0 )
+        return 0;
+
+    batch->guest_mapping = xenforeignmemory_map(xch->fmem,
+        ctx->domid, PROT_READ, nr_pages, batch->mfns, batch->errors);
+    if ( !batch->guest_mapping )
+    {
+        PERROR("Failed to map guest pages");
+        return -1;
+    }
+    batch->nr_pages_mapped = nr_pages;
+
+    for ( i = 0, p = 0; i < nr_pfns; ++i )
+    {
+        if ( !page_type_has_data(batch->types[i]) )
             continue;
+
+        if ( batch->errors[p] )
+        {
+            ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
+                  batch->pfns[i], batch->mfns[p], batch->errors[p]);
+            return -1;
         }
 
-        mfns[nr_pages++] = mfns[i];
+        batch->guest_data[i] = batch->guest_mapping + (p * PAGE_SIZE);
+        ++p;
+    }
+
+    return 0;
+}
+
+/*
+ * Run the normalise_page() hook over the mapped pages of the batch in the
+ * range [start, end).  Failures are recorded in normalise_errno[] and acted
+ * upon by finish_normalise_batch(), so this may be called concurrently for
+ * disjoint ranges of the same batch.
+ */
+static void normalise_batch_range(struct xc_sr_context *ctx,
+                                  struct xc_sr_save_batch *batch,
+                                  unsigned start, unsigned end)
+{
+    void *page, *orig_page;
+    unsigned i;
+    int rc;
+
+    for ( i = start; i < end; ++i )
+    {
+        if ( !batch->guest_data[i] )
+            continue;
+
+        orig_page = page = batch->guest_data[i];
+        errno = 0;
+        rc = ctx->save.ops.normalise_page(ctx, batch->types[i], &page);
+
+        if ( orig_page != page )
+            batch->local_pages[i] = page;
+
+        if ( rc )
+            batch->normalise_errno[i] = errno ?: EINVAL;
+        else
+            batch->guest_data[i] = page;
+    }
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+        if ( p[i] )
+            return false;
+
+    return true;
+}
+
+/* FNV-1a over the 64bit words of a page. */
+static uint64_t page_hash(const void *page)
+{
+    const uint64_t *p = page;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); ++i )
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
     }
 
-    if ( nr_pages > 0 )
+    return hash;
+}
+
+/*
+ * Choose an encoding for each normalised page of the batch in the range
+ * [start, end), for a COMPRESSED_PAGE_DATA record.  Zero pages are elided,
+ * and other pages are deflated into deflate_buf if that is worthwhile.
+ * Duplicates are only identified later by build_compressed_batch_record(),
+ * as that needs to consider the batch as a whole.
+ */
+static void encode_batch_range(struct xc_sr_context *ctx,
+                               struct xc_sr_save_batch *batch,
+                               unsigned start, unsigned end)
+{
+    struct xc_sr_rec_compressed_page *info;
+    uLongf len;
+    unsigned i;
+
+    for ( i = start; i < end; ++i )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
-            ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_data[i] || batch->normalise_errno[i] )
+            continue;
+
+        info = &batch->page_info[i];
+        *info = (struct xc_sr_rec_compressed_page)
+            { .encoding = COMPRESSED_PAGE_RAW, .param = PAGE_SIZE };
+
+        if ( page_is_zero(batch->guest_data[i]) )
         {
-            PERROR("Failed to map guest pages");
-            goto err;
+            info->encoding = COMPRESSED_PAGE_ZERO;
+            info->param = 0;
+            continue;
         }
-        nr_pages_mapped = nr_pages;
 
-        for ( i = 0, p = 0; i < nr_pfns; ++i )
+        batch->page_hash[i] = page_hash(batch->guest_data[i]);
+
+        len = SR_DEFLATE_MAX_LEN;
+        if ( compress2(&batch->deflate_buf[i * PAGE_SIZE], &len,
+                       batch->guest_data[i], PAGE_SIZE,
+                       Z_BEST_SPEED) == Z_OK )
         {
-            switch ( types[i] )
-            {
-            case XEN_DOMCTL_PFINFO_BROKEN:
-            case XEN_DOMCTL_PFINFO_XALLOC:
-            case XEN_DOMCTL_PFINFO_XTAB:
-                continue;
-            }
+            info->encoding = COMPRESSED_PAGE_DEFLATE;
+            info->param = len;
+        }
+    }
+}
 
-            if ( errors[p] )
-            {
-                ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
-                goto err;
-            }
+/*
+ * Prepare the pages of the batch in the range [start, end) for the stream.
+ * May be called concurrently for disjoint ranges of the same batch.
+ */
+static void process_batch_range(struct xc_sr_context *ctx,
+                                struct xc_sr_save_batch *batch,
+                                unsigned start, unsigned end)
+{
+    normalise_batch_range(ctx, batch, start, end);
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
-            rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
+    if ( ctx->save.compress )
+        encode_batch_range(ctx, batch, start, end);
+}
 
-            if ( orig_page != page )
-                local_pages[i] = page;
+/*
+ * Act on the results of normalisation.  Pages which could not be normalised
+ * yet are deferred until the guest is paused; any other failure is fatal.
+ */
+static int finish_normalise_batch(struct xc_sr_context *ctx,
+                                  struct xc_sr_save_batch *batch)
+{
+    unsigned i;
 
-            if ( rc )
-            {
-                if ( rc == -1 && errno == EAGAIN )
-                {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
-                    types[i] = XEN_DOMCTL_PFINFO_XTAB;
-                    --nr_pages;
-                }
-                else
-                    goto err;
-            }
-            else
-                guest_data[i] = page;
+    for ( i = 0; i < batch->nr_pfns; ++i )
+    {
+        if ( !batch->normalise_errno[i] )
+            continue;
 
-            rc = -1;
-            ++p;
+        if ( batch->normalise_errno[i] != EAGAIN )
+        {
+            errno = batch->normalise_errno[i];
+            return -1;
         }
+
+        set_bit(batch->pfns[i], ctx->save.deferred_pages);
+        ++ctx->save.nr_deferred_pages;
+        batch->types[i] = XEN_DOMCTL_PFINFO_XTAB;
+        batch->guest_data[i] = NULL;
+        --batch->nr_pages;
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    return 0;
+}
+
+/*
+ * Look for an earlier page in the batch with identical contents to pfn index
+ * i, adding i to the hash table if there is none.  Returns the pfn index of
+ * the duplicate, or -1.
+ */
+static int find_duplicate_page(struct xc_sr_save_batch *batch, unsigned i)
+{
+    unsigned slot = batch->page_hash[i] & (SR_DUP_TABLE_SIZE - 1);
+    int e;
+
+    while ( (e = batch->dup_table[slot]) != -1 )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
+        if ( batch->page_hash[e] == batch->page_hash[i] &&
+             !memcmp(batch->guest_data[e], batch->guest_data[i], PAGE_SIZE) )
+            return e;
+
+        slot = (slot + 1) & (SR_DUP_TABLE_SIZE - 1);
     }
 
-    hdr.count = nr_pfns;
+    batch->dup_table[slot] = i;
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
+    return -1;
+}
 
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+/*
+ * Construct the COMPRESSED_PAGE_DATA record for a fully normalised and
+ * encoded batch.  Page info is packed into page_info[], in the order of the
+ * pages in the record.
+ */
+static void build_compressed_batch_record(struct xc_sr_context *ctx,
+                                          struct xc_sr_save_batch *batch)
+{
+    static const uint8_t zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+    struct xc_sr_rec_compressed_page info;
+    struct iovec *iov = batch->iov;
+    unsigned i, j, payload = 0;
+    int dup;
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+    batch->rec.type = REC_TYPE_COMPRESSED_PAGE_DATA;
+    batch->hdr = (struct xc_sr_rec_page_data_header){ .count = batch->nr_pfns };
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    iov[4].iov_base = batch->page_info;
+    iov[4].iov_len = batch->nr_pages * sizeof(*batch->page_info);
+    batch->iovcnt = 5;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    memset(batch->dup_table, 0xff,
+           SR_DUP_TABLE_SIZE * sizeof(*batch->dup_table));
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    for ( i = 0, j = 0; i < batch->nr_pfns; ++i )
+    {
+        batch->rec_pfns[i] = ((uint64_t)(batch->types[i]) << 32) |
+            batch->pfns[i];
+
+        if ( !batch->guest_data[i] )
+            continue;
 
-    iovcnt = 4;
+        /* j <= i, so page_info[] can be packed in place. */
+        info = batch->page_info[i];
+        batch->page_ordinal[i] = j;
 
-    if ( nr_pages )
+        if ( info.encoding != COMPRESSED_PAGE_ZERO &&
+             (dup = find_duplicate_page(batch, i)) != -1 )
+        {
+            info.encoding = COMPRESSED_PAGE_DUPLICATE;
+            info.param = batch->page_ordinal[dup];
+        }
+
+        switch ( info.encoding )
+        {
+        case COMPRESSED_PAGE_ZERO:
+            ctx->save.compress_stats.zero++;
+            break;
+
+        case COMPRESSED_PAGE_DUPLICATE:
+            ctx->save.compress_stats.duplicate++;
+            break;
+
+        case COMPRESSED_PAGE_DEFLATE:
+            ctx->save.compress_stats.deflated++;
+            iov[batch->iovcnt].iov_base = &batch->deflate_buf[i * PAGE_SIZE];
+            iov[batch->iovcnt].iov_len = info.param;
+            batch->iovcnt++;
+            payload += info.param;
+            break;
+
+        default:
+            ctx->save.compress_stats.raw++;
+            iov[batch->iovcnt].iov_base = batch->guest_data[i];
+            iov[batch->iovcnt].iov_len = PAGE_SIZE;
+            batch->iovcnt++;
+            payload += PAGE_SIZE;
+            break;
+        }
+
+        batch->page_info[j++] = info;
+    }
+
+    /* Sanity check we are sending all the pages we expected to. */
+    assert(j == batch->nr_pages);
+
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += batch->nr_pfns * sizeof(*batch->rec_pfns);
+    batch->rec.length += batch->nr_pages * sizeof(*batch->page_info);
+    batch->rec.length += payload;
+
+    ctx->save.compress_stats.bytes += batch->rec.length;
+
+    iov[batch->iovcnt].iov_base = (void *)zeroes;
+    iov[batch->iovcnt].iov_len =
+        ROUNDUP(batch->rec.length, REC_ALIGN_ORDER) - batch->rec.length;
+    batch->iovcnt++;
+}
+
+/*
+ * Fill in the iovec[] entries for the record header, PAGE_DATA header and pfn
+ * list, common to both PAGE_DATA and COMPRESSED_PAGE_DATA records.
+ */
+static void set_batch_record_headers(struct xc_sr_save_batch *batch)
+{
+    struct iovec *iov = batch->iov;
+
+    iov[0].iov_base = &batch->rec.type;
+    iov[0].iov_len = sizeof(batch->rec.type);
+
+    iov[1].iov_base = &batch->rec.length;
+    iov[1].iov_len = sizeof(batch->rec.length);
+
+    iov[2].iov_base = &batch->hdr;
+    iov[2].iov_len = sizeof(batch->hdr);
+
+    iov[3].iov_base = batch->rec_pfns;
+    iov[3].iov_len = batch->nr_pfns * sizeof(*batch->rec_pfns);
+}
+
+/*
+ * Construct the PAGE_DATA record for a fully normalised batch.
+ */
+static void build_batch_record(struct xc_sr_context *ctx,
+                               struct xc_sr_save_batch *batch)
+{
+    unsigned i, nr_pages = batch->nr_pages;
+    struct iovec *iov = batch->iov;
+
+    set_batch_record_headers(batch);
+
+    if ( ctx->save.compress )
+    {
+        build_compressed_batch_record(ctx, batch);
+        return;
+    }
+
+    batch->rec.type = REC_TYPE_PAGE_DATA;
+    batch->hdr = (struct xc_sr_rec_page_data_header){ .count = batch->nr_pfns };
+
+    batch->rec.length = sizeof(batch->hdr);
+    batch->rec.length += batch->nr_pfns * sizeof(*batch->rec_pfns);
+    batch->rec.length += nr_pages * PAGE_SIZE;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
+        batch->rec_pfns[i] = ((uint64_t)(batch->types[i]) << 32) |
+            batch->pfns[i];
+
+    batch->iovcnt = 4;
+
+    for ( i = 0; nr_pages && i < batch->nr_pfns; ++i )
     {
-        for ( i = 0; i < nr_pfns; ++i )
+        if ( batch->guest_data[i] )
         {
-            if ( guest_data[i] )
-            {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
-                --nr_pages;
-            }
+            iov[batch->iovcnt].iov_base = batch->guest_data[i];
+            iov[batch->iovcnt].iov_len = PAGE_SIZE;
+            batch->iovcnt++;
+            --nr_pages;
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    /* Sanity check we are sending all the pages we expected to. */
+    assert(nr_pages == 0);
+}
+
+/*
+ * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
+ * is constructed in ctx->save.batch_pfns.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ * - construct and writes a PAGE_DATA record into the stream.
+ */
+static int write_batch(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch = ctx->save.batch;
+    int rc = -1;
+
+    if ( map_batch(ctx, batch) )
+        goto err;
+
+    process_batch_range(ctx, batch, 0, batch->nr_pfns);
+    if ( finish_normalise_batch(ctx, batch) )
+        goto err;
+
+    build_batch_record(ctx, batch);
+
+    if ( writev_exact(ctx->fd, batch->iov, batch->iovcnt) )
     {
         PERROR("Failed to write page data to stream");
         goto err;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
     rc = ctx->save.nr_batch_pfns = 0;
 
  err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+    release_batch(ctx, batch);
 
     return rc;
 }
 
+/*
+ * The save pipeline.
+ *
+ * With XCFLAGS_PIPELINE, sending a batch is split into stages running
+ * concurrently:
+ * - the calling thread maps the next batch of guest pages,
+ * - a pool of worker threads (joined by the calling thread) runs the
+ *   normalise_page() hook over the mapped pages, and encodes them for
+ *   compressed streams,
+ * - a writer thread streams completed PAGE_DATA records, strictly in the
+ *   order in which they were queued, and releases their mappings.
+ *
+ * Up to SR_PIPELINE_DEPTH batches may be queued for writing at once, which
+ * lets mapping and normalisation of later batches overlap with stalls on
+ * the stream.  pipeline_drain() must be called before any other record is
+ * written to the stream.
+ */
+#define SR_PIPELINE_DEPTH       4
+#define SR_PIPELINE_MAX_WORKERS 8
+#define SR_NORMALISE_CHUNK      64
+
+struct xc_sr_save_pipeline
+{
+    struct xc_sr_context *ctx;
+
+    /* Normalisation stage. */
+    pthread_mutex_t work_lock;
+    pthread_cond_t work_cond, work_done_cond;
+    struct xc_sr_save_batch *work;  /* Batch being normalised, or NULL. */
+    unsigned work_next;             /* Next pfn index to hand out. */
+    unsigned work_pending;          /* Pfns not yet normalised. */
+    unsigned nr_workers;
+    pthread_t *workers;
+
+    /* Writer stage. */
+    pthread_mutex_t write_lock;
+    pthread_cond_t write_cond, write_done_cond;
+    struct xc_sr_save_batch *slots[SR_PIPELINE_DEPTH];
+    unsigned long produced, consumed;
+    int write_rc, write_errno;
+    bool writer_started;
+    pthread_t writer;
+
+    bool stop;
+};
+
+/*
+ * Hand out chunks of the current work batch until it is exhausted.  Called
+ * with work_lock held, which is dropped while normalising.
+ */
+static void pipeline_normalise_chunks(struct xc_sr_save_pipeline *pl)
+{
+    struct xc_sr_save_batch *batch = pl->work;
+
+    while ( batch && pl->work_next < batch->nr_pfns )
+    {
+        unsigned start = pl->work_next;
+        unsigned end = min(start + SR_NORMALISE_CHUNK, batch->nr_pfns);
+
+        pl->work_next = end;
+        pthread_mutex_unlock(&pl->work_lock);
+
+        process_batch_range(pl->ctx, batch, start, end);
+
+        pthread_mutex_lock(&pl->work_lock);
+        pl->work_pending -= end - start;
+        if ( pl->work_pending == 0 )
+            pthread_cond_signal(&pl->work_done_cond);
+    }
+}
+
+static void *pipeline_worker(void *arg)
+{
+    struct xc_sr_save_pipeline *pl = arg;
+
+    pthread_mutex_lock(&pl->work_lock);
+    for ( ; ; )
+    {
+        while ( !pl->stop && (!pl->work || pl->work_next >= pl->work->nr_pfns) )
+            pthread_cond_wait(&pl->work_cond, &pl->work_lock);
+
+        if ( pl->stop )
+            break;
+
+        pipeline_normalise_chunks(pl);
+    }
+    pthread_mutex_unlock(&pl->work_lock);
+
+    return NULL;
+}
+
+static void *pipeline_writer(void *arg)
+{
+    struct xc_sr_save_pipeline *pl = arg;
+    struct xc_sr_context *ctx = pl->ctx;
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch;
+    bool failed;
+
+    pthread_mutex_lock(&pl->write_lock);
+    for ( ; ; )
+    {
+        while ( !pl->stop && pl->consumed == pl->produced )
+            pthread_cond_wait(&pl->write_cond, &pl->write_lock);
+
+        if ( pl->consumed == pl->produced )
+            break;
+
+        batch = pl->slots[pl->consumed % SR_PIPELINE_DEPTH];
+        failed = pl->write_rc || pl->stop;
+        pthread_mutex_unlock(&pl->write_lock);
+
+        /*
+         * After a failure, or when tearing down, queued batches are released
+         * without being written.
+         */
+        if ( !failed && writev_exact(ctx->fd, batch->iov, batch->iovcnt) )
+        {
+            int saved_errno = errno;
+
+            PERROR("Failed to write page data to stream");
+            pthread_mutex_lock(&pl->write_lock);
+            pl->write_rc = -1;
+            pl->write_errno = saved_errno;
+            pthread_mutex_unlock(&pl->write_lock);
+        }
+
+        release_batch(ctx, batch);
+
+        pthread_mutex_lock(&pl->write_lock);
+        pl->consumed++;
+        pthread_cond_signal(&pl->write_done_cond);
+    }
+    pthread_mutex_unlock(&pl->write_lock);
+
+    return NULL;
+}
+
+/*
+ * Wait for all queued batches to hit the stream.  Returns 0, or -1 with errno
+ * set if the writer stage failed.
+ */
+static int pipeline_drain(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    int rc;
+
+    if ( !pl )
+        return 0;
+
+    pthread_mutex_lock(&pl->write_lock);
+    while ( pl->consumed != pl->produced )
+        pthread_cond_wait(&pl->write_done_cond, &pl->write_lock);
+    rc = pl->write_rc;
+    if ( rc )
+        errno = pl->write_errno;
+    pthread_mutex_unlock(&pl->write_lock);
+
+    return rc;
+}
+
+/*
+ * Pipelined counterpart of write_batch().  Maps and normalises the batch in
+ * ctx->save.batch_pfns, then queues it for the writer stage.
+ */
+static int pipeline_write_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    struct xc_sr_save_batch *batch;
+    int rc = 0;
+
+    /* Wait for a free slot, bailing early if the writer has failed. */
+    pthread_mutex_lock(&pl->write_lock);
+    while ( !pl->write_rc && pl->produced - pl->consumed == SR_PIPELINE_DEPTH )
+        pthread_cond_wait(&pl->write_done_cond, &pl->write_lock);
+    if ( pl->write_rc )
+    {
+        rc = pl->write_rc;
+        errno = pl->write_errno;
+    }
+    pthread_mutex_unlock(&pl->write_lock);
+
+    if ( rc )
+        return rc;
+
+    batch = pl->slots[pl->produced % SR_PIPELINE_DEPTH];
+
+    rc = map_batch(ctx, batch);
+    if ( rc )
+        goto err;
+
+    if ( pl->nr_workers )
+    {
+        pthread_mutex_lock(&pl->work_lock);
+        pl->work = batch;
+        pl->work_next = 0;
+        pl->work_pending = batch->nr_pfns;
+        pthread_cond_broadcast(&pl->work_cond);
+
+        pipeline_normalise_chunks(pl);
+
+        while ( pl->work_pending )
+            pthread_cond_wait(&pl->work_done_cond, &pl->work_lock);
+        pl->work = NULL;
+        pthread_mutex_unlock(&pl->work_lock);
+    }
+    else
+        process_batch_range(ctx, batch, 0, batch->nr_pfns);
+
+    rc = finish_normalise_batch(ctx, batch);
+    if ( rc )
+        goto err;
+
+    build_batch_record(ctx, batch);
+
+    pthread_mutex_lock(&pl->write_lock);
+    pl->produced++;
+    pthread_cond_signal(&pl->write_cond);
+    pthread_mutex_unlock(&pl->write_lock);
+
+    ctx->save.nr_batch_pfns = 0;
+    return 0;
+
+ err:
+    release_batch(ctx, batch);
+    return rc;
+}
+
+static void pipeline_destroy(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_pipeline *pl = ctx->save.pipeline;
+    unsigned i;
+
+    if ( !pl )
+        return;
+
+    pthread_mutex_lock(&pl->work_lock);
+    pthread_mutex_lock(&pl->write_lock);
+    pl->stop = true;
+    pthread_cond_broadcast(&pl->work_cond);
+    pthread_cond_broadcast(&pl->write_cond);
+    pthread_mutex_unlock(&pl->write_lock);
+    pthread_mutex_unlock(&pl->work_lock);
+
+    for ( i = 0; i < pl->nr_workers; ++i )
+        pthread_join(pl->workers[i], NULL);
+    if ( pl->writer_started )
+        pthread_join(pl->writer, NULL);
+
+    for ( i = 0; i < SR_PIPELINE_DEPTH; ++i )
+    {
+        if ( pl->slots[i] )
+            release_batch(ctx, pl->slots[i]);
+        free_batch(pl->slots[i]);
+    }
+
+    pthread_cond_destroy(&pl->write_done_cond);
+    pthread_cond_destroy(&pl->write_cond);
+    pthread_mutex_destroy(&pl->write_lock);
+    pthread_cond_destroy(&pl->work_done_cond);
+    pthread_cond_destroy(&pl->work_cond);
+    pthread_mutex_destroy(&pl->work_lock);
+
+    free(pl->workers);
+    free(pl);
+    ctx->save.pipeline = NULL;
+}
+
+static int pipeline_create(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_pipeline *pl;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i, nr_workers;
+    int rc;
+
+    /* The calling thread and the writer each occupy a cpu already. */
+    nr_workers = nr_cpus > 2
+        ? min_t(long, nr_cpus - 2, SR_PIPELINE_MAX_WORKERS) : 0;
+
+    pl = calloc(1, sizeof(*pl));
+    if ( !pl )
+        goto enomem;
+
+    pl->ctx = ctx;
+    pthread_mutex_init(&pl->work_lock, NULL);
+    pthread_cond_init(&pl->work_cond, NULL);
+    pthread_cond_init(&pl->work_done_cond, NULL);
+    pthread_mutex_init(&pl->write_lock, NULL);
+    pthread_cond_init(&pl->write_cond, NULL);
+    pthread_cond_init(&pl->write_done_cond, NULL);
+    ctx->save.pipeline = pl;
+
+    for ( i = 0; i < SR_PIPELINE_DEPTH; ++i )
+    {
+        pl->slots[i] = alloc_batch(ctx);
+        if ( !pl->slots[i] )
+            goto err;
+    }
+
+    pl->workers = calloc(nr_workers ?: 1, sizeof(*pl->workers));
+    if ( !pl->workers )
+        goto enomem;
+
+    rc = pthread_create(&pl->writer, NULL, pipeline_writer, pl);
+    if ( rc )
+    {
+        errno = rc;
+        PERROR("Unable to create save pipeline writer thread");
+        goto err;
+    }
+    pl->writer_started = true;
+
+    for ( i = 0; i < nr_workers; ++i )
+    {
+        rc = pthread_create(&pl->workers[i], NULL, pipeline_worker, pl);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Unable to create save pipeline worker thread");
+            goto err;
+        }
+        pl->nr_workers++;
+    }
+
+    DPRINTF("Save pipeline: %u batches deep, %u normalise workers",
+            SR_PIPELINE_DEPTH, pl->nr_workers);
+
+    return 0;
+
+ enomem:
+    ERROR("Unable to allocate memory for the save pipeline");
+    errno = ENOMEM;
+ err:
+    pipeline_destroy(ctx);
+    return -1;
+}
+
 /*
  * Flush a batch of pfns into the stream.
  */
@@ -286,7 +1014,10 @@ static int flush_batch(struct xc_sr_context *ctx)
     if ( ctx->save.nr_batch_pfns == 0 )
         return rc;
 
-    rc = write_batch(ctx);
+    if ( ctx->save.pipeline )
+        rc = pipeline_write_batch(ctx);
+    else
+        rc = write_batch(ctx);
 
     if ( !rc )
     {
@@ -383,19 +1114,129 @@ static int send_dirty_pages(struct xc_sr_context *ctx,
         if ( (written & ((1U << (22 - 12)) - 1)) == 0 )
             xc_report_progress_step(xch, written, entries);
 
-        ++written;
+        ++written;
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    rc = pipeline_drain(ctx);
+    if ( rc )
+    {
+        PERROR("Failed to write page data to stream");
+        return rc;
+    }
+
+    if ( written > entries )
+        DPRINTF("Bitmap contained more entries than expected...");
+
+    xc_report_progress_step(xch, entries, entries);
+
+    return ctx->save.ops.check_vm_state(ctx);
+}
+
+/* Dirty pfns to harvest at once; matches what Xen records between harvests. */
+#define SR_DIRTY_LIST_ENTRIES (1UL << 17)
+
+static int compare_dirty_pfns(const void *l, const void *r)
+{
+    uint64_t lhs = *(const uint64_t *)l, rhs = *(const uint64_t *)r;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/*
+ * Send the pages harvested into the dirty list.  Used instead of
+ * send_dirty_pages() for the live iterations where Xen could provide a list,
+ * avoiding a scan of the whole bitmap when few pages have been dirtied.
+ */
+static int send_dirty_list(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned long i, entries = ctx->save.nr_dirty_list;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
+
+    /* The list is in the order pages were dirtied; batch them in pfn order. */
+    qsort(dirty_list, entries, sizeof(*dirty_list), compare_dirty_pfns);
+
+    for ( i = 0; i < entries; ++i )
+    {
+        if ( dirty_list[i] >= ctx->save.p2m_size )
+            continue;
+
+        rc = add_to_batch(ctx, dirty_list[i]);
+        if ( rc )
+            return rc;
+
+        /* Update progress every 4MB worth of memory sent. */
+        if ( (i & ((1U << (22 - 12)) - 1)) == 0 )
+            xc_report_progress_step(xch, i, entries);
+    }
+
+    rc = flush_batch(ctx);
+    if ( rc )
+        return rc;
+
+    rc = pipeline_drain(ctx);
+    if ( rc )
+    {
+        PERROR("Failed to write page data to stream");
+        return rc;
+    }
+
+    xc_report_progress_step(xch, entries, entries);
+
+    return ctx->save.ops.check_vm_state(ctx);
+}
+
+/*
+ * Collect the pages dirtied during the last live iteration.  Prefer the
+ * dirty list, and use the bitmap when Xen cannot provide one, or when too
+ * many pages have been dirtied for it to hold them.
+ */
+static int clean_dirty_pages(struct xc_sr_context *ctx,
+                             xc_shadow_op_stats_t *stats)
+{
+    xc_interface *xch = ctx->xch;
+    int rc;
+
+    ctx->save.nr_dirty_list = -1;
+
+    if ( ctx->save.use_dirty_list )
+    {
+        rc = xc_shadow_control(
+            xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN_LIST,
+            &ctx->save.dirty_list_hbuf, ctx->save.dirty_list_size,
+            NULL, 0, stats);
+        if ( rc >= 0 )
+        {
+            ctx->save.nr_dirty_list = rc;
+            stats->dirty_count = rc;
+            return 0;
+        }
+
+        if ( errno != ENOBUFS )
+        {
+            /* Older Xen, or a paging mode which cannot keep a list. */
+            DPRINTF("Dirty list unavailable (%d, %s), using bitmap",
+                    errno, strerror(errno));
+            ctx->save.use_dirty_list = false;
+        }
     }
 
-    rc = flush_batch(ctx);
-    if ( rc )
-        return rc;
-
-    if ( written > entries )
-        DPRINTF("Bitmap contained more entries than expected...");
-
-    xc_report_progress_step(xch, entries, entries);
+    if ( xc_shadow_control(
+             xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
+             &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
+             NULL, 0, stats) != ctx->save.p2m_size )
+    {
+        PERROR("Failed to retrieve logdirty bitmap");
+        return -1;
+    }
 
-    return ctx->save.ops.check_vm_state(ctx);
+    return 0;
 }
 
 /*
@@ -519,6 +1360,7 @@ static int send_memory_live(struct xc_sr_context *ctx)
          precopy_policy = simple_precopy_policy;
 
     bitmap_set(dirty_bitmap, ctx->save.p2m_size);
+    ctx->save.nr_dirty_list = -1;
 
     for ( ; ; )
     {
@@ -531,7 +1373,10 @@ static int send_memory_live(struct xc_sr_context *ctx)
             if ( rc )
                 goto out;
 
-            rc = send_dirty_pages(ctx, stats.dirty_count);
+            if ( ctx->save.nr_dirty_list >= 0 )
+                rc = send_dirty_list(ctx);
+            else
+                rc = send_dirty_pages(ctx, stats.dirty_count);
             if ( rc )
                 goto out;
         }
@@ -548,15 +1393,9 @@ static int send_memory_live(struct xc_sr_context *ctx)
         if ( policy_decision != XGS_POLICY_CONTINUE_PRECOPY )
            break;
 
-        if ( xc_shadow_control(
-                 xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
-                 &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
-                 NULL, 0, &stats) != ctx->save.p2m_size )
-        {
-            PERROR("Failed to retrieve logdirty bitmap");
-            rc = -1;
+        rc = clean_dirty_pages(ctx, &stats);
+        if ( rc )
             goto out;
-        }
 
         policy_stats->dirty_count = stats.dirty_count;
 
@@ -620,6 +1459,257 @@ static int colo_merge_secondary_dirty_bitmap(struct xc_sr_context *ctx)
     return rc;
 }
 
+/*
+ * Post-copy.
+ *
+ * With XCFLAGS_POSTCOPY, the final set of dirty pages is not sent while the
+ * guest is suspended.  Instead:
+ * - their pfns are listed in POSTCOPY_PFNS records, ahead of the end of
+ *   checkpoint records,
+ * - a POSTCOPY_TRANSITION record tells the receiver to start the guest with
+ *   the listed pfns paged out,
+ * - the pages then follow in PAGE_DATA records.  Pfns which the guest faults
+ *   on are requested with POSTCOPY_FAULT records over the back channel and
+ *   sent ahead of the rest, which are pushed in pfn order in the background.
+ *
+ * The dirty bitmap tracks the pfns which are still to be sent.
+ */
+#define SR_POSTCOPY_PFNS_PER_RECORD 4096
+
+static int send_postcopy_pfns(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    uint64_t *pfns = malloc(SR_POSTCOPY_PFNS_PER_RECORD * sizeof(*pfns));
+    struct xc_sr_record rec =
+    {
+        .type = REC_TYPE_POSTCOPY_PFNS,
+        .data = pfns,
+    };
+    unsigned count = 0;
+    xen_pfn_t p;
+    int rc = -1;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    if ( !pfns )
+    {
+        ERROR("Unable to allocate memory for post-copy pfn list");
+        goto err;
+    }
+
+    ctx->save.nr_postcopy_pfns = 0;
+
+    for ( p = 0; p < ctx->save.p2m_size; ++p )
+    {
+        if ( !test_bit(p, dirty_bitmap) )
+            continue;
+
+        pfns[count++] = p;
+        ++ctx->save.nr_postcopy_pfns;
+
+        if ( count == SR_POSTCOPY_PFNS_PER_RECORD )
+        {
+            rec.length = count * sizeof(*pfns);
+            if ( write_record(ctx, &rec) )
+                goto err;
+            count = 0;
+        }
+    }
+
+    if ( count )
+    {
+        rec.length = count * sizeof(*pfns);
+        if ( write_record(ctx, &rec) )
+            goto err;
+    }
+
+    DPRINTF("Deferring %lu pages to post-copy", ctx->save.nr_postcopy_pfns);
+    rc = 0;
+
+ err:
+    free(pfns);
+    return rc;
+}
+
+/*
+ * Read a POSTCOPY_FAULT record from the back channel, and batch up any of
+ * its pfns which are still to be sent.
+ */
+static int handle_postcopy_fault(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { 0, 0, NULL };
+    uint64_t *pfns;
+    unsigned count, i;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        goto err;
+
+    rc = -1;
+    if ( rec.type != REC_TYPE_POSTCOPY_FAULT )
+    {
+        ERROR("Expected post-copy fault record, but received %u", rec.type);
+        goto err;
+    }
+
+    if ( rec.length % sizeof(*pfns) )
+    {
+        ERROR("Invalid post-copy fault record length %u", rec.length);
+        goto err;
+    }
+
+    count = rec.length / sizeof(*pfns);
+    pfns = rec.data;
+
+    for ( i = 0; i < count; ++i )
+    {
+        if ( pfns[i] >= ctx->save.p2m_size )
+        {
+            ERROR("Invalid post-copy fault pfn 0x%" PRIx64, pfns[i]);
+            goto err;
+        }
+
+        /* Already sent, or in flight. */
+        if ( !test_and_clear_bit(pfns[i], dirty_bitmap) )
+            continue;
+
+        --ctx->save.nr_postcopy_pfns;
+        if ( add_to_batch(ctx, pfns[i]) )
+            goto err;
+    }
+
+    rc = 0;
+
+ err:
+    free(rec.data);
+    return rc;
+}
+
+/*
+ * Batch up the next MAX_BATCH_SIZE pfns still to be sent, starting from
+ * *cursor.
+ */
+static int queue_postcopy_background(struct xc_sr_context *ctx,
+                                     xen_pfn_t *cursor)
+{
+    xen_pfn_t p = *cursor;
+    unsigned queued = 0;
+    int rc = 0;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    while ( queued < MAX_BATCH_SIZE && ctx->save.nr_postcopy_pfns )
+    {
+        if ( p >= ctx->save.p2m_size )
+            p = 0;
+
+        if ( test_and_clear_bit(p, dirty_bitmap) )
+        {
+            --ctx->save.nr_postcopy_pfns;
+            ++queued;
+            rc = add_to_batch(ctx, p);
+            if ( rc )
+                break;
+        }
+
+        ++p;
+    }
+
+    *cursor = p;
+    return rc;
+}
+
+/*
+ * Switch the receiver over to post-copy, then send the outstanding pages,
+ * giving priority to those the guest has faulted on.
+ */
+static int send_postcopy_pages(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_POSTCOPY_TRANSITION, 0, NULL };
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    unsigned long entries = ctx->save.nr_postcopy_pfns, faults = 0;
+    xen_pfn_t cursor = 0;
+    int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        goto out;
+
+    /*
+     * The receiver starts the guest once it has the toolstack's state, which
+     * follows the transition record in the stream.
+     */
+    if ( ctx->save.callbacks->postcopy_transition(
+             ctx->save.callbacks->data) <= 0 )
+    {
+        ERROR("Toolstack failed to send its post-copy state");
+        rc = -1;
+        goto out;
+    }
+
+    xc_set_progress_prefix(xch, "Post-copy");
+
+    while ( ctx->save.nr_postcopy_pfns )
+    {
+        rc = poll(&pfd, 1, 0);
+        if ( rc < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Failed to poll for post-copy faults");
+            goto out;
+        }
+
+        if ( rc > 0 )
+        {
+            rc = handle_postcopy_fault(ctx);
+            ++faults;
+        }
+        else
+            rc = queue_postcopy_background(ctx, &cursor);
+        if ( rc )
+            goto out;
+
+        rc = flush_batch(ctx);
+        if ( rc )
+            goto out;
+
+        /* Pages which could not be normalised go back on the list. */
+        if ( ctx->save.nr_deferred_pages )
+        {
+            bitmap_or(dirty_bitmap, ctx->save.deferred_pages,
+                      ctx->save.p2m_size);
+            bitmap_clear(ctx->save.deferred_pages, ctx->save.p2m_size);
+            ctx->save.nr_postcopy_pfns += ctx->save.nr_deferred_pages;
+            ctx->save.nr_deferred_pages = 0;
+        }
+
+        xc_report_progress_step(xch, entries - ctx->save.nr_postcopy_pfns,
+                                entries);
+    }
+
+    rc = pipeline_drain(ctx);
+    if ( rc )
+    {
+        PERROR("Failed to write page data to stream");
+        goto out;
+    }
+
+    DPRINTF("Post-copy complete: %lu pages, %lu fault records",
+            entries, faults);
+
+ out:
+    xc_set_progress_prefix(xch, NULL);
+    return rc;
+}
+
 /*
  * Suspend the domain and send dirty memory.
  * This is the last iteration of the live migration and the
@@ -670,7 +1760,20 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
         }
     }
 
-    rc = send_dirty_pages(ctx, stats.dirty_count + ctx->save.nr_deferred_pages);
+    if ( ctx->save.postcopy &&
+         stats.dirty_count + ctx->save.nr_deferred_pages <
+         SPP_TARGET_DIRTY_COUNT )
+    {
+        DPRINTF("Only %lu pages left to send, not using post-copy",
+                stats.dirty_count + ctx->save.nr_deferred_pages);
+        ctx->save.postcopy = false;
+    }
+
+    if ( ctx->save.postcopy )
+        rc = send_postcopy_pfns(ctx);
+    else
+        rc = send_dirty_pages(ctx,
+                              stats.dirty_count + ctx->save.nr_deferred_pages);
     if ( rc )
         goto out;
 
@@ -809,7 +1912,27 @@ static int setup(struct xc_sr_context *ctx)
         goto err;
     }
 
-    rc = 0;
+    if ( ctx->save.live )
+    {
+        DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                        &ctx->save.dirty_list_hbuf);
+
+        ctx->save.dirty_list_size = min_t(unsigned long, ctx->save.p2m_size,
+                                          SR_DIRTY_LIST_ENTRIES);
+        dirty_list = xc_hypercall_buffer_alloc_pages(
+            xch, dirty_list,
+            NRPAGES(ctx->save.dirty_list_size * sizeof(*dirty_list)));
+        /* Not fatal: the bitmap is always available. */
+        ctx->save.use_dirty_list = !!dirty_list;
+    }
+
+    if ( ctx->save.pipelined )
+        rc = pipeline_create(ctx);
+    else
+    {
+        ctx->save.batch = alloc_batch(ctx);
+        rc = ctx->save.batch ? 0 : -1;
+    }
 
  err:
     return rc;
@@ -820,8 +1943,13 @@ static void cleanup(struct xc_sr_context *ctx)
     xc_interface *xch = ctx->xch;
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
+    DECLARE_HYPERCALL_BUFFER_SHADOW(uint64_t, dirty_list,
+                                    &ctx->save.dirty_list_hbuf);
 
 
+    pipeline_destroy(ctx);
+    free_batch(ctx->save.batch);
+
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
 
@@ -830,10 +1958,97 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+    xc_hypercall_buffer_free_pages(
+        xch, dirty_list,
+        NRPAGES(ctx->save.dirty_list_size * sizeof(*dirty_list)));
     free(ctx->save.deferred_pages);
     free(ctx->save.batch_pfns);
 }
 
+/* How long a receiver gets to answer a CAPABILITIES_QUERY. */
+#define SR_CAPABILITIES_TIMEOUT_MS 10000
+
+/*
+ * Ask the receiver which optional stream features it understands, and wait a
+ * bounded time for the answer.  The query is an optional record, so receivers
+ * which predate it skip it and never answer; such features are then simply
+ * left unused.
+ */
+static int query_capabilities(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_record rec = { REC_TYPE_CAPABILITIES_QUERY, 0, NULL };
+    struct xc_sr_rec_capabilities *caps;
+    struct pollfd pfd = { .fd = ctx->save.recv_fd, .events = POLLIN };
+    int rc;
+
+    if ( !ctx->save.query_capabilities )
+        return 0;
+
+    rc = write_record(ctx, &rec);
+    if ( rc )
+        return rc;
+
+    do {
+        rc = poll(&pfd, 1, SR_CAPABILITIES_TIMEOUT_MS);
+    } while ( rc < 0 && errno == EINTR );
+
+    if ( rc < 0 )
+    {
+        PERROR("Failed to poll for receiver capabilities");
+        return -1;
+    }
+
+    if ( rc == 0 )
+    {
+        DPRINTF("Receiver did not answer capabilities query");
+        if ( ctx->save.postcopy )
+        {
+            IPRINTF("Receiver cannot be asked for post-copy, not using it");
+            ctx->save.postcopy = false;
+        }
+        return 0;
+    }
+
+    rc = read_record(ctx, ctx->save.recv_fd, &rec);
+    if ( rc )
+        return rc;
+
+    rc = -1;
+    if ( rec.type != REC_TYPE_CAPABILITIES )
+    {
+        ERROR("Expected capabilities record, but received %u", rec.type);
+        goto err;
+    }
+
+    if ( rec.length < sizeof(*caps) )
+    {
+        ERROR("Capabilities record truncated: length %u, min %zu",
+              rec.length, sizeof(*caps));
+        goto err;
+    }
+
+    caps = rec.data;
+    if ( ctx->save.want_compress &&
+         (caps->caps & CAPABILITY_COMPRESSED_PAGE_DATA) )
+    {
+        DPRINTF("Receiver accepts compressed page data");
+        ctx->save.compress = true;
+    }
+
+    if ( ctx->save.postcopy && !(caps->caps & CAPABILITY_POSTCOPY) )
+    {
+        IPRINTF("Receiver does not support post-copy, not using it");
+        ctx->save.postcopy = false;
+    }
+
+    rc = 0;
+
+ err:
+    free(rec.data);
+    return rc;
+}
+
 /*
  * Save a domain.
  */
@@ -855,6 +2070,10 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    rc = query_capabilities(ctx);
+    if ( rc )
+        goto err;
+
     rc = ctx->save.ops.start_of_stream(ctx);
     if ( rc )
         goto err;
@@ -890,6 +2109,13 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
         if ( rc )
             goto err;
 
+        if ( ctx->save.postcopy )
+        {
+            rc = send_postcopy_pages(ctx);
+            if ( rc )
+                goto err;
+        }
+
         if ( ctx->save.checkpointed != XC_MIG_STREAM_NONE )
         {
             /*
@@ -945,6 +2171,15 @@ static int save(struct xc_sr_context *ctx, uint16_t guest_type)
     if ( rc )
         goto err;
 
+    if ( ctx->save.compress )
+        DPRINTF("Compressed page data: %lu raw, %lu deflated, %lu zero, "
+                "%lu duplicate pages in %"PRIu64" bytes",
+                ctx->save.compress_stats.raw,
+                ctx->save.compress_stats.deflated,
+                ctx->save.compress_stats.zero,
+                ctx->save.compress_stats.duplicate,
+                ctx->save.compress_stats.bytes);
+
     xc_report_progress_single(xch, "Complete");
     goto done;
 
@@ -979,9 +2214,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.pipelined = !!(flags & XCFLAGS_PIPELINE);
+    ctx.save.want_compress = !!(flags & XCFLAGS_STREAM_COMPRESS);
+    ctx.save.postcopy = !!(flags & XCFLAGS_POSTCOPY);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
 
+    /*
+     * Plain streams with a back channel find out whether the receiver can
+     * decompress, or start the guest for post-copy, before relying on it.
+     * Otherwise the caller vouches for the receiver.
+     */
+    if ( (ctx.save.want_compress || ctx.save.postcopy) && recv_fd >= 0 &&
+         stream_type == XC_MIG_STREAM_NONE )
+        ctx.save.query_capabilities = true;
+    else
+        ctx.save.compress = ctx.save.want_compress;
+
     /* If altering migration_stream update this assert too. */
     assert(stream_type == XC_MIG_STREAM_NONE ||
            stream_type == XC_MIG_STREAM_REMUS ||
@@ -994,6 +2243,21 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
         assert(callbacks->checkpoint && callbacks->postcopy);
     if ( ctx.save.checkpointed == XC_MIG_STREAM_COLO )
         assert(callbacks->wait_checkpoint);
+    if ( ctx.save.postcopy )
+        assert(callbacks->postcopy_transition);
+
+    /*
+     * Post-copy relies on mem_paging at the far end, which is HVM only, and
+     * needs the back channel to carry faults.
+     */
+    if ( ctx.save.postcopy &&
+         (!hvm || !ctx.save.live || ctx.save.checkpointed || recv_fd < 0) )
+    {
+        ERROR("Post-copy requires a live, non-checkpointed HVM stream with a"
+              " back channel");
+        errno = EINVAL;
+        return -1;
+    }
 
     DPRINTF("fd %d, dom %u, flags %u, hvm %d", io_fd, dom, flags, hvm);
 
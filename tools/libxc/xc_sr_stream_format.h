@@ -76,9 +76,16 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000010U
+#define REC_TYPE_POSTCOPY_PFNS              0x00000011U
+#define REC_TYPE_POSTCOPY_TRANSITION        0x00000012U
+#define REC_TYPE_POSTCOPY_FAULT             0x00000013U
+#define REC_TYPE_CAPABILITIES               0x00000015U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
+#define REC_TYPE_CAPABILITIES_QUERY   (0x00000014U | REC_TYPE_OPTIONAL)
+
 /* PAGE_DATA */
 struct xc_sr_rec_page_data_header
 {
@@ -90,6 +97,29 @@ struct xc_sr_rec_page_data_header
 #define PAGE_DATA_PFN_MASK  0x000fffffffffffffULL
 #define PAGE_DATA_TYPE_MASK 0xf000000000000000ULL
 
+/* COMPRESSED_PAGE_DATA */
+struct xc_sr_rec_compressed_page
+{
+    uint16_t encoding;
+    uint16_t _res1;
+    uint32_t param; /* Payload length, or index of the duplicated page. */
+};
+
+#define COMPRESSED_PAGE_RAW       0x0000U
+#define COMPRESSED_PAGE_ZERO      0x0001U
+#define COMPRESSED_PAGE_DUPLICATE 0x0002U
+#define COMPRESSED_PAGE_DEFLATE   0x0003U
+
+/* CAPABILITIES */
+struct xc_sr_rec_capabilities
+{
+    uint32_t caps;
+    uint32_t _res1;
+};
+
+#define CAPABILITY_COMPRESSED_PAGE_DATA  (1U << 0)
+#define CAPABILITY_POSTCOPY              (1U << 1)
+
 /* X86_PV_INFO */
 struct xc_sr_rec_x86_pv_info
 {
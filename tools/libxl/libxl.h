@@ -1169,6 +1169,33 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_PVCALLS 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_PIPELINE
+ *
+ * If this is defined, libxl_domain_suspend() accepts the
+ * LIBXL_SUSPEND_PIPELINE flag, which spreads the work of sending guest
+ * memory over several threads.
+ */
+#define LIBXL_HAVE_SUSPEND_PIPELINE 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_MIGRATE
+ *
+ * If this is defined, libxl_domain_migrate() exists, and both it and
+ * libxl_domain_suspend() accept the LIBXL_SUSPEND_COMPRESS flag, which
+ * compresses guest memory in the stream.
+ */
+#define LIBXL_HAVE_DOMAIN_MIGRATE 1
+
+/*
+ * LIBXL_HAVE_DOMAIN_MIGRATE_POSTCOPY
+ *
+ * If this is defined, libxl_domain_migrate() accepts the
+ * LIBXL_SUSPEND_POSTCOPY flag, may fail with ERROR_POSTCOPY_FAILED, and
+ * reports through postcopy_started_r whether post-copy was used.
+ */
+#define LIBXL_HAVE_DOMAIN_MIGRATE_POSTCOPY 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1518,6 +1545,36 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_PIPELINE 4
+#define LIBXL_SUSPEND_COMPRESS 8
+#define LIBXL_SUSPEND_POSTCOPY 16
+
+/*
+ * As libxl_domain_suspend(), but for sending the domain to a receiver which
+ * can answer over recv_fd, such as the incoming side of a migration whose
+ * libxl_domain_create_restore() was given a send_back_fd.
+ *
+ * With LIBXL_SUSPEND_COMPRESS, memory is only compressed if the receiver
+ * reports that it understands compressed streams, so older receivers keep
+ * working.  libxl_domain_suspend() has no way to ask, and always compresses.
+ *
+ * With LIBXL_SUSPEND_POSTCOPY (live HVM migration only), the receiver may
+ * start the guest before the last of its memory has arrived, fetching the
+ * rest on demand.  If the receiver does not support this, the migration is
+ * completed as usual.  ERROR_POSTCOPY_FAILED means the migration failed after
+ * the guest may have been started at the receiver: it must not be resumed
+ * here, as neither copy can be trusted to be complete.
+ *
+ * If postcopy_started_r is not NULL, it is set when the operation completes
+ * to whether the receiver was allowed to start the guest.  If it was, the
+ * domain must not be resumed here even if the migration later fails.
+ */
+int libxl_domain_migrate(libxl_ctx *ctx, uint32_t domid,
+                         int send_fd, int recv_fd,
+                         int flags, /* LIBXL_SUSPEND_* */
+                         bool *postcopy_started_r,
+                         const libxl_asyncop_how *ao_how)
+                         LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /*
  * Only suspend domain, do not save its state to file, do not destroy it.
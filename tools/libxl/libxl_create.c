@@ -800,6 +800,18 @@ static void libxl__colo_restore_setup_done(libxl__egc *egc,
 static void domcreate_stream_done(libxl__egc *egc,
                                   libxl__stream_read_state *srs,
                                   int ret);
+static void domcreate_postcopy_transition(void *data);
+static void domcreate_postcopy_records_done(libxl__egc *egc,
+                                            libxl__stream_read_state *srs,
+                                            int ret);
+static void domcreate_postcopy_started(libxl__egc *egc,
+                                       libxl__domain_create_state *dcs,
+                                       int rc, uint32_t domid);
+static void domcreate_postcopy_stream_done(libxl__egc *egc,
+                                           libxl__stream_read_state *srs,
+                                           int rc);
+static void domcreate_postcopy_check_finished(libxl__egc *egc,
+                                              libxl__domain_create_state *dcs);
 static void domcreate_rebuild_done(libxl__egc *egc,
                                    libxl__domain_create_state *dcs,
                                    int ret);
@@ -1122,6 +1134,15 @@ static void domcreate_bootloader_done(libxl__egc *egc,
     dcs->srs.back_channel = false;
     dcs->srs.completion_callback = domcreate_stream_done;
 
+    /*
+     * Post-copy needs the back channel for memory faults, and a device
+     * model to start along with the guest.
+     */
+    if (restore_fd >= 0 && dcs->send_back_fd >= 0 &&
+        info->type == LIBXL_DOMAIN_TYPE_HVM &&
+        checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE)
+        callbacks->postcopy_transition = domcreate_postcopy_transition;
+
     if (restore_fd >= 0) {
         switch (checkpointed_stream) {
         case LIBXL_CHECKPOINTED_STREAM_COLO:
@@ -1177,6 +1198,118 @@ void libxl__srm_callout_callback_restore_results(xen_pfn_t store_mfn,
     shs->need_results =           0;
 }
 
+/*
+ * Post-copy restore.
+ *
+ * At the post-copy transition, libxc has loaded everything but the memory
+ * still to arrive, and hands the stream back to us.  We read our own records
+ * as at a checkpoint, then build the domain and its device model as if the
+ * stream had ended, and unpause it.  Meanwhile libxc carries on with the
+ * rest of the stream, which ends as usual, and the caller is called back once
+ * both are done, with the domain paused again.
+ */
+static void domcreate_postcopy_transition(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_create_state *dcs = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+
+    dcs->srs.checkpoint_callback = domcreate_postcopy_records_done;
+    libxl__stream_read_start_checkpoint(egc, &dcs->srs);
+}
+
+static void domcreate_postcopy_records_done(libxl__egc *egc,
+                                            libxl__stream_read_state *srs,
+                                            int ret)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+
+    if (ret != XGR_CHECKPOINT_SUCCESS) {
+        libxl__xc_domain_saverestore_async_callback_done(egc, &srs->shs, 0);
+        return;
+    }
+
+    dcs->postcopy_saved_cb = dcs->callback;
+    dcs->callback = domcreate_postcopy_started;
+    dcs->postcopy_built = false;
+    dcs->postcopy_stream_done = false;
+    dcs->postcopy_rc = 0;
+
+    /* The stream completing is now the end of post-copy, not the build. */
+    srs->completion_callback = domcreate_postcopy_stream_done;
+
+    domcreate_stream_done(egc, srs, 0);
+}
+
+static void domcreate_postcopy_started(libxl__egc *egc,
+                                       libxl__domain_create_state *dcs,
+                                       int rc, uint32_t domid)
+{
+    STATE_AO_GC(dcs->ao);
+
+    dcs->callback = dcs->postcopy_saved_cb;
+    dcs->postcopy_saved_cb = NULL;
+
+    if (!rc) {
+        dcs->postcopy_built = true;
+
+        rc = libxl_domain_unpause(CTX, domid);
+        if (rc)
+            LOGD(ERROR, domid, "failed to start guest for post-copy");
+    }
+
+    if (rc && !dcs->postcopy_rc)
+        dcs->postcopy_rc = rc;
+
+    if (libxl__save_helper_inuse(&dcs->srs.shs))
+        libxl__xc_domain_saverestore_async_callback_done(egc, &dcs->srs.shs,
+                                                         !rc);
+
+    domcreate_postcopy_check_finished(egc, dcs);
+}
+
+static void domcreate_postcopy_stream_done(libxl__egc *egc,
+                                           libxl__stream_read_state *srs,
+                                           int rc)
+{
+    libxl__domain_create_state *dcs = srs->dcs;
+
+    dcs->postcopy_stream_done = true;
+    if (rc && !dcs->postcopy_rc)
+        dcs->postcopy_rc = rc;
+
+    domcreate_postcopy_check_finished(egc, dcs);
+}
+
+static void domcreate_postcopy_check_finished(libxl__egc *egc,
+                                              libxl__domain_create_state *dcs)
+{
+    STATE_AO_GC(dcs->ao);
+    int rc = dcs->postcopy_rc;
+
+    /* Wait for both the build and the rest of the stream. */
+    if (dcs->postcopy_saved_cb || !dcs->postcopy_stream_done)
+        return;
+
+    if (!rc) {
+        /* Callers expect a paused domain, as after any other restore. */
+        rc = libxl_domain_pause(CTX, dcs->guest_domid);
+        if (rc)
+            LOGD(ERROR, dcs->guest_domid, "failed to pause guest after "
+                 "post-copy");
+    }
+
+    if (rc && dcs->postcopy_built) {
+        dcs->dds.ao = ao;
+        dcs->dds.domid = dcs->guest_domid;
+        dcs->dds.callback = domcreate_destruction_cb;
+        libxl__domain_destroy(egc, &dcs->dds);
+        return;
+    }
+
+    dcs->callback(egc, dcs, rc, dcs->guest_domid);
+}
+
 static void domcreate_stream_done(libxl__egc *egc,
                                   libxl__stream_read_state *srs,
                                   int ret)
@@ -25,6 +25,10 @@ static void stream_done(libxl__egc *egc,
                         libxl__stream_write_state *sws, int rc);
 static void domain_save_done(libxl__egc *egc,
                              libxl__domain_save_state *dss, int rc);
+static void domain_save_postcopy_transition(void *data);
+static void postcopy_transition_written(libxl__egc *egc,
+                                        libxl__stream_write_state *sws,
+                                        int rc);
 
 /*----- complicated callback, called by xc_domain_save -----*/
 
@@ -342,6 +346,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     const libxl_domain_type type = dss->type;
     const int live = dss->live;
     const int debug = dss->debug;
+    const int pipeline = dss->pipeline;
+    const int compress = dss->compress;
     const libxl_domain_remus_info *const r_info = dss->remus;
     libxl__srm_save_autogen_callbacks *const callbacks =
         &dss->sws.shs.callbacks.save.a;
@@ -356,6 +362,7 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     }
 
     dss->rc = 0;
+    dss->postcopy_started = false;
     libxl__logdirty_init(&dss->logdirty);
     dss->logdirty.ao = ao;
 
@@ -380,6 +387,8 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
 
     dss->xcflags = (live ? XCFLAGS_LIVE : 0)
           | (debug ? XCFLAGS_DEBUG : 0)
+          | (pipeline ? XCFLAGS_PIPELINE : 0)
+          | (compress ? XCFLAGS_STREAM_COMPRESS : 0)
           | (dss->hvm ? XCFLAGS_HVM : 0);
 
     /* Disallow saving a guest with vNUMA configured because migration
@@ -405,6 +414,18 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     if (dss->checkpointed_stream == LIBXL_CHECKPOINTED_STREAM_NONE)
         callbacks->suspend = libxl__domain_suspend_callback;
 
+    if (dss->postcopy) {
+        if (!live || !dss->hvm || dss->recv_fd < 0 ||
+            dss->checkpointed_stream != LIBXL_CHECKPOINTED_STREAM_NONE) {
+            LOGD(ERROR, domid, "Post-copy requires live migration of an HVM "
+                               "guest to a receiver which can answer back");
+            rc = ERROR_INVAL;
+            goto out;
+        }
+        dss->xcflags |= XCFLAGS_POSTCOPY;
+        callbacks->postcopy_transition = domain_save_postcopy_transition;
+    }
+
     callbacks->switch_qemu_logdirty = libxl__domain_suspend_common_switch_qemu_logdirty;
 
     dss->sws.ao  = dss->ao;
@@ -420,6 +441,32 @@ void libxl__domain_save(libxl__egc *egc, libxl__domain_save_state *dss)
     domain_save_done(egc, dss, rc);
 }
 
+/*
+ * At the post-copy transition, libxc has sent everything but the remaining
+ * memory.  Send our own records now, so the receiver can start the guest.
+ */
+static void domain_save_postcopy_transition(void *data)
+{
+    libxl__save_helper_state *shs = data;
+    libxl__domain_save_state *dss = shs->caller_state;
+    libxl__egc *egc = shs->egc;
+
+    dss->sws.checkpoint_callback = postcopy_transition_written;
+    libxl__stream_write_start_checkpoint(egc, &dss->sws);
+}
+
+static void postcopy_transition_written(libxl__egc *egc,
+                                        libxl__stream_write_state *sws,
+                                        int rc)
+{
+    libxl__domain_save_state *dss = sws->dss;
+
+    if (!rc)
+        dss->postcopy_started = true;
+
+    libxl__xc_domain_saverestore_async_callback_done(egc, &sws->shs, !rc);
+}
+
 static void stream_done(libxl__egc *egc,
                         libxl__stream_write_state *sws, int rc)
 {
@@ -455,6 +502,12 @@ static void domain_save_done(libxl__egc *egc,
         return;
     }
 
+    if (rc && dss->postcopy_started) {
+        LOGD(ERROR, domid, "Post-copy migration failed after the transition; "
+                           "the guest may have been started by the receiver");
+        rc = ERROR_POSTCOPY_FAILED;
+    }
+
     dss->callback(egc, dss, rc);
 }
 
@@ -482,12 +482,17 @@ static void domain_suspend_cb(libxl__egc *egc,
     /* If suspend has failed already then report that error not this one. */
     if (flrc && !rc) rc = flrc;
 
+    if (dss->postcopy_started_r)
+        *dss->postcopy_started_r = dss->postcopy_started;
+
     libxl__ao_complete(egc,ao,rc);
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int domain_suspend(libxl_ctx *ctx, uint32_t domid,
+                          int fd, int recv_fd, int flags,
+                          bool *postcopy_started_r,
+                          const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
     int rc;
@@ -506,9 +511,14 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
 
     dss->domid = domid;
     dss->fd = fd;
+    dss->recv_fd = recv_fd;
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->pipeline = flags & LIBXL_SUSPEND_PIPELINE;
+    dss->compress = flags & LIBXL_SUSPEND_COMPRESS;
+    dss->postcopy = flags & LIBXL_SUSPEND_POSTCOPY;
+    dss->postcopy_started_r = postcopy_started_r;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
@@ -523,6 +533,24 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return domain_suspend(ctx, domid, fd, -1, flags, NULL, ao_how);
+}
+
+int libxl_domain_migrate(libxl_ctx *ctx, uint32_t domid,
+                         int send_fd, int recv_fd, int flags,
+                         bool *postcopy_started_r,
+                         const libxl_asyncop_how *ao_how)
+{
+    if (postcopy_started_r)
+        *postcopy_started_r = false;
+
+    return domain_suspend(ctx, domid, send_fd, recv_fd, flags,
+                          postcopy_started_r, ao_how);
+}
+
 static void domain_suspend_empty_cb(libxl__egc *egc,
                               libxl__domain_suspend_state *dss, int rc)
 {
@@ -3461,12 +3461,17 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int pipeline;
+    int compress;
+    int postcopy;
+    bool *postcopy_started_r; /* may be NULL */
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
     int rc;
     int hvm;
     int xcflags;
+    bool postcopy_started; /* receiver may have started the guest */
     libxl__domain_suspend_state dsps;
     union {
         /* for Remus */
@@ -4022,6 +4027,10 @@ struct libxl__domain_create_state {
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
+    /* post-copy: domain built from the stream's transition records */
+    libxl__domain_create_cb *postcopy_saved_cb;
+    bool postcopy_built, postcopy_stream_done;
+    int postcopy_rc;
 };
 
 _hidden int libxl__device_nic_set_devids(libxl__gc *gc,
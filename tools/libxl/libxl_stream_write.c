@@ -375,6 +375,9 @@ void libxl__xc_domain_save_done(libxl__egc *egc, void *dss_void,
              * return value (Please refer to libxl__remus_teardown())
              */
             stream_complete(egc, stream, 0);
+        else if (dss->postcopy_started)
+            /* Our records were sent at the post-copy transition. */
+            write_end_record(egc, stream);
         else
             write_emulator_xenstore_record(egc, stream);
     }
@@ -0,0 +1,553 @@
+/*
+ * xen-dedupd: share identical pages between HVM guests.
+ *
+ * Guest memory is scanned a chunk at a time through read-only foreign
+ * mappings, and the hash of each page is looked up in an index of the
+ * distinct pages seen so far during the pass.  The hits in each chunk are
+ * nominated and shared with a single xc_memshr_share_batch() call, which has
+ * Xen compare their contents, so neither a hash collision nor a guest writing
+ * to a page after it was hashed can result in wrongly shared memory.
+ *
+ * Scanning is rate limited, and the savings are reported after each pass.
+ *
+ * Note that the domains' sharing rings are not set up: a guest which
+ * unshares a page when the host is out of memory will be crashed, so hosts
+ * must keep enough memory free to cover unsharing.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenforeignmemory.h>
+
+#include <xen-tools/libs.h>
+
+#define PAGE_SHIFT      12
+#define PAGE_SIZE       (1UL << PAGE_SHIFT)
+#define PAGE_WORDS      (PAGE_SIZE / sizeof(uint64_t))
+
+/* Pages mapped and hashed at once. */
+#define SCAN_CHUNK      256
+
+#define DEFAULT_RATE        25600       /* Pages per second (100MB/s). */
+#define DEFAULT_INTERVAL    300         /* Seconds between passes. */
+#define DEFAULT_MAX_ENTRIES (1UL << 21) /* Distinct pages indexed. */
+
+/*
+ * Index keys pack the domain id above the gfn.  Unused entries hold a key
+ * with DOMID_INVALID, which is never scanned.
+ */
+#define KEY(domid, gfn)     (((uint64_t)(domid) << 48) | (gfn))
+#define KEY_UNUSED          (~0ULL)
+#define KEY_DOMID(key)      ((uint32_t)((key) >> 48))
+#define KEY_GFN(key)        ((key) & ((1ULL << 48) - 1))
+
+struct index_entry {
+    uint64_t hash;
+    uint64_t key;
+};
+
+struct pass_stats {
+    unsigned long scanned, unmappable;
+    unsigned long candidates, shared, differ, failed;
+};
+
+static xc_interface *xch;
+static xenforeignmemory_handle *fmem;
+
+static struct index_entry *index_slots;
+static unsigned long index_mask, index_used, index_max;
+
+static unsigned long rate = DEFAULT_RATE;
+static unsigned int interval = DEFAULT_INTERVAL;
+static bool verbose;
+
+static volatile sig_atomic_t stop;
+
+static void catch_stop(int sig)
+{
+    stop = 1;
+}
+
+static void usage(FILE *f)
+{
+    fprintf(f,
+            "Usage: xen-dedupd [options]\n"
+            "Share identical pages between HVM guests.\n"
+            "\n"
+            "Options:\n"
+            "  -d, --domain=DOMID      scan DOMID (may be repeated; default: all\n"
+            "                          HVM guests)\n"
+            "  -r, --rate=PAGES        scan at most PAGES pages per second\n"
+            "                          (default: %u)\n"
+            "  -i, --interval=SECONDS  wait SECONDS between passes (default: %u)\n"
+            "  -m, --max-entries=N     index up to N distinct pages per pass\n"
+            "                          (default: %lu)\n"
+            "  -o, --once              make a single pass and exit\n"
+            "  -v, --verbose           report progress for each domain\n"
+            "  -h, --help              display this help\n",
+            DEFAULT_RATE, DEFAULT_INTERVAL, DEFAULT_MAX_ENTRIES);
+}
+
+static inline uint64_t rotl64(uint64_t x, unsigned int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * A fast, non-cryptographic 64-bit hash of a page, in the style of xxHash64:
+ * four independent lanes, combined and mixed at the end.
+ */
+static uint64_t hash_page(const uint64_t *p)
+{
+    static const uint64_t P1 = 0x9e3779b185ebca87ULL;
+    static const uint64_t P2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t h[4] = { P1 + P2, P2, 0, -P1 }, x;
+    unsigned int i, j;
+
+    for ( i = 0; i < PAGE_WORDS; i += 4 )
+        for ( j = 0; j < 4; ++j )
+            h[j] = rotl64(h[j] + p[i + j] * P2, 31) * P1;
+
+    x = rotl64(h[0], 1) + rotl64(h[1], 7) + rotl64(h[2], 12) +
+        rotl64(h[3], 18);
+    x ^= x >> 33;
+    x *= P2;
+    x ^= x >> 29;
+
+    return x;
+}
+
+static void index_reset(void)
+{
+    unsigned long i;
+
+    for ( i = 0; i <= index_mask; i++ )
+        index_slots[i].key = KEY_UNUSED;
+    index_used = 0;
+}
+
+static int index_alloc(unsigned long max_entries)
+{
+    unsigned long slots = 1;
+
+    /* Keep the table at most half full. */
+    while ( slots < 2 * max_entries )
+        slots <<= 1;
+
+    index_slots = malloc(slots * sizeof(*index_slots));
+    if ( !index_slots )
+        return -1;
+
+    index_mask = slots - 1;
+    index_max = max_entries;
+    index_reset();
+
+    return 0;
+}
+
+/*
+ * Find the entry for a hash, or the free slot it would go in.  Returns NULL if
+ * the hash is not present and the index is full.
+ */
+static struct index_entry *index_find(uint64_t hash)
+{
+    unsigned long i = hash & index_mask;
+
+    for ( ; ; i = (i + 1) & index_mask )
+    {
+        struct index_entry *e = &index_slots[i];
+
+        if ( e->key == KEY_UNUSED )
+            return index_used < index_max ? e : NULL;
+        if ( e->hash == hash )
+            return e;
+    }
+}
+
+/* Sleep as needed to keep to the scan rate. */
+static void rate_limit(const struct timespec *start, unsigned long scanned)
+{
+    struct timespec now, delay;
+    uint64_t due_ns, now_ns;
+
+    if ( !rate )
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    due_ns = (uint64_t)start->tv_sec * 1000000000ULL + start->tv_nsec +
+        (uint64_t)scanned * 1000000000ULL / rate;
+    now_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    if ( due_ns <= now_ns )
+        return;
+
+    delay.tv_sec = (due_ns - now_ns) / 1000000000ULL;
+    delay.tv_nsec = (due_ns - now_ns) % 1000000000ULL;
+    nanosleep(&delay, NULL);
+}
+
+/*
+ * Share the client page with the indexed source page.  If the source is no
+ * longer sharable, the client replaces it in the index.
+ */
+static void try_share(struct index_entry *e, uint32_t domid, xen_pfn_t gfn,
+                      struct pass_stats *stats)
+{
+    uint32_t sdomid = KEY_DOMID(e->key);
+    xen_pfn_t sgfn = KEY_GFN(e->key);
+    uint64_t sh, ch;
+
+    stats->candidates++;
+
+    if ( xc_memshr_nominate_gfn(xch, sdomid, sgfn, &sh) )
+    {
+        e->key = KEY(domid, gfn);
+        stats->failed++;
+        return;
+    }
+
+    if ( xc_memshr_nominate_gfn(xch, domid, gfn, &ch) )
+    {
+        stats->failed++;
+        return;
+    }
+
+    if ( !xc_memshr_share_gfns_identical(xch, sdomid, sgfn, sh,
+                                         domid, gfn, ch) )
+        stats->shared++;
+    else if ( errno == ENODATA )
+        stats->differ++;
+    else
+    {
+        if ( errno == -XENMEM_SHARING_OP_S_HANDLE_INVALID )
+            e->key = KEY(domid, gfn);
+        stats->failed++;
+    }
+}
+
+/*
+ * Share a chunk's candidates in one hypercall.  The freshly hashed pages are
+ * the sources, so the indexed pages (possibly in other domains) are the
+ * clients.  A candidate which fails for any reason but differing contents
+ * replaces its index entry, as the indexed page is the more likely to have
+ * changed since it was hashed.
+ */
+static void share_batch(uint32_t domid, xen_mem_sharing_batch_entry_t *batch,
+                        struct index_entry **entries, unsigned int nr,
+                        struct pass_stats *stats)
+{
+    unsigned int i;
+
+    if ( !nr )
+        return;
+
+    if ( xc_memshr_share_batch(xch, domid, batch, nr,
+                               XENMEM_SHARING_BATCH_IDENTICAL) )
+    {
+        /* Fall back to sharing one page at a time. */
+        for ( i = 0; i < nr; ++i )
+            try_share(entries[i], domid, batch[i].source_gfn, stats);
+        return;
+    }
+
+    for ( i = 0; i < nr; ++i )
+    {
+        stats->candidates++;
+
+        if ( !batch[i].rc )
+            stats->shared++;
+        else if ( batch[i].rc == -ENODATA )
+            stats->differ++;
+        else
+        {
+            entries[i]->key = KEY(domid, batch[i].source_gfn);
+            stats->failed++;
+        }
+    }
+}
+
+static int scan_domain(uint32_t domid, const struct timespec *start,
+                       struct pass_stats *stats)
+{
+    xen_pfn_t gfns[SCAN_CHUNK], max_gfn, gfn;
+    uint64_t hashes[SCAN_CHUNK];
+    int errs[SCAN_CHUNK];
+    xen_mem_sharing_batch_entry_t batch[SCAN_CHUNK];
+    struct index_entry *entries[SCAN_CHUNK];
+    unsigned int i, n, nr;
+    const uint8_t *map;
+
+    if ( xc_domain_maximum_gpfn(xch, domid, &max_gfn) < 0 )
+    {
+        fprintf(stderr, "d%u: failed to get maximum gfn: %s\n",
+                domid, strerror(errno));
+        return -1;
+    }
+
+    for ( gfn = 0; gfn <= max_gfn && !stop; gfn += n )
+    {
+        n = min_t(xen_pfn_t, SCAN_CHUNK, max_gfn - gfn + 1);
+
+        rate_limit(start, stats->scanned);
+
+        for ( i = 0; i < n; ++i )
+            gfns[i] = gfn + i;
+
+        map = xenforeignmemory_map(fmem, domid, PROT_READ, n, gfns, errs);
+        if ( !map )
+        {
+            /* The domain has probably gone away. */
+            if ( verbose )
+                fprintf(stderr, "d%u: failed to map gfn %#"PRIx64": %s\n",
+                        domid, (uint64_t)gfn, strerror(errno));
+            return -1;
+        }
+
+        for ( i = 0; i < n; ++i )
+            if ( !errs[i] )
+                hashes[i] = hash_page((const void *)&map[i * PAGE_SIZE]);
+
+        /* Nominating fails on pages which are mapped elsewhere. */
+        xenforeignmemory_unmap(fmem, (void *)map, n);
+
+        for ( i = nr = 0; i < n; ++i )
+        {
+            struct index_entry *e;
+
+            stats->scanned++;
+            if ( errs[i] )
+            {
+                stats->unmappable++;
+                continue;
+            }
+
+            e = index_find(hashes[i]);
+            if ( !e )
+                continue;
+
+            if ( e->key == KEY_UNUSED )
+            {
+                e->hash = hashes[i];
+                e->key = KEY(domid, gfn + i);
+                index_used++;
+            }
+            else if ( e->key != KEY(domid, gfn + i) )
+            {
+                batch[nr] = (xen_mem_sharing_batch_entry_t){
+                    .source_gfn = gfn + i,
+                    .client_domain = KEY_DOMID(e->key),
+                    .client_gfn = KEY_GFN(e->key),
+                };
+                entries[nr++] = e;
+            }
+        }
+
+        share_batch(domid, batch, entries, nr, stats);
+    }
+
+    return 0;
+}
+
+static void report(unsigned int pass, const struct pass_stats *stats,
+                   time_t secs)
+{
+    printf("pass %u: scanned %lu pages in %lus (%lu unmappable), "
+           "%lu candidates: %lu shared, %lu differed, %lu failed; "
+           "%lu distinct pages indexed\n",
+           pass, stats->scanned, (unsigned long)secs, stats->unmappable,
+           stats->candidates, stats->shared, stats->differ, stats->failed,
+           index_used);
+    printf("host: %ld pages saved by sharing, %ld shared frames in use\n",
+           xc_sharing_freed_pages(xch), xc_sharing_used_frames(xch));
+}
+
+static void scan_pass(unsigned int pass, const uint32_t *domids,
+                      unsigned int nr_domids)
+{
+    struct pass_stats stats = { 0 };
+    struct timespec start, end;
+    xc_dominfo_t info[64];
+    uint32_t next = 1;
+    unsigned int i;
+    int nr;
+
+    index_reset();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for ( i = 0; i < nr_domids && !stop; ++i )
+    {
+        if ( xc_domain_getinfo(xch, domids[i], 1, info) != 1 ||
+             info[0].domid != domids[i] )
+        {
+            fprintf(stderr, "d%u: no such domain\n", domids[i]);
+            continue;
+        }
+
+        if ( xc_memshr_control(xch, domids[i], 1) )
+        {
+            fprintf(stderr, "d%u: unable to enable sharing: %s\n",
+                    domids[i], strerror(errno));
+            continue;
+        }
+
+        scan_domain(domids[i], &start, &stats);
+        if ( verbose && xc_domain_getinfo(xch, domids[i], 1, info) == 1 )
+            printf("d%u: %lu shared pages\n", domids[i],
+                   info[0].nr_shared_pages);
+    }
+
+    /* Without an explicit list, scan all HVM guests. */
+    while ( !nr_domids && !stop &&
+            (nr = xc_domain_getinfo(xch, next, ARRAY_SIZE(info), info)) > 0 )
+    {
+        for ( i = 0; i < nr && !stop; ++i )
+        {
+            next = info[i].domid + 1;
+
+            if ( !info[i].hvm || info[i].dying || info[i].shutdown )
+                continue;
+
+            if ( xc_memshr_control(xch, info[i].domid, 1) )
+            {
+                if ( verbose )
+                    fprintf(stderr, "d%u: unable to enable sharing: %s\n",
+                            info[i].domid, strerror(errno));
+                continue;
+            }
+
+            scan_domain(info[i].domid, &start, &stats);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report(pass, &stats, end.tv_sec - start.tv_sec);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "domain",      required_argument, NULL, 'd' },
+        { "rate",        required_argument, NULL, 'r' },
+        { "interval",    required_argument, NULL, 'i' },
+        { "max-entries", required_argument, NULL, 'm' },
+        { "once",        no_argument,       NULL, 'o' },
+        { "verbose",     no_argument,       NULL, 'v' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    unsigned long max_entries = DEFAULT_MAX_ENTRIES;
+    uint32_t *domids = NULL, *p;
+    unsigned int nr_domids = 0, pass;
+    bool once = false;
+    int c, rc = 1;
+
+    while ( (c = getopt_long(argc, argv, "d:r:i:m:ovh", opts, NULL)) != -1 )
+    {
+        switch ( c )
+        {
+        case 'd':
+            p = realloc(domids, (nr_domids + 1) * sizeof(*domids));
+            if ( !p )
+            {
+                perror("realloc");
+                goto out;
+            }
+            domids = p;
+            domids[nr_domids++] = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            max_entries = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            once = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+            usage(stdout);
+            rc = 0;
+            goto out;
+        default:
+            usage(stderr);
+            goto out;
+        }
+    }
+
+    if ( optind != argc || !max_entries )
+    {
+        usage(stderr);
+        goto out;
+    }
+
+    if ( index_alloc(max_entries) )
+    {
+        fprintf(stderr, "Unable to allocate an index of %lu pages\n",
+                max_entries);
+        goto out;
+    }
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    fmem = xenforeignmemory_open(NULL, 0);
+    if ( !xch || !fmem )
+    {
+        perror("Unable to open a Xen interface");
+        goto out;
+    }
+
+    signal(SIGINT, catch_stop);
+    signal(SIGTERM, catch_stop);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for ( pass = 1; !stop; ++pass )
+    {
+        scan_pass(pass, domids, nr_domids);
+
+        if ( once )
+            break;
+
+        /* Interrupted by the signals above. */
+        if ( !stop )
+            sleep(interval);
+    }
+
+    rc = 0;
+
+ out:
+    if ( fmem )
+        xenforeignmemory_close(fmem);
+    if ( xch )
+        xc_interface_close(xch);
+    free(index_slots);
+    free(domids);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -65,6 +65,12 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_compressed_page_data       = 0x00000010
+REC_TYPE_postcopy_pfns              = 0x00000011
+REC_TYPE_postcopy_transition        = 0x00000012
+REC_TYPE_postcopy_fault             = 0x00000013
+REC_TYPE_capabilities               = 0x00000015
+REC_TYPE_capabilities_query         = 0x80000014
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -82,7 +88,13 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
+    REC_TYPE_postcopy_pfns              : "Post-copy pfns",
+    REC_TYPE_postcopy_transition        : "Post-copy transition",
+    REC_TYPE_postcopy_fault             : "Post-copy fault",
+    REC_TYPE_capabilities               : "Capabilities",
+    REC_TYPE_capabilities_query         : "Capabilities query",
 }
 
 # page_data
@@ -105,6 +117,14 @@ PAGE_DATA_TYPE_BROKEN        = (long(0xd) << PAGE_DATA_TYPE_SHIFT) # Broken
 PAGE_DATA_TYPE_XALLOC        = (long(0xe) << PAGE_DATA_TYPE_SHIFT) # Allocate-only
 PAGE_DATA_TYPE_XTAB          = (long(0xf) << PAGE_DATA_TYPE_SHIFT) # Invalid
 
+# compressed_page_data
+COMPRESSED_PAGE_FORMAT       = "HHI"
+
+COMPRESSED_PAGE_RAW          = 0x0000
+COMPRESSED_PAGE_ZERO         = 0x0001
+COMPRESSED_PAGE_DUPLICATE    = 0x0002
+COMPRESSED_PAGE_DEFLATE      = 0x0003
+
 # x86_pv_info
 X86_PV_INFO_FORMAT        = "BBHI"
 
@@ -242,24 +262,26 @@ class VerifyLibxc(VerifyBase):
             raise RecordError("End record with non-zero length")
 
 
-    def verify_record_page_data(self, content):
-        """ Page Data record """
+    def verify_page_data_pfns(self, content, name):
+        """ Common header and pfn list of (compressed) page data records.
+        Returns the length of the header and pfn list, and the number of
+        pages of data expected """
         minsz = calcsize(PAGE_DATA_FORMAT)
 
         if len(content) <= minsz:
-            raise RecordError("PAGE_DATA record must be at least %d bytes long"
-                              % (minsz, ))
+            raise RecordError("%s record must be at least %d bytes long"
+                              % (name, minsz))
 
         count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
 
         if res1 != 0:
-            raise StreamError("Reserved bits set in PAGE_DATA record 0x%04x"
-                              % (res1, ))
+            raise StreamError("Reserved bits set in %s record 0x%04x"
+                              % (name, res1))
 
         pfnsz = count * 8
         if (len(content) - minsz) < pfnsz:
-            raise RecordError("PAGE_DATA record must contain a pfn record for "
-                              "each count")
+            raise RecordError("%s record must contain a pfn record for "
+                              "each count" % (name, ))
 
         pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
 
@@ -279,10 +301,57 @@ class VerifyLibxc(VerifyBase):
                     <= PAGE_DATA_TYPE_L4TAB:
                 nr_pages += 1
 
+        return minsz + pfnsz, nr_pages
+
+
+    def verify_record_page_data(self, content):
+        """ Page Data record """
+        hdrsz, nr_pages = self.verify_page_data_pfns(content, "PAGE_DATA")
+
         pagesz = nr_pages * 4096
-        if len(content) != minsz + pfnsz + pagesz:
-            raise RecordError("Expected %u + %u + %u, got %u"
-                              % (minsz, pfnsz, pagesz, len(content)))
+        if len(content) != hdrsz + pagesz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (hdrsz, pagesz, len(content)))
+
+
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        hdrsz, nr_pages = self.verify_page_data_pfns(content,
+                                                     "COMPRESSED_PAGE_DATA")
+
+        infosz = calcsize(COMPRESSED_PAGE_FORMAT)
+        datasz = len(content) - hdrsz - nr_pages * infosz
+        if datasz < 0:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain page "
+                              "info for each page")
+
+        for idx in range(nr_pages):
+            off = hdrsz + idx * infosz
+            encoding, res1, param = unpack(COMPRESSED_PAGE_FORMAT,
+                                           content[off:off + infosz])
+
+            if res1 != 0:
+                raise RecordError("Reserved bits set in page info[%d]: 0x%04x"
+                                  % (idx, res1))
+
+            if encoding == COMPRESSED_PAGE_RAW:
+                if param != 4096:
+                    raise RecordError("Raw page[%d] has length %u"
+                                      % (idx, param))
+                datasz -= param
+            elif encoding == COMPRESSED_PAGE_DEFLATE:
+                datasz -= param
+            elif encoding == COMPRESSED_PAGE_DUPLICATE:
+                if param >= idx:
+                    raise RecordError("Page[%d] duplicates later page %u"
+                                      % (idx, param))
+            elif encoding != COMPRESSED_PAGE_ZERO:
+                raise RecordError("Unknown encoding 0x%04x for page[%d]"
+                                  % (encoding, idx))
+
+        if datasz != 0:
+            raise RecordError("COMPRESSED_PAGE_DATA record has %d bytes of "
+                              "page data unaccounted for" % (datasz, ))
 
 
     def verify_record_x86_pv_info(self, content):
@@ -424,6 +493,39 @@ class VerifyLibxc(VerifyBase):
         """ checkpoint dirty pfn list """
         raise RecordError("Found checkpoint dirty pfn list record in stream")
 
+    def verify_record_postcopy_pfns(self, content):
+        """ post-copy pfns record """
+
+        if len(content) == 0 or len(content) % 8 != 0:
+            raise RecordError("Post-copy pfns record length %d not a non-zero "
+                              "multiple of 8" % (len(content), ))
+
+        for pfn in unpack("=%dQ" % (len(content) / 8), content):
+            if pfn & ~PAGE_DATA_PFN_MASK:
+                raise RecordError("Post-copy pfn 0x%x out of range" % (pfn, ))
+
+    def verify_record_postcopy_transition(self, content):
+        """ post-copy transition record """
+
+        if len(content) != 0:
+            raise RecordError("Post-copy transition record with non-zero "
+                              "length")
+
+    def verify_record_postcopy_fault(self, content):
+        """ post-copy fault record """
+        raise RecordError("Found post-copy fault record in stream")
+
+    def verify_record_capabilities_query(self, content):
+        """ capabilities query record """
+
+        if len(content) != 0:
+            raise RecordError("Capabilities query record with non-zero "
+                              "length")
+
+    def verify_record_capabilities(self, content):
+        """ capabilities record """
+        raise RecordError("Found capabilities record in stream")
+
 
 record_verifiers = {
     REC_TYPE_end:
@@ -466,4 +568,16 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
+    REC_TYPE_postcopy_pfns:
+        VerifyLibxc.verify_record_postcopy_pfns,
+    REC_TYPE_postcopy_transition:
+        VerifyLibxc.verify_record_postcopy_transition,
+    REC_TYPE_postcopy_fault:
+        VerifyLibxc.verify_record_postcopy_fault,
+    REC_TYPE_capabilities:
+        VerifyLibxc.verify_record_capabilities,
+    REC_TYPE_capabilities_query:
+        VerifyLibxc.verify_record_capabilities_query,
     }
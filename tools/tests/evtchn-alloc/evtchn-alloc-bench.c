@@ -0,0 +1,184 @@
+/*
+ * evtchn-alloc-bench.c
+ *
+ * Measure the cost of allocating event channel ports, depending on the
+ * number of ports a domain has in use already.
+ *
+ * Unbound ports (for the remote domain given with -d, default: ourselves)
+ * are allocated until -n of them are in use, reporting the average time
+ * per allocation for each step of -s ports.  Then the highest port in use
+ * is repeatedly freed and allocated again (-r times), which is the worst
+ * case for a linear search for a free port, and finally random ports are
+ * freed and allocated again.
+ *
+ * The number of ports a process may have bound is limited by the kernel
+ * (for Linux see /sys/module/xen_evtchn/parameters/max_user_ports), and
+ * the number of ports of a domain by the hypervisor (see max_event_channels
+ * in xl.cfg(5)).  For dom0 the FIFO ABI is needed for more than 4096 ports.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms and conditions of the GNU General Public
+ * License, version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xenevtchn.h>
+
+static xenevtchn_handle *xce;
+static uint32_t remote = DOMID_SELF;
+static evtchn_port_t *ports;
+static unsigned int nr_ports;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Allocate a port into ports[idx], returning the time taken. */
+static uint64_t alloc_port(unsigned int idx)
+{
+    uint64_t start = now_ns();
+    xenevtchn_port_or_error_t port = xenevtchn_bind_unbound_port(xce, remote);
+    uint64_t end = now_ns();
+
+    if ( port < 0 )
+    {
+        fprintf(stderr, "allocating port %u failed: %s\n", idx,
+                strerror(errno));
+        exit(2);
+    }
+    ports[idx] = port;
+
+    return end - start;
+}
+
+static void free_port(unsigned int idx)
+{
+    if ( xenevtchn_unbind(xce, ports[idx]) )
+    {
+        fprintf(stderr, "freeing port %u failed: %s\n", ports[idx],
+                strerror(errno));
+        exit(2);
+    }
+}
+
+static unsigned int highest_port(void)
+{
+    unsigned int i, max = 0;
+
+    for ( i = 1; i < nr_ports; i++ )
+        if ( ports[i] > ports[max] )
+            max = i;
+
+    return max;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n ports] [-s step] [-r rounds] [-d remote-domid]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int step = 1024, rounds = 10000, i, j;
+    uint64_t ns;
+    int c;
+
+    nr_ports = 16384;
+
+    while ( (c = getopt(argc, argv, "n:s:r:d:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'n':
+            nr_ports = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            step = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            remote = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc || !nr_ports || !step || !rounds )
+        usage(argv[0]);
+
+    ports = calloc(nr_ports, sizeof(*ports));
+    if ( !ports )
+    {
+        perror("calloc");
+        return 2;
+    }
+
+    xce = xenevtchn_open(NULL, 0);
+    if ( !xce )
+    {
+        perror("xenevtchn_open");
+        return 2;
+    }
+
+    printf("%-24s %12s\n", "ports in use", "ns/alloc");
+
+    for ( i = 0; i < nr_ports; i += step )
+    {
+        unsigned int n = nr_ports - i < step ? nr_ports - i : step;
+
+        for ( ns = 0, j = 0; j < n; j++ )
+            ns += alloc_port(i + j);
+
+        printf("%10u - %-11u %12"PRIu64"\n", i, i + n, ns / n);
+    }
+
+    j = highest_port();
+    for ( ns = 0, i = 0; i < rounds; i++ )
+    {
+        free_port(j);
+        ns += alloc_port(j);
+    }
+    printf("%-24s %12"PRIu64"\n", "free/alloc highest", ns / rounds);
+
+    srand(nr_ports);
+    for ( ns = 0, i = 0; i < rounds; i++ )
+    {
+        j = rand() % nr_ports;
+        free_port(j);
+        ns += alloc_port(j);
+    }
+    printf("%-24s %12"PRIu64"\n", "free/alloc random", ns / rounds);
+
+    for ( i = 0; i < nr_ports; i++ )
+        free_port(i);
+
+    xenevtchn_close(xce);
+    free(ports);
+
+    return 0;
+}
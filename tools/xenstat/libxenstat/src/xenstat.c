@@ -158,6 +158,22 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+static void domain_get_gnttab_stats(xenstat_handle * handle,
+				    xenstat_domain * domain)
+{
+	xc_gnttab_stats_t stats;
+
+	if (xc_gnttab_stats(handle->xc_handle, domain->id, &stats) < 0)
+		return;
+	domain->gnttab_stats.maps = stats.maps;
+	domain->gnttab_stats.unmaps = stats.unmaps;
+	domain->gnttab_stats.copies = stats.copies;
+	domain->gnttab_stats.copy_bytes = stats.copy_bytes;
+	domain->gnttab_stats.transfers = stats.transfers;
+	domain->gnttab_stats.iommu_ops = stats.iommu_ops;
+	domain->gnttab_stats.maptrack_steals = stats.maptrack_steals;
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
 #define DOMAIN_CHUNK_SIZE 256
@@ -261,6 +277,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
 			domain_get_tmem_stats(handle,domain);
+			domain_get_gnttab_stats(handle, domain);
 
 			domain++;
 			node->num_domains++;
@@ -762,6 +779,57 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 	return tmem->succ_pers_gets;
 }
 
+/*
+ * Grant table functions
+ */
+
+xenstat_gnttab *xenstat_domain_gnttab(xenstat_domain * domain)
+{
+	return &domain->gnttab_stats;
+}
+
+/* Get the number of grant mappings established */
+unsigned long long xenstat_gnttab_maps(xenstat_gnttab *gnttab)
+{
+	return gnttab->maps;
+}
+
+/* Get the number of grant mappings removed */
+unsigned long long xenstat_gnttab_unmaps(xenstat_gnttab *gnttab)
+{
+	return gnttab->unmaps;
+}
+
+/* Get the number of grant copy operations */
+unsigned long long xenstat_gnttab_copies(xenstat_gnttab *gnttab)
+{
+	return gnttab->copies;
+}
+
+/* Get the number of bytes copied by grant copy operations */
+unsigned long long xenstat_gnttab_copy_bytes(xenstat_gnttab *gnttab)
+{
+	return gnttab->copy_bytes;
+}
+
+/* Get the number of page transfers */
+unsigned long long xenstat_gnttab_transfers(xenstat_gnttab *gnttab)
+{
+	return gnttab->transfers;
+}
+
+/* Get the number of IOMMU updates for grant mappings */
+unsigned long long xenstat_gnttab_iommu_ops(xenstat_gnttab *gnttab)
+{
+	return gnttab->iommu_ops;
+}
+
+/* Get the number of maptrack handles taken from another VCPU */
+unsigned long long xenstat_gnttab_maptrack_steals(xenstat_gnttab *gnttab)
+{
+	return gnttab->maptrack_steals;
+}
+
 
 static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
 {
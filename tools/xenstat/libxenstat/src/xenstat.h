@@ -28,6 +28,7 @@ typedef struct xenstat_vcpu xenstat_vcpu;
 typedef struct xenstat_network xenstat_network;
 typedef struct xenstat_vbd xenstat_vbd;
 typedef struct xenstat_tmem xenstat_tmem;
+typedef struct xenstat_gnttab xenstat_gnttab;
 
 /* Initialize the xenstat library.  Returns a handle to be used with
  * subsequent calls to the xenstat library, or NULL if an error occurs. */
@@ -136,6 +137,9 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
+/* Get the grant table information for a given domain */
+xenstat_gnttab *xenstat_domain_gnttab(xenstat_domain * domain);
+
 /*
  * VCPU functions - extract information from a xenstat_vcpu
  */
@@ -201,4 +205,15 @@ unsigned long long xenstat_tmem_succ_eph_gets(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_puts(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem);
 
+/*
+ * Grant table functions - extract grant table usage information
+ */
+unsigned long long xenstat_gnttab_maps(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_unmaps(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_copies(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_copy_bytes(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_transfers(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_iommu_ops(xenstat_gnttab *gnttab);
+unsigned long long xenstat_gnttab_maptrack_steals(xenstat_gnttab *gnttab);
+
 #endif /* XENSTAT_H */
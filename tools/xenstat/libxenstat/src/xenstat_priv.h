@@ -59,6 +59,16 @@ struct xenstat_tmem {
 	unsigned long long succ_pers_gets;
 };
 
+struct xenstat_gnttab {
+	unsigned long long maps;
+	unsigned long long unmaps;
+	unsigned long long copies;
+	unsigned long long copy_bytes;
+	unsigned long long transfers;
+	unsigned long long iommu_ops;
+	unsigned long long maptrack_steals;
+};
+
 struct xenstat_domain {
 	unsigned int id;
 	char *name;
@@ -74,6 +84,7 @@ struct xenstat_domain {
 	unsigned int num_vbds;
 	xenstat_vbd *vbds;
 	xenstat_tmem tmem_stats;
+	xenstat_gnttab gnttab_stats;
 };
 
 struct xenstat_vcpu {
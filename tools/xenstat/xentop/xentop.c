@@ -210,6 +210,7 @@ int show_vcpus = 0;
 int show_networks = 0;
 int show_vbds = 0;
 int show_tmem = 0;
+int show_gnttab = 0;
 int repeat_header = 0;
 int show_full_name = 0;
 #define PROMPT_VAL_LEN 80
@@ -238,6 +239,7 @@ static void usage(const char *program)
 	       "-x, --vbds           output vbd block device data\n"
 	       "-r, --repeat-header  repeat table header before each domain\n"
 	       "-v, --vcpus          output vcpu data\n"
+	       "-g, --grants         output grant table usage data\n"
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
@@ -365,6 +367,9 @@ static int handle_key(int ch)
 		case 't': case 'T':
 			show_tmem ^= 1;
 			break;
+		case 'g': case 'G':
+			show_gnttab ^= 1;
+			break;
 		case 'r': case 'R':
 			repeat_header ^= 1;
 			break;
@@ -957,6 +962,11 @@ void do_bottom_line(void)
 		attr_addstr(show_tmem ? COLOR_PAIR(1) : 0, "mem");
 		addstr("  ");
 
+		/* grants */
+		addch(A_REVERSE | 'G');
+		attr_addstr(show_gnttab ? COLOR_PAIR(1) : 0, "rants");
+		addstr("  ");
+
 
 		/* vcpus */
 		addch(A_REVERSE | 'V');
@@ -1103,6 +1113,23 @@ void do_tmem(xenstat_domain *domain)
 
 }
 
+/* Output all grant table information */
+void do_gnttab(xenstat_domain *domain)
+{
+	xenstat_gnttab *gnttab = xenstat_domain_gnttab(domain);
+
+	print("Grants:  Maps: %10llu   Unmaps: %10llu   Copies: %10llu   "
+	      "Copied: %10lluk   Transfers: %8llu   IOMMU ops: %10llu   "
+	      "Maptrack steals: %8llu\n",
+	      xenstat_gnttab_maps(gnttab),
+	      xenstat_gnttab_unmaps(gnttab),
+	      xenstat_gnttab_copies(gnttab),
+	      xenstat_gnttab_copy_bytes(gnttab) >> 10,
+	      xenstat_gnttab_transfers(gnttab),
+	      xenstat_gnttab_iommu_ops(gnttab),
+	      xenstat_gnttab_maptrack_steals(gnttab));
+}
+
 static void top(void)
 {
 	xenstat_domain **domains;
@@ -1157,6 +1184,8 @@ static void top(void)
 			do_vbd(domains[i]);
 		if (show_tmem)
 			do_tmem(domains[i]);
+		if (show_gnttab)
+			do_gnttab(domains[i]);
 	}
 
 	if (!batch)
@@ -1184,13 +1213,14 @@ int main(int argc, char **argv)
 		{ "vbds",          no_argument,       NULL, 'x' },
 		{ "repeat-header", no_argument,       NULL, 'r' },
 		{ "vcpus",         no_argument,       NULL, 'v' },
+		{ "grants",        no_argument,       NULL, 'g' },
 		{ "delay",         required_argument, NULL, 'd' },
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
 		{ "full-name",     no_argument,       NULL, 'f' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:f";
+	const char *sopts = "hVnxrvgd:bi:f";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1219,6 +1249,9 @@ int main(int argc, char **argv)
 		case 'v':
 			show_vcpus = 1;
 			break;
+		case 'g':
+			show_gnttab = 1;
+			break;
 		case 'd':
 			delay = atoi(optarg);
 			break;
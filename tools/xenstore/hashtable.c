@@ -192,6 +192,30 @@ hashtable_search(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+void * /* returns value previously associated with key */
+hashtable_replace(struct hashtable *h, void *k, void *v)
+{
+    struct entry *e;
+    unsigned int hashvalue, index;
+    void *old;
+    hashvalue = hash(h,k);
+    index = indexFor(h->tablelength,hashvalue);
+    e = h->table[index];
+    while (NULL != e)
+    {
+        /* Check hash value to short circuit heavier comparison */
+        if ((hashvalue == e->h) && (h->eqfn(k, e->k)))
+        {
+            old = e->v;
+            e->v = v;
+            return old;
+        }
+        e = e->next;
+    }
+    return NULL;
+}
+
 /*****************************************************************************/
 void * /* returns value associated with key */
 hashtable_remove(struct hashtable *h, void *k)
@@ -226,6 +250,26 @@ hashtable_remove(struct hashtable *h, void *k)
     return NULL;
 }
 
+/*****************************************************************************/
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*fn)(void *k, void *v, void *arg), void *arg)
+{
+    unsigned int i;
+    struct entry *e, *next;
+    int ret = 0;
+    for (i = 0; i < h->tablelength && !ret; i++)
+    {
+        /* Fetch next first, as fn may remove the current entry. */
+        for (e = h->table[i]; e && !ret; e = next)
+        {
+            next = e->next;
+            ret = fn(e->k, e->v, arg);
+        }
+    }
+    return ret;
+}
+
 /*****************************************************************************/
 /* destroy */
 void
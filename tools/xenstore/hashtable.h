@@ -127,6 +127,20 @@ valuetype * fnname (struct hashtable *h, keytype *k) \
     return (valuetype *) (hashtable_search(h,k)); \
 }
 
+/*****************************************************************************
+ * hashtable_replace
+   
+ * @name        hashtable_replace
+ * @param   h   the hashtable to search
+ * @param   k   the key to search for  - does not claim ownership
+ * @param   v   the value to associate with the key
+ * @return      the value previously associated with the key, or NULL if none
+ *              found, in which case nothing is changed
+ */
+
+void *
+hashtable_replace(struct hashtable *h, void *k, void *v);
+
 /*****************************************************************************
  * hashtable_remove
    
@@ -157,6 +171,22 @@ unsigned int
 hashtable_count(struct hashtable *h);
 
 
+/*****************************************************************************
+ * hashtable_iterate
+   
+ * @name        hashtable_iterate
+ * @param   h   the hashtable
+ * @param   fn  function called for each key and value, which may remove the
+ *              entry it was called for.  Returning non-zero stops iteration.
+ * @param   arg passed to fn
+ * @return      the last value returned by fn
+ */
+
+int
+hashtable_iterate(struct hashtable *h,
+                  int (*fn)(void *k, void *v, void *arg), void *arg);
+
+
 /*****************************************************************************
  * hashtable_destroy
    
@@ -52,7 +52,7 @@
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
 #include "xenstored_control.h"
-#include "tdb.h"
+#include "xenstored_worker.h"
 
 #ifndef NO_SOCKETS
 #if defined(HAVE_SYSTEMD)
@@ -66,6 +66,7 @@
 
 extern xenevtchn_handle *xce_handle; /* in xenstored_domain.c */
 static int xce_pollfd_idx = -1;
+static int worker_pollfd_idx = -1;
 static struct pollfd *fds;
 static unsigned int current_array_size;
 static unsigned int nr_fds;
@@ -79,7 +80,7 @@ static bool recovery = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 char *tracefile = NULL;
-TDB_CONTEXT *tdb_ctx = NULL;
+struct hashtable *node_db;
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type);
 
@@ -257,6 +258,8 @@ static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
 
+	worker_cancel(conn);
+
 	/* Flush outgoing if possible, but don't block. */
 	if (!conn->domain) {
 		struct pollfd pfd;
@@ -335,18 +338,21 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 		xce_pollfd_idx = set_fd(xenevtchn_fd(xce_handle),
 					POLLIN|POLLPRI);
 
+	if (worker_wake_fd() != -1)
+		worker_pollfd_idx = set_fd(worker_wake_fd(), POLLIN|POLLPRI);
+
 	wrl_gettime_now(&now);
 	wrl_log_periodic(now);
 
 	list_for_each_entry(conn, &connections, list) {
 		if (conn->domain) {
 			wrl_check_timeout(conn->domain, now, ptimeout);
-			if (domain_can_read(conn) ||
+			if ((!conn->job && domain_can_read(conn)) ||
 			    (domain_can_write(conn) &&
 			     !list_empty(&conn->out_list)))
 				*ptimeout = 0;
 		} else {
-			short events = POLLIN|POLLPRI;
+			short events = conn->job ? 0 : POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
 			conn->pollfd_idx = set_fd(conn->fd, events);
@@ -354,6 +360,105 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 	}
 }
 
+unsigned int hash_from_key_fn(void *k)
+{
+	char *str = k;
+	unsigned int hash = 5381;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+
+	return hash;
+}
+
+
+int keys_equal_fn(void *key1, void *key2)
+{
+	return 0 == strcmp((char *)key1, (char *)key2);
+}
+
+
+/* Records are shared with worker threads, so count atomically. */
+static void get_record(struct node_record *rec)
+{
+	__atomic_add_fetch(&rec->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static void put_record(struct node_record *rec)
+{
+	if (!__atomic_sub_fetch(&rec->refcnt, 1, __ATOMIC_ACQ_REL))
+		free(rec);
+}
+
+struct hashtable *db_create(void)
+{
+	return create_hashtable(16, hash_from_key_fn, keys_equal_fn);
+}
+
+static int db_put_(void *k, void *v, void *arg)
+{
+	put_record(v);
+	return 0;
+}
+
+void db_destroy(struct hashtable *db)
+{
+	hashtable_iterate(db, db_put_, NULL);
+	hashtable_destroy(db, 0);
+}
+
+struct node_record *db_fetch(struct hashtable *db, const char *name)
+{
+	return hashtable_search(db, (void *)name);
+}
+
+/* The database takes its own reference to rec. */
+int db_write(struct hashtable *db, const char *name, struct node_record *rec)
+{
+	struct node_record *old;
+	char *key;
+
+	get_record(rec);
+
+	old = hashtable_replace(db, (void *)name, rec);
+	if (old) {
+		put_record(old);
+		return 0;
+	}
+
+	key = strdup(name);
+	if (!key || !hashtable_insert(db, key, rec)) {
+		free(key);
+		put_record(rec);
+		errno = ENOMEM;
+		return errno;
+	}
+
+	return 0;
+}
+
+int db_delete(struct hashtable *db, const char *name)
+{
+	struct node_record *rec = hashtable_remove(db, (void *)name);
+
+	if (!rec) {
+		errno = ENOENT;
+		return errno;
+	}
+
+	put_record(rec);
+	return 0;
+}
+
+static int release_record(void *_ref)
+{
+	struct node_record **ref = _ref;
+
+	put_record(*ref);
+	return 0;
+}
+
 /*
  * If it fails, returns NULL and sets errno.
  * Temporary memory allocations will be done with ctx.
@@ -361,7 +466,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 static struct node *read_node(struct connection *conn, const void *ctx,
 			      const char *name)
 {
-	TDB_DATA key, data;
+	struct node_record *rec, **ref;
 	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
 
@@ -377,29 +482,32 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 		return NULL;
 	}
 
-	if (transaction_prepend(conn, name, &key))
+	rec = db_fetch(transaction_db(conn, name), name);
+	if (!rec) {
+		node->generation = NO_GENERATION;
+		node->record = NULL;
+		access_node(conn, node, NODE_ACCESS_READ, NULL);
+		talloc_free(node);
+		errno = ENOENT;
 		return NULL;
+	}
 
-	data = tdb_fetch(tdb_ctx, key);
-
-	if (data.dptr == NULL) {
-		if (tdb_error(tdb_ctx) == TDB_ERR_NOEXIST) {
-			node->generation = NO_GENERATION;
-			access_node(conn, node, NODE_ACCESS_READ, NULL);
-			errno = ENOENT;
-		} else {
-			log("TDB error on read: %s", tdb_errorstr(tdb_ctx));
-			errno = EIO;
-		}
+	/* Hold on to the record for as long as the node points into it. */
+	ref = talloc(node, struct node_record *);
+	if (!ref) {
 		talloc_free(node);
+		errno = ENOMEM;
 		return NULL;
 	}
+	*ref = rec;
+	get_record(rec);
+	talloc_set_destructor(ref, release_record);
 
 	node->parent = NULL;
-	talloc_steal(node, data.dptr);
+	node->record = rec;
 
 	/* Datalen, childlen, number of permissions */
-	hdr = (void *)data.dptr;
+	hdr = &rec->hdr;
 	node->generation = hdr->generation;
 	node->num_perms = hdr->num_perms;
 	node->datalen = hdr->datalen;
@@ -417,24 +525,32 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	return node;
 }
 
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
+static int write_node_raw(struct connection *conn, struct hashtable *db,
+			  struct node *node)
 {
-	TDB_DATA data;
-	void *p;
+	struct node_record *rec;
 	struct xs_tdb_record_hdr *hdr;
+	size_t size;
+	void *p;
 
-	data.dsize = sizeof(*hdr)
+	size = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
 	if (domain_is_unprivileged(conn) &&
-	    data.dsize >= quota_max_entry_size) {
+	    size >= quota_max_entry_size) {
 		errno = ENOSPC;
 		return errno;
 	}
 
-	data.dptr = talloc_size(node, data.dsize);
-	hdr = (void *)data.dptr;
+	rec = malloc(offsetof(struct node_record, hdr) + size);
+	if (!rec) {
+		errno = ENOMEM;
+		return errno;
+	}
+	rec->refcnt = 0;
+
+	hdr = &rec->hdr;
 	hdr->generation = node->generation;
 	hdr->num_perms = node->num_perms;
 	hdr->datalen = node->datalen;
@@ -446,23 +562,18 @@ int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_ctx, *key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key->dptr);
-		errno = EIO;
-		return errno;
-	}
-	return 0;
+	/* On failure the record's only reference is dropped again. */
+	return db_write(db, node->name, rec);
 }
 
 static int write_node(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
+	struct hashtable *db;
 
-	if (access_node(conn, node, NODE_ACCESS_WRITE, &key))
+	if (access_node(conn, node, NODE_ACCESS_WRITE, &db))
 		return errno;
 
-	return write_node_raw(conn, &key, node);
+	return write_node_raw(conn, db, node);
 }
 
 static enum xs_perm_type perm_for_conn(struct connection *conn,
@@ -647,7 +758,15 @@ static void send_error(struct connection *conn, int error)
 
 	for (i = 0; error != xsd_errors[i].errnum; i++) {
 		if (i == ARRAY_SIZE(xsd_errors) - 1) {
-			eprintf("xenstored: error %i untranslatable", error);
+			if (worker_running()) {
+				char msg[64];
+
+				snprintf(msg, sizeof(msg),
+					 "error %i untranslatable", error);
+				worker_report(conn, false, msg);
+			} else
+				eprintf("xenstored: error %i untranslatable",
+					error);
 			i = 0; /* EINVAL */
 			break;
 		}
@@ -656,14 +775,15 @@ static void send_error(struct connection *conn, int error)
 			  strlen(xsd_errors[i].errstring) + 1);
 }
 
-void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
-		const void *data, unsigned int len)
+static struct buffered_data *queue_reply(struct connection *conn,
+					 enum xsd_sockmsg_type type,
+					 const void *data, unsigned int len)
 {
 	struct buffered_data *bdata;
 
 	if ( len > XENSTORE_PAYLOAD_MAX ) {
 		send_error(conn, E2BIG);
-		return;
+		return NULL;
 	}
 
 	/* Replies reuse the request buffer, events need a new one. */
@@ -681,7 +801,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		 * tell anybody about it.
 		 */
 		if (!bdata)
-			return;
+			return NULL;
 	}
 	if (len <= DEFAULT_BUFFER_SIZE)
 		bdata->buffer = bdata->default_buffer;
@@ -691,12 +811,12 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		if (type == XS_WATCH_EVENT) {
 			/* Same as above: no way to tell someone. */
 			talloc_free(bdata);
-			return;
+			return NULL;
 		}
 		/* re-establish request buffer for sending ENOMEM. */
 		conn->in = bdata;
 		send_error(conn, ENOMEM);
-		return;
+		return NULL;
 	}
 
 	/* Update relevant header fields and fill in the message body. */
@@ -707,7 +827,19 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
 
-	return;
+	return bdata;
+}
+
+void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
+		const void *data, unsigned int len)
+{
+	queue_reply(conn, type, data, len);
+}
+
+struct buffered_data *send_event(struct connection *conn,
+				 const void *data, unsigned int len)
+{
+	return queue_reply(conn, XS_WATCH_EVENT, data, len);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -886,12 +1018,12 @@ static int do_read(struct connection *conn, struct buffered_data *in)
 
 static void delete_node_single(struct connection *conn, struct node *node)
 {
-	TDB_DATA key;
+	struct hashtable *db;
 
-	if (access_node(conn, node, NODE_ACCESS_DELETE, &key))
+	if (access_node(conn, node, NODE_ACCESS_DELETE, &db))
 		return;
 
-	if (tdb_delete(tdb_ctx, key) != 0) {
+	if (db_delete(db, node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -960,6 +1092,7 @@ static struct node *construct_node(struct connection *conn, const void *ctx,
 	node->children = node->data = NULL;
 	node->childlen = node->datalen = 0;
 	node->parent = parent;
+	node->record = NULL;
 	domain_entry_inc(conn, node);
 	return node;
 
@@ -971,15 +1104,11 @@ nomem:
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(tdb_ctx, key);
+	db_delete(node_db, node->name);
 	return 0;
 }
 
@@ -1113,6 +1242,14 @@ static int remove_child_entry(struct connection *conn, struct node *node,
 			      size_t offset)
 {
 	size_t childlen = strlen(node->children + offset);
+	char *children;
+
+	/* The children may point into a database record: don't modify it. */
+	children = talloc_memdup(node, node->children, node->childlen);
+	if (!children)
+		return ENOMEM;
+	node->children = children;
+
 	memdel(node->children, offset, childlen + 1, node->childlen);
 	node->childlen -= childlen + 1;
 	return write_node(conn, node);
@@ -1266,11 +1403,15 @@ static int do_set_perms(struct connection *conn, struct buffered_data *in)
 static struct {
 	const char *str;
 	int (*func)(struct connection *conn, struct buffered_data *in);
+	unsigned int flags;
+#define XS_FLAG_RO		(1U << 0) /* May be handled by a worker. */
 } const wire_funcs[XS_TYPE_COUNT] = {
 	[XS_CONTROL]           = { "CONTROL",           do_control },
-	[XS_DIRECTORY]         = { "DIRECTORY",         send_directory },
-	[XS_READ]              = { "READ",              do_read },
-	[XS_GET_PERMS]         = { "GET_PERMS",         do_get_perms },
+	[XS_DIRECTORY]         =
+			{ "DIRECTORY",         send_directory, XS_FLAG_RO },
+	[XS_READ]              = { "READ",              do_read, XS_FLAG_RO },
+	[XS_GET_PERMS]         =
+			{ "GET_PERMS",         do_get_perms, XS_FLAG_RO },
 	[XS_WATCH]             = { "WATCH",             do_watch },
 	[XS_UNWATCH]           = { "UNWATCH",           do_unwatch },
 	[XS_TRANSACTION_START] = { "TRANSACTION_START", do_transaction_start },
@@ -1289,7 +1430,8 @@ static struct {
 	[XS_RESUME]            = { "RESUME",            do_resume },
 	[XS_SET_TARGET]        = { "SET_TARGET",        do_set_target },
 	[XS_RESET_WATCHES]     = { "RESET_WATCHES",     do_reset_watches },
-	[XS_DIRECTORY_PART]    = { "DIRECTORY_PART",    send_directory_part },
+	[XS_DIRECTORY_PART]    =
+			{ "DIRECTORY_PART",    send_directory_part, XS_FLAG_RO },
 };
 
 static const char *sockmsg_string(enum xsd_sockmsg_type type)
@@ -1300,6 +1442,17 @@ static const char *sockmsg_string(enum xsd_sockmsg_type type)
 	return "**UNKNOWN**";
 }
 
+/* Read-only requests outside transactions, called on a worker thread. */
+static void process_message_ro(struct connection *conn,
+			       struct buffered_data *in)
+{
+	int ret;
+
+	ret = wire_funcs[in->hdr.msg.type].func(conn, in);
+	if (ret)
+		send_error(conn, ret);
+}
+
 /* Process "in" for conn: "in" will vanish after this conversation, so
  * we can talloc off it for temporary variables.  May free "conn".
  */
@@ -1309,6 +1462,11 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 	enum xsd_sockmsg_type type = in->hdr.msg.type;
 	int ret;
 
+	if ((unsigned)type < XS_TYPE_COUNT &&
+	    (wire_funcs[type].flags & XS_FLAG_RO) && !in->hdr.msg.tx_id &&
+	    worker_queue(conn, in, process_message_ro))
+		return;
+
 	trans = transaction_lookup(conn, in->hdr.msg.tx_id);
 	if (IS_ERR(trans)) {
 		send_error(conn, -PTR_ERR(trans));
@@ -1339,7 +1497,8 @@ static void consider_message(struct connection *conn)
 
 	process_message(conn, conn->in);
 
-	assert(conn->in == NULL);
+	/* A worker thread will send the reply later. */
+	assert(conn->in == NULL || conn->job);
 }
 
 /* Errors in reading or allocating here mean we get out of sync, so we
@@ -1349,6 +1508,10 @@ static void handle_input(struct connection *conn)
 	int bytes;
 	struct buffered_data *in;
 
+	/* No new request before the one with a worker has been answered. */
+	if (conn->job)
+		return;
+
 	if (!conn->in) {
 		conn->in = new_buffer(conn);
 		/* In case of no memory just try it again next time. */
@@ -1495,8 +1658,6 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
-
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
 {
@@ -1519,41 +1680,11 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
-static void tdb_logger(TDB_CONTEXT *tdb, int level, const char * fmt, ...)
-{
-	va_list ap;
-	char *s;
-
-	va_start(ap, fmt);
-	s = talloc_vasprintf(NULL, fmt, ap);
-	va_end(ap);
-
-	if (s) {
-		trace("TDB: %s\n", s);
-		syslog(LOG_ERR, "TDB: %s",  s);
-		if (verbose)
-			xprintf("TDB: %s", s);
-		talloc_free(s);
-	} else {
-		trace("talloc failure during logging\n");
-		syslog(LOG_ERR, "talloc failure during logging\n");
-	}
-}
-
 static void setup_structure(void)
 {
-	char *tdbname;
-	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
-	if (!tdbname)
-		barf_perror("Could not create tdbname");
-
-	if (!(tdb_flags & TDB_INTERNAL))
-		unlink(tdbname);
-
-	tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT|O_EXCL,
-			      0640, &tdb_logger, NULL);
-	if (!tdb_ctx)
-		barf_perror("Could not create tdb file %s", tdbname);
+	node_db = db_create();
+	if (!node_db)
+		barf_perror("Could not create node database");
 
 	manual_node("/", "tool");
 	manual_node("/tool", "xenstored");
@@ -1563,25 +1694,6 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
-{
-	char *str = k;
-	unsigned int hash = 5381;
-	char c;
-
-	while ((c = *str++))
-		hash = ((hash << 5) + hash) + (unsigned int)c;
-
-	return hash;
-}
-
-
-static int keys_equal_fn(void *key1, void *key2)
-{
-	return 0 == strcmp((char *)key1, (char *)key2);
-}
-
-
 static char *child_name(const char *s1, const char *s2)
 {
 	if (strcmp(s1, "/")) {
@@ -1709,32 +1821,18 @@ static int check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static int clean_store_(void *k, void *v, void *private)
 {
 	struct hashtable *reachable = private;
-	char *slash;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
-
-	if (!name) {
-		log("clean_store: ENOMEM");
-		return 1;
-	}
+	char *name = k;
 
-	if (name[0] != '/') {
-		slash = strchr(name, '/');
-		if (slash)
-			*slash = 0;
-	}
 	if (!hashtable_search(reachable, name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			db_delete(node_db, name);
 		}
 	}
 
-	talloc_free(name);
-
 	return 0;
 }
 
@@ -1745,7 +1843,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	hashtable_iterate(node_db, clean_store_, reachable);
 }
 
 
@@ -1761,8 +1859,7 @@ void check_store(void)
 	}
 
 	log("Checking store ...");
-	if (!check_store_(root, reachable) &&
-	    !check_transactions(reachable))
+	if (!check_store_(root, reachable))
 		clean_store(reachable);
 	log("Checking store complete.");
 
@@ -1779,6 +1876,17 @@ void corrupt(struct connection *conn, const char *fmt, ...)
 	char *str;
 	int saved_errno = errno;
 
+	/* Leave logging and checking the store to the main thread. */
+	if (worker_running()) {
+		char msg[256];
+
+		va_start(arglist, fmt);
+		vsnprintf(msg, sizeof(msg), fmt, arglist);
+		va_end(arglist);
+		worker_report(conn, true, msg);
+		return;
+	}
+
 	va_start(arglist, fmt);
 	str = talloc_vasprintf(NULL, fmt, arglist);
 	va_end(arglist);
@@ -1875,21 +1983,25 @@ static void usage(void)
 "  -E, --entry-nb <nb>     limit the number of entries per domain,\n"
 "  -S, --entry-size <size> limit the size of entry per domain, and\n"
 "  -W, --watch-nb <nb>     limit the number of watches per domain,\n"
+"  -C, --coalesce-watches  merge watch events which are already queued,\n"
 "  -t, --transaction <nb>  limit the number of transaction allowed per domain,\n"
+"  -j, --threads <nb>      process read requests on <nb> worker threads,\n"
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
-"  -I, --internal-db       store database in memory, not on disk\n"
+"  -I, --internal-db       no effect, the database is always kept in memory,\n"
 "  -V, --verbose           to request verbose execution.\n");
 }
 
 
 static struct option options[] = {
 	{ "no-domain-init", 0, NULL, 'D' },
+	{ "coalesce-watches", 0, NULL, 'C' },
 	{ "entry-nb", 1, NULL, 'E' },
 	{ "pid-file", 1, NULL, 'F' },
 	{ "event", 1, NULL, 'e' },
 	{ "master-domid", 1, NULL, 'm' },
 	{ "help", 0, NULL, 'H' },
+	{ "threads", 1, NULL, 'j' },
 	{ "no-fork", 0, NULL, 'N' },
 	{ "priv-domid", 1, NULL, 'p' },
 	{ "output-pid", 0, NULL, 'P' },
@@ -1916,11 +2028,15 @@ int main(int argc, char *argv[])
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
 	int timeout;
+	unsigned int nr_threads = 0;
 
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RVW:", options,
+	while ((opt = getopt_long(argc, argv, "CDE:F:Hj:NPS:t:T:RVW:", options,
 				  NULL)) != -1) {
 		switch (opt) {
+		case 'C':
+			watch_coalesce = true;
+			break;
 		case 'D':
 			no_domain_init = true;
 			break;
@@ -1933,6 +2049,9 @@ int main(int argc, char *argv[])
 		case 'H':
 			usage();
 			return 0;
+		case 'j':
+			nr_threads = strtoul(optarg, NULL, 10);
+			break;
 		case 'N':
 			dofork = false;
 			break;
@@ -1952,7 +2071,8 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			fprintf(stderr, "%s: -I has no effect, the database "
+				"is always kept in memory\n", argv[0]);
 			break;
 		case 'V':
 			verbose = true;
@@ -2024,6 +2144,10 @@ int main(int argc, char *argv[])
 	if (tracefile)
 		tracefile = talloc_strdup(NULL, tracefile);
 
+	/* Start workers for read requests, the store is ours from now on. */
+	worker_init(nr_threads);
+	worker_lock();
+
 	/* Get ready to listen to the tools. */
 	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
 		       &timeout);
@@ -2040,11 +2164,20 @@ int main(int argc, char *argv[])
 	for (;;) {
 		struct connection *conn, *next;
 
+		worker_unlock();
 		if (poll(fds, nr_fds, timeout) < 0) {
+			worker_lock();
 			if (errno == EINTR)
 				continue;
 			barf_perror("Poll failed");
 		}
+		worker_lock();
+
+		if (worker_pollfd_idx != -1) {
+			if (fds[worker_pollfd_idx].revents & POLLIN)
+				worker_wake_drain();
+			worker_pollfd_idx = -1;
+		}
 
 		if (reopen_log_pipe0_pollfd_idx != -1) {
 			if (fds[reopen_log_pipe0_pollfd_idx].revents
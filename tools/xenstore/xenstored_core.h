@@ -31,7 +31,6 @@
 
 #include "xenstore_lib.h"
 #include "list.h"
-#include "tdb.h"
 #include "hashtable.h"
 
 /* DEFAULT_BUFFER_SIZE should be large enough for each errno string. */
@@ -62,6 +61,7 @@ struct buffered_data
 };
 
 struct connection;
+struct worker_job;
 typedef int connwritefn_t(struct connection *, const void *, unsigned int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
@@ -83,6 +83,9 @@ struct connection
 	/* Buffered incoming data. */
 	struct buffered_data *in;
 
+	/* Request handed to a worker thread (NULL if none). */
+	struct worker_job *job;
+
 	/* Buffered output data */
 	struct list_head out_list;
 
@@ -130,6 +133,20 @@ struct node {
 	/* Children, each nul-terminated. */
 	unsigned int childlen;
 	char *children;
+
+	/* Database record the above point into (NULL if not read). */
+	struct node_record *record;
+};
+
+/*
+ * A node as held in a node database.  Records are reference counted and never
+ * changed once written (apart from the generation of a transaction's record
+ * when it is committed), so nodes read from a database point into them
+ * rather than holding a copy.
+ */
+struct node_record {
+	unsigned int refcnt;
+	struct xs_tdb_record_hdr hdr;
 };
 
 /* Return the only argument in the input. */
@@ -142,14 +159,26 @@ unsigned int get_strings(struct buffered_data *data,
 void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 		const void *data, unsigned int len);
 
+/* Queue a watch event: returns its buffer, or NULL if it was dropped. */
+struct buffered_data *send_event(struct connection *conn,
+				 const void *data, unsigned int len);
+
 /* Some routines (write, mkdir, etc) just need a non-error return */
 void send_ack(struct connection *conn, enum xsd_sockmsg_type type);
 
 /* Canonicalize this path if possible. */
 char *canonicalize(struct connection *conn, const void *ctx, const char *node);
 
-/* Write a node to the tdb data base. */
-int write_node_raw(struct connection *conn, TDB_DATA *key, struct node *node);
+/* Hash table functions for string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
+/* Node databases: records indexed by node name. */
+struct hashtable *db_create(void);
+void db_destroy(struct hashtable *db);
+struct node_record *db_fetch(struct hashtable *db, const char *name);
+int db_write(struct hashtable *db, const char *name, struct node_record *rec);
+int db_delete(struct hashtable *db, const char *name);
 
 /* Get this node, checking we have permissions. */
 struct node *get_node(struct connection *conn,
@@ -175,7 +204,7 @@ void close_log(void);
 extern char *tracefile;
 extern int tracefd;
 
-extern TDB_CONTEXT *tdb_ctx;
+extern struct hashtable *node_db;
 extern int dom0_domid;
 extern int dom0_event;
 extern int priv_domid;
@@ -40,7 +40,7 @@
  * Some notes regarding detection and handling of transaction conflicts:
  *
  * Basic source of reference is the 'generation' count. Each writing access
- * (either normal write or in a transaction) to the tdb data base will set
+ * (either normal write or in a transaction) to the node data base will set
  * the node specific generation count to the global generation count.
  * For being able to identify a transaction the transaction specific generation
  * count is initialized with the global generation count when starting the
@@ -120,7 +120,7 @@ struct accessed_node
 	/* Modified? */
 	bool modified;
 
-	/* Transaction node in data base? */
+	/* Node in the transaction's data base? */
 	bool ta_node;
 };
 
@@ -150,6 +150,12 @@ struct transaction
 	/* List of accessed nodes. */
 	struct list_head accessed;
 
+	/*
+	 * Nodes as seen by this transaction: the ones it modified, and
+	 * references to the records of those it read.
+	 */
+	struct hashtable *nodes;
+
 	/* List of changed domains - to record the changed domain entry number */
 	struct list_head changed_domains;
 
@@ -160,12 +166,6 @@ struct transaction
 extern int quota_max_transaction;
 static uint64_t generation;
 
-static void set_tdb_key(const char *name, TDB_DATA *key)
-{
-	key->dptr = (char *)name;
-	key->dsize = strlen(name);
-}
-
 static struct accessed_node *find_accessed_node(struct transaction *trans,
 						const char *name)
 {
@@ -178,35 +178,17 @@ static struct accessed_node *find_accessed_node(struct transaction *trans,
 	return NULL;
 }
 
-static char *transaction_get_node_name(void *ctx, struct transaction *trans,
-				       const char *name)
-{
-	return talloc_asprintf(ctx, "%"PRIu64"/%s", trans->generation, name);
-}
-
 /*
- * Prepend the transaction to name if node has been modified in the current
- * transaction.
+ * Get the data base to access name in: the transaction specific one if the
+ * node has been accessed in the current transaction.
  */
-int transaction_prepend(struct connection *conn, const char *name,
-			TDB_DATA *key)
+struct hashtable *transaction_db(struct connection *conn, const char *name)
 {
-	char *tdb_name;
-
 	if (!conn || !conn->transaction ||
-	    !find_accessed_node(conn->transaction, name)) {
-		set_tdb_key(name, key);
-		return 0;
-	}
-
-	tdb_name = transaction_get_node_name(conn->transaction,
-					     conn->transaction, name);
-	if (!tdb_name)
-		return errno;
+	    !find_accessed_node(conn->transaction, name))
+		return node_db;
 
-	set_tdb_key(tdb_name, key);
-
-	return 0;
+	return conn->transaction->nodes;
 }
 
 /*
@@ -216,20 +198,18 @@ int transaction_prepend(struct connection *conn, const char *name,
  * node->generation).
  *
  * Accesses in a transaction will be added to the list of accessed nodes
- * if not already done. Read type accesses will copy the node to the
- * transaction specific data base part, write type accesses go there
+ * if not already done. Read type accesses will add a reference to the node's
+ * record to the transaction specific data base, write type accesses go there
  * anyway.
  *
- * If not NULL, key will be supplied with name and length of name of the node
- * to be accessed in the data base.
+ * If not NULL, db will be supplied with the data base the node is to be
+ * accessed in.
  */
 int access_node(struct connection *conn, struct node *node,
-		enum node_access_type type, TDB_DATA *key)
+		enum node_access_type type, struct hashtable **db)
 {
 	struct accessed_node *i = NULL;
 	struct transaction *trans;
-	TDB_DATA local_key;
-	const char *trans_name = NULL;
 	int ret;
 	bool introduce = false;
 
@@ -241,17 +221,13 @@ int access_node(struct connection *conn, struct node *node,
 
 	if (!conn || !conn->transaction) {
 		/* They're changing the global database. */
-		if (key)
-			set_tdb_key(node->name, key);
+		if (db)
+			*db = node_db;
 		return 0;
 	}
 
 	trans = conn->transaction;
 
-	trans_name = transaction_get_node_name(node, trans, node->name);
-	if (!trans_name)
-		goto nomem;
-
 	i = find_accessed_node(trans, node->name);
 	if (!i) {
 		i = talloc_zero(trans, struct accessed_node);
@@ -268,15 +244,16 @@ int access_node(struct connection *conn, struct node *node,
 		 * Additional transaction-specific node for read type. We only
 		 * have to verify read nodes if we didn't write them.
 		 *
-		 * The node is created and written to DB here to distinguish
-		 * from the write types.
+		 * The node's record is shared with the global DB here to
+		 * distinguish from the write types: as records are not
+		 * modified, this keeps the node as read for the transaction.
 		 */
 		if (type == NODE_ACCESS_READ) {
 			i->generation = node->generation;
 			i->check_gen = true;
 			if (node->generation != NO_GENERATION) {
-				set_tdb_key(trans_name, &local_key);
-				ret = write_node_raw(conn, &local_key, node);
+				ret = db_write(trans->nodes, node->name,
+					       node->record);
 				if (ret)
 					goto err;
 				i->ta_node = true;
@@ -292,8 +269,8 @@ int access_node(struct connection *conn, struct node *node,
 		/* Nothing to delete. */
 		return -1;
 
-	if (key) {
-		set_tdb_key(trans_name, key);
+	if (db) {
+		*db = trans->nodes;
 		if (type == NODE_ACCESS_WRITE)
 			i->ta_node = true;
 		if (type == NODE_ACCESS_DELETE)
@@ -305,7 +282,6 @@ int access_node(struct connection *conn, struct node *node,
 nomem:
 	ret = ENOMEM;
 err:
-	talloc_free((void *)trans_name);
 	talloc_free(i);
 	trans->fail = true;
 	errno = ret;
@@ -315,65 +291,42 @@ err:
 /*
  * Finalize transaction:
  * Walk through accessed nodes and check generation against global data.
- * If all entries match, read the transaction entries and write them without
- * transaction prepended. Delete all transaction specific nodes in the data
+ * If all entries match, move the transaction's records to the global data
  * base.
  */
 static int finalize_transaction(struct connection *conn,
 				struct transaction *trans)
 {
 	struct accessed_node *i;
-	TDB_DATA key, ta_key, data;
-	struct xs_tdb_record_hdr *hdr;
+	struct node_record *rec;
 	uint64_t gen;
-	char *trans_name;
-	int ret;
 
 	list_for_each_entry(i, &trans->accessed, list) {
 		if (!i->check_gen)
 			continue;
 
-		set_tdb_key(i->node, &key);
-		data = tdb_fetch(tdb_ctx, key);
-		hdr = (void *)data.dptr;
-		if (!data.dptr) {
-			if (tdb_error(tdb_ctx) != TDB_ERR_NOEXIST)
-				return EIO;
-			gen = NO_GENERATION;
-		} else
-			gen = hdr->generation;
-		talloc_free(data.dptr);
+		rec = db_fetch(node_db, i->node);
+		gen = rec ? rec->hdr.generation : NO_GENERATION;
 		if (i->generation != gen)
 			return EAGAIN;
 	}
 
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		trans_name = transaction_get_node_name(i, trans, i->node);
-		if (!trans_name)
-			/* We are doomed: the transaction is only partial. */
-			goto err;
-
-		set_tdb_key(trans_name, &ta_key);
-
 		if (i->modified) {
-			set_tdb_key(i->node, &key);
 			if (i->ta_node) {
-				data = tdb_fetch(tdb_ctx, ta_key);
-				if (!data.dptr)
+				/* Written in the transaction, so not shared. */
+				rec = db_fetch(trans->nodes, i->node);
+				if (!rec)
 					goto err;
-				hdr = (void *)data.dptr;
-				hdr->generation = generation++;
-				ret = tdb_store(tdb_ctx, key, data,
-						TDB_REPLACE);
-				talloc_free(data.dptr);
-				if (ret)
+				rec->hdr.generation = generation++;
+				if (db_write(node_db, i->node, rec))
 					goto err;
-			} else if (tdb_delete(tdb_ctx, key))
+			} else if (db_delete(node_db, i->node))
 					goto err;
 			fire_watches(conn, trans, i->node, false);
 		}
 
-		if (i->ta_node && tdb_delete(tdb_ctx, ta_key))
+		if (i->ta_node && db_delete(trans->nodes, i->node))
 			goto err;
 		list_del(&i->list);
 		talloc_free(i);
@@ -390,23 +343,14 @@ static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 	struct accessed_node *i;
-	char *trans_name;
-	TDB_DATA key;
 
 	wrl_ntransactions--;
 	trace_destroy(trans, "transaction");
 	while ((i = list_top(&trans->accessed, struct accessed_node, list))) {
-		if (i->ta_node) {
-			trans_name = transaction_get_node_name(i, trans,
-							       i->node);
-			if (trans_name) {
-				set_tdb_key(trans_name, &key);
-				tdb_delete(tdb_ctx, key);
-			}
-		}
 		list_del(&i->list);
 		talloc_free(i);
 	}
+	db_destroy(trans->nodes);
 
 	return 0;
 }
@@ -445,6 +389,9 @@ int do_transaction_start(struct connection *conn, struct buffered_data *in)
 	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changed_domains);
 	trans->fail = false;
+	trans->nodes = db_create();
+	if (!trans->nodes)
+		return ENOMEM;
 	trans->generation = generation++;
 
 	/* Pick an unused transaction identifier. */
@@ -575,41 +522,6 @@ void conn_delete_all_transactions(struct connection *conn)
 	conn->transaction_started = 0;
 }
 
-int check_transactions(struct hashtable *hash)
-{
-	struct connection *conn;
-	struct transaction *trans;
-	struct accessed_node *i;
-	char *tname, *tnode;
-
-	list_for_each_entry(conn, &connections, list) {
-		list_for_each_entry(trans, &conn->transaction_list, list) {
-			tname = talloc_asprintf(trans, "%"PRIu64,
-						trans->generation);
-			if (!tname || !remember_string(hash, tname))
-				goto nomem;
-
-			list_for_each_entry(i, &trans->accessed, list) {
-				if (!i->ta_node)
-					continue;
-				tnode = transaction_get_node_name(tname, trans,
-								  i->node);
-				if (!tnode || !remember_string(hash, tnode))
-					goto nomem;
-				talloc_free(tnode);
-			}
-
-			talloc_free(tname);
-		}
-	}
-
-	return 0;
-
-nomem:
-	talloc_free(tname);
-	return ENOMEM;
-}
-
 /*
  * Local variables:
  *  c-file-style: "linux"
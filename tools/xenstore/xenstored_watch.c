@@ -28,15 +28,45 @@
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
+#include "hashtable.h"
 #include "xenstored_domain.h"
 
 extern int quota_nb_watch_per_domain;
 
+bool watch_coalesce = false;
+
+/*
+ * All watches are indexed by the path they are on.  Each watched path and
+ * all of its parents have an entry, so the watches for a modified node are
+ * found by looking up the node and its parents, and the ones below a
+ * removed node by walking down from it.  "@" paths have no parents.
+ */
+struct watch_node
+{
+	/* Key in watch_index, freed with the entry. */
+	char *path;
+
+	struct watch_node *parent;
+	struct list_head children;
+	struct list_head sibling;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, and the index entry of the path. */
+	struct list_head node_list;
+	struct watch_node *wnode;
+
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -47,6 +77,13 @@ struct watch
 	char *node;
 };
 
+/* An event queued for a watch, until it has been sent. */
+struct watch_event
+{
+	struct list_head list;
+	struct buffered_data *out;
+};
+
 static bool check_event_node(const char *node)
 {
 	if (!node || !strstarts(node, "@")) {
@@ -56,22 +93,39 @@ static bool check_event_node(const char *node)
 	return true;
 }
 
-/* Is child a subnode of parent, or equal? */
-static bool is_child(const char *child, const char *parent)
+static int destroy_watch_event(void *_event)
 {
-	unsigned int len = strlen(parent);
+	struct watch_event *event = _event;
 
-	/*
-	 * / should really be "" for this algorithm to work, but that's a
-	 * usability nightmare.
-	 */
-	if (streq(parent, "/"))
-		return true;
+	list_del(&event->list);
+	return 0;
+}
 
-	if (strncmp(child, parent, len) != 0)
-		return false;
+/* Queue an event, unless an identical one is still waiting to be sent. */
+static void queue_event(struct connection *conn, struct watch *watch,
+			const char *data, unsigned int len)
+{
+	struct watch_event *event;
+	struct buffered_data *out;
 
-	return child[len] == '/' || child[len] == '\0';
+	list_for_each_entry(event, &watch->events, list) {
+		out = event->out;
+		if (out->inhdr && !out->used && out->hdr.msg.len == len &&
+		    !memcmp(out->buffer, data, len))
+			return;
+	}
+
+	out = send_event(conn, data, len);
+	if (!out)
+		return;
+
+	/* Without memory we just can't merge later events into this one. */
+	event = talloc(out, struct watch_event);
+	if (!event)
+		return;
+	event->out = out;
+	list_add_tail(&event->list, &watch->events);
+	talloc_set_destructor(event, destroy_watch_event);
 }
 
 /*
@@ -115,10 +169,37 @@ static void add_event(struct connection *conn,
 		return;
 	strcpy(data, name);
 	strcpy(data + strlen(name) + 1, watch->token);
-	send_reply(conn, XS_WATCH_EVENT, data, len);
+	if (watch_coalesce)
+		queue_event(conn, watch, data, len);
+	else
+		send_event(conn, data, len);
 	talloc_free(data);
 }
 
+static void fire_watch_node(struct watch_node *wnode, void *ctx,
+			    const char *name)
+{
+	struct watch *watch;
+
+	if (!wnode)
+		return;
+
+	list_for_each_entry(watch, &wnode->watches, node_list)
+		add_event(watch->conn, ctx, watch,
+			  name ? name : watch->node);
+}
+
+/* Fire all watches below wnode, on their own paths. */
+static void fire_watch_children(struct watch_node *wnode, void *ctx)
+{
+	struct watch_node *child;
+
+	list_for_each_entry(child, &wnode->children, sibling) {
+		fire_watch_node(child, ctx, NULL);
+		fire_watch_children(child, ctx);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -126,27 +207,148 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct watch_node *wnode;
+	char *path, *slash;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
+	if (!watch_index)
+		return;
+
+	/* A watch on / sees everything, including special events. */
+	wnode = hashtable_search(watch_index, "/");
+	fire_watch_node(wnode, ctx, name);
+
+	/* Watches on the parents. */
+	if (strstarts(name, "/")) {
+		path = talloc_strdup(ctx, name);
+		if (!path)
+			return;
+		for (slash = strchr(path + 1, '/'); slash;
+		     slash = strchr(slash + 1, '/')) {
+			*slash = 0;
+			fire_watch_node(hashtable_search(watch_index, path),
+					ctx, name);
+			*slash = '/';
 		}
+		talloc_free(path);
 	}
+
+	/* Watches on the node itself. */
+	if (!streq(name, "/")) {
+		wnode = hashtable_search(watch_index, (void *)name);
+		fire_watch_node(wnode, ctx, name);
+	}
+
+	if (recurse && wnode)
+		fire_watch_children(wnode, ctx);
+}
+
+static void put_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while (wnode && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		parent = wnode->parent;
+		if (parent)
+			list_del(&wnode->sibling);
+		/* Frees the path, too. */
+		hashtable_remove(watch_index, wnode->path);
+		free(wnode);
+		wnode = parent;
+	}
+}
+
+static struct watch_node *new_watch_node(const char *path)
+{
+	struct watch_node *wnode;
+
+	wnode = malloc(sizeof(*wnode));
+	if (!wnode)
+		return NULL;
+	wnode->path = strdup(path);
+	if (!wnode->path ||
+	    !hashtable_insert(watch_index, wnode->path, wnode)) {
+		free(wnode->path);
+		free(wnode);
+		return NULL;
+	}
+
+	wnode->parent = NULL;
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+
+	return wnode;
+}
+
+/*
+ * Find the index entry of path, adding it and its parents if needed.
+ * Temporary memory allocations are done with ctx.
+ */
+static struct watch_node *get_watch_node(void *ctx, const char *path)
+{
+	struct watch_node *wnode, *found, *child = NULL, *first = NULL;
+	char *name, *slash;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	name = talloc_strdup(ctx, path);
+	if (!name)
+		return NULL;
+
+	for (;;) {
+		found = hashtable_search(watch_index, name);
+		wnode = found ? found : new_watch_node(name);
+		if (!wnode) {
+			/* Drop what has been added so far. */
+			put_watch_node(first);
+			first = NULL;
+			break;
+		}
+
+		if (child) {
+			child->parent = wnode;
+			list_add_tail(&child->sibling, &wnode->children);
+		} else
+			first = wnode;
+
+		/* Existing entries are linked to their parents already. */
+		if (found || !strstarts(name, "/") || streq(name, "/"))
+			break;
+
+		child = wnode;
+		slash = strrchr(name, '/');
+		if (slash == name)
+			slash[1] = 0;
+		else
+			*slash = 0;
+	}
+
+	talloc_free(name);
+	return first;
 }
 
 static int destroy_watch(void *_watch)
 {
-	trace_destroy(_watch, "watch");
+	struct watch *watch = _watch;
+	struct watch_event *event;
+
+	/* Pending events outlive their watch. */
+	while ((event = list_top(&watch->events, struct watch_event, list)))
+		list_del_init(&event->list);
+
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
+
+	trace_destroy(watch, "watch");
 	return 0;
 }
 
@@ -197,10 +399,18 @@ int do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->wnode = get_watch_node(in, watch->node);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		return ENOMEM;
+	}
+
+	watch->conn = conn;
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
@@ -21,6 +21,9 @@
 
 #include "xenstored_core.h"
 
+/* Drop events which are identical to one still waiting to be sent. */
+extern bool watch_coalesce;
+
 int do_watch(struct connection *conn, struct buffered_data *in);
 int do_unwatch(struct connection *conn, struct buffered_data *in);
 
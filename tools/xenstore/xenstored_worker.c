@@ -0,0 +1,255 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Read-only requests outside of transactions don't modify anything but
+ * the connection they arrived on, so they can be served by several
+ * threads at once.  Everything else stays with the main thread.
+ *
+ * The main thread holds store_lock for writing all the time, except while
+ * it is waiting in poll().  Workers take it for reading to process a
+ * request, so they never run concurrently with the main thread, but only
+ * with each other.  Jobs are taken off the queue with store_lock held,
+ * which lets the main thread cancel a queued job without further checks.
+ *
+ * Workers must not log, as that uses the talloc null context, nor check
+ * the store.  They report problems with worker_report() instead, and the
+ * main thread deals with them once it has the store again.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "list.h"
+#include "xenstored_core.h"
+#include "xenstored_worker.h"
+
+struct worker_job {
+	struct list_head list;
+	struct connection *conn;
+	struct buffered_data *in;
+	worker_fn_t *fn;
+};
+
+static unsigned int nr_workers;
+static pthread_t main_thread;
+static pthread_rwlock_t store_lock;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(jobs);
+static int wake_pipe[2] = { -1, -1 };
+
+/* Problems reported by workers, protected by job_lock. */
+static unsigned int nr_reports;
+static bool report_corrupt;
+static char report_msg[256];
+
+static struct worker_job *get_job(void)
+{
+	struct worker_job *job;
+
+	pthread_mutex_lock(&job_lock);
+	job = list_top(&jobs, struct worker_job, list);
+	if (job)
+		list_del(&job->list);
+	pthread_mutex_unlock(&job_lock);
+
+	return job;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker_job *job;
+	char c = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&job_lock);
+		while (list_empty(&jobs))
+			pthread_cond_wait(&job_cond, &job_lock);
+		pthread_mutex_unlock(&job_lock);
+
+		pthread_rwlock_rdlock(&store_lock);
+
+		/* Another worker or a cancel might have been faster. */
+		job = get_job();
+		if (job) {
+			job->fn(job->conn, job->in);
+			job->conn->job = NULL;
+			free(job);
+
+			/* A full pipe means the main thread is awake anyway. */
+			if (write(wake_pipe[1], &c, 1) != 1 && errno != EAGAIN)
+				barf_perror("worker wakeup failed");
+		}
+
+		pthread_rwlock_unlock(&store_lock);
+	}
+
+	return NULL;
+}
+
+void worker_init(unsigned int nr)
+{
+	pthread_rwlockattr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+	unsigned int i;
+
+	if (!nr)
+		return;
+
+	/* Don't let a stream of readers starve the main thread. */
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	if (pthread_rwlock_init(&store_lock, &attr))
+		barf("Could not initialize store lock");
+	pthread_rwlockattr_destroy(&attr);
+
+	if (pipe(wake_pipe) ||
+	    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) ||
+	    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK))
+		barf_perror("Could not create worker pipe");
+
+	/* Signals are for the main thread only. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < nr; i++) {
+		if (pthread_create(&thread, NULL, worker_thread, NULL))
+			barf("Could not create worker thread");
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	main_thread = pthread_self();
+	nr_workers = nr;
+}
+
+bool worker_queue(struct connection *conn, struct buffered_data *in,
+		  worker_fn_t *fn)
+{
+	struct worker_job *job;
+
+	if (!nr_workers)
+		return false;
+
+	/* In case of no memory just process it inline. */
+	job = malloc(sizeof(*job));
+	if (!job)
+		return false;
+
+	job->conn = conn;
+	job->in = in;
+	job->fn = fn;
+	conn->job = job;
+
+	pthread_mutex_lock(&job_lock);
+	list_add_tail(&job->list, &jobs);
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+
+	return true;
+}
+
+void worker_cancel(struct connection *conn)
+{
+	struct worker_job *job = conn->job;
+
+	if (!job)
+		return;
+
+	pthread_mutex_lock(&job_lock);
+	list_del(&job->list);
+	pthread_mutex_unlock(&job_lock);
+
+	free(job);
+	conn->job = NULL;
+}
+
+void worker_lock(void)
+{
+	if (nr_workers)
+		pthread_rwlock_wrlock(&store_lock);
+}
+
+void worker_unlock(void)
+{
+	if (nr_workers)
+		pthread_rwlock_unlock(&store_lock);
+}
+
+int worker_wake_fd(void)
+{
+	return wake_pipe[0];
+}
+
+/* Called by the main thread, with the store locked. */
+void worker_wake_drain(void)
+{
+	char buf[64], msg[sizeof(report_msg)];
+	unsigned int nr;
+	bool corrupted;
+
+	while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&job_lock);
+	nr = nr_reports;
+	corrupted = report_corrupt;
+	memcpy(msg, report_msg, sizeof(msg));
+	nr_reports = 0;
+	report_corrupt = false;
+	pthread_mutex_unlock(&job_lock);
+
+	if (!nr)
+		return;
+
+	if (corrupted)
+		corrupt(NULL, "%s (%u reports from workers)", msg, nr);
+	else
+		eprintf("%s (%u reports from workers)", msg, nr);
+}
+
+bool worker_running(void)
+{
+	return nr_workers && !pthread_equal(pthread_self(), main_thread);
+}
+
+/*
+ * Leave a problem found by a worker for the main thread to report, and to
+ * check the store if it may be corrupted.  Only the first message is kept.
+ */
+void worker_report(struct connection *conn, bool corrupt, const char *msg)
+{
+	pthread_mutex_lock(&job_lock);
+	if (!nr_reports++)
+		snprintf(report_msg, sizeof(report_msg), "connection %i: %s",
+			 conn ? (int)conn->id : -1, msg);
+	report_corrupt |= corrupt;
+	pthread_mutex_unlock(&job_lock);
+}
@@ -0,0 +1,101 @@
+/*
+    Worker threads for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_WORKER_H
+#define _XENSTORED_WORKER_H
+
+#include <stdbool.h>
+
+#include "xenstored_core.h"
+
+typedef void worker_fn_t(struct connection *conn, struct buffered_data *in);
+
+#ifndef __MINIOS__
+
+/* Start nr threads for read-only requests (0 keeps everything inline). */
+void worker_init(unsigned int nr);
+
+/*
+ * Hand a request to the workers: returns false if it must be processed
+ * by the caller.  conn->job is set until the reply has been queued.
+ */
+bool worker_queue(struct connection *conn, struct buffered_data *in,
+		  worker_fn_t *fn);
+
+/* Drop a queued request of a connection going away. */
+void worker_cancel(struct connection *conn);
+
+/*
+ * The main thread owns the store, except while it is waiting for events:
+ * it has to drop the lock around poll() only.
+ */
+void worker_lock(void);
+void worker_unlock(void);
+
+/* Written to whenever a worker has finished a request, -1 if unused. */
+int worker_wake_fd(void);
+void worker_wake_drain(void);
+
+bool worker_running(void);
+void worker_report(struct connection *conn, bool corrupt, const char *msg);
+
+#else
+
+static inline void worker_init(unsigned int nr)
+{
+}
+
+static inline bool worker_queue(struct connection *conn,
+				struct buffered_data *in, worker_fn_t *fn)
+{
+	return false;
+}
+
+static inline void worker_cancel(struct connection *conn)
+{
+}
+
+static inline void worker_lock(void)
+{
+}
+
+static inline void worker_unlock(void)
+{
+}
+
+static inline int worker_wake_fd(void)
+{
+	return -1;
+}
+
+static inline void worker_wake_drain(void)
+{
+}
+
+static inline bool worker_running(void)
+{
+	return false;
+}
+
+static inline void worker_report(struct connection *conn, bool corrupt,
+				 const char *msg)
+{
+}
+
+#endif
+
+#endif /* _XENSTORED_WORKER_H */
@@ -167,6 +167,10 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--pipeline      Use several threads to send the domain's memory.\n"
+      "--compress      Compress the domain's memory, if the receiver supports it.\n"
+      "--postcopy      Start the domain at the target before the last of its\n"
+      "                memory has been sent, if the receiver supports it.\n"
       "-p              Do not unpause domain after migrating it."
     },
     { "restore",
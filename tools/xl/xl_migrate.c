@@ -176,7 +176,8 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 
 }
 
-static void migrate_domain(uint32_t domid, const char *rune, int debug,
+static void migrate_domain(uint32_t domid, const char *rune,
+                           int flags, /* LIBXL_SUSPEND_* */
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -184,8 +185,9 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     int send_fd = -1, recv_fd = -1;
     char *away_domname;
     char rc_buf;
+    bool postcopy_started = false;
     uint8_t *config_data;
-    int config_len, flags = LIBXL_SUSPEND_LIVE;
+    int config_len;
 
     save_domain_core_begin(domid, override_config_file,
                            &config_data, &config_len);
@@ -203,14 +205,15 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     xtl_stdiostream_adjust_flags(logger, XTL_STDIOSTREAM_HIDE_PROGRESS, 0);
 
-    if (debug)
-        flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    rc = libxl_domain_migrate(ctx, domid, send_fd, recv_fd, flags,
+                              &postcopy_started, NULL);
     if (rc) {
-        fprintf(stderr, "migration sender: libxl_domain_suspend failed"
+        fprintf(stderr, "migration sender: libxl_domain_migrate failed"
                 " (rc=%d)\n", rc);
         if (rc == ERROR_GUEST_TIMEDOUT)
             goto failed_suspend;
+        else if (rc == ERROR_POSTCOPY_FAILED)
+            goto failed_badly;
         else
             goto failed_resume;
     }
@@ -222,7 +225,15 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
     rc = migrate_read_fixedmessage(recv_fd, migrate_receiver_ready,
                                    sizeof(migrate_receiver_ready),
                                    "ready message", rune);
-    if (rc) goto failed_resume;
+    /*
+     * Once the stream has switched to post-copy, the domain may already
+     * have run at the target, so it is no longer safe to resume it here.
+     */
+    if (rc) {
+        if (postcopy_started)
+            goto failed_badly;
+        goto failed_resume;
+    }
 
     xtl_stdiostream_adjust_flags(logger, 0, XTL_STDIOSTREAM_HIDE_PROGRESS);
 
@@ -537,9 +548,13 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    int flags = LIBXL_SUSPEND_LIVE;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"pipeline", 0, 0, 0x300},
+        {"compress", 0, 0, 0x400},
+        {"postcopy", 0, 0, 0x500},
         COMMON_LONG_OPTS
     };
 
@@ -562,10 +577,26 @@ int main_migrate(int argc, char **argv)
         break;
     case 0x100: /* --debug */
         debug = 1;
+        flags |= LIBXL_SUSPEND_DEBUG;
         break;
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --pipeline */
+        flags |= LIBXL_SUSPEND_PIPELINE;
+        break;
+    case 0x400: /* --compress */
+        flags |= LIBXL_SUSPEND_COMPRESS;
+        break;
+    case 0x500: /* --postcopy */
+        flags |= LIBXL_SUSPEND_POSTCOPY;
+        break;
+    }
+
+    if ((flags & LIBXL_SUSPEND_POSTCOPY) && pause_after_migration) {
+        fprintf(stderr, "--postcopy cannot be used with -p, as the domain "
+                "runs at the target before the migration completes.\n");
+        return EXIT_FAILURE;
     }
 
     domid = find_domain(argv[optind]);
@@ -596,7 +627,7 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, flags, config_filename);
     return EXIT_SUCCESS;
 }
 
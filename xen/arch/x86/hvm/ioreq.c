@@ -26,6 +26,7 @@
 #include <xen/domain.h>
 #include <xen/event.h>
 #include <xen/paging.h>
+#include <xen/sort.h>
 #include <xen/vpci.h>
 
 #include <asm/hvm/hvm.h>
@@ -694,9 +695,290 @@ static int hvm_ioreq_server_alloc_rangesets(struct hvm_ioreq_server *s,
     return rc;
 }
 
+/*
+ * For each range type, the ranges of all enabled servers are indexed, so
+ * that hvm_select_ioreq_server() doesn't have to go through every server's
+ * rangeset.  The ranges are split at every range boundary, each piece goes
+ * to the server that would be selected for it (the one with the highest
+ * id), and adjacent pieces of the same server are merged again.  An access
+ * within a single piece goes to that piece's server.  Accesses crossing
+ * pieces are rare, and are left to searching all servers.
+ *
+ * The index is rebuilt, with the ioreq server lock held, whenever a range
+ * or the state of an enabled server changes.  It is marked invalid before
+ * the change becomes visible, and stays so if the rebuild fails.
+ */
+struct hvm_ioreq_index_build {
+    struct hvm_ioreq_range *ranges;
+    unsigned int           nr, max;
+    unsigned int           id;
+};
+
+static int hvm_ioreq_index_add(unsigned long start, unsigned long end,
+                               void *arg)
+{
+    struct hvm_ioreq_index_build *b = arg;
+
+    if ( b->ranges )
+    {
+        if ( b->nr >= b->max )
+            return -ENOSPC;
+
+        b->ranges[b->nr].start = start;
+        b->ranges[b->nr].end = end;
+        b->ranges[b->nr].id = b->id;
+    }
+
+    b->nr++;
+
+    return 0;
+}
+
+static int hvm_ioreq_index_collect(struct domain *d, unsigned int type,
+                                   struct hvm_ioreq_index_build *b)
+{
+    struct hvm_ioreq_server *s;
+    unsigned int id;
+    int rc;
+
+    /* Highest id first, i.e. in order of priority. */
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( !s->enabled )
+            continue;
+
+        b->id = id;
+        rc = rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                    hvm_ioreq_index_add, b);
+        if ( rc )
+            return rc;
+    }
+
+    return 0;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Index of the first of the @nr sorted @vals which is not less than @val */
+static unsigned int lower_bound(const unsigned long *vals, unsigned int nr,
+                                unsigned long val)
+{
+    unsigned int lo = 0, hi = nr;
+
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( vals[mid] < val )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int hvm_ioreq_index_build(struct domain *d, unsigned int type)
+{
+    struct hvm_ioreq_index *idx = &d->arch.hvm.ioreq_server.index[type];
+    struct hvm_ioreq_index_build b = {};
+    struct hvm_ioreq_range *pieces = NULL, *old;
+    unsigned long *bp = NULL;
+    unsigned int *owner = NULL;
+    unsigned int i, j, nr_bp, nr = 0;
+    int rc;
+
+    ASSERT(spin_is_locked(&d->arch.hvm.ioreq_server.lock));
+
+    rc = hvm_ioreq_index_collect(d, type, &b);
+    if ( rc )
+        goto out;
+    if ( !b.nr )
+        goto install;
+
+    rc = -ENOMEM;
+    b.ranges = xmalloc_array(struct hvm_ioreq_range, b.nr);
+    bp = xmalloc_array(unsigned long, 2 * b.nr);
+    owner = xmalloc_array(unsigned int, 2 * b.nr);
+    if ( !b.ranges || !bp || !owner )
+        goto out;
+
+    b.max = b.nr;
+    b.nr = 0;
+    rc = hvm_ioreq_index_collect(d, type, &b);
+    if ( rc )
+        goto out;
+
+    /* Piece j covers [bp[j], bp[j + 1] - 1], the last one up to ~0UL. */
+    for ( i = nr_bp = 0; i < b.nr; i++ )
+    {
+        bp[nr_bp++] = b.ranges[i].start;
+        if ( b.ranges[i].end != ~0UL )
+            bp[nr_bp++] = b.ranges[i].end + 1;
+    }
+
+    sort(bp, nr_bp, sizeof(*bp), cmp_ulong, NULL);
+
+    for ( i = j = 0; i < nr_bp; i++ )
+        if ( !j || bp[i] != bp[j - 1] )
+            bp[j++] = bp[i];
+    nr_bp = j;
+
+    for ( j = 0; j < nr_bp; j++ )
+        owner[j] = MAX_NR_IOREQ_SERVERS;
+
+    /*
+     * A server's ranges don't overlap each other, so every piece is
+     * looked at no more than once per server.
+     */
+    for ( i = 0; i < b.nr; i++ )
+        for ( j = lower_bound(bp, nr_bp, b.ranges[i].start);
+              j < nr_bp && bp[j] <= b.ranges[i].end; j++ )
+            if ( owner[j] == MAX_NR_IOREQ_SERVERS )
+                owner[j] = b.ranges[i].id;
+
+    for ( j = 0; j < nr_bp; j++ )
+        if ( owner[j] != MAX_NR_IOREQ_SERVERS &&
+             (!j || owner[j - 1] != owner[j]) )
+            nr++;
+
+    rc = -ENOMEM;
+    pieces = xmalloc_array(struct hvm_ioreq_range, nr);
+    if ( !pieces )
+        goto out;
+
+    for ( i = j = 0; j < nr_bp; j++ )
+    {
+        if ( owner[j] == MAX_NR_IOREQ_SERVERS )
+            continue;
+
+        if ( !j || owner[j - 1] != owner[j] )
+        {
+            pieces[i].start = bp[j];
+            pieces[i].id = owner[j];
+            i++;
+        }
+
+        pieces[i - 1].end = (j + 1 < nr_bp) ? bp[j + 1] - 1 : ~0UL;
+    }
+
+ install:
+    rc = 0;
+    write_lock(&d->arch.hvm.ioreq_server.index_lock);
+    old = idx->ranges;
+    idx->ranges = pieces;
+    idx->nr = nr;
+    idx->valid = true;
+    write_unlock(&d->arch.hvm.ioreq_server.index_lock);
+
+    xfree(old);
+
+ out:
+    if ( rc )
+    {
+        write_lock(&d->arch.hvm.ioreq_server.index_lock);
+        idx->valid = false;
+        write_unlock(&d->arch.hvm.ioreq_server.index_lock);
+    }
+
+    xfree(owner);
+    xfree(bp);
+    xfree(b.ranges);
+
+    return rc;
+}
+
+/* Have lookups search all servers until the index is rebuilt. */
+static void hvm_ioreq_index_invalidate(struct domain *d, unsigned int type)
+{
+    write_lock(&d->arch.hvm.ioreq_server.index_lock);
+    d->arch.hvm.ioreq_server.index[type].valid = false;
+    write_unlock(&d->arch.hvm.ioreq_server.index_lock);
+}
+
+static void hvm_ioreq_index_update(struct domain *d)
+{
+    unsigned int type;
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        hvm_ioreq_index_build(d, type);
+}
+
+static void hvm_ioreq_index_free(struct domain *d)
+{
+    unsigned int type;
+
+    write_lock(&d->arch.hvm.ioreq_server.index_lock);
+
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+    {
+        struct hvm_ioreq_index *idx = &d->arch.hvm.ioreq_server.index[type];
+
+        xfree(idx->ranges);
+        idx->ranges = NULL;
+        idx->nr = 0;
+        idx->valid = false;
+    }
+
+    write_unlock(&d->arch.hvm.ioreq_server.index_lock);
+}
+
+/*
+ * Returns 1 with *id set if [start, end] goes to server id, 0 if there is
+ * no server for it, and -1 if all servers need to be searched.
+ */
+static int hvm_ioreq_index_lookup(struct domain *d, unsigned int type,
+                                  unsigned long start, unsigned long end,
+                                  unsigned int *id)
+{
+    const struct hvm_ioreq_index *idx = &d->arch.hvm.ioreq_server.index[type];
+    const struct hvm_ioreq_range *r;
+    unsigned int lo = 0, hi;
+    int rc = -1;
+
+    read_lock(&d->arch.hvm.ioreq_server.index_lock);
+
+    if ( !idx->valid )
+        goto out;
+
+    /* Find the last piece starting at or before start. */
+    hi = idx->nr;
+    while ( lo < hi )
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if ( idx->ranges[mid].start <= start )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    r = lo ? &idx->ranges[lo - 1] : NULL;
+
+    if ( !r || r->end < start )
+        rc = 0;
+    else if ( end <= r->end )
+    {
+        *id = r->id;
+        rc = 1;
+    }
+
+ out:
+    read_unlock(&d->arch.hvm.ioreq_server.index_lock);
+
+    return rc;
+}
+
 static void hvm_ioreq_server_enable(struct hvm_ioreq_server *s)
 {
     struct hvm_ioreq_vcpu *sv;
+    unsigned int type;
 
     spin_lock(&s->lock);
 
@@ -706,6 +988,9 @@ static void hvm_ioreq_server_enable(struct hvm_ioreq_server *s)
     hvm_remove_ioreq_gfn(s, false);
     hvm_remove_ioreq_gfn(s, true);
 
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        hvm_ioreq_index_invalidate(s->target, type);
+
     s->enabled = true;
 
     list_for_each_entry ( sv,
@@ -713,12 +998,16 @@ static void hvm_ioreq_server_enable(struct hvm_ioreq_server *s)
                           list_entry )
         hvm_update_ioreq_evtchn(s, sv);
 
+    hvm_ioreq_index_update(s->target);
+
   done:
     spin_unlock(&s->lock);
 }
 
 static void hvm_ioreq_server_disable(struct hvm_ioreq_server *s)
 {
+    unsigned int type;
+
     spin_lock(&s->lock);
 
     if ( !s->enabled )
@@ -727,8 +1016,13 @@ static void hvm_ioreq_server_disable(struct hvm_ioreq_server *s)
     hvm_add_ioreq_gfn(s, true);
     hvm_add_ioreq_gfn(s, false);
 
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        hvm_ioreq_index_invalidate(s->target, type);
+
     s->enabled = false;
 
+    hvm_ioreq_index_update(s->target);
+
  done:
     spin_unlock(&s->lock);
 }
@@ -1040,7 +1334,12 @@ int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
     if ( rangeset_overlaps_range(r, start, end) )
         goto out;
 
+    if ( s->enabled )
+        hvm_ioreq_index_invalidate(d, type);
+
     rc = rangeset_add_range(r, start, end);
+    if ( s->enabled )
+        hvm_ioreq_index_build(d, type);
 
  out:
     spin_unlock_recursive(&d->arch.hvm.ioreq_server.lock);
@@ -1092,7 +1391,12 @@ int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
     if ( !rangeset_contains_range(r, start, end) )
         goto out;
 
+    if ( s->enabled )
+        hvm_ioreq_index_invalidate(d, type);
+
     rc = rangeset_remove_range(r, start, end);
+    if ( s->enabled )
+        hvm_ioreq_index_build(d, type);
 
  out:
     spin_unlock_recursive(&d->arch.hvm.ioreq_server.lock);
@@ -1253,6 +1557,8 @@ void hvm_destroy_all_ioreq_servers(struct domain *d)
         xfree(s);
     }
 
+    hvm_ioreq_index_free(d);
+
     spin_unlock_recursive(&d->arch.hvm.ioreq_server.lock);
 }
 
@@ -1263,6 +1569,7 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
     uint32_t cf8;
     uint8_t type;
     uint64_t addr;
+    unsigned long start, end;
     unsigned int id;
 
     if ( p->type != IOREQ_TYPE_COPY && p->type != IOREQ_TYPE_PIO )
@@ -1304,49 +1611,55 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
         addr = p->addr;
     }
 
-    FOR_EACH_IOREQ_SERVER(d, id, s)
+    switch ( type )
     {
-        struct rangeset *r;
-
-        if ( !s->enabled )
-            continue;
-
-        r = s->range[type];
+    case XEN_DMOP_IO_RANGE_PORT:
+        start = addr;
+        end = start + p->size - 1;
+        break;
 
-        switch ( type )
-        {
-            unsigned long start, end;
+    case XEN_DMOP_IO_RANGE_MEMORY:
+        start = hvm_mmio_first_byte(p);
+        end = hvm_mmio_last_byte(p);
+        break;
 
-        case XEN_DMOP_IO_RANGE_PORT:
-            start = addr;
-            end = start + p->size - 1;
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    case XEN_DMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
 
-            break;
+    default:
+        ASSERT_UNREACHABLE();
+        return NULL;
+    }
 
-        case XEN_DMOP_IO_RANGE_MEMORY:
-            start = hvm_mmio_first_byte(p);
-            end = hvm_mmio_last_byte(p);
+    switch ( hvm_ioreq_index_lookup(d, type, start, end, &id) )
+    {
+    case 0:
+        return NULL;
 
-            if ( rangeset_contains_range(r, start, end) )
-                return s;
+    case 1:
+        s = GET_IOREQ_SERVER(d, id);
+        if ( s && s->enabled )
+            goto found;
+        break;
+    }
 
-            break;
+    FOR_EACH_IOREQ_SERVER(d, id, s)
+    {
+        if ( s->enabled && rangeset_contains_range(s->range[type], start, end) )
+            goto found;
+    }
 
-        case XEN_DMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+    return NULL;
 
-            break;
-        }
+ found:
+    if ( type == XEN_DMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
     }
 
-    return NULL;
+    return s;
 }
 
 static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
@@ -1534,7 +1847,14 @@ static int hvm_access_cf8(
 
 void hvm_ioreq_init(struct domain *d)
 {
+    unsigned int type;
+
     spin_lock_init(&d->arch.hvm.ioreq_server.lock);
+    rwlock_init(&d->arch.hvm.ioreq_server.index_lock);
+
+    /* No servers yet, so nothing goes anywhere. */
+    for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        d->arch.hvm.ioreq_server.index[type].valid = true;
 
     register_portio_handler(d, 0xcf8, 4, hvm_access_cf8);
 }
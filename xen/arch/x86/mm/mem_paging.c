@@ -63,6 +63,10 @@ int mem_paging_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_paging_op_t) arg)
             copyback = 1;
         break;
 
+    case XENMEM_paging_op_discard:
+        rc = p2m_mem_paging_discard(d, mpo.gfn);
+        break;
+
     default:
         rc = -ENOSYS;
         break;
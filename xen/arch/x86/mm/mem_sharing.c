@@ -890,7 +890,8 @@ out:
 }
 
 static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
-                       struct domain *cd, gfn_t cgfn, shr_handle_t ch)
+                       struct domain *cd, gfn_t cgfn, shr_handle_t ch,
+                       bool compare)
 {
     struct page_info *spage, *cpage, *firstpg, *secondpg;
     gfn_info_t *gfn;
@@ -964,6 +965,27 @@ static int share_pages(struct domain *sd, gfn_t sgfn, shr_handle_t sh,
         goto err_out;
     }
 
+    /*
+     * Both pages are read-only to their guests while they are shared, and
+     * unsharing needs the page locks we hold, so the contents are stable.
+     */
+    if ( compare )
+    {
+        const void *s = map_domain_page(smfn), *c = map_domain_page(cmfn);
+        bool differ = memcmp(s, c, PAGE_SIZE);
+
+        unmap_domain_page(c);
+        unmap_domain_page(s);
+
+        if ( differ )
+        {
+            ret = -ENODATA;
+            mem_sharing_page_unlock(secondpg);
+            mem_sharing_page_unlock(firstpg);
+            goto err_out;
+        }
+    }
+
     /* Acquire an extra reference, for the freeing below to be safe. */
     if ( !get_page(cpage, cd) )
     {
@@ -1312,7 +1334,8 @@ static int range_share(struct domain *d, struct domain *cd,
             if ( !rc )
             {
                 /* If we get here this should be guaranteed to succeed. */
-                rc = share_pages(d, _gfn(start), sh, cd, _gfn(start), ch);
+                rc = share_pages(d, _gfn(start), sh, cd, _gfn(start), ch,
+                                 false);
                 ASSERT(!rc);
             }
         }
@@ -1337,6 +1360,109 @@ static int range_share(struct domain *d, struct domain *cd,
     return rc;
 }
 
+static int batch_lock_client(struct domain *d, domid_t domid,
+                             struct domain **cd)
+{
+    int rc = rcu_lock_live_remote_domain_by_id(domid, cd);
+
+    if ( rc )
+        return rc;
+
+    /* As with range sharing, reuse the XENMEM_sharing_op_share check. */
+    rc = xsm_mem_sharing_op(XSM_DM_PRIV, d, *cd, XENMEM_sharing_op_share);
+    if ( !rc && !mem_sharing_enabled(*cd) )
+        rc = -EINVAL;
+
+    if ( rc )
+    {
+        rcu_unlock_domain(*cd);
+        *cd = NULL;
+    }
+
+    return rc;
+}
+
+static int batch_share_entry(struct domain *d, struct domain *cd,
+                             const xen_mem_sharing_batch_entry_t *entry,
+                             bool compare)
+{
+    gfn_t sgfn = _gfn(entry->source_gfn), cgfn = _gfn(entry->client_gfn);
+    shr_handle_t sh, ch;
+    int rc;
+
+    /* Grant references are not supported in batches. */
+    if ( entry->_pad ||
+         XENMEM_SHARING_OP_FIELD_IS_GREF(entry->source_gfn) ||
+         XENMEM_SHARING_OP_FIELD_IS_GREF(entry->client_gfn) )
+        return -EINVAL;
+
+    rc = nominate_page(d, sgfn, 0, &sh);
+    if ( rc )
+        return rc;
+
+    rc = nominate_page(cd, cgfn, 0, &ch);
+    if ( rc )
+        return rc;
+
+    return share_pages(d, sgfn, sh, cd, cgfn, ch, compare);
+}
+
+static int batch_share(struct domain *d, struct mem_sharing_op_batch *batch)
+{
+    xen_mem_sharing_batch_entry_t entry;
+    struct domain *cd = NULL;
+    bool compare = batch->flags & XENMEM_SHARING_BATCH_IDENTICAL;
+    unsigned int i = batch->opaque;
+    int rc = 0;
+
+    while ( i < batch->nr_entries )
+    {
+        if ( copy_from_guest_offset(&entry, batch->entries, i, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Entries are usually grouped by client, so keep it locked. */
+        if ( cd && cd->domain_id != entry.client_domain )
+        {
+            rcu_unlock_domain(cd);
+            cd = NULL;
+        }
+
+        entry.rc = cd ? 0 : batch_lock_client(d, entry.client_domain, &cd);
+        if ( !entry.rc )
+            entry.rc = batch_share_entry(d, cd, &entry, compare);
+
+        if ( copy_to_guest_offset(batch->entries, i, &entry, 1) )
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        /* Individual entries may fail, but running out of memory is fatal. */
+        if ( entry.rc == -ENOMEM )
+        {
+            rc = -ENOMEM;
+            break;
+        }
+
+        /* Check for continuation if it's not the last iteration. */
+        if ( ++i < batch->nr_entries && hypercall_preempt_check() )
+        {
+            rc = 1;
+            break;
+        }
+    }
+
+    if ( cd )
+        rcu_unlock_domain(cd);
+
+    batch->opaque = i;
+
+    return rc;
+}
+
 int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
 {
     int rc;
@@ -1397,6 +1523,7 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
         break;
 
         case XENMEM_sharing_op_share:
+        case XENMEM_sharing_op_share_identical:
         {
             gfn_t sgfn, cgfn;
             struct domain *cd;
@@ -1460,7 +1587,8 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
             sh = mso.u.share.source_handle;
             ch = mso.u.share.client_handle;
 
-            rc = share_pages(d, sgfn, sh, cd, cgfn, ch);
+            rc = share_pages(d, sgfn, sh, cd, cgfn, ch,
+                             mso.op == XENMEM_sharing_op_share_identical);
 
             rcu_unlock_domain(cd);
         }
@@ -1603,6 +1731,32 @@ int mem_sharing_memop(XEN_GUEST_HANDLE_PARAM(xen_mem_sharing_op_t) arg)
         }
         break;
 
+        case XENMEM_sharing_op_share_batch:
+        {
+            rc = -EINVAL;
+            if ( mso.u.batch.flags & ~XENMEM_SHARING_BATCH_IDENTICAL ||
+                 mso.u.batch.opaque > mso.u.batch.nr_entries )
+                goto out;
+
+            if ( !mem_sharing_enabled(d) )
+                goto out;
+
+            rc = batch_share(d, &mso.u.batch);
+
+            if ( rc > 0 )
+            {
+                if ( __copy_to_guest(arg, &mso, 1) )
+                    rc = -EFAULT;
+                else
+                    rc = hypercall_create_continuation(__HYPERVISOR_memory_op,
+                                                       "lh", XENMEM_sharing_op,
+                                                       arg);
+            }
+            else
+                mso.u.batch.opaque = 0;
+        }
+        break;
+
         case XENMEM_sharing_op_debug_gfn:
             rc = debug_gfn(d, _gfn(mso.u.debug.u.gfn));
             break;
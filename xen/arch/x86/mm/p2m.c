@@ -1623,6 +1623,83 @@ int p2m_mem_paging_evict(struct domain *d, unsigned long gfn_l)
     return ret;
 }
 
+/**
+ * p2m_mem_paging_discard - Mark a guest page as paged-out without a pager copy
+ * @d: guest domain
+ * @gfn: guest page to discard
+ *
+ * Returns 0 for success or negative errno values if the gfn can not be
+ * discarded.
+ *
+ * p2m_mem_paging_discard() is called by a pager which will supply the contents
+ * of the gfn from elsewhere, such as the restore side of a post-copy migration.
+ * The gfn is put straight into the paged state, so that the next access causes
+ * a populate request to be sent to the pager. The following gfns are accepted:
+ * - a gfn not backed by a mfn, which has never been populated
+ * - a gfn backed by a mfn which could have been nominated, in which case any
+ *   current contents are thrown away
+ */
+int p2m_mem_paging_discard(struct domain *d, unsigned long gfn_l)
+{
+    struct page_info *page;
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    gfn_t gfn = _gfn(gfn_l);
+    mfn_t mfn;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = -EBUSY;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &p2mt, &a, 0, NULL, NULL);
+
+    /* An empty gfn needs nothing but the p2m type changing */
+    if ( !mfn_valid(mfn) )
+    {
+        if ( p2mt != p2m_invalid && p2mt != p2m_mmio_dm )
+            goto out;
+
+        ret = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
+                            p2m_ram_paged, p2m->default_access);
+        if ( !ret )
+            atomic_inc(&d->paged_pages);
+        goto out;
+    }
+
+    /* Otherwise apply the same checks as nominate and evict */
+    if ( !p2m_is_pageable(p2mt) || is_iomem_page(mfn) )
+        goto out;
+
+    page = mfn_to_page(mfn);
+    if ( unlikely(!get_page(page, d)) )
+        goto out;
+
+    if ( (page->count_info & (PGC_count_mask | PGC_allocated)) !=
+         (2 | PGC_allocated) )
+        goto out_put;
+
+    if ( (page->u.inuse.type_info & PGT_count_mask) != 0 )
+        goto out_put;
+
+    ret = p2m_set_entry(p2m, gfn, INVALID_MFN, PAGE_ORDER_4K,
+                        p2m_ram_paged, a);
+    if ( ret )
+        goto out_put;
+
+    if ( test_and_clear_bit(_PGC_allocated, &page->count_info) )
+        put_page(page);
+
+    scrub_one_page(page);
+    atomic_inc(&d->paged_pages);
+
+ out_put:
+    put_page(page);
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+    return ret;
+}
+
 /**
  * p2m_mem_paging_drop_page - Tell pager to drop its reference to a paged page
  * @d: guest domain
@@ -21,10 +21,12 @@
 
 #include <xen/init.h>
 #include <xen/guest_access.h>
+#include <xen/vmap.h>
 #include <asm/paging.h>
 #include <asm/shadow.h>
 #include <asm/p2m.h>
 #include <asm/hap.h>
+#include <asm/altp2m.h>
 #include <asm/event.h>
 #include <asm/hvm/nestedhvm.h>
 #include <xen/numa.h>
@@ -51,6 +53,14 @@ DEFINE_PER_CPU(int, mm_lock_level);
 /*              LOG DIRTY SUPPORT               */
 /************************************************/
 
+/*
+ * Number of pfns which can be recorded for XEN_DOMCTL_SHADOW_OP_CLEAN_LIST
+ * between two harvests (512MB worth of 4k pages).
+ */
+#define LOGDIRTY_LIST_ENTRIES (1u << 17)
+/* pfns made log-dirty again per p2m lock hold in paging_log_dirty_list_op() */
+#define LOGDIRTY_LIST_BATCH   512
+
 static mfn_t paging_new_log_dirty_page(struct domain *d)
 {
     struct page_info *page;
@@ -209,6 +219,44 @@ static int paging_free_log_dirty_bitmap(struct domain *d, int rc)
     return rc;
 }
 
+static void paging_alloc_log_dirty_list(struct domain *d)
+{
+    uint64_t *list = vzalloc(LOGDIRTY_LIST_ENTRIES * sizeof(*list));
+    uint64_t *spare = vzalloc(LOGDIRTY_LIST_ENTRIES * sizeof(*spare));
+
+    /* Not fatal: callers fall back to cleaning the whole bitmap. */
+    if ( !list || !spare )
+    {
+        vfree(list);
+        vfree(spare);
+        return;
+    }
+
+    paging_lock(d);
+    d->arch.paging.log_dirty.list = list;
+    d->arch.paging.log_dirty.spare_list = spare;
+    d->arch.paging.log_dirty.list_count = 0;
+    d->arch.paging.log_dirty.list_overflow = false;
+    paging_unlock(d);
+}
+
+static void paging_free_log_dirty_list(struct domain *d)
+{
+    uint64_t *list, *spare;
+
+    paging_lock(d);
+    list = d->arch.paging.log_dirty.list;
+    spare = d->arch.paging.log_dirty.spare_list;
+    d->arch.paging.log_dirty.list = NULL;
+    d->arch.paging.log_dirty.spare_list = NULL;
+    d->arch.paging.log_dirty.list_count = 0;
+    d->arch.paging.log_dirty.list_overflow = false;
+    paging_unlock(d);
+
+    vfree(list);
+    vfree(spare);
+}
+
 int paging_log_dirty_enable(struct domain *d, bool_t log_global)
 {
     int ret;
@@ -225,10 +273,20 @@ int paging_log_dirty_enable(struct domain *d, bool_t log_global)
     if ( paging_mode_log_dirty(d) )
         return -EINVAL;
 
+    /*
+     * The pfn list is only useful to a global log-dirty user, and only
+     * HAP can re-protect individual pages cheaply enough for it to pay off.
+     */
+    if ( log_global && hap_enabled(d) && !d->arch.paging.log_dirty.list )
+        paging_alloc_log_dirty_list(d);
+
     domain_pause(d);
     ret = d->arch.paging.log_dirty.ops->enable(d, log_global);
     domain_unpause(d);
 
+    if ( ret )
+        paging_free_log_dirty_list(d);
+
     return ret;
 }
 
@@ -251,6 +309,8 @@ static int paging_log_dirty_disable(struct domain *d, bool_t resuming)
     if ( ret == -ERESTART )
         return ret;
 
+    paging_free_log_dirty_list(d);
+
     domain_unpause(d);
 
     return ret;
@@ -326,6 +386,15 @@ void paging_mark_pfn_dirty(struct domain *d, pfn_t pfn)
                      "d%d: marked mfn %" PRI_mfn " (pfn %" PRI_pfn ")\n",
                      d->domain_id, mfn_x(mfn), pfn_x(pfn));
         d->arch.paging.log_dirty.dirty_count++;
+
+        if ( d->arch.paging.log_dirty.list )
+        {
+            if ( d->arch.paging.log_dirty.list_count < LOGDIRTY_LIST_ENTRIES )
+                d->arch.paging.log_dirty.list[
+                    d->arch.paging.log_dirty.list_count++] = pfn_x(pfn);
+            else
+                d->arch.paging.log_dirty.list_overflow = true;
+        }
     }
 
 out:
@@ -540,6 +609,8 @@ static int paging_log_dirty_op(struct domain *d,
         {
             d->arch.paging.log_dirty.fault_count = 0;
             d->arch.paging.log_dirty.dirty_count = 0;
+            d->arch.paging.log_dirty.list_count = 0;
+            d->arch.paging.log_dirty.list_overflow = false;
         }
     }
     else
@@ -586,6 +657,174 @@ static int paging_log_dirty_op(struct domain *d,
     return rv;
 }
 
+/* Clear a pfn's bit in the log-dirty bitmap.  Never allocates. */
+static void paging_clear_pfn_dirty(struct domain *d, pfn_t pfn)
+{
+    mfn_t mfn, *l4, *l3, *l2;
+    unsigned long *l1;
+
+    ASSERT(paging_locked_by_me(d));
+
+    mfn = d->arch.paging.log_dirty.top;
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l4 = map_domain_page(mfn);
+    mfn = l4[L4_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l4);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l3 = map_domain_page(mfn);
+    mfn = l3[L3_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l3);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l2 = map_domain_page(mfn);
+    mfn = l2[L2_LOGDIRTY_IDX(pfn)];
+    unmap_domain_page(l2);
+    if ( !mfn_valid(mfn) )
+        return;
+
+    l1 = map_domain_page(mfn);
+    __clear_bit(L1_LOGDIRTY_IDX(pfn), l1);
+    unmap_domain_page(l1);
+}
+
+/*
+ * Return the list of pfns dirtied since the last harvest, clean them in the
+ * bitmap, and make them log-dirty again in the p2m.  Unlike
+ * paging_log_dirty_op() the cost only depends on the number of dirty pages.
+ *
+ * The harvested list is parked in the spare list while the pages are made
+ * log-dirty again, a batch at a time so the p2m lock is not held for long,
+ * and preemptibly, with the domain kept paused across continuations.  It is
+ * only copied out at the end, so a failed copy leaves nothing to undo.
+ */
+static int paging_log_dirty_list_op(struct domain *d,
+                                    struct xen_domctl_shadow_op *sc,
+                                    bool_t resuming)
+{
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    struct log_dirty_domain *ld = &d->arch.paging.log_dirty;
+    uint64_t *list;
+    unsigned int i, count;
+    int rv = 0;
+
+    if ( !hap_enabled(d) || altp2m_active(d) )
+        return -EOPNOTSUPP;
+
+    if ( !resuming )
+    {
+        /* See paging_log_dirty_op(). */
+        if ( is_hvm_domain(d) &&
+             (sc->mode & XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL) )
+            hvm_mapped_guest_frames_mark_dirty(d);
+
+        domain_pause(d);
+
+        p2m_flush_hardware_cached_dirty(d);
+    }
+
+    paging_lock(d);
+
+    /* Reported on every call, as a continuation starts from a fresh copy. */
+    sc->stats.fault_count = ld->fault_count;
+    sc->stats.dirty_count = ld->dirty_count;
+
+    if ( resuming )
+    {
+        ASSERT(d->arch.paging.preempt.dom == current->domain &&
+               d->arch.paging.preempt.op == sc->op);
+        list = ld->spare_list;
+        i = d->arch.paging.preempt.log_dirty_list.done;
+        count = d->arch.paging.preempt.log_dirty_list.count;
+        paging_unlock(d);
+        goto reprotect;
+    }
+
+    /* Another log-dirty op is part way through. */
+    if ( d->arch.paging.preempt.dom )
+        rv = -EBUSY;
+    else if ( !ld->list )
+        rv = -EOPNOTSUPP;
+    else if ( unlikely(ld->failed_allocs) )
+        rv = -ENOMEM;
+    else if ( ld->list_overflow || ld->list_count > sc->pages )
+        rv = -ENOBUFS;
+
+    if ( rv )
+    {
+        paging_unlock(d);
+        domain_unpause(d);
+        return rv;
+    }
+
+    list = ld->list;
+    count = ld->list_count;
+    ld->list = ld->spare_list;
+    ld->spare_list = list;
+    ld->list_count = 0;
+
+    for ( i = 0; i < count; i++ )
+        paging_clear_pfn_dirty(d, _pfn(list[i]));
+
+    PAGING_DEBUG(LOGDIRTY, "log-dirty clean list: dom %u faults=%u dirty=%u\n",
+                 d->domain_id, ld->fault_count, ld->dirty_count);
+
+    /* Keep other log-dirty ops away from the spare list until we are done. */
+    d->arch.paging.preempt.dom = current->domain;
+    d->arch.paging.preempt.op = sc->op;
+    d->arch.paging.preempt.log_dirty_list.count = count;
+
+    paging_unlock(d);
+
+    i = 0;
+
+ reprotect:
+    /*
+     * Pages which have been marked dirty by other means without being
+     * written by the guest are still log-dirty (-EBUSY).  Holding the p2m
+     * lock defers the TLB flush until the end of each batch.
+     */
+    while ( i < count )
+    {
+        unsigned int end = min(count, i + LOGDIRTY_LIST_BATCH);
+
+        p2m_lock(p2m);
+        for ( ; i < end; i++ )
+            p2m_change_type_one(d, list[i], p2m_ram_rw, p2m_ram_logdirty);
+        p2m_unlock(p2m);
+
+        if ( i < count && hypercall_preempt_check() )
+        {
+            paging_lock(d);
+            d->arch.paging.preempt.log_dirty_list.done = i;
+            paging_unlock(d);
+            return -ERESTART;
+        }
+    }
+
+    if ( count && !guest_handle_is_null(sc->dirty_bitmap) &&
+         copy_to_guest_offset(sc->dirty_bitmap, 0, (uint8_t *)list,
+                              count * sizeof(*list)) )
+        rv = -EFAULT;
+
+    paging_lock(d);
+    d->arch.paging.preempt.dom = NULL;
+    ld->fault_count = 0;
+    ld->dirty_count = 0;
+    paging_unlock(d);
+
+    domain_unpause(d);
+
+    if ( !rv )
+        sc->pages = count;
+
+    return rv;
+}
+
 void paging_log_dirty_range(struct domain *d,
                            unsigned long begin_pfn,
                            unsigned long nr,
@@ -739,6 +978,11 @@ int paging_domctl(struct domain *d, struct xen_domctl_shadow_op *sc,
         if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
             return -EINVAL;
         return paging_log_dirty_op(d, sc, resuming);
+
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_LIST:
+        if ( sc->mode & ~XEN_DOMCTL_SHADOW_LOGDIRTY_FINAL )
+            return -EINVAL;
+        return paging_log_dirty_list_op(d, sc, resuming);
     }
 
     /* Here, dispatch domctl to the appropriate paging code */
@@ -808,6 +1052,8 @@ int paging_teardown(struct domain *d)
     if ( rc == -ERESTART )
         return rc;
 
+    paging_free_log_dirty_list(d);
+
     /* Move populate-on-demand cache back to domain_list for destruction */
     rc = p2m_pod_empty_cache(d);
 
@@ -257,6 +257,32 @@ int cpupool_move_domain(struct domain *d, struct cpupool *c)
     return ret;
 }
 
+/*
+ * With sched-gran=core|socket, the scheduler of a cpupool can only keep the
+ * cpus it owns from running other domains, so a scheduling unit must not be
+ * shared by several cpupools (cpus of a unit may be free, though).  Check
+ * whether assigning cpu to c would put its unit in two cpupools.
+ * cpupool_lock must be held
+ */
+static bool cpupool_unit_split(const struct cpupool *c, unsigned int cpu)
+{
+    const cpumask_t *unit = sched_unit_mask(cpu);
+    struct cpupool **q;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu )
+        return false;
+
+    if ( (cpupool_moving_cpu != -1) && (cpupool_cpu_moving != c) &&
+         cpumask_test_cpu(cpupool_moving_cpu, unit) )
+        return true;
+
+    for_each_cpupool(q)
+        if ( (*q != c) && cpumask_intersects((*q)->cpu_valid, unit) )
+            return true;
+
+    return false;
+}
+
 /*
  * assign a specific cpu to a cpupool
  * cpupool_lock must be held
@@ -520,10 +546,16 @@ static int cpupool_cpu_add(unsigned int cpu)
          * If we are not resuming, we are hot-plugging cpu, and in which case
          * we add it to pool0, as it certainly was there when hot-unplagged
          * (or unplugging would have failed) and that is the default behavior
-         * anyway.
+         * anyway.  Unless the rest of its scheduling unit has been moved to
+         * another pool meanwhile, in which case it is left free.
          */
         per_cpu(cpupool, cpu) = NULL;
-        ret = cpupool_assign_cpu_locked(cpupool0, cpu);
+        if ( cpupool_unit_split(cpupool0, cpu) )
+            printk(XENLOG_WARNING
+                   "CPU%u not added to Pool-0: its scheduling unit is in "
+                   "another cpupool\n", cpu);
+        else
+            ret = cpupool_assign_cpu_locked(cpupool0, cpu);
     }
  out:
     spin_unlock(&cpupool_lock);
@@ -658,6 +690,9 @@ int cpupool_do_sysctl(struct xen_sysctl_cpupool_op *op)
         ret = -ENOENT;
         if ( c == NULL )
             goto addcpu_out;
+        ret = -EBUSY;
+        if ( cpupool_unit_split(c, cpu) )
+            goto addcpu_out;
         ret = cpupool_assign_cpu_locked(c, cpu);
     addcpu_out:
         spin_unlock(&cpupool_lock);
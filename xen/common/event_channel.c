@@ -178,30 +178,65 @@ int evtchn_allocate_port(struct domain *d, evtchn_port_t port)
             return -ENOMEM;
         bucket_from_port(d, port) = chn;
 
+        /* All but the port asked for are free. */
+        set_bit(port / EVTCHNS_PER_BUCKET, d->evtchn_free_buckets);
+
         write_atomic(&d->valid_evtchns, d->valid_evtchns + EVTCHNS_PER_BUCKET);
     }
 
     return 0;
 }
 
+/*
+ * Ports are handed out lowest first.  Rather than looking at all ports in
+ * use below the one found, only buckets which may have free ports (those
+ * which had ports freed since last found to be full) are looked at.
+ */
 static int get_free_port(struct domain *d)
 {
-    int            port;
+    unsigned int bucket, port, end;
+    int rc;
 
     if ( d->is_dying )
         return -EINVAL;
 
-    for ( port = 0; port <= d->max_evtchn_port; port++ )
+    for_each_set_bit ( bucket, d->evtchn_free_buckets, NR_EVTCHN_BUCKETS )
     {
-        int rc = evtchn_allocate_port(d, port);
+        bool free = false;
 
-        if ( rc == -EBUSY )
-            continue;
+        port = bucket * EVTCHNS_PER_BUCKET;
+        if ( !port_is_valid(d, port) || port > d->max_evtchn_port )
+            break;
+        end = min_t(unsigned int, port + EVTCHNS_PER_BUCKET - 1,
+                    d->max_evtchn_port);
+
+        for ( ; port <= end; port++ )
+        {
+            rc = evtchn_allocate_port(d, port);
+            if ( rc == 0 )
+                return port;
+            if ( rc != -EBUSY )
+                return rc;
+
+            /* Free, but still linked on an event queue. */
+            if ( evtchn_from_port(d, port)->state == ECS_FREE )
+                free = true;
+        }
 
-        return port;
+        if ( !free )
+            clear_bit(bucket, d->evtchn_free_buckets);
     }
 
-    return -ENOSPC;
+    /* All allocated ports are in use: the first one of a new bucket. */
+    port = read_atomic(&d->valid_evtchns);
+    if ( port > d->max_evtchn_port )
+        return -ENOSPC;
+
+    rc = evtchn_allocate_port(d, port);
+    if ( rc )
+        return rc;
+
+    return port;
 }
 
 void evtchn_free(struct domain *d, struct evtchn *chn)
@@ -211,6 +246,7 @@ void evtchn_free(struct domain *d, struct evtchn *chn)
 
     /* Reset binding to vcpu0 when the channel is freed. */
     chn->state          = ECS_FREE;
+    set_bit(chn->port / EVTCHNS_PER_BUCKET, d->evtchn_free_buckets);
     chn->notify_vcpu_id = 0;
     chn->xen_consumer   = 0;
 
@@ -1051,6 +1087,47 @@ static long evtchn_set_priority(const struct evtchn_set_priority *set_priority)
     return ret;
 }
 
+static long evtchn_set_coalesce(const struct evtchn_set_coalesce *set_coalesce)
+{
+    struct domain *d = current->domain;
+    unsigned int port = set_coalesce->port;
+    struct evtchn *chn;
+    long ret;
+
+    if ( set_coalesce->max_delay_us > EVTCHN_COALESCE_MAX_DELAY_US )
+        return -EINVAL;
+
+    spin_lock(&d->event_lock);
+
+    if ( !port_is_valid(d, port) )
+    {
+        spin_unlock(&d->event_lock);
+        return -EINVAL;
+    }
+
+    chn = evtchn_from_port(d, port);
+
+    switch ( chn->state )
+    {
+    case ECS_INTERDOMAIN:
+    case ECS_PIRQ:
+    case ECS_VIRQ:
+    case ECS_IPI:
+        ret = evtchn_port_set_coalesce(d, chn, set_coalesce->max_events,
+                                       set_coalesce->max_delay_us);
+        break;
+
+    default:
+        /* Free, reserved and unbound ports get no notifications. */
+        ret = -EINVAL;
+        break;
+    }
+
+    spin_unlock(&d->event_lock);
+
+    return ret;
+}
+
 long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     long rc;
@@ -1194,6 +1271,14 @@ long do_event_channel_op(int cmd, XEN_GUEST_HANDLE_PARAM(void) arg)
         break;
     }
 
+    case EVTCHNOP_set_coalesce: {
+        struct evtchn_set_coalesce set_coalesce;
+        if ( copy_from_guest(&set_coalesce, arg, 1) != 0 )
+            return -EFAULT;
+        rc = evtchn_set_coalesce(&set_coalesce);
+        break;
+    }
+
     default:
         rc = -ENOSYS;
         break;
@@ -1295,15 +1380,25 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     evtchn_2l_init(d);
     d->max_evtchn_port = min_t(unsigned int, max_port, INT_MAX);
 
+    d->evtchn_free_buckets = xzalloc_array(unsigned long,
+                                           BITS_TO_LONGS(NR_EVTCHN_BUCKETS));
+    if ( !d->evtchn_free_buckets )
+        return -ENOMEM;
+
     d->evtchn = alloc_evtchn_bucket(d, 0);
     if ( !d->evtchn )
+    {
+        XFREE(d->evtchn_free_buckets);
         return -ENOMEM;
+    }
     d->valid_evtchns = EVTCHNS_PER_BUCKET;
+    __set_bit(0, d->evtchn_free_buckets);
 
     spin_lock_init_prof(d, event_lock);
     if ( get_free_port(d) != 0 )
     {
         free_evtchn_bucket(d, d->evtchn);
+        XFREE(d->evtchn_free_buckets);
         return -EINVAL;
     }
     evtchn_from_port(d, 0)->state = ECS_RESERVED;
@@ -1313,6 +1408,7 @@ int evtchn_init(struct domain *d, unsigned int max_port)
     if ( !d->poll_mask )
     {
         free_evtchn_bucket(d, d->evtchn);
+        XFREE(d->evtchn_free_buckets);
         return -ENOMEM;
     }
 #endif
@@ -1353,6 +1449,7 @@ void evtchn_destroy_final(struct domain *d)
         xfree(d->evtchn_group[i]);
     }
     free_evtchn_bucket(d, d->evtchn);
+    XFREE(d->evtchn_free_buckets);
 
 #if MAX_VIRT_CPUS > BITS_PER_LONG
     xfree(d->poll_mask);
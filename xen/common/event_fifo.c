@@ -16,9 +16,29 @@
 #include <xen/paging.h>
 #include <xen/mm.h>
 #include <xen/domain_page.h>
+#include <xen/timer.h>
 
 #include <public/event_channel.h>
 
+/*
+ * Notification coalescing state of a port (see EVTCHNOP_set_coalesce).
+ *
+ * Allocated the first time coalescing is set up for a port, and kept until
+ * the event array is torn down, so the timer never has to be killed while
+ * events may be in flight.  The timer handler runs under the channel lock,
+ * which is also held when the port is bound or closed, so a handler already
+ * running when the port changes finds nothing left to deliver.
+ */
+struct evtchn_fifo_coalesce {
+    spinlock_t lock;
+    struct timer timer;         /* Delivers held back events. */
+    struct domain *domain;
+    evtchn_port_t port;
+    unsigned int max_events;    /* <= 1 means disabled. */
+    s_time_t max_delay;
+    unsigned int count;         /* Events held back. */
+};
+
 static inline event_word_t *evtchn_fifo_word_from_port(const struct domain *d,
                                                        unsigned int port)
 {
@@ -42,10 +62,23 @@ static inline event_word_t *evtchn_fifo_word_from_port(const struct domain *d,
 
 static void evtchn_fifo_init(struct domain *d, struct evtchn *evtchn)
 {
+    struct evtchn_fifo_coalesce *c = evtchn->fifo_coalesce;
     event_word_t *word;
 
     evtchn->priority = EVTCHN_FIFO_PRIORITY_DEFAULT;
 
+    /* A new binding starts without coalescing.  Called with evtchn->lock. */
+    if ( c )
+    {
+        unsigned long flags;
+
+        spin_lock_irqsave(&c->lock, flags);
+        c->max_events = 0;
+        c->count = 0;
+        stop_timer(&c->timer);
+        spin_unlock_irqrestore(&c->lock, flags);
+    }
+
     /*
      * If this event is still linked, the first event may be delivered
      * on the wrong VCPU or with an unexpected priority.
@@ -150,113 +183,201 @@ static bool_t evtchn_fifo_set_link(const struct domain *d, event_word_t *word,
     return 1;
 }
 
-static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
+/*
+ * Link the (pending) event to the tail of its queue, and raise an upcall
+ * if the queue was empty.
+ */
+static void evtchn_fifo_link(struct vcpu *v, struct evtchn *evtchn,
+                             event_word_t *word)
 {
     struct domain *d = v->domain;
-    unsigned int port;
-    event_word_t *word;
+    unsigned int port = evtchn->port;
     unsigned long flags;
-    bool_t was_pending;
+    struct evtchn_fifo_queue *q, *old_q;
+    event_word_t *tail_word;
+    bool_t linked = 0;
 
-    port = evtchn->port;
-    word = evtchn_fifo_word_from_port(d, port);
+    /*
+     * Control block not mapped.  The guest must not unmask an
+     * event until the control block is initialized, so we can
+     * just drop the event.
+     */
+    if ( unlikely(!v->evtchn_fifo->control_block) )
+    {
+        printk(XENLOG_G_WARNING
+               "%pv has no FIFO event channel control block\n", v);
+        return;
+    }
 
     /*
-     * Event array page may not exist yet, save the pending state for
-     * when the page is added.
+     * No locking around getting the queue. This may race with
+     * changing the priority but we are allowed to signal the
+     * event once on the old priority.
      */
-    if ( unlikely(!word) )
+    q = &v->evtchn_fifo->queue[evtchn->priority];
+
+    old_q = lock_old_queue(d, evtchn, &flags);
+    if ( !old_q )
+        return;
+
+    if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
     {
-        evtchn->pending = 1;
+        spin_unlock_irqrestore(&old_q->lock, flags);
         return;
     }
 
-    was_pending = test_and_set_bit(EVTCHN_FIFO_PENDING, word);
+    /*
+     * If this event was a tail, the old queue is now empty and
+     * its tail must be invalidated to prevent adding an event to
+     * the old queue from corrupting the new queue.
+     */
+    if ( old_q->tail == port )
+        old_q->tail = 0;
+
+    /* Moved to a different queue? */
+    if ( old_q != q )
+    {
+        evtchn->last_vcpu_id = evtchn->notify_vcpu_id;
+        evtchn->last_priority = evtchn->priority;
+
+        spin_unlock_irqrestore(&old_q->lock, flags);
+        spin_lock_irqsave(&q->lock, flags);
+    }
 
     /*
-     * Link the event if it unmasked and not already linked.
+     * Atomically link the tail to port iff the tail is linked.
+     * If the tail is unlinked the queue is empty.
+     *
+     * If port is the same as tail, the queue is empty but q->tail
+     * will appear linked as we just set LINKED above.
+     *
+     * If the queue is empty (i.e., we haven't linked to the new
+     * event), head must be updated.
      */
-    if ( !test_bit(EVTCHN_FIFO_MASKED, word)
-         && !test_bit(EVTCHN_FIFO_LINKED, word) )
+    if ( q->tail )
     {
-        struct evtchn_fifo_queue *q, *old_q;
-        event_word_t *tail_word;
-        bool_t linked = 0;
-
-        /*
-         * Control block not mapped.  The guest must not unmask an
-         * event until the control block is initialized, so we can
-         * just drop the event.
-         */
-        if ( unlikely(!v->evtchn_fifo->control_block) )
-        {
-            printk(XENLOG_G_WARNING
-                   "%pv has no FIFO event channel control block\n", v);
-            goto done;
-        }
+        tail_word = evtchn_fifo_word_from_port(d, q->tail);
+        linked = evtchn_fifo_set_link(d, tail_word, port);
+    }
+    if ( !linked )
+        write_atomic(q->head, port);
+    q->tail = port;
 
-        /*
-         * No locking around getting the queue. This may race with
-         * changing the priority but we are allowed to signal the
-         * event once on the old priority.
-         */
-        q = &v->evtchn_fifo->queue[evtchn->priority];
+    spin_unlock_irqrestore(&q->lock, flags);
 
-        old_q = lock_old_queue(d, evtchn, &flags);
-        if ( !old_q )
-            goto done;
+    if ( !linked
+         && !test_and_set_bit(q->priority,
+                              &v->evtchn_fifo->control_block->ready) )
+        vcpu_mark_events_pending(v);
+}
 
-        if ( test_and_set_bit(EVTCHN_FIFO_LINKED, word) )
-        {
-            spin_unlock_irqrestore(&old_q->lock, flags);
-            goto done;
-        }
+/*
+ * Should this event be held back, rather than linked right away?
+ */
+static bool evtchn_fifo_coalesce(struct evtchn_fifo_coalesce *c)
+{
+    unsigned long flags;
+    bool hold = false;
 
-        /*
-         * If this event was a tail, the old queue is now empty and
-         * its tail must be invalidated to prevent adding an event to
-         * the old queue from corrupting the new queue.
-         */
-        if ( old_q->tail == port )
-            old_q->tail = 0;
+    spin_lock_irqsave(&c->lock, flags);
 
-        /* Moved to a different queue? */
-        if ( old_q != q )
+    if ( c->max_events > 1 )
+    {
+        if ( ++c->count < c->max_events )
         {
-            evtchn->last_vcpu_id = evtchn->notify_vcpu_id;
-            evtchn->last_priority = evtchn->priority;
-
-            spin_unlock_irqrestore(&old_q->lock, flags);
-            spin_lock_irqsave(&q->lock, flags);
+            /* Deliver after max_delay, unless max_events arrive earlier. */
+            if ( c->count == 1 )
+                set_timer(&c->timer, NOW() + c->max_delay);
+            hold = true;
         }
-
-        /*
-         * Atomically link the tail to port iff the tail is linked.
-         * If the tail is unlinked the queue is empty.
-         *
-         * If port is the same as tail, the queue is empty but q->tail
-         * will appear linked as we just set LINKED above.
-         *
-         * If the queue is empty (i.e., we haven't linked to the new
-         * event), head must be updated.
-         */
-        if ( q->tail )
+        else
         {
-            tail_word = evtchn_fifo_word_from_port(d, q->tail);
-            linked = evtchn_fifo_set_link(d, tail_word, port);
+            c->count = 0;
+            stop_timer(&c->timer);
         }
-        if ( !linked )
-            write_atomic(q->head, port);
-        q->tail = port;
+    }
+
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    return hold;
+}
+
+/*
+ * Forget about the events held back, returning how many there were.
+ */
+static unsigned int evtchn_fifo_coalesce_flush(struct evtchn_fifo_coalesce *c)
+{
+    unsigned long flags;
+    unsigned int count;
 
-        spin_unlock_irqrestore(&q->lock, flags);
+    spin_lock_irqsave(&c->lock, flags);
+    count = c->count;
+    c->count = 0;
+    stop_timer(&c->timer);
+    spin_unlock_irqrestore(&c->lock, flags);
 
-        if ( !linked
-             && !test_and_set_bit(q->priority,
-                                  &v->evtchn_fifo->control_block->ready) )
-            vcpu_mark_events_pending(v);
+    return count;
+}
+
+static void evtchn_fifo_coalesce_timer(void *data)
+{
+    struct evtchn_fifo_coalesce *c = data;
+    struct domain *d = c->domain;
+    struct evtchn *evtchn = evtchn_from_port(d, c->port);
+    event_word_t *word;
+
+    spin_lock(&evtchn->lock);
+
+    /*
+     * The port may have been closed, or the event consumed, cleared or
+     * masked in the meantime, in which case there is nothing (left) to
+     * deliver.
+     */
+    if ( evtchn_fifo_coalesce_flush(c) && evtchn->state != ECS_FREE )
+    {
+        word = evtchn_fifo_word_from_port(d, c->port);
+        if ( word && test_bit(EVTCHN_FIFO_PENDING, word)
+             && !test_bit(EVTCHN_FIFO_MASKED, word)
+             && !test_bit(EVTCHN_FIFO_LINKED, word) )
+            evtchn_fifo_link(d->vcpu[read_atomic(&evtchn->notify_vcpu_id)],
+                             evtchn, word);
+    }
+
+    spin_unlock(&evtchn->lock);
+}
+
+static void evtchn_fifo_set_pending(struct vcpu *v, struct evtchn *evtchn)
+{
+    struct domain *d = v->domain;
+    unsigned int port;
+    event_word_t *word;
+    bool_t was_pending;
+
+    port = evtchn->port;
+    word = evtchn_fifo_word_from_port(d, port);
+
+    /*
+     * Event array page may not exist yet, save the pending state for
+     * when the page is added.
+     */
+    if ( unlikely(!word) )
+    {
+        evtchn->pending = 1;
+        return;
     }
- done:
+
+    was_pending = test_and_set_bit(EVTCHN_FIFO_PENDING, word);
+
+    /*
+     * Link the event if it unmasked and not already linked (and not being
+     * held back for coalescing).
+     */
+    if ( !test_bit(EVTCHN_FIFO_MASKED, word)
+         && !test_bit(EVTCHN_FIFO_LINKED, word)
+         && (likely(!evtchn->fifo_coalesce)
+             || !evtchn_fifo_coalesce(evtchn->fifo_coalesce)) )
+        evtchn_fifo_link(v, evtchn, word);
+
     if ( !was_pending )
         evtchn_check_pollers(d, port);
 }
@@ -289,8 +410,18 @@ static void evtchn_fifo_unmask(struct domain *d, struct evtchn *evtchn)
 
     clear_bit(EVTCHN_FIFO_MASKED, word);
 
-    /* Relink if pending. */
-    if ( test_bit(EVTCHN_FIFO_PENDING, word) )
+    if ( !test_bit(EVTCHN_FIFO_PENDING, word) )
+        return;
+
+    /* Relink if pending, without holding it back any longer. */
+    if ( evtchn->fifo_coalesce )
+    {
+        evtchn_fifo_coalesce_flush(evtchn->fifo_coalesce);
+        if ( !test_bit(EVTCHN_FIFO_MASKED, word)
+             && !test_bit(EVTCHN_FIFO_LINKED, word) )
+            evtchn_fifo_link(v, evtchn, word);
+    }
+    else
         evtchn_fifo_set_pending(v, evtchn);
 }
 
@@ -331,6 +462,48 @@ static int evtchn_fifo_set_priority(struct domain *d, struct evtchn *evtchn,
     return 0;
 }
 
+static int evtchn_fifo_set_coalesce(struct domain *d, struct evtchn *evtchn,
+                                    unsigned int max_events,
+                                    unsigned int max_delay_us)
+{
+    struct evtchn_fifo_coalesce *c = evtchn->fifo_coalesce;
+    unsigned long flags;
+
+    if ( !c )
+    {
+        /* Nothing to turn off. */
+        if ( max_events <= 1 )
+            return 0;
+
+        c = xzalloc(struct evtchn_fifo_coalesce);
+        if ( !c )
+            return -ENOMEM;
+
+        spin_lock_init(&c->lock);
+        init_timer(&c->timer, evtchn_fifo_coalesce_timer, c,
+                   smp_processor_id());
+        c->domain = d;
+        c->port = evtchn->port;
+
+        /* Make the above visible before set_pending can see c. */
+        smp_wmb();
+        evtchn->fifo_coalesce = c;
+    }
+
+    spin_lock_irqsave(&c->lock, flags);
+
+    c->max_events = max_events;
+    c->max_delay = MICROSECS(max_delay_us);
+
+    /* Don't leave an event held back after coalescing has been disabled. */
+    if ( max_events <= 1 && c->count )
+        set_timer(&c->timer, NOW());
+
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    return 0;
+}
+
 static void evtchn_fifo_print_state(struct domain *d,
                                     const struct evtchn *evtchn)
 {
@@ -357,6 +530,7 @@ static const struct evtchn_port_ops evtchn_port_ops_fifo =
     .is_busy       = evtchn_fifo_is_busy,
     .set_priority  = evtchn_fifo_set_priority,
     .print_state   = evtchn_fifo_print_state,
+    .set_coalesce  = evtchn_fifo_set_coalesce,
 };
 
 static int map_guest_page(struct domain *d, uint64_t gfn, void **virt)
@@ -635,6 +809,20 @@ int evtchn_fifo_expand_array(const struct evtchn_expand_array *expand_array)
 void evtchn_fifo_destroy(struct domain *d)
 {
     struct vcpu *v;
+    unsigned int port;
+
+    for ( port = 1; port_is_valid(d, port); port++ )
+    {
+        struct evtchn *evtchn = evtchn_from_port(d, port);
+        struct evtchn_fifo_coalesce *c = evtchn->fifo_coalesce;
+
+        if ( !c )
+            continue;
+
+        evtchn->fifo_coalesce = NULL;
+        kill_timer(&c->timer);
+        xfree(c);
+    }
 
     for_each_vcpu( d, v )
         cleanup_control_block(v);
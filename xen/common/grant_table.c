@@ -40,6 +40,19 @@
 #include <xsm/xsm.h>
 #include <asm/flushtlb.h>
 
+/*
+ * Each VCPU only ever updates its own set of counters, so no atomic
+ * operations are needed; readers add them up.
+ */
+struct grant_stats {
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t copies;
+    uint64_t copy_bytes;
+    uint64_t transfers;
+    uint64_t iommu_ops;
+};
+
 /* Per-domain grant information. */
 struct grant_table {
     /*
@@ -63,6 +76,14 @@ struct grant_table {
     unsigned int          nr_status_frames;
     /* Number of available maptrack entries. */
     unsigned int          maptrack_limit;
+    /* Batches of free maptrack entries, protected by maptrack_lock. */
+    unsigned int          maptrack_pool;
+    /* Statistics, protected by maptrack_lock. */
+    unsigned int          maptrack_refills;
+    unsigned int          maptrack_steals;
+    unsigned int          maptrack_exhausted;
+    /* Usage statistics, one set per VCPU doing the operations. */
+    struct grant_stats   *stats;
     /* Shared grant table (see include/public/grant_table.h). */
     union {
         void **shared_raw;
@@ -183,10 +204,10 @@ struct gnttab_unmap_common {
  * table of these, indexes into which are returned as a 'mapping handle'.
  */
 struct grant_mapping {
-    grant_ref_t ref;        /* grant ref */
+    grant_ref_t ref;        /* grant ref, or next free entry if unused */
     uint16_t flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
     domid_t  domid;         /* granting domain */
-    uint32_t vcpu;          /* vcpu which created the grant mapping */
+    uint32_t next_batch;    /* next batch in the pool (unused entries only) */
     uint32_t pad;           /* round size to a power of 2 */
 };
 
@@ -308,6 +329,14 @@ static inline void gnttab_flush_tlb(const struct domain *d)
         flush_tlb_mask(d->dirty_cpumask);
 }
 
+/* Grant operations are always done on behalf of the calling domain. */
+static inline struct grant_stats *this_grant_stats(void)
+{
+    const struct vcpu *curr = current;
+
+    return &curr->domain->grant_table->stats[curr->vcpu_id];
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -437,70 +466,128 @@ double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 
 #define INVALID_MAPTRACK_HANDLE UINT_MAX
 
+/*
+ * Free maptrack handles live on per-VCPU lists (chained through the ref
+ * field) and, in batches of MAPTRACK_BATCH, in a pool per grant table
+ * (the batches chained through next_batch).
+ *
+ * A VCPU's list is only added to, and only has single entries taken off,
+ * by that VCPU itself (handles are only got and put by the local domain's
+ * current VCPU), so this needs neither locks nor protection against ABA.
+ * The one thing other VCPUs may do is to steal the whole list, by swapping
+ * it for an empty one, when the grant table has run out of handles.  The
+ * count of a list is therefore only a hint.
+ *
+ * The pool, growing the maptrack and stealing are protected by
+ * maptrack_lock, which a VCPU only needs to take once every MAPTRACK_BATCH
+ * gets or puts.
+ */
+#define MAPTRACK_BATCH 32
+
 static inline grant_handle_t
 _get_maptrack_handle(struct grant_table *t, struct vcpu *v)
 {
     unsigned int head, next, prev_head;
 
-    spin_lock(&v->maptrack_freelist_lock);
-
+    head = read_atomic(&v->maptrack_head);
     do {
-        /* No maptrack pages allocated for this VCPU yet? */
-        head = read_atomic(&v->maptrack_head);
         if ( unlikely(head == MAPTRACK_TAIL) )
         {
-            spin_unlock(&v->maptrack_freelist_lock);
+            v->maptrack_nr = 0;
             return INVALID_MAPTRACK_HANDLE;
         }
 
-        /*
-         * Always keep one entry in the free list to make it easier to
-         * add free entries to the tail.
-         */
         next = read_atomic(&maptrack_entry(t, head).ref);
-        if ( unlikely(next == MAPTRACK_TAIL) )
-        {
-            spin_unlock(&v->maptrack_freelist_lock);
-            return INVALID_MAPTRACK_HANDLE;
-        }
-
         prev_head = head;
         head = cmpxchg(&v->maptrack_head, prev_head, next);
     } while ( head != prev_head );
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    if ( v->maptrack_nr )
+        v->maptrack_nr--;
 
     return head;
 }
 
 /*
- * Try to "steal" a free maptrack entry from another VCPU.
- *
- * A stolen entry is transferred to the thief, so the number of
- * entries for each VCPU should tend to the usage pattern.
+ * Give the oldest MAPTRACK_BATCH entries of an overly long free list back
+ * to the pool.
+ */
+static void flush_maptrack_handles(struct grant_table *t, struct vcpu *v)
+{
+    unsigned int head, handle, nr = 0, keep;
+
+    /* Take the whole list, so it can't be stolen while walking it. */
+    head = xchg(&v->maptrack_head, MAPTRACK_TAIL);
+
+    for ( handle = head; handle != MAPTRACK_TAIL;
+          handle = maptrack_entry(t, handle).ref )
+        nr++;
+
+    if ( nr >= 2 * MAPTRACK_BATCH )
+    {
+        unsigned int i, batch;
+
+        keep = nr - MAPTRACK_BATCH;
+        for ( handle = head, i = 1; i < keep; i++ )
+            handle = maptrack_entry(t, handle).ref;
+        batch = maptrack_entry(t, handle).ref;
+        maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
+
+        spin_lock(&t->maptrack_lock);
+        maptrack_entry(t, batch).next_batch = t->maptrack_pool;
+        t->maptrack_pool = batch;
+        spin_unlock(&t->maptrack_lock);
+
+        perfc_incr(maptrack_flush);
+    }
+    else
+        keep = nr;
+
+    /* Nobody but ourselves can make the list non-empty. */
+    write_atomic(&v->maptrack_head, head);
+    v->maptrack_nr = keep;
+}
+
+/*
+ * Try to "steal" the free maptrack entries of another VCPU.  Called with
+ * maptrack_lock held, when there are neither entries in the pool nor frames
+ * left to grow the maptrack by.
  *
- * To avoid having to atomically count the number of free entries on
- * each VCPU and to avoid two VCPU repeatedly stealing entries from
- * each other, the initial victim VCPU is selected randomly.
+ * To avoid two VCPUs repeatedly stealing entries from each other, the
+ * initial victim VCPU is selected randomly.
  */
 static grant_handle_t steal_maptrack_handle(struct grant_table *t,
-                                            const struct vcpu *curr)
+                                            struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
-    unsigned int first, i;
+    unsigned int first, i, nr;
+    grant_handle_t handle, rest, h;
+
+    ASSERT(spin_is_locked(&t->maptrack_lock));
 
     /* Find an initial victim. */
     first = i = get_random() % currd->max_vcpus;
 
     do {
-        if ( currd->vcpu[i] )
-        {
-            grant_handle_t handle;
+        struct vcpu *v = currd->vcpu[i];
 
-            handle = _get_maptrack_handle(t, currd->vcpu[i]);
-            if ( handle != INVALID_MAPTRACK_HANDLE )
+        if ( v && v != curr &&
+             read_atomic(&v->maptrack_head) != MAPTRACK_TAIL )
+        {
+            handle = xchg(&v->maptrack_head, MAPTRACK_TAIL);
+            if ( handle != MAPTRACK_TAIL )
             {
-                maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+                t->maptrack_steals++;
+                perfc_incr(maptrack_steal);
+
+                /* Keep the others, we're likely to want more of them. */
+                rest = maptrack_entry(t, handle).ref;
+                for ( nr = 0, h = rest; h != MAPTRACK_TAIL;
+                      h = maptrack_entry(t, h).ref )
+                    nr++;
+                write_atomic(&curr->maptrack_head, rest);
+                curr->maptrack_nr = nr;
+
                 return handle;
             }
         }
@@ -511,6 +598,9 @@ static grant_handle_t steal_maptrack_handle(struct grant_table *t,
     } while ( i != first );
 
     /* No free handles on any VCPU. */
+    t->maptrack_exhausted++;
+    perfc_incr(maptrack_exhausted);
+
     return INVALID_MAPTRACK_HANDLE;
 }
 
@@ -518,28 +608,19 @@ static inline void
 put_maptrack_handle(
     struct grant_table *t, grant_handle_t handle)
 {
-    struct domain *currd = current->domain;
-    struct vcpu *v;
-    unsigned int prev_tail, cur_tail;
-
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
-
-    spin_lock(&v->maptrack_freelist_lock);
+    struct vcpu *curr = current;
+    unsigned int head, prev_head;
 
-    cur_tail = read_atomic(&v->maptrack_tail);
+    /* Add entry to the head of the list of the current VCPU. */
+    head = read_atomic(&curr->maptrack_head);
     do {
-        prev_tail = cur_tail;
-        cur_tail = cmpxchg(&v->maptrack_tail, prev_tail, handle);
-    } while ( cur_tail != prev_tail );
-
-    /* 3. Update the old tail entry to point to the new entry. */
-    write_atomic(&maptrack_entry(t, prev_tail).ref, handle);
+        write_atomic(&maptrack_entry(t, handle).ref, head);
+        prev_head = head;
+        head = cmpxchg(&curr->maptrack_head, prev_head, handle);
+    } while ( head != prev_head );
 
-    spin_unlock(&v->maptrack_freelist_lock);
+    if ( unlikely(++curr->maptrack_nr >= 2 * MAPTRACK_BATCH) )
+        flush_maptrack_handles(t, curr);
 }
 
 static inline grant_handle_t
@@ -547,10 +628,12 @@ get_maptrack_handle(
     struct grant_table *lgt)
 {
     struct vcpu          *curr = current;
-    unsigned int          i, head;
+    unsigned int          i, nr;
     grant_handle_t        handle;
     struct grant_mapping *new_mt = NULL;
 
+    BUILD_BUG_ON(MAPTRACK_PER_PAGE % MAPTRACK_BATCH);
+
     handle = _get_maptrack_handle(lgt, curr);
     if ( likely(handle != INVALID_MAPTRACK_HANDLE) )
         return handle;
@@ -558,9 +641,28 @@ get_maptrack_handle(
     spin_lock(&lgt->maptrack_lock);
 
     /*
-     * If we've run out of handles and still have frame headroom, try
+     * Our list is empty: refill it with a batch from the pool.  Use the
+     * first entry right away, as our list may be stolen any time.
+     */
+    handle = lgt->maptrack_pool;
+    if ( handle != MAPTRACK_TAIL )
+    {
+        lgt->maptrack_pool = maptrack_entry(lgt, handle).next_batch;
+        lgt->maptrack_refills++;
+        spin_unlock(&lgt->maptrack_lock);
+
+        perfc_incr(maptrack_refill);
+
+        write_atomic(&curr->maptrack_head, maptrack_entry(lgt, handle).ref);
+        curr->maptrack_nr = MAPTRACK_BATCH - 1;
+
+        return handle;
+    }
+
+    /*
+     * If the pool is empty too and we still have frame headroom, try
      * allocating a new maptrack frame.  If there is no headroom, or we're
-     * out of memory, try stealing an entry from another VCPU (in case the
+     * out of memory, try stealing entries from another VCPU (in case the
      * guest isn't mapping across its VCPUs evenly).
      */
     if ( nr_maptrack_frames(lgt) < lgt->max_maptrack_frames )
@@ -568,59 +670,46 @@ get_maptrack_handle(
 
     if ( !new_mt )
     {
+        handle = steal_maptrack_handle(lgt, curr);
         spin_unlock(&lgt->maptrack_lock);
-
-        /*
-         * Uninitialized free list? Steal an extra entry for the tail
-         * sentinel.
-         */
-        if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        {
-            handle = steal_maptrack_handle(lgt, curr);
-            if ( handle == INVALID_MAPTRACK_HANDLE )
-                return handle;
-            spin_lock(&curr->maptrack_freelist_lock);
-            maptrack_entry(lgt, handle).ref = MAPTRACK_TAIL;
-            curr->maptrack_tail = handle;
-            if ( curr->maptrack_head == MAPTRACK_TAIL )
-                write_atomic(&curr->maptrack_head, handle);
-            spin_unlock(&curr->maptrack_freelist_lock);
-        }
-        return steal_maptrack_handle(lgt, curr);
+        return handle;
     }
 
     clear_page(new_mt);
 
     /*
-     * Use the first new entry and add the remaining entries to the
-     * head of the free list.
+     * Use the first new entry, keep as many of the following ones as don't
+     * make up full batches, and add the rest to the pool.
      */
     handle = lgt->maptrack_limit;
+    nr = MAPTRACK_BATCH - 1;
 
-    for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
+    for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
     {
         BUILD_BUG_ON(sizeof(new_mt->ref) < sizeof(handle));
         new_mt[i].ref = handle + i + 1;
-        new_mt[i].vcpu = curr->vcpu_id;
+        if ( i == nr || !((i - nr) % MAPTRACK_BATCH) )
+        {
+            new_mt[i].ref = MAPTRACK_TAIL;
+            if ( i > nr )
+            {
+                new_mt[i - MAPTRACK_BATCH + 1].next_batch = lgt->maptrack_pool;
+                lgt->maptrack_pool = handle + i - MAPTRACK_BATCH + 1;
+            }
+        }
     }
 
-    /* Set tail directly if this is the first page for this VCPU. */
-    if ( curr->maptrack_tail == MAPTRACK_TAIL )
-        curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
-
     lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     smp_wmb();
     lgt->maptrack_limit += MAPTRACK_PER_PAGE;
 
     spin_unlock(&lgt->maptrack_lock);
-    spin_lock(&curr->maptrack_freelist_lock);
 
-    do {
-        new_mt[i - 1].ref = read_atomic(&curr->maptrack_head);
-        head = cmpxchg(&curr->maptrack_head, new_mt[i - 1].ref, handle + 1);
-    } while ( head != new_mt[i - 1].ref );
+    perfc_incr(maptrack_grow);
 
-    spin_unlock(&curr->maptrack_freelist_lock);
+    /* Our list is empty, and nobody but ourselves can change that. */
+    write_atomic(&curr->maptrack_head, handle + 1);
+    curr->maptrack_nr = nr;
 
     return handle;
 }
@@ -856,12 +945,18 @@ static struct active_grant_entry *grant_map_exists(const struct domain *ld,
 
 #define MAPKIND_READ 1
 #define MAPKIND_WRITE 2
-static unsigned int mapkind(
-    struct grant_table *lgt, const struct domain *rd, mfn_t mfn)
+
+/*
+ * Work out how each of the nr frames in mfn[] is mapped by ld's maptrack
+ * entries for grants of rd, with a single walk of the maptrack.
+ */
+static void mapkinds(
+    struct grant_table *lgt, const struct domain *rd, const mfn_t *mfn,
+    unsigned int *kind, unsigned int nr)
 {
     struct grant_mapping *map;
     grant_handle_t handle, limit = lgt->maptrack_limit;
-    unsigned int kind = 0;
+    unsigned int i, nr_write = 0;
 
     /*
      * Must have the local domain's grant table write lock when
@@ -874,25 +969,89 @@ static unsigned int mapkind(
      */
     ASSERT(percpu_rw_is_write_locked(&rd->grant_table->lock));
 
+    for ( i = 0; i < nr; i++ )
+        kind[i] = 0;
+
     smp_rmb();
 
-    for ( handle = 0; !(kind & MAPKIND_WRITE) && handle < limit; handle++ )
+    for ( handle = 0; nr_write < nr && handle < limit; handle++ )
     {
+        mfn_t map_mfn;
+
         map = &maptrack_entry(lgt, handle);
         if ( !(map->flags & (GNTMAP_device_map|GNTMAP_host_map)) ||
              map->domid != rd->domain_id )
             continue;
-        if ( mfn_eq(_active_entry(rd->grant_table, map->ref).mfn, mfn) )
-            kind |= map->flags & GNTMAP_readonly ?
-                    MAPKIND_READ : MAPKIND_WRITE;
+
+        map_mfn = _active_entry(rd->grant_table, map->ref).mfn;
+        for ( i = 0; i < nr; i++ )
+        {
+            if ( (kind[i] & MAPKIND_WRITE) || !mfn_eq(map_mfn, mfn[i]) )
+                continue;
+            kind[i] |= map->flags & GNTMAP_readonly ?
+                       MAPKIND_READ : MAPKIND_WRITE;
+            if ( kind[i] & MAPKIND_WRITE )
+                nr_write++;
+        }
     }
+}
+
+static unsigned int mapkind(
+    struct grant_table *lgt, const struct domain *rd, mfn_t mfn)
+{
+    unsigned int kind;
+
+    mapkinds(lgt, rd, &mfn, &kind, 1);
 
     return kind;
 }
 
+/*
+ * IOMMU updates done by a batch of map or unmap ops only get their IOTLB
+ * flushed once, at the end of the batch.
+ */
+struct gnttab_iotlb_flush {
+    unsigned int flags;
+    unsigned int count;     /* Number of frames updated. */
+    dfn_t dfn;              /* The frame, if there was just one. */
+};
+
+static void gnttab_iotlb_flush_init(struct gnttab_iotlb_flush *flush)
+{
+    flush->flags = 0;
+    flush->count = 0;
+    flush->dfn = INVALID_DFN;
+}
+
+static void gnttab_iotlb_flush_add(struct gnttab_iotlb_flush *flush, dfn_t dfn)
+{
+    if ( !flush->count++ )
+        flush->dfn = dfn;
+}
+
+static int gnttab_iotlb_flush(struct domain *d,
+                              struct gnttab_iotlb_flush *flush)
+{
+    int rc;
+
+    if ( !flush->count )
+        return 0;
+
+    this_grant_stats()->iommu_ops += flush->count;
+
+    if ( flush->count == 1 )
+        rc = iommu_iotlb_flush(d, flush->dfn, 1, flush->flags);
+    else
+        rc = iommu_iotlb_flush_all(d, flush->flags);
+
+    gnttab_iotlb_flush_init(flush);
+
+    return rc;
+}
+
 static void
 map_grant_ref(
-    struct gnttab_map_grant_ref *op)
+    struct gnttab_map_grant_ref *op, struct gnttab_iotlb_flush *flush)
 {
     struct domain *ld, *rd, *owner = NULL;
     struct grant_table *lgt, *rgt;
@@ -1127,21 +1286,33 @@ map_grant_ref(
 
         double_gt_lock(lgt, rgt);
 
-        /* We're not translated, so we know that gmfns and mfns are
-           the same things, so the IOMMU entry is always 1-to-1. */
-        kind = mapkind(lgt, rd, mfn);
+        /*
+         * We're not translated, so we know that gmfns and mfns are
+         * the same things, so the IOMMU entry is always 1-to-1.  The
+         * (expensive) maptrack walk is only needed if the pin count
+         * says the IOMMU mapping may have to change.
+         */
         if ( (act_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) &&
              !(old_pin & (GNTPIN_hstw_mask|GNTPIN_devw_mask)) )
         {
+            kind = mapkind(lgt, rd, mfn);
             if ( !(kind & MAPKIND_WRITE) )
-                err = iommu_legacy_map(ld, _dfn(mfn_x(mfn)), mfn, 0,
-                                       IOMMUF_readable | IOMMUF_writable);
+            {
+                err = iommu_map(ld, _dfn(mfn_x(mfn)), mfn, 0,
+                                IOMMUF_readable | IOMMUF_writable,
+                                &flush->flags);
+                gnttab_iotlb_flush_add(flush, _dfn(mfn_x(mfn)));
+            }
         }
         else if ( act_pin && !old_pin )
         {
+            kind = mapkind(lgt, rd, mfn);
             if ( !kind )
-                err = iommu_legacy_map(ld, _dfn(mfn_x(mfn)), mfn, 0,
-                                       IOMMUF_readable);
+            {
+                err = iommu_map(ld, _dfn(mfn_x(mfn)), mfn, 0,
+                                IOMMUF_readable, &flush->flags);
+                gnttab_iotlb_flush_add(flush, _dfn(mfn_x(mfn)));
+            }
         }
         if ( err )
         {
@@ -1173,6 +1344,7 @@ map_grant_ref(
     op->dev_bus_addr = mfn_to_maddr(mfn);
     op->handle       = handle;
     op->status       = GNTST_okay;
+    this_grant_stats()->maps++;
 
     rcu_unlock_domain(rd);
     return;
@@ -1224,23 +1396,42 @@ gnttab_map_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_map_grant_ref_t) uop, unsigned int count)
 {
     int i;
+    long rc = 0;
     struct gnttab_map_grant_ref op;
+    struct gnttab_iotlb_flush flush;
+
+    gnttab_iotlb_flush_init(&flush);
 
     for ( i = 0; i < count; i++ )
     {
         if ( i && hypercall_preempt_check() )
-            return i;
+        {
+            rc = i;
+            break;
+        }
 
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
 
-        map_grant_ref(&op);
+        map_grant_ref(&op, &flush);
 
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    /*
+     * A failure gets reported (and, for other than the hardware domain,
+     * the domain crashed) by iommu_iotlb_flush().
+     */
+    gnttab_iotlb_flush(current->domain, &flush);
+
+    return rc;
 }
 
 static void
@@ -1380,30 +1571,13 @@ unmap_common(
     if ( put_handle )
         put_maptrack_handle(lgt, op->handle);
 
-    if ( rc == GNTST_okay && gnttab_need_iommu_mapping(ld) )
-    {
-        unsigned int kind;
-        int err = 0;
-
-        double_gt_lock(lgt, rgt);
-
-        kind = mapkind(lgt, rd, op->mfn);
-        if ( !kind )
-            err = iommu_legacy_unmap(ld, _dfn(mfn_x(op->mfn)), 0);
-        else if ( !(kind & MAPKIND_WRITE) )
-            err = iommu_legacy_map(ld, _dfn(mfn_x(op->mfn)), op->mfn, 0,
-                                   IOMMUF_readable);
-
-        double_gt_unlock(lgt, rgt);
-
-        if ( err )
-            rc = GNTST_general_error;
-    }
-
-    /* If just unmapped a writable mapping, mark as dirtied */
-    if ( rc == GNTST_okay && !(flags & GNTMAP_readonly) )
-         gnttab_mark_dirty(rd, op->mfn);
+    /*
+     * IOMMU mappings are updated, and a writable mapping marked dirty, for
+     * the whole batch by unmap_batch().
+     */
 
+    if ( rc == GNTST_okay )
+        this_grant_stats()->unmaps++;
     op->status = rc;
     rcu_unlock_domain(rd);
 }
@@ -1429,6 +1603,10 @@ unmap_common_complete(struct gnttab_unmap_common *op)
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
 
+    /* If just unmapped a writable mapping, mark as dirtied */
+    if ( op->status == GNTST_okay && !(op->done & GNTMAP_readonly) )
+        gnttab_mark_dirty(rd, op->mfn);
+
     grant_read_lock(rgt);
 
     act = active_entry_acquire(rgt, op->ref);
@@ -1488,6 +1666,118 @@ unmap_common_complete(struct gnttab_unmap_common *op)
     rcu_unlock_domain(rd);
 }
 
+/*
+ * Bring the IOMMU mappings of the frames unmapped by a batch of ops in line
+ * with whatever is left mapped.  Each remote domain's grant table lock is
+ * taken, and the maptrack walked, once for all of its ops in the batch.
+ */
+static void
+unmap_batch_iommu(struct gnttab_unmap_common *common, unsigned int nr)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *lgt = ld->grant_table;
+    struct gnttab_iotlb_flush flush;
+    mfn_t mfn[GNTTAB_UNMAP_BATCH_SIZE];
+    unsigned int kind[GNTTAB_UNMAP_BATCH_SIZE];
+    unsigned int idx[GNTTAB_UNMAP_BATCH_SIZE];
+    bool todo[GNTTAB_UNMAP_BATCH_SIZE], updated = false;
+    unsigned int i, j, n;
+
+    ASSERT(nr <= GNTTAB_UNMAP_BATCH_SIZE);
+
+    /* Nothing changes for an op which failed or didn't drop a mapping. */
+    for ( i = 0; i < nr; i++ )
+        todo[i] = common[i].status == GNTST_okay && common[i].done;
+
+    gnttab_iotlb_flush_init(&flush);
+
+    for ( i = 0; i < nr; i++ )
+    {
+        struct domain *rd = common[i].rd;
+
+        if ( !todo[i] )
+            continue;
+
+        for ( n = 0, j = i; j < nr; j++ )
+        {
+            if ( !todo[j] || common[j].rd != rd )
+                continue;
+            todo[j] = false;
+            idx[n] = j;
+            mfn[n++] = common[j].mfn;
+        }
+
+        rcu_lock_domain(rd);
+        double_gt_lock(lgt, rd->grant_table);
+
+        mapkinds(lgt, rd, mfn, kind, n);
+
+        for ( j = 0; j < n; j++ )
+        {
+            dfn_t dfn = _dfn(mfn_x(mfn[j]));
+            unsigned int k;
+            int err = 0;
+
+            /* Several ops of the batch may have unmapped the same frame. */
+            for ( k = 0; k < j && !mfn_eq(mfn[k], mfn[j]); k++ )
+                ;
+            if ( k < j )
+            {
+                common[idx[j]].status = common[idx[k]].status;
+                continue;
+            }
+
+            if ( !kind[j] )
+                err = iommu_unmap(ld, dfn, 0, &flush.flags);
+            else if ( !(kind[j] & MAPKIND_WRITE) )
+                err = iommu_map(ld, dfn, mfn[j], 0, IOMMUF_readable,
+                                &flush.flags);
+            else
+                continue;
+
+            gnttab_iotlb_flush_add(&flush, dfn);
+            updated = true;
+
+            if ( err )
+                common[idx[j]].status = GNTST_general_error;
+        }
+
+        double_gt_unlock(lgt, rd->grant_table);
+        rcu_unlock_domain(rd);
+    }
+
+    if ( updated && gnttab_iotlb_flush(ld, &flush) )
+        for ( i = 0; i < nr; i++ )
+            if ( common[i].done )
+                common[i].status = GNTST_general_error;
+}
+
+/*
+ * Finish a batch of unmap_common() calls: update the IOMMU, flush stale
+ * TLB entries - if any host mapping was touched at all - and only then
+ * drop the references the mappings held.
+ */
+static void
+unmap_batch(struct gnttab_unmap_common *common, unsigned int nr)
+{
+    struct domain *ld = current->domain;
+    bool flush_tlb = false;
+    unsigned int i;
+
+    if ( gnttab_need_iommu_mapping(ld) )
+        unmap_batch_iommu(common, nr);
+
+    for ( i = 0; i < nr; i++ )
+        if ( (common[i].done & GNTMAP_host_map) || common[i].new_addr )
+            flush_tlb = true;
+
+    if ( flush_tlb )
+        gnttab_flush_tlb(ld);
+
+    for ( i = 0; i < nr; i++ )
+        unmap_common_complete(&common[i]);
+}
+
 static void
 unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
@@ -1523,19 +1813,22 @@ gnttab_unmap_grant_ref(
 
         for ( i = 0; i < c; i++ )
         {
-            if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+            if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
                 goto fault;
             unmap_grant_ref(&op, &common[i]);
             ++partial_done;
-            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-                goto fault;
-            guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        unmap_batch(common, partial_done);
 
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        /* The IOMMU update may still fail an op, so report status last. */
+        for ( i = 0; i < c; i++ )
+        {
+            op.status = common[i].status;
+            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+                return -EFAULT;
+            guest_handle_add_offset(uop, 1);
+        }
 
         count -= c;
         done += c;
@@ -1547,10 +1840,16 @@ gnttab_unmap_grant_ref(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    unmap_batch(common, partial_done);
 
     for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
+    {
+        op.status = common[i].status;
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            break;
+        guest_handle_add_offset(uop, 1);
+    }
+
     return -EFAULT;
 }
 
@@ -1588,19 +1887,22 @@ gnttab_unmap_and_replace(
 
         for ( i = 0; i < c; i++ )
         {
-            if ( unlikely(__copy_from_guest(&op, uop, 1)) )
+            if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
                 goto fault;
             unmap_and_replace(&op, &common[i]);
             ++partial_done;
-            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-                goto fault;
-            guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
+        unmap_batch(common, partial_done);
 
-        for ( i = 0; i < partial_done; i++ )
-            unmap_common_complete(&common[i]);
+        /* The IOMMU update may still fail an op, so report status last. */
+        for ( i = 0; i < c; i++ )
+        {
+            op.status = common[i].status;
+            if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+                return -EFAULT;
+            guest_handle_add_offset(uop, 1);
+        }
 
         count -= c;
         done += c;
@@ -1612,10 +1914,16 @@ gnttab_unmap_and_replace(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
+    unmap_batch(common, partial_done);
 
     for ( i = 0; i < partial_done; i++ )
-        unmap_common_complete(&common[i]);
+    {
+        op.status = common[i].status;
+        if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
+            break;
+        guest_handle_add_offset(uop, 1);
+    }
+
     return -EFAULT;
 }
 
@@ -1819,11 +2127,16 @@ int grant_table_init(struct domain *d, unsigned int max_grant_frames,
     gt->gt_version = 1;
     gt->max_grant_frames = max_grant_frames;
     gt->max_maptrack_frames = max_maptrack_frames;
+    gt->maptrack_pool = MAPTRACK_TAIL;
 
     /* Install the structure early to simplify the error path. */
     gt->domain = d;
     d->grant_table = gt;
 
+    gt->stats = xzalloc_array(struct grant_stats, d->max_vcpus);
+    if ( gt->stats == NULL )
+        goto out;
+
     /* Active grant table. */
     gt->active = xzalloc_array(struct active_grant_entry *,
                                max_nr_active_grant_frames(gt));
@@ -2281,6 +2594,7 @@ gnttab_transfer(
         rcu_unlock_domain(e);
 
         gop.status = GNTST_okay;
+        this_grant_stats()->transfers++;
 
     copyback:
         if ( unlikely(__copy_field_to_guest(uop, &gop, status)) )
@@ -2651,27 +2965,43 @@ struct gnttab_copy_buf {
     bool_t read_only;
     bool_t have_grant;
     bool_t have_type;
+    bool dirty;
+};
+
+/*
+ * Number of frames kept claimed (i.e. pinned and mapped) on either side of
+ * a batch of copies.  A guest typically copies several chunks to or from
+ * each of a handful of frames (e.g. the header and the fragments of a
+ * packet), not necessarily in order.
+ */
+#define GNTTAB_COPY_CACHE_SIZE 4
+
+struct gnttab_copy_cache {
+    struct domain *domain;
+    domid_t domid;
+    unsigned int next;      /* Entry to be replaced next. */
+    struct gnttab_copy_buf buf[GNTTAB_COPY_CACHE_SIZE];
 };
 
 static int gnttab_copy_lock_domain(domid_t domid, bool is_gref,
-                                   struct gnttab_copy_buf *buf)
+                                   struct gnttab_copy_cache *cache)
 {
     /* Only DOMID_SELF may reference via frame. */
     if ( domid != DOMID_SELF && !is_gref )
         return GNTST_permission_denied;
 
-    buf->domain = rcu_lock_domain_by_any_id(domid);
+    cache->domain = rcu_lock_domain_by_any_id(domid);
 
-    if ( !buf->domain )
+    if ( !cache->domain )
         return GNTST_bad_domain;
 
-    buf->ptr.domid = domid;
+    cache->domid = domid;
 
     return GNTST_okay;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_cache *src,
+                                       struct gnttab_copy_cache *dest)
 {
     if ( src->domain )
     {
@@ -2686,8 +3016,8 @@ static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
 }
 
 static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+                                    struct gnttab_copy_cache *src,
+                                    struct gnttab_copy_cache *dest)
 {
     int rc;
 
@@ -2715,6 +3045,12 @@ static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
 
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
 {
+    /* Mark the frame dirty once, after all copies to it are done. */
+    if ( buf->dirty )
+    {
+        gnttab_mark_dirty(buf->domain, buf->mfn);
+        buf->dirty = false;
+    }
     if ( buf->virt )
     {
         unmap_domain_page(buf->virt);
@@ -2737,6 +3073,14 @@ static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
     }
 }
 
+static void gnttab_copy_release_cache(struct gnttab_copy_cache *cache)
+{
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_CACHE_SIZE; i++ )
+        gnttab_copy_release_buf(&cache->buf[i]);
+}
+
 static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
                                  const struct gnttab_copy_ptr *ptr,
                                  struct gnttab_copy_buf *buf,
@@ -2801,13 +3145,45 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
+
+/*
+ * Find the frame referenced by ptr among the ones claimed already, or
+ * claim it in place of the one claimed the longest ago.
+ */
+static struct gnttab_copy_buf *gnttab_copy_get_buf(
+    const struct gnttab_copy *op, const struct gnttab_copy_ptr *ptr,
+    struct gnttab_copy_cache *cache, unsigned int gref_flag, int *rc)
+{
+    struct gnttab_copy_buf *buf;
+    unsigned int i;
+
+    for ( i = 0; i < GNTTAB_COPY_CACHE_SIZE; i++ )
+        if ( gnttab_copy_buf_valid(ptr, &cache->buf[i], op->flags & gref_flag) )
+            return &cache->buf[i];
+
+    buf = &cache->buf[cache->next];
+    if ( ++cache->next == GNTTAB_COPY_CACHE_SIZE )
+        cache->next = 0;
+
+    gnttab_copy_release_buf(buf);
+    buf->domain = cache->domain;
+    *rc = gnttab_copy_claim_buf(op, ptr, buf, gref_flag);
+    if ( *rc )
+    {
+        gnttab_copy_release_buf(buf);
+        return NULL;
+    }
+
+    return buf;
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
                            struct gnttab_copy_buf *dest,
                            const struct gnttab_copy_buf *src)
 {
+    struct grant_stats *stats = this_grant_stats();
     int rc;
 
     if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
@@ -2828,25 +3204,36 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
                  op->dest.offset, dest->ptr.offset,
                  op->len, dest->len);
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
-    gnttab_mark_dirty(dest->domain, dest->mfn);
+    /*
+     * Whole pages (both offsets are necessarily 0 then) don't need to go
+     * through the cache: the copy isn't likely to be looked at by us, and
+     * the destination not right away by its owner.
+     */
+    if ( op->len == PAGE_SIZE )
+        copy_page(dest->virt, src->virt);
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
+    dest->dirty = true;
+    stats->copies++;
+    stats->copy_bytes += op->len;
     rc = GNTST_okay;
  out:
     return rc;
 }
 
 static int gnttab_copy_one(const struct gnttab_copy *op,
-                           struct gnttab_copy_buf *dest,
-                           struct gnttab_copy_buf *src)
+                           struct gnttab_copy_cache *dest,
+                           struct gnttab_copy_cache *src)
 {
+    struct gnttab_copy_buf *sbuf, *dbuf;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( !src->domain || op->source.domid != src->domid ||
+         !dest->domain || op->dest.domid != dest->domid )
     {
-        gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
+        gnttab_copy_release_cache(src);
+        gnttab_copy_release_cache(dest);
         gnttab_copy_unlock_domains(src, dest);
 
         rc = gnttab_copy_lock_domains(op, src, dest);
@@ -2854,27 +3241,24 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
             goto out;
     }
 
-    /* Different source? */
-    if ( !gnttab_copy_buf_valid(&op->source, src,
-                                op->flags & GNTCOPY_source_gref) )
+    sbuf = gnttab_copy_get_buf(op, &op->source, src, GNTCOPY_source_gref,
+                               &rc);
+    if ( !sbuf )
+        goto out;
+
+    dbuf = gnttab_copy_get_buf(op, &op->dest, dest, GNTCOPY_dest_gref, &rc);
+    if ( !dbuf )
     {
-        gnttab_copy_release_buf(src);
-        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
-        if ( rc )
-            goto out;
+        gnttab_copy_release_buf(sbuf);
+        goto out;
     }
 
-    /* Different dest? */
-    if ( !gnttab_copy_buf_valid(&op->dest, dest,
-                                op->flags & GNTCOPY_dest_gref) )
+    rc = gnttab_copy_buf(op, dbuf, sbuf);
+    if ( rc != GNTST_okay )
     {
-        gnttab_copy_release_buf(dest);
-        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
-        if ( rc )
-            goto out;
+        gnttab_copy_release_buf(sbuf);
+        gnttab_copy_release_buf(dbuf);
     }
-
-    rc = gnttab_copy_buf(op, dest, src);
  out:
     return rc;
 }
@@ -2892,8 +3276,8 @@ static long gnttab_copy(
 {
     unsigned int i;
     struct gnttab_copy op;
-    struct gnttab_copy_buf src = {};
-    struct gnttab_copy_buf dest = {};
+    struct gnttab_copy_cache src = {};
+    struct gnttab_copy_cache dest = {};
     long rc = 0;
 
     for ( i = 0; i < count; i++ )
@@ -2916,11 +3300,6 @@ static long gnttab_copy(
             rc = count - i;
             break;
         }
-        if ( rc != GNTST_okay )
-        {
-            gnttab_copy_release_buf(&src);
-            gnttab_copy_release_buf(&dest);
-        }
 
         op.status = rc;
         rc = 0;
@@ -2932,8 +3311,8 @@ static long gnttab_copy(
         guest_handle_add_offset(uop, 1);
     }
 
-    gnttab_copy_release_buf(&src);
-    gnttab_copy_release_buf(&dest);
+    gnttab_copy_release_cache(&src);
+    gnttab_copy_release_cache(&dest);
     gnttab_copy_unlock_domains(&src, &dest);
 
     return rc;
@@ -3749,15 +4128,42 @@ grant_table_destroy(
         free_xenheap_page(t->status[i]);
     xfree(t->status);
 
+    xfree(t->stats);
     xfree(t);
     d->grant_table = NULL;
 }
 
 void grant_table_init_vcpu(struct vcpu *v)
 {
-    spin_lock_init(&v->maptrack_freelist_lock);
     v->maptrack_head = MAPTRACK_TAIL;
-    v->maptrack_tail = MAPTRACK_TAIL;
+    v->maptrack_nr = 0;
+}
+
+void gnttab_get_stats(struct domain *d, struct xen_sysctl_gnttab_stats *stats)
+{
+    struct grant_table *gt = d->grant_table;
+    unsigned int i;
+
+    stats->maps = stats->unmaps = 0;
+    stats->copies = stats->copy_bytes = 0;
+    stats->transfers = stats->iommu_ops = 0;
+
+    /* Good enough for statistics even while the VCPUs are running. */
+    for ( i = 0; i < d->max_vcpus; i++ )
+    {
+        const struct grant_stats *s = &gt->stats[i];
+
+        stats->maps += s->maps;
+        stats->unmaps += s->unmaps;
+        stats->copies += s->copies;
+        stats->copy_bytes += s->copy_bytes;
+        stats->transfers += s->transfers;
+        stats->iommu_ops += s->iommu_ops;
+    }
+
+    spin_lock(&gt->maptrack_lock);
+    stats->maptrack_steals = gt->maptrack_steals;
+    spin_unlock(&gt->maptrack_lock);
 }
 
 #ifdef CONFIG_HAS_MEM_SHARING
@@ -3944,10 +4350,13 @@ static void gnttab_usage_print(struct domain *rd)
     grant_read_lock(gt);
 
     printk("grant-table for remote d%d (v%u)\n"
-           "  %u frames (%u max), %u maptrack frames (%u max)\n",
+           "  %u frames (%u max), %u maptrack frames (%u max)\n"
+           "  maptrack: %u refills, %u steals, %u exhausted\n",
            rd->domain_id, gt->gt_version,
            nr_grant_frames(gt), gt->max_grant_frames,
-           nr_maptrack_frames(gt), gt->max_maptrack_frames);
+           nr_maptrack_frames(gt), gt->max_maptrack_frames,
+           gt->maptrack_refills, gt->maptrack_steals,
+           gt->maptrack_exhausted);
 
     for ( ref = 0; ref != nr_grant_entries(gt); ref++ )
     {
@@ -25,6 +25,7 @@
 #include <xen/trace.h>
 #include <xen/cpu.h>
 #include <xen/keyhandler.h>
+#include <xen/numa.h>
 
 /* Meant only for helping developers during debugging. */
 /* #define d2printk printk */
@@ -397,6 +398,25 @@ integer_param("credit2_balance_over", opt_overload_balance_tolerance);
 static unsigned int __read_mostly opt_cap_period = 10;    /* ms */
 integer_param("credit2_cap_period_ms", opt_cap_period);
 
+/*
+ * Topology aware load balancing.
+ *
+ * If enabled, when looking for a runqueue to balance with, the load
+ * difference is scaled down by the NUMA distance between the runqueues
+ * (as reported by the SLIT, with CSCHED2_LOCAL_DISTANCE meaning same node),
+ * so that a remote runqueue has to be more unbalanced for us to consider it.
+ *
+ * Also, when evaluating candidate vcpus, moving a cache-hot one (i.e., one
+ * which ran during the last opt_cache_hot_us microseconds) to a runqueue
+ * that does not share the LLC with its current one is accounted as costing
+ * half of its load, scaled by the NUMA distance too.
+ */
+static bool __read_mostly opt_balance_topology;
+boolean_param("credit2_balance_topology", opt_balance_topology);
+static unsigned int __read_mostly opt_cache_hot_us = 1000;
+integer_param("credit2_cache_hot_us", opt_cache_hot_us);
+#define CSCHED2_LOCAL_DISTANCE       10
+
 /*
  * Runqueue organization.
  *
@@ -948,7 +968,7 @@ _runq_assign(struct csched2_vcpu *svc, struct csched2_runqueue_data *rqd)
     update_max_weight(svc->rqd, svc->weight, 0);
 
     /* Expected new load based on adding this vcpu */
-    rqd->b_avgload += svc->avgload;
+    write_atomic(&rqd->b_avgload, rqd->b_avgload + svc->avgload);
 
     if ( unlikely(tb_init_done) )
     {
@@ -988,7 +1008,8 @@ _runq_deassign(struct csched2_vcpu *svc)
     update_max_weight(rqd, 0, svc->weight);
 
     /* Expected new load based on removing this vcpu */
-    rqd->b_avgload = max_t(s_time_t, rqd->b_avgload - svc->avgload, 0);
+    write_atomic(&rqd->b_avgload,
+                 max_t(s_time_t, rqd->b_avgload - svc->avgload, 0));
 
     svc->rqd = NULL;
 }
@@ -1143,7 +1164,7 @@ update_runq_load(const struct scheduler *ops,
     if ( rqd->load_last_update + (1ULL << W)  < now )
     {
         rqd->avgload = load << P;
-        rqd->b_avgload = load << P;
+        write_atomic(&rqd->b_avgload, load << P);
     }
     else
     {
@@ -1169,12 +1190,13 @@ update_runq_load(const struct scheduler *ops,
         rqd->avgload = rqd->avgload +
                        ((delta * (load << P)) >> W) -
                        ((delta * rqd->avgload) >> W);
-        rqd->b_avgload = rqd->b_avgload +
-                         ((delta * (load << P)) >> W) -
-                         ((delta * rqd->b_avgload) >> W);
+        write_atomic(&rqd->b_avgload,
+                     rqd->b_avgload +
+                     ((delta * (load << P)) >> W) -
+                     ((delta * rqd->b_avgload) >> W));
     }
-    rqd->load += change;
-    rqd->load_last_update = now;
+    write_atomic(&rqd->load, rqd->load + change);
+    write_atomic(&rqd->load_last_update, now);
 
     /* Overflow, capable of making the load look negative, must not occur. */
     ASSERT(rqd->avgload >= 0 && rqd->b_avgload >= 0);
@@ -1196,6 +1218,36 @@ update_runq_load(const struct scheduler *ops,
     }
 }
 
+/*
+ * Balancing load of a runqueue whose lock we don't hold, decayed up to now,
+ * as update_runq_load() would compute it.
+ *
+ * Fields are read one by one, while the runqueue may be updated, so this is
+ * only an estimate.  That is good enough for choosing where to put vcpus,
+ * and it means pcpus looking for a runqueue don't have to bounce all the
+ * (busy) runqueue locks around the host.
+ */
+static s_time_t
+runq_avgload(const struct csched2_private *prv,
+             const struct csched2_runqueue_data *rqd, s_time_t now)
+{
+    unsigned int W = prv->load_window_shift, P = prv->load_precision_shift;
+    s_time_t load = read_atomic(&rqd->load);
+    s_time_t avgload = read_atomic(&rqd->b_avgload);
+    s_time_t delta;
+
+    delta = (now >> LOADAVG_GRANULARITY_SHIFT) -
+            read_atomic(&rqd->load_last_update);
+
+    if ( delta > (1LL << W) )
+        return load << P;
+    if ( delta <= 0 )
+        return avgload;
+
+    return max_t(s_time_t, avgload + ((delta * (load << P)) >> W) -
+                           ((delta * avgload) >> W), 0);
+}
+
 static void
 update_svc_load(const struct scheduler *ops,
                 struct csched2_vcpu *svc, int change, s_time_t now)
@@ -1285,16 +1337,33 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
     ASSERT(!svc->vcpu->is_running);
     ASSERT(!(svc->flags & CSFLAG_scheduled));
 
-    list_for_each( iter, runq )
+    /*
+     * The runqueue is sorted by credit, and we go after all the vcpus with
+     * at least as much credit as we have.  Vcpus that just ran usually have
+     * little credit left, so scan from whichever end is closer, in terms
+     * of credit, to avoid walking the whole (long, under load) runqueue
+     * while holding its lock.
+     */
+    if ( list_empty(runq) ||
+         svc->credit - runq_elem(runq->prev)->credit <
+         runq_elem(runq->next)->credit - svc->credit )
     {
-        struct csched2_vcpu * iter_svc = runq_elem(iter);
-
-        if ( svc->credit > iter_svc->credit )
-            break;
+        for ( iter = runq->prev; iter != runq; iter = iter->prev )
+            if ( svc->credit <= runq_elem(iter)->credit )
+                break;
+        list_add(&svc->runq_elem, iter);
+    }
+    else
+    {
+        list_for_each( iter, runq )
+        {
+            struct csched2_vcpu * iter_svc = runq_elem(iter);
 
-        pos++;
+            if ( svc->credit > iter_svc->credit )
+                break;
+        }
+        list_add_tail(&svc->runq_elem, iter);
     }
-    list_add_tail(&svc->runq_elem, iter);
 
     if ( unlikely(tb_init_done) )
     {
@@ -1302,6 +1371,9 @@ runq_insert(const struct scheduler *ops, struct csched2_vcpu *svc)
             unsigned vcpu:16, dom:16;
             unsigned pos;
         } d;
+
+        for ( iter = runq->next; iter != &svc->runq_elem; iter = iter->next )
+            pos++;
         d.dom = svc->vcpu->domain->domain_id;
         d.vcpu = svc->vcpu->vcpu_id;
         d.pos = pos;
@@ -1327,6 +1399,75 @@ tickle_cpu(unsigned int cpu, struct csched2_runqueue_data *rqd)
     cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
 }
 
+/*
+ * Core scheduling (sched-gran=core|socket).
+ *
+ * The pcpus of a scheduling unit only run vcpus of one domain at a time.
+ * All of them which are in our cpupool are in the same runqueue, so what
+ * each of them has picked (curr_on_cpu()) can't change while we hold the
+ * runqueue lock, and a pcpu can always pick either a vcpu of the domain the
+ * rest of its unit is running, or idle.  cpupool.c keeps the others free.
+ *
+ * unit_vcpu() returns the vcpu with the highest credit among the ones the
+ * other pcpus of cpu's unit are running, or NULL if they all are idle.
+ */
+static struct csched2_vcpu *
+unit_vcpu(const struct csched2_runqueue_data *rqd, unsigned int cpu)
+{
+    struct csched2_vcpu *sunit = NULL;
+    unsigned int i;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu )
+        return NULL;
+
+    for_each_cpu ( i, sched_unit_mask(cpu) )
+    {
+        struct vcpu *v = curr_on_cpu(i);
+
+        if ( i == cpu || !cpumask_test_cpu(i, &rqd->active) ||
+             is_idle_vcpu(v) )
+            continue;
+
+        ASSERT(!sunit || sunit->vcpu->domain == v->domain);
+        if ( !sunit || csched2_vcpu(v)->credit > sunit->credit )
+            sunit = csched2_vcpu(v);
+    }
+
+    return sunit;
+}
+
+/* Clear the pcpus whose unit is running a domain other than d from mask. */
+static void
+unit_mask_domain(const struct csched2_runqueue_data *rqd, cpumask_t *mask,
+                 const struct domain *d)
+{
+    const struct csched2_vcpu *sunit;
+    unsigned int i;
+
+    if ( opt_sched_granularity == SCHED_GRAN_cpu )
+        return;
+
+    for_each_cpu ( i, mask )
+    {
+        sunit = unit_vcpu(rqd, i);
+        if ( sunit && sunit->vcpu->domain != d )
+            __cpumask_clear_cpu(i, mask);
+    }
+}
+
+/* Have the other idle (or busy) pcpus of cpu's unit reschedule. */
+static void
+unit_tickle(struct csched2_runqueue_data *rqd, unsigned int cpu, bool idle)
+{
+    unsigned int i;
+
+    for_each_cpu ( i, sched_unit_mask(cpu) )
+        if ( i != cpu && cpumask_test_cpu(i, &rqd->active) &&
+             is_idle_vcpu(curr_on_cpu(i)) == idle &&
+             !cpumask_test_cpu(i, &rqd->tickled) )
+            tickle_cpu(i, rqd);
+}
+
 /*
  * What we want to know is whether svc, which we assume to be running on some
  * pcpu, can be interrupted and preempted (which, so far, basically means
@@ -1518,6 +1659,7 @@ runq_tickle(const struct scheduler *ops, struct csched2_vcpu *new, s_time_t now)
         cpumask_andnot(&mask, &rqd->idle, &rqd->tickled);
         cpumask_and(cpumask_scratch_cpu(cpu), cpumask_scratch_cpu(cpu), online);
         cpumask_and(&mask, &mask, cpumask_scratch_cpu(cpu));
+        unit_mask_domain(rqd, &mask, new->vcpu->domain);
         i = cpumask_test_or_cycle(cpu, &mask);
         if ( i < nr_cpu_ids )
         {
@@ -2202,6 +2344,7 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
     unsigned int new_cpu, cpu = vc->processor;
     struct csched2_vcpu *svc = csched2_vcpu(vc);
     s_time_t min_avgload = MAX_LOAD, min_s_avgload = MAX_LOAD;
+    s_time_t now = NOW();
     bool has_soft;
 
     ASSERT(!cpumask_empty(&prv->active_queues));
@@ -2212,8 +2355,7 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
      * - Runqueue lock of vc->processor is already locked
      * - Need to grab prv lock to make sure active runqueues don't
      *   change
-     * - Need to grab locks for other runqueues while checking
-     *   avgload
+     * - The avgload of other runqueues is read without their locks
      * Locking constraint is:
      * - Lock prv before runqueue locks
      * - Trylock between runqueue locks (no ordering)
@@ -2301,22 +2443,18 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
             continue;
 
         /*
-         * If checking a different runqueue, grab the lock, read the avg,
-         * and then release the lock.
+         * If checking a different runqueue, estimate its load without
+         * taking its lock (see runq_avgload()).
          *
-         * If on our own runqueue, don't grab or release the lock;
-         * but subtract our own load from the runqueue load to simulate
-         * impartiality.
+         * If on our own runqueue, subtract our own load from the runqueue
+         * load to simulate impartiality.
          */
         if ( rqd == svc->rqd )
         {
             rqd_avgload = max_t(s_time_t, rqd->b_avgload - svc->avgload, 0);
         }
-        else if ( spin_trylock(&rqd->lock) )
-        {
-            rqd_avgload = rqd->b_avgload;
-            spin_unlock(&rqd->lock);
-        }
+        else
+            rqd_avgload = runq_avgload(prv, rqd, now);
 
         /*
          * if svc has a soft-affinity, and some cpus of rqd are part of it,
@@ -2381,8 +2519,8 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
     else
     {
         /*
-         * We didn't find anyone at all (most likely because of spinlock
-         * contention).
+         * We didn't find anyone at all (e.g., because of a concurrent
+         * affinity change).
          */
         new_cpu = get_fallback_cpu(svc);
         min_rqi = c2r(new_cpu);
@@ -2426,8 +2564,60 @@ typedef struct {
     /* NB: Read by consider() */
     struct csched2_runqueue_data *lrqd;
     struct csched2_runqueue_data *orqd;                  
+    unsigned int distance;     /* 0 if the two runqueues share the LLC */
+    s_time_t now;
 } balance_state_t;
 
+/*
+ * Distance between two runqueues, for topology aware balancing: the NUMA
+ * distance of their nodes, or 0 if they (are likely to) share the LLC.
+ * Runqueues are checked through their first cpu, which is good enough
+ * as long as they do not span several sockets.
+ */
+static unsigned int rqd_distance(const struct csched2_runqueue_data *a,
+                                 const struct csched2_runqueue_data *b)
+{
+    unsigned int ca = cpumask_first(&a->active);
+    unsigned int cb = cpumask_first(&b->active);
+    nodeid_t na, nb;
+    unsigned int d;
+
+    if ( ca >= nr_cpu_ids || cb >= nr_cpu_ids )
+        return CSCHED2_LOCAL_DISTANCE;
+
+    /* We have no LLC information, so use sockets as a proxy. */
+    if ( cpu_to_socket(ca) == cpu_to_socket(cb) )
+        return 0;
+
+    na = cpu_to_node(ca);
+    nb = cpu_to_node(cb);
+    if ( na == nb || na == NUMA_NO_NODE || nb == NUMA_NO_NODE )
+        return CSCHED2_LOCAL_DISTANCE;
+
+    d = __node_distance(na, nb);
+    if ( d < CSCHED2_LOCAL_DISTANCE || d == NUMA_NO_DISTANCE )
+        d = 2 * CSCHED2_LOCAL_DISTANCE;
+
+    return d;
+}
+
+/*
+ * What moving svc away from its runqueue costs, expressed as load (and
+ * hence comparable with load deltas). Only cache-hot vcpus are charged.
+ */
+static s_time_t migrate_cost(const balance_state_t *st,
+                             const struct csched2_vcpu *svc)
+{
+    if ( !opt_balance_topology || !st->distance )
+        return 0;
+
+    if ( !(svc->flags & CSFLAG_scheduled) &&
+         st->now - svc->vcpu->last_run_time >= MICROSECS(opt_cache_hot_us) )
+        return 0;
+
+    return (svc->avgload >> 1) * st->distance / CSCHED2_LOCAL_DISTANCE;
+}
+
 static void consider(balance_state_t *st, 
                      struct csched2_vcpu *push_svc,
                      struct csched2_vcpu *pull_svc)
@@ -2453,6 +2643,11 @@ static void consider(balance_state_t *st,
     if ( delta < 0 )
         delta = -delta;
 
+    if ( push_svc )
+        delta += migrate_cost(st, push_svc);
+    if ( pull_svc )
+        delta += migrate_cost(st, pull_svc);
+
     if ( delta < st->load_delta )
     {
         st->load_delta = delta;
@@ -2549,10 +2744,12 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
 {
     struct csched2_private *prv = csched2_priv(ops);
     int i, max_delta_rqi;
+    s_time_t o_load = 0, max_delta;
     struct list_head *push_iter, *pull_iter;
     bool inner_load_updated = 0;
 
-    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
+    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL,
+                           .now = now };
 
     /*
      * Basic algorithm: Push, pull, or swap.
@@ -2571,31 +2768,45 @@ retry:
     if ( !read_trylock(&prv->lock) )
         return;
 
-    st.load_delta = 0;
+    st.load_delta = max_delta = 0;
 
+    /*
+     * Find the runqueue with the largest load difference (weighted by
+     * distance, if balancing is topology aware).  We don't take the other
+     * runqueues' locks for that, but just estimate their load (see
+     * runq_avgload()), and only lock the one we pick.
+     */
     for_each_cpu(i, &prv->active_queues)
     {
-        s_time_t delta;
-        
+        s_time_t load, delta, wdelta;
+        unsigned int distance = CSCHED2_LOCAL_DISTANCE;
+
         st.orqd = prv->rqd + i;
 
-        if ( st.orqd == st.lrqd
-             || !spin_trylock(&st.orqd->lock) )
+        if ( st.orqd == st.lrqd )
             continue;
 
-        update_runq_load(ops, st.orqd, 0, now);
-    
-        delta = st.lrqd->b_avgload - st.orqd->b_avgload;
+        load = runq_avgload(prv, st.orqd, now);
+        delta = st.lrqd->b_avgload - load;
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        wdelta = delta;
+        if ( opt_balance_topology )
+        {
+            distance = rqd_distance(st.lrqd, st.orqd);
+            if ( distance > CSCHED2_LOCAL_DISTANCE )
+                wdelta = delta * CSCHED2_LOCAL_DISTANCE / distance;
+        }
+
+        if ( wdelta > max_delta )
         {
+            max_delta = wdelta;
             st.load_delta = delta;
+            st.distance = distance;
             max_delta_rqi = i;
+            o_load = load;
         }
-
-        spin_unlock(&st.orqd->lock);
     }
 
     /* Minimize holding the private scheduler lock. */
@@ -2603,14 +2814,15 @@ retry:
     if ( max_delta_rqi == -1 )
         goto out;
 
+    st.orqd = prv->rqd + max_delta_rqi;
+
     {
         s_time_t load_max;
         int cpus_max;
 
-        
         load_max = st.lrqd->b_avgload;
-        if ( st.orqd->b_avgload > load_max )
-            load_max = st.orqd->b_avgload;
+        if ( o_load > load_max )
+            load_max = o_load;
 
         cpus_max = cpumask_weight(&st.lrqd->active);
         i = cpumask_weight(&st.orqd->active);
@@ -2637,13 +2849,13 @@ retry:
          */
         if ( load_max < ((s_time_t)cpus_max << prv->load_precision_shift) )
         {
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_underload_balance_tolerance)) )
+            if ( max_delta < (1ULL << (prv->load_precision_shift +
+                                       opt_underload_balance_tolerance)) )
                  goto out;
         }
         else
-            if ( st.load_delta < (1ULL << (prv->load_precision_shift +
-                                           opt_overload_balance_tolerance)) )
+            if ( max_delta < (1ULL << (prv->load_precision_shift +
+                                       opt_overload_balance_tolerance)) )
                 goto out;
     }
              
@@ -2651,7 +2863,6 @@ retry:
      * meantime, try the process over again.  This can't deadlock
      * because if it doesn't get any other rqd locks, it will simply
      * give up and return. */
-    st.orqd = prv->rqd + max_delta_rqi;
     if ( !spin_trylock(&st.orqd->lock) )
         goto retry;
 
@@ -2659,6 +2870,9 @@ retry:
     if ( unlikely(st.orqd->id < 0) )
         goto out_up;
 
+    /* Now that we hold the lock, make its load exact. */
+    update_runq_load(ops, st.orqd, 0, now);
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -3256,12 +3470,14 @@ csched2_runtime(const struct scheduler *ops, int cpu,
 static struct csched2_vcpu *
 runq_candidate(struct csched2_runqueue_data *rqd,
                struct csched2_vcpu *scurr,
+               const struct csched2_vcpu *sunit,
                int cpu, s_time_t now,
                unsigned int *skipped)
 {
     struct list_head *iter, *temp;
-    struct csched2_vcpu *snext = NULL;
+    struct csched2_vcpu *snext = NULL, *sother = NULL;
     struct csched2_private *prv = csched2_priv(per_cpu(scheduler, cpu));
+    const struct domain *udom = sunit ? sunit->vcpu->domain : NULL;
     bool yield = false, soft_aff_preempt = false;
 
     *skipped = 0;
@@ -3284,6 +3500,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
      * no point forcing it to do so until rate limiting expires.
      */
     if ( !yield && prv->ratelimit_us && vcpu_runnable(scurr->vcpu) &&
+         (!udom || scurr->vcpu->domain == udom) &&
          (now - scurr->vcpu->runstate.state_entry_time) <
           MICROSECS(prv->ratelimit_us) )
     {
@@ -3336,9 +3553,11 @@ runq_candidate(struct csched2_runqueue_data *rqd,
      * continue to run here (in fact, soft_aff_preempt will still be false,
      * in this case).
      *
-     * Of course, we also default to idle also if scurr is not runnable.
+     * Of course, we also default to idle also if scurr is not runnable, or
+     * if the rest of our scheduling unit is running another domain.
      */
-    if ( vcpu_runnable(scurr->vcpu) && !soft_aff_preempt )
+    if ( vcpu_runnable(scurr->vcpu) && !soft_aff_preempt &&
+         (!udom || scurr->vcpu->domain == udom) )
         snext = scurr;
     else
         snext = csched2_vcpu(idle_vcpu[cpu]);
@@ -3367,6 +3586,18 @@ runq_candidate(struct csched2_runqueue_data *rqd,
             continue;
         }
 
+        /*
+         * Nor vcpus of a domain other than the one our scheduling unit is
+         * running, but remember the best of them.
+         */
+        if ( udom && svc->vcpu->domain != udom )
+        {
+            if ( !sother )
+                sother = svc;
+            (*skipped)++;
+            continue;
+        }
+
         /*
          * If a vcpu is meant to be picked up by another processor, and such
          * processor has not scheduled yet, leave it in the runqueue for him.
@@ -3405,6 +3636,20 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         break;
     }
 
+    /*
+     * If a vcpu of another domain deserves to run more than anything our
+     * unit has, idle and make the other pcpus of the unit reschedule too,
+     * so that the whole unit can switch over to it.
+     */
+    if ( unlikely(sother) &&
+         sother->credit > max(snext->credit, sunit->credit) +
+                          CSCHED2_MIGRATE_RESIST )
+    {
+        snext = csched2_vcpu(idle_vcpu[cpu]);
+        unit_tickle(rqd, cpu, false);
+        SCHED_STAT_CRANK(unit_switch);
+    }
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -3446,7 +3691,7 @@ csched2_schedule(
     const int cpu = smp_processor_id();
     struct csched2_runqueue_data *rqd;
     struct csched2_vcpu * const scurr = csched2_vcpu(current);
-    struct csched2_vcpu *snext = NULL;
+    struct csched2_vcpu *snext = NULL, *sunit;
     unsigned int skipped_vcpus = 0;
     struct task_slice ret;
     bool tickled;
@@ -3525,7 +3770,19 @@ csched2_schedule(
         snext = csched2_vcpu(idle_vcpu[cpu]);
     }
     else
-        snext = runq_candidate(rqd, scurr, cpu, now, &skipped_vcpus);
+    {
+        sunit = unit_vcpu(rqd, cpu);
+        snext = runq_candidate(rqd, scurr, sunit, cpu, now, &skipped_vcpus);
+
+        /*
+         * If our unit was idle, the other pcpus may be able to run further
+         * vcpus of snext's domain now.
+         */
+        if ( !sunit && !is_idle_vcpu(snext->vcpu) &&
+             opt_sched_granularity != SCHED_GRAN_cpu &&
+             !list_empty(&rqd->runq) )
+            unit_tickle(rqd, cpu, true);
+    }
 
     /* If switching from a non-idle runnable vcpu, put it
      * back on the runqueue. */
@@ -3999,18 +4256,28 @@ csched2_init(struct scheduler *ops)
 
     printk("Initializing Credit2 scheduler\n");
 
+    /* The pcpus of a scheduling unit must share a runqueue (and its lock). */
+    if ( opt_sched_granularity == SCHED_GRAN_core &&
+         opt_runqueue < OPT_RUNQUEUE_CORE )
+        opt_runqueue = OPT_RUNQUEUE_CORE;
+    else if ( opt_sched_granularity == SCHED_GRAN_socket &&
+              opt_runqueue < OPT_RUNQUEUE_SOCKET )
+        opt_runqueue = OPT_RUNQUEUE_SOCKET;
+
     printk(XENLOG_INFO " load_precision_shift: %d\n"
            XENLOG_INFO " load_window_shift: %d\n"
            XENLOG_INFO " underload_balance_tolerance: %d\n"
            XENLOG_INFO " overload_balance_tolerance: %d\n"
            XENLOG_INFO " runqueues arrangement: %s\n"
-           XENLOG_INFO " cap enforcement granularity: %dms\n",
+           XENLOG_INFO " cap enforcement granularity: %dms\n"
+           XENLOG_INFO " topology aware balancing: %s (cache hot: %uus)\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
            opt_runqueue_str[opt_runqueue],
-           opt_cap_period);
+           opt_cap_period,
+           opt_balance_topology ? "yes" : "no", opt_cache_hot_us);
 
     printk(XENLOG_INFO "load tracking window length %llu ns\n",
            1ULL << opt_load_window_shift);
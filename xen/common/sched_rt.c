@@ -43,7 +43,8 @@
  * Design:
  *
  * This scheduler follows the Preemptive Global Earliest Deadline First (EDF)
- * theory in real-time field.
+ * theory in real-time field, or the Clustered EDF one, if the pCPUs of a
+ * pool are split in clusters (see below).
  * At any scheduling point, the VCPU with earlier deadline has higher priority.
  * The scheduler always picks highest priority VCPU to run on a feasible PCPU.
  * A PCPU is feasible if the VCPU can run on this PCPU and (the PCPU is idle or
@@ -64,25 +65,43 @@
  * When a VCPU has no task but with budget left, its budget is preserved.
  *
  * Queue scheme:
- * A global runqueue and a global depletedqueue for each CPU pool.
+ * A runqueue, a depletedqueue and a replenishment queue for each cluster
+ * of PCPUs of a CPU pool.
  * The runqueue holds all runnable VCPUs with budget,
  * sorted by priority_level and deadline;
  * The depletedqueue holds all VCPUs without budget, unsorted;
+ * The replenishment queue holds the VCPUs waiting for their next period,
+ * and is served by a per-cluster timer.
+ *
+ * By default, there is only one cluster, with all the PCPUs of the pool in
+ * it (i.e., global EDF).  With the rtds_cluster boot parameter, clusters
+ * can be made of the PCPUs of a core, socket or NUMA node, or be single
+ * PCPUs.  A VCPU is queued in the cluster of its v->processor, and EDF is
+ * enforced within each cluster.  Clusters are, however, work conserving:
+ * - when none of the PCPUs of its cluster can run a waking up (or
+ *   replenished) VCPU, idle PCPUs of other clusters are poked (push);
+ * - a PCPU about to go idle looks at the other clusters for VCPUs waiting
+ *   in their runqueues that can run on it, and takes one (pull).
  *
  * Note: cpumask and cpupool is supported.
  */
 
 /*
  * Locking:
- * A global system lock is used to protect the RunQ and DepletedQ.
- * The global lock is referenced by schedule_data.schedule_lock
- * from all physical cpus.
+ * Each cluster has its own lock, which protects its RunQ, DepletedQ and
+ * replenishment queue, and is referenced by schedule_data.schedule_lock
+ * of all the physical cpus in the cluster.
  *
  * The lock is already grabbed when calling wake/sleep/schedule/ functions
  * in schedule.c
  *
  * The functions involes RunQ and needs to grab locks are:
  *    vcpu_insert, vcpu_remove, context_saved, runq_insert
+ *
+ * The private scheduler lock (a rwlock) protects the list of domains and
+ * the set of active clusters.  If both are needed, it must be taken
+ * before any cluster lock; pulling, which happens with a cluster lock held,
+ * hence only trylocks it (and the other clusters' locks).
  */
 
 
@@ -175,13 +194,47 @@
 static void repl_timer_handler(void *data);
 
 /*
- * System-wide private data, include global RunQueue/DepletedQ
- * Global lock is referenced by schedule_data.schedule_lock from all
- * physical cpus. It can be grabbed via vcpu_schedule_lock_irq()
+ * How PCPUs are grouped in clusters (see above).
  */
-struct rt_private {
-    spinlock_t lock;            /* the global coarse-grained lock */
-    struct list_head sdom;      /* list of availalbe domains, used for dump */
+#define OPT_CLUSTER_CPU    0
+#define OPT_CLUSTER_CORE   1
+#define OPT_CLUSTER_SOCKET 2
+#define OPT_CLUSTER_NODE   3
+#define OPT_CLUSTER_ALL    4
+static const char *const opt_cluster_str[] = {
+    [OPT_CLUSTER_CPU] = "cpu",
+    [OPT_CLUSTER_CORE] = "core",
+    [OPT_CLUSTER_SOCKET] = "socket",
+    [OPT_CLUSTER_NODE] = "node",
+    [OPT_CLUSTER_ALL] = "all"
+};
+static int __read_mostly opt_cluster = OPT_CLUSTER_ALL;
+
+static int __init parse_rtds_cluster(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_cluster_str); i++ )
+    {
+        if ( !strcmp(s, opt_cluster_str[i]) )
+        {
+            opt_cluster = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+custom_param("rtds_cluster", parse_rtds_cluster);
+
+/*
+ * Cluster of PCPUs, with its queues.
+ * The lock is referenced by schedule_data.schedule_lock of all the PCPUs
+ * of the cluster. It can be grabbed via vcpu_schedule_lock_irq()
+ */
+struct rt_runqueue {
+    spinlock_t lock;            /* lock of this cluster */
+    int id;                     /* index in rt_private, -1 if not in use */
 
     struct list_head runq;      /* ordered list of runnable vcpus */
     struct list_head depletedq; /* unordered list of depleted vcpus */
@@ -189,9 +242,28 @@ struct rt_private {
     struct timer repl_timer;    /* replenishment timer */
     struct list_head replq;     /* ordered list of vcpus that need replenishment */
 
+    cpumask_t active;           /* cpus in this cluster */
     cpumask_t tickled;          /* cpus been tickled */
 };
 
+/*
+ * System-wide private data, include the clusters
+ */
+struct rt_private {
+    rwlock_t lock;              /* private scheduler lock */
+    struct list_head sdom;      /* list of availalbe domains, used for dump */
+
+    cpumask_t active_queues;    /* clusters with (maybe) active cpus */
+    struct rt_runqueue *rqd;    /* data of the clusters */
+};
+
+/*
+ * Physical CPU
+ */
+struct rt_pcpu {
+    struct rt_runqueue *rqd;    /* cluster of this cpu */
+};
+
 /*
  * Virtual CPU
  */
@@ -238,19 +310,20 @@ static inline struct rt_vcpu *rt_vcpu(const struct vcpu *vcpu)
     return vcpu->sched_priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
+static inline struct rt_pcpu *rt_pcpu(unsigned int cpu)
 {
-    return &rt_priv(ops)->runq;
+    return per_cpu(schedule_data, cpu).sched_priv;
 }
 
-static inline struct list_head *rt_depletedq(const struct scheduler *ops)
+/* Cluster of a cpu (and hence of the vcpus with that cpu as v->processor) */
+static inline struct rt_runqueue *c2rqd(unsigned int cpu)
 {
-    return &rt_priv(ops)->depletedq;
+    return rt_pcpu(cpu)->rqd;
 }
 
-static inline struct list_head *rt_replq(const struct scheduler *ops)
+static inline struct rt_runqueue *svc_rqd(const struct rt_vcpu *svc)
 {
-    return &rt_priv(ops)->replq;
+    return c2rqd(svc->vcpu->processor);
 }
 
 static inline bool has_extratime(const struct rt_vcpu *svc)
@@ -351,58 +424,70 @@ rt_dump_vcpu(const struct scheduler *ops, const struct rt_vcpu *svc)
 static void
 rt_dump_pcpu(const struct scheduler *ops, int cpu)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *svc;
+    spinlock_t *lock;
     unsigned long flags;
 
-    spin_lock_irqsave(&prv->lock, flags);
-    printk("CPU[%02d]\n", cpu);
+    lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    printk("CPU[%02d] cluster=%d\n", cpu, c2rqd(cpu)->id);
     /* current VCPU (nothing to say if that's the idle vcpu). */
     svc = rt_vcpu(curr_on_cpu(cpu));
     if ( svc && !is_idle_vcpu(svc->vcpu) )
     {
         rt_dump_vcpu(ops, svc);
     }
-    spin_unlock_irqrestore(&prv->lock, flags);
+    pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
 }
 
 static void
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *runq, *depletedq, *replq, *iter;
+    struct list_head *iter;
     struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *svc;
     struct rt_dom *sdom;
     unsigned long flags;
+    unsigned int i;
+
+    read_lock_irqsave(&prv->lock, flags);
 
-    spin_lock_irqsave(&prv->lock, flags);
+    printk("Cluster arrangement: %s\n", opt_cluster_str[opt_cluster]);
 
     if ( list_empty(&prv->sdom) )
         goto out;
 
-    runq = rt_runq(ops);
-    depletedq = rt_depletedq(ops);
-    replq = rt_replq(ops);
-
-    printk("Global RunQueue info:\n");
-    list_for_each ( iter, runq )
+    for_each_cpu ( i, &prv->active_queues )
     {
-        svc = q_elem(iter);
-        rt_dump_vcpu(ops, svc);
-    }
+        struct rt_runqueue *rqd = prv->rqd + i;
 
-    printk("Global DepletedQueue info:\n");
-    list_for_each ( iter, depletedq )
-    {
-        svc = q_elem(iter);
-        rt_dump_vcpu(ops, svc);
-    }
+        /* We need the lock to scan the queues. */
+        spin_lock(&rqd->lock);
 
-    printk("Global Replenishment Events info:\n");
-    list_for_each ( iter, replq )
-    {
-        svc = replq_elem(iter);
-        rt_dump_vcpu(ops, svc);
+        printk("Cluster %d: cpus=%*pbl\n", i, nr_cpu_ids,
+               cpumask_bits(&rqd->active));
+
+        printk("RunQueue info:\n");
+        list_for_each ( iter, &rqd->runq )
+        {
+            svc = q_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        printk("DepletedQueue info:\n");
+        list_for_each ( iter, &rqd->depletedq )
+        {
+            svc = q_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        printk("Replenishment Events info:\n");
+        list_for_each ( iter, &rqd->replq )
+        {
+            svc = replq_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        spin_unlock(&rqd->lock);
     }
 
     printk("Domain info:\n");
@@ -415,13 +500,17 @@ rt_dump(const struct scheduler *ops)
 
         for_each_vcpu ( sdom->dom, v )
         {
+            spinlock_t *lock = vcpu_schedule_lock(v);
+
             svc = rt_vcpu(v);
             rt_dump_vcpu(ops, svc);
+
+            vcpu_schedule_unlock(lock, v);
         }
     }
 
  out:
-    spin_unlock_irqrestore(&prv->lock, flags);
+    read_unlock_irqrestore(&prv->lock, flags);
 }
 
 /*
@@ -530,10 +619,9 @@ q_remove(struct rt_vcpu *svc)
 }
 
 static inline void
-replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
+replq_remove(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
+    struct list_head *replq = &rqd->replq;
 
     ASSERT( vcpu_on_replq(svc) );
 
@@ -548,10 +636,10 @@ replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
         if ( !list_empty(replq) )
         {
             struct rt_vcpu *svc_next = replq_elem(replq->next);
-            set_timer(&prv->repl_timer, svc_next->cur_deadline);
+            set_timer(&rqd->repl_timer, svc_next->cur_deadline);
         }
         else
-            stop_timer(&prv->repl_timer);
+            stop_timer(&rqd->repl_timer);
     }
 }
 
@@ -561,37 +649,31 @@ replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
  * Insert svc without budget in DepletedQ unsorted;
  */
 static void
-runq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
+runq_insert(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
-
-    ASSERT( spin_is_locked(&prv->lock) );
+    ASSERT( spin_is_locked(&rqd->lock) );
     ASSERT( !vcpu_on_q(svc) );
     ASSERT( vcpu_on_replq(svc) );
 
     /* add svc to runq if svc still has budget or its extratime is set */
     if ( svc->cur_budget > 0 ||
          has_extratime(svc) )
-        deadline_runq_insert(svc, &svc->q_elem, runq);
+        deadline_runq_insert(svc, &svc->q_elem, &rqd->runq);
     else
-        list_add(&svc->q_elem, &prv->depletedq);
+        list_add(&svc->q_elem, &rqd->depletedq);
 }
 
 static void
-replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
+replq_insert(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
-    struct rt_private *prv = rt_priv(ops);
-
     ASSERT( !vcpu_on_replq(svc) );
 
     /*
      * The timer may be re-programmed if svc is inserted
      * at the front of the event list.
      */
-    if ( deadline_replq_insert(svc, &svc->replq_elem, replq) )
-        set_timer(&prv->repl_timer, svc->cur_deadline);
+    if ( deadline_replq_insert(svc, &svc->replq_elem, &rqd->replq) )
+        set_timer(&rqd->repl_timer, svc->cur_deadline);
 }
 
 /*
@@ -601,9 +683,9 @@ replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
  * changed.
  */
 static void
-replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
+replq_reinsert(struct rt_runqueue *rqd, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct list_head *replq = &rqd->replq;
     struct rt_vcpu *rearm_svc = svc;
     bool_t rearm = 0;
 
@@ -628,13 +710,17 @@ replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
         rearm = deadline_replq_insert(svc, &svc->replq_elem, replq);
 
     if ( rearm )
-        set_timer(&rt_priv(ops)->repl_timer, rearm_svc->cur_deadline);
+        set_timer(&rqd->repl_timer, rearm_svc->cur_deadline);
 }
 
 /*
  * Pick a valid CPU for the vcpu vc
  * Valid CPU of a vcpu is intesection of vcpu's affinity
  * and available cpus
+ *
+ * With more than one cluster, if that cpu is busy, look for an idle one,
+ * first in the same cluster and then in the others. This is racy, as we
+ * do not hold the locks of the clusters, but that's fine for a hint.
  */
 static int
 rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
@@ -642,6 +728,7 @@ rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
     cpumask_t cpus;
     cpumask_t *online;
     int cpu;
+    unsigned int i;
 
     online = cpupool_domain_cpumask(vc->domain);
     cpumask_and(&cpus, online, vc->cpu_hard_affinity);
@@ -651,9 +738,73 @@ rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
             : cpumask_cycle(vc->processor, &cpus);
     ASSERT( !cpumask_empty(&cpus) && cpumask_test_cpu(cpu, &cpus) );
 
+    if ( opt_cluster == OPT_CLUSTER_ALL || is_idle_vcpu(curr_on_cpu(cpu)) )
+        return cpu;
+
+    for_each_cpu ( i, &cpus )
+        if ( cpumask_test_cpu(i, &c2rqd(cpu)->active) &&
+             is_idle_vcpu(curr_on_cpu(i)) )
+            return i;
+
+    for_each_cpu ( i, &cpus )
+        if ( is_idle_vcpu(curr_on_cpu(i)) )
+            return i;
+
     return cpu;
 }
 
+static inline bool same_node(unsigned int cpua, unsigned int cpub)
+{
+    return cpu_to_node(cpua) == cpu_to_node(cpub);
+}
+
+static inline bool same_socket(unsigned int cpua, unsigned int cpub)
+{
+    return cpu_to_socket(cpua) == cpu_to_socket(cpub);
+}
+
+static inline bool same_core(unsigned int cpua, unsigned int cpub)
+{
+    return same_socket(cpua, cpub) &&
+           cpu_to_core(cpua) == cpu_to_core(cpub);
+}
+
+/* Find (or pick a new one) the cluster for cpu. */
+static unsigned int
+cpu_to_cluster(struct rt_private *prv, unsigned int cpu)
+{
+    unsigned int rqi;
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+    {
+        struct rt_runqueue *rqd = prv->rqd + rqi;
+        unsigned int peer_cpu;
+
+        /*
+         * As soon as we find an unused cluster, use it: either this is
+         * the first cpu (possibly the boot cpu, for which the topology
+         * information is not reliable yet), or no existing cluster matches.
+         */
+        if ( rqd->id == -1 )
+            break;
+
+        BUG_ON(cpumask_empty(&rqd->active));
+        peer_cpu = cpumask_first(&rqd->active);
+
+        if ( opt_cluster == OPT_CLUSTER_CPU )
+            continue;
+        if ( opt_cluster == OPT_CLUSTER_ALL ||
+             (opt_cluster == OPT_CLUSTER_CORE && same_core(peer_cpu, cpu)) ||
+             (opt_cluster == OPT_CLUSTER_SOCKET && same_socket(peer_cpu, cpu)) ||
+             (opt_cluster == OPT_CLUSTER_NODE && same_node(peer_cpu, cpu)) )
+            break;
+    }
+
+    BUG_ON(rqi >= nr_cpu_ids);
+
+    return rqi;
+}
+
 /*
  * Init/Free related code
  */
@@ -661,6 +812,7 @@ static int
 rt_init(struct scheduler *ops)
 {
     int rc = -ENOMEM;
+    unsigned int i;
     struct rt_private *prv = xzalloc(struct rt_private);
 
     printk("Initializing RTDS scheduler\n"
@@ -670,18 +822,24 @@ rt_init(struct scheduler *ops)
     if ( prv == NULL )
         goto err;
 
-    spin_lock_init(&prv->lock);
+    prv->rqd = xzalloc_array(struct rt_runqueue, nr_cpu_ids);
+    if ( prv->rqd == NULL )
+        goto err;
+    for ( i = 0; i < nr_cpu_ids; i++ )
+        prv->rqd[i].id = -1;
+
+    rwlock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
-    INIT_LIST_HEAD(&prv->depletedq);
-    INIT_LIST_HEAD(&prv->replq);
 
     ops->sched_data = prv;
     rc = 0;
 
  err:
-    if ( rc )
+    if ( rc && prv )
+    {
+        xfree(prv->rqd);
         xfree(prv);
+    }
 
     return rc;
 }
@@ -690,42 +848,110 @@ static void
 rt_deinit(struct scheduler *ops)
 {
     struct rt_private *prv = rt_priv(ops);
+    unsigned int i;
 
-    ASSERT(prv->repl_timer.status == TIMER_STATUS_invalid ||
-           prv->repl_timer.status == TIMER_STATUS_killed);
+    for ( i = 0; i < nr_cpu_ids; i++ )
+        ASSERT(prv->rqd[i].repl_timer.status == TIMER_STATUS_invalid ||
+               prv->rqd[i].repl_timer.status == TIMER_STATUS_killed);
 
     ops->sched_data = NULL;
+    xfree(prv->rqd);
     xfree(prv);
 }
 
+static void *
+rt_alloc_pdata(const struct scheduler *ops, int cpu)
+{
+    struct rt_pcpu *spc = xzalloc(struct rt_pcpu);
+
+    if ( spc == NULL )
+        return ERR_PTR(-ENOMEM);
+
+    return spc;
+}
+
+static void
+rt_free_pdata(const struct scheduler *ops, void *pcpu, int cpu)
+{
+    struct rt_pcpu *spc = pcpu;
+
+    /* Either init_pdata was never called, or deinit_pdata was already. */
+    ASSERT(!spc || !spc->rqd);
+
+    xfree(spc);
+}
+
+/*
+ * Add cpu to its cluster, activating the cluster if it is the first cpu
+ * in there. Returns the cluster, the lock of which cpu must use.
+ */
+static struct rt_runqueue *
+init_pdata(struct rt_private *prv, struct rt_pcpu *spc, unsigned int cpu)
+{
+    struct rt_runqueue *rqd;
+    unsigned int rqi;
+
+    ASSERT(rw_is_write_locked(&prv->lock));
+    ASSERT(spc && !spc->rqd);
+
+    rqi = cpu_to_cluster(prv, cpu);
+    rqd = prv->rqd + rqi;
+
+    if ( rqd->id == -1 )
+    {
+        rqd->id = rqi;
+        spin_lock_init(&rqd->lock);
+        INIT_LIST_HEAD(&rqd->runq);
+        INIT_LIST_HEAD(&rqd->depletedq);
+        INIT_LIST_HEAD(&rqd->replq);
+        cpumask_clear(&rqd->tickled);
+        __cpumask_set_cpu(rqi, &prv->active_queues);
+    }
+
+    /*
+     * If we are the first cpu of the cluster to see the timer uninitialized
+     * (TIMER_STATUS_invalid) or killed (all the cpus of the cluster had been
+     * removed, and we are adding one back), it's up to us to initialize it.
+     */
+    if ( rqd->repl_timer.status == TIMER_STATUS_invalid ||
+         rqd->repl_timer.status == TIMER_STATUS_killed )
+    {
+        init_timer(&rqd->repl_timer, repl_timer_handler, rqd, cpu);
+        dprintk(XENLOG_DEBUG, "RTDS: cluster %u timer initialized on cpu %u\n",
+                rqi, cpu);
+    }
+
+    __cpumask_set_cpu(cpu, &rqd->active);
+    spc->rqd = rqd;
+
+    if ( opt_cluster != OPT_CLUSTER_ALL )
+        printk(XENLOG_INFO "RTDS: adding cpu %u to cluster %u\n", cpu, rqi);
+
+    return rqd;
+}
+
 /*
- * Point per_cpu spinlock to the global system lock;
- * All cpu have same global system lock
+ * Point per_cpu spinlock to the lock of the cluster of the cpu
  */
 static void
 rt_init_pdata(const struct scheduler *ops, void *pdata, int cpu)
 {
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
     spinlock_t *old_lock;
     unsigned long flags;
 
-    old_lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    write_lock_irqsave(&prv->lock, flags);
+    old_lock = pcpu_schedule_lock(cpu);
 
-    /*
-     * TIMER_STATUS_invalid means we are the first cpu that sees the timer
-     * allocated but not initialized, and so it's up to us to initialize it.
-     */
-    if ( prv->repl_timer.status == TIMER_STATUS_invalid )
-    {
-        init_timer(&prv->repl_timer, repl_timer_handler, (void *)ops, cpu);
-        dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
-    }
+    rqd = init_pdata(prv, pdata, cpu);
 
-    /* Move the scheduler lock to our global runqueue lock.  */
-    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    /* Move the scheduler lock to our cluster lock.  */
+    per_cpu(schedule_data, cpu).schedule_lock = &rqd->lock;
 
     /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
-    spin_unlock_irqrestore(old_lock, flags);
+    spin_unlock(old_lock);
+    write_unlock_irqrestore(&prv->lock, flags);
 }
 
 /* Change the scheduler of cpu to us (RTDS). */
@@ -735,34 +961,27 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
 {
     struct rt_private *prv = rt_priv(new_ops);
     struct rt_vcpu *svc = vdata;
+    struct rt_runqueue *rqd;
 
-    ASSERT(!pdata && svc && is_idle_vcpu(svc->vcpu));
+    ASSERT(pdata && svc && is_idle_vcpu(svc->vcpu));
 
     /*
      * We are holding the runqueue lock already (it's been taken in
      * schedule_cpu_switch()). It's actually the runqueue lock of
      * another scheduler, but that is how things need to be, for
-     * preventing races.
+     * preventing races. That lock has no ordering relationship with
+     * our private lock, so it is fine to take the latter now.
      */
-    ASSERT(per_cpu(schedule_data, cpu).schedule_lock != &prv->lock);
+    ASSERT(!local_irq_is_enabled());
+    write_lock(&prv->lock);
 
-    /*
-     * If we are the absolute first cpu being switched toward this
-     * scheduler (in which case we'll see TIMER_STATUS_invalid), or the
-     * first one that is added back to the cpupool that had all its cpus
-     * removed (in which case we'll see TIMER_STATUS_killed), it's our
-     * job to (re)initialize the timer.
-     */
-    if ( prv->repl_timer.status == TIMER_STATUS_invalid ||
-         prv->repl_timer.status == TIMER_STATUS_killed )
-    {
-        init_timer(&prv->repl_timer, repl_timer_handler, (void *)new_ops, cpu);
-        dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
-    }
+    rqd = init_pdata(prv, pdata, cpu);
+
+    ASSERT(per_cpu(schedule_data, cpu).schedule_lock != &rqd->lock);
 
     idle_vcpu[cpu]->sched_priv = vdata;
     per_cpu(scheduler, cpu) = new_ops;
-    per_cpu(schedule_data, cpu).sched_priv = NULL; /* no pdata */
+    per_cpu(schedule_data, cpu).sched_priv = pdata;
 
     /*
      * (Re?)route the lock to the per pCPU lock as /last/ thing. In fact,
@@ -770,7 +989,9 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
      * taking it, find all the initializations we've done above in place.
      */
     smp_mb();
-    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    per_cpu(schedule_data, cpu).schedule_lock = &rqd->lock;
+
+    write_unlock(&prv->lock);
 }
 
 static void
@@ -778,31 +999,51 @@ rt_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     unsigned long flags;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_pcpu *spc = pcpu;
+    struct rt_runqueue *rqd;
+
+    ASSERT(spc && spc->rqd);
+
+    write_lock_irqsave(&prv->lock, flags);
 
-    spin_lock_irqsave(&prv->lock, flags);
+    rqd = spc->rqd;
+    spin_lock(&rqd->lock);
 
-    if ( prv->repl_timer.cpu == cpu )
+    __cpumask_clear_cpu(cpu, &rqd->active);
+    __cpumask_clear_cpu(cpu, &rqd->tickled);
+
+    if ( rqd->repl_timer.cpu == cpu )
     {
-        struct cpupool *c = per_cpu(cpupool, cpu);
-        unsigned int new_cpu = cpumask_cycle(cpu, cpupool_online_cpumask(c));
+        unsigned int new_cpu = cpumask_first(&rqd->active);
 
         /*
          * Make sure the timer run on one of the cpus that are still available
-         * to this scheduler. If there aren't any left, it means it's the time
+         * to this cluster. If there aren't any left, it means it's the time
          * to just kill it.
          */
         if ( new_cpu >= nr_cpu_ids )
         {
-            kill_timer(&prv->repl_timer);
+            kill_timer(&rqd->repl_timer);
             dprintk(XENLOG_DEBUG, "RTDS: timer killed on cpu %d\n", cpu);
         }
         else
         {
-            migrate_timer(&prv->repl_timer, new_cpu);
+            migrate_timer(&rqd->repl_timer, new_cpu);
         }
     }
 
-    spin_unlock_irqrestore(&prv->lock, flags);
+    if ( cpumask_empty(&rqd->active) )
+    {
+        ASSERT(list_empty(&rqd->runq) && list_empty(&rqd->depletedq) &&
+               list_empty(&rqd->replq));
+        rqd->id = -1;
+        __cpumask_clear_cpu(rqd - prv->rqd, &prv->active_queues);
+    }
+
+    spc->rqd = NULL;
+
+    spin_unlock(&rqd->lock);
+    write_unlock_irqrestore(&prv->lock, flags);
 }
 
 static void *
@@ -820,9 +1061,9 @@ rt_alloc_domdata(const struct scheduler *ops, struct domain *dom)
     sdom->dom = dom;
 
     /* spinlock here to insert the dom */
-    spin_lock_irqsave(&prv->lock, flags);
+    write_lock_irqsave(&prv->lock, flags);
     list_add_tail(&sdom->sdom_elem, &(prv->sdom));
-    spin_unlock_irqrestore(&prv->lock, flags);
+    write_unlock_irqrestore(&prv->lock, flags);
 
     return sdom;
 }
@@ -837,9 +1078,9 @@ rt_free_domdata(const struct scheduler *ops, void *data)
     {
         unsigned long flags;
 
-        spin_lock_irqsave(&prv->lock, flags);
+        write_lock_irqsave(&prv->lock, flags);
         list_del_init(&sdom->sdom_elem);
-        spin_unlock_irqrestore(&prv->lock, flags);
+        write_unlock_irqrestore(&prv->lock, flags);
 
         xfree(sdom);
     }
@@ -908,10 +1149,10 @@ rt_vcpu_insert(const struct scheduler *ops, struct vcpu *vc)
 
     if ( !vcpu_on_q(svc) && vcpu_runnable(vc) )
     {
-        replq_insert(ops, svc);
+        replq_insert(svc_rqd(svc), svc);
 
         if ( !vc->is_running )
-            runq_insert(ops, svc);
+            runq_insert(svc_rqd(svc), svc);
     }
     vcpu_schedule_unlock_irq(lock, vc);
 
@@ -937,7 +1178,7 @@ rt_vcpu_remove(const struct scheduler *ops, struct vcpu *vc)
         q_remove(svc);
 
     if ( vcpu_on_replq(svc) )
-        replq_remove(ops,svc);
+        replq_remove(svc_rqd(svc), svc);
 
     vcpu_schedule_unlock_irq(lock, vc);
 }
@@ -1011,9 +1252,9 @@ burn_budget(const struct scheduler *ops, struct rt_vcpu *svc, s_time_t now)
  * lock is grabbed before calling this function
  */
 static struct rt_vcpu *
-runq_pick(const struct scheduler *ops, const cpumask_t *mask)
+runq_pick(struct rt_runqueue *rqd, const cpumask_t *mask)
 {
-    struct list_head *runq = rt_runq(ops);
+    struct list_head *runq = &rqd->runq;
     struct list_head *iter;
     struct rt_vcpu *svc = NULL;
     struct rt_vcpu *iter_svc = NULL;
@@ -1058,6 +1299,54 @@ runq_pick(const struct scheduler *ops, const cpumask_t *mask)
     return svc;
 }
 
+/*
+ * Look in the other clusters for a vcpu, waiting in a runqueue, that can
+ * run on cpu, and move it to our cluster (rqd), so that cpu does not go
+ * idle while there is work around. The first one that is found is taken.
+ *
+ * We hold the lock of rqd already, so we only trylock the private lock and
+ * the locks of the other clusters, and just skip them on failure.
+ */
+static void
+runq_pull(const struct scheduler *ops, struct rt_runqueue *rqd,
+          unsigned int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    unsigned int rqi;
+
+    if ( !read_trylock(&prv->lock) )
+        return;
+
+    for_each_cpu ( rqi, &prv->active_queues )
+    {
+        struct rt_runqueue *orqd = prv->rqd + rqi;
+        struct rt_vcpu *svc;
+
+        if ( orqd == rqd || list_empty(&orqd->runq) ||
+             !spin_trylock(&orqd->lock) )
+            continue;
+
+        svc = runq_pick(orqd, cpumask_of(cpu));
+        if ( svc != NULL )
+        {
+            q_remove(svc);
+            replq_remove(orqd, svc);
+            /* This is safe, as we hold both the old and the new lock. */
+            svc->vcpu->processor = cpu;
+            replq_insert(rqd, svc);
+            runq_insert(rqd, svc);
+            SCHED_STAT_CRANK(rtds_pull);
+        }
+
+        spin_unlock(&orqd->lock);
+
+        if ( svc != NULL )
+            break;
+    }
+
+    read_unlock(&prv->lock);
+}
+
 /*
  * schedule function for rt scheduler.
  * The lock is already grabbed in schedule.c, no need to lock here
@@ -1066,7 +1355,7 @@ static struct task_slice
 rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_scheduled)
 {
     const int cpu = smp_processor_id();
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = c2rqd(cpu);
     struct rt_vcpu *const scurr = rt_vcpu(current);
     struct rt_vcpu *snext = NULL;
     struct task_slice ret = { .migrated = 0 };
@@ -1078,7 +1367,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
         } d;
         d.cpu = cpu;
         d.tasklet = tasklet_work_scheduled;
-        d.tickled = cpumask_test_cpu(cpu, &prv->tickled);
+        d.tickled = cpumask_test_cpu(cpu, &rqd->tickled);
         d.idle = is_idle_vcpu(current);
         trace_var(TRC_RTDS_SCHEDULE, 1,
                   sizeof(d),
@@ -1086,7 +1375,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
     }
 
     /* clear ticked bit now that we've been scheduled */
-    cpumask_clear_cpu(cpu, &prv->tickled);
+    cpumask_clear_cpu(cpu, &rqd->tickled);
 
     /* burn_budget would return for IDLE VCPU */
     burn_budget(ops, scurr, now);
@@ -1098,7 +1387,17 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
     }
     else
     {
-        snext = runq_pick(ops, cpumask_of(cpu));
+        snext = runq_pick(rqd, cpumask_of(cpu));
+
+        /* If we would go idle, see if other clusters have work for us. */
+        if ( snext == NULL && opt_cluster != OPT_CLUSTER_ALL &&
+             (is_idle_vcpu(current) || !vcpu_runnable(current) ||
+              scurr->cur_budget <= 0) )
+        {
+            runq_pull(ops, rqd, cpu);
+            snext = runq_pick(rqd, cpumask_of(cpu));
+        }
+
         if ( snext == NULL )
             snext = rt_vcpu(idle_vcpu[cpu]);
 
@@ -1154,7 +1453,7 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
     else if ( vcpu_on_q(svc) )
     {
         q_remove(svc);
-        replq_remove(ops, svc);
+        replq_remove(svc_rqd(svc), svc);
     }
     else if ( svc->flags & RTDS_delayed_runq_add )
         __clear_bit(__RTDS_delayed_runq_add, &svc->flags);
@@ -1171,6 +1470,8 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
  * 2) now all pcpus are busy;
  *    among all the running vcpus, pick lowest priority one
  *    if snext has higher priority, kick it.
+ * 3) with clusters, if no pcpu of the cluster of new can be kicked, poke
+ *    an idle pcpu from another cluster, which will then pull new.
  *
  * TODO:
  * 1) what if these two vcpus belongs to the same domain?
@@ -1179,9 +1480,8 @@ rt_vcpu_sleep(const struct scheduler *ops, struct vcpu *vc)
  * lock is grabbed before calling this function
  */
 static void
-runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
+runq_tickle(struct rt_runqueue *rqd, struct rt_vcpu *new)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *latest_deadline_vcpu = NULL; /* lowest priority */
     struct rt_vcpu *iter_svc;
     struct vcpu *iter_vc;
@@ -1194,7 +1494,8 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
 
     online = cpupool_domain_cpumask(new->vcpu->domain);
     cpumask_and(&not_tickled, online, new->vcpu->cpu_hard_affinity);
-    cpumask_andnot(&not_tickled, &not_tickled, &prv->tickled);
+    cpumask_and(&not_tickled, &not_tickled, &rqd->active);
+    cpumask_andnot(&not_tickled, &not_tickled, &rqd->tickled);
 
     /*
      * 1) If there are any idle CPUs, kick one.
@@ -1229,6 +1530,27 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
         goto out;
     }
 
+    /*
+     * 3) Push: new has to wait in our cluster, but an idle cpu elsewhere
+     *    could run it. We don't have the lock of that cpu, so just poke it,
+     *    rather than marking it tickled. It will pull new, unless someone
+     *    else gets to it first (either here or in another cluster).
+     */
+    if ( opt_cluster != OPT_CLUSTER_ALL )
+    {
+        cpumask_and(&not_tickled, online, new->vcpu->cpu_hard_affinity);
+        cpumask_andnot(&not_tickled, &not_tickled, &rqd->active);
+        for_each_cpu ( cpu, &not_tickled )
+        {
+            if ( is_idle_vcpu(curr_on_cpu(cpu)) )
+            {
+                SCHED_STAT_CRANK(rtds_push);
+                cpu_raise_softirq(cpu, SCHEDULE_SOFTIRQ);
+                return;
+            }
+        }
+    }
+
     /* didn't tickle any cpu */
     SCHED_STAT_CRANK(tickled_no_cpu);
     return;
@@ -1245,7 +1567,7 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
                   (unsigned char *)&d);
     }
 
-    cpumask_set_cpu(cpu_to_tickle, &prv->tickled);
+    cpumask_set_cpu(cpu_to_tickle, &rqd->tickled);
     cpu_raise_softirq(cpu_to_tickle, SCHEDULE_SOFTIRQ);
     return;
 }
@@ -1310,16 +1632,16 @@ rt_vcpu_wake(const struct scheduler *ops, struct vcpu *vc)
          * and queue a new one (to occur at our new deadline).
          */
         if ( missed )
-           replq_reinsert(ops, svc);
+           replq_reinsert(svc_rqd(svc), svc);
         return;
     }
 
     /* Replenishment event got cancelled when we blocked. Add it back. */
-    replq_insert(ops, svc);
+    replq_insert(svc_rqd(svc), svc);
     /* insert svc to runq/depletedq because svc is not in queue now */
-    runq_insert(ops, svc);
+    runq_insert(svc_rqd(svc), svc);
 
-    runq_tickle(ops, svc);
+    runq_tickle(svc_rqd(svc), svc);
 }
 
 /*
@@ -1340,11 +1662,11 @@ rt_context_saved(const struct scheduler *ops, struct vcpu *vc)
     if ( __test_and_clear_bit(__RTDS_delayed_runq_add, &svc->flags) &&
          likely(vcpu_runnable(vc)) )
     {
-        runq_insert(ops, svc);
-        runq_tickle(ops, svc);
+        runq_insert(svc_rqd(svc), svc);
+        runq_tickle(svc_rqd(svc), svc);
     }
     else
-        replq_remove(ops, svc);
+        replq_remove(svc_rqd(svc), svc);
 
 out:
     vcpu_schedule_unlock_irq(lock, vc);
@@ -1359,9 +1681,9 @@ rt_dom_cntl(
     struct domain *d,
     struct xen_domctl_scheduler_op *op)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *svc;
     struct vcpu *v;
+    spinlock_t *lock;
     unsigned long flags;
     int rc = 0;
     struct xen_domctl_schedparam_vcpu local_sched;
@@ -1381,14 +1703,14 @@ rt_dom_cntl(
             rc = -EINVAL;
             break;
         }
-        spin_lock_irqsave(&prv->lock, flags);
         for_each_vcpu ( d, v )
         {
+            lock = vcpu_schedule_lock_irqsave(v, &flags);
             svc = rt_vcpu(v);
             svc->period = MICROSECS(op->u.rtds.period); /* transfer to nanosec */
             svc->budget = MICROSECS(op->u.rtds.budget);
+            vcpu_schedule_unlock_irqrestore(lock, flags, v);
         }
-        spin_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_getvcpuinfo:
     case XEN_DOMCTL_SCHEDOP_putvcpuinfo:
@@ -1409,15 +1731,16 @@ rt_dom_cntl(
 
             if ( op->cmd == XEN_DOMCTL_SCHEDOP_getvcpuinfo )
             {
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_vcpu(d->vcpu[local_sched.vcpuid]);
+                v = d->vcpu[local_sched.vcpuid];
+                lock = vcpu_schedule_lock_irqsave(v, &flags);
+                svc = rt_vcpu(v);
                 local_sched.u.rtds.budget = svc->budget / MICROSECS(1);
                 local_sched.u.rtds.period = svc->period / MICROSECS(1);
                 if ( has_extratime(svc) )
                     local_sched.u.rtds.flags |= XEN_DOMCTL_SCHEDRT_extra;
                 else
                     local_sched.u.rtds.flags &= ~XEN_DOMCTL_SCHEDRT_extra;
-                spin_unlock_irqrestore(&prv->lock, flags);
+                vcpu_schedule_unlock_irqrestore(lock, flags, v);
 
                 if ( copy_to_guest_offset(op->u.v.vcpus, index,
                                           &local_sched, 1) )
@@ -1437,15 +1760,16 @@ rt_dom_cntl(
                     break;
                 }
 
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_vcpu(d->vcpu[local_sched.vcpuid]);
+                v = d->vcpu[local_sched.vcpuid];
+                lock = vcpu_schedule_lock_irqsave(v, &flags);
+                svc = rt_vcpu(v);
                 svc->period = period;
                 svc->budget = budget;
                 if ( local_sched.u.rtds.flags & XEN_DOMCTL_SCHEDRT_extra )
                     __set_bit(__RTDS_extratime, &svc->flags);
                 else
                     __clear_bit(__RTDS_extratime, &svc->flags);
-                spin_unlock_irqrestore(&prv->lock, flags);
+                vcpu_schedule_unlock_irqrestore(lock, flags, v);
             }
             /* Process a most 64 vCPUs without checking for preemptions. */
             if ( (++index > 63) && hypercall_preempt_check() )
@@ -1462,19 +1786,18 @@ rt_dom_cntl(
 
 /*
  * The replenishment timer handler picks vcpus
- * from the replq and does the actual replenishment.
+ * from the replq of a cluster and does the actual replenishment.
  */
 static void repl_timer_handler(void *data){
     s_time_t now;
-    struct scheduler *ops = data;
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct rt_runqueue *rqd = data;
+    struct list_head *replq = &rqd->replq;
+    struct list_head *runq = &rqd->runq;
     struct list_head *iter, *tmp;
     struct rt_vcpu *svc;
     LIST_HEAD(tmp_replq);
 
-    spin_lock_irq(&prv->lock);
+    spin_lock_irq(&rqd->lock);
 
     now = NOW();
 
@@ -1498,7 +1821,7 @@ static void repl_timer_handler(void *data){
         if ( vcpu_on_q(svc) )
         {
             q_remove(svc);
-            runq_insert(ops, svc);
+            runq_insert(rqd, svc);
         }
     }
 
@@ -1519,11 +1842,11 @@ static void repl_timer_handler(void *data){
             struct rt_vcpu *next_on_runq = q_elem(runq->next);
 
             if ( compare_vcpu_priority(svc, next_on_runq) < 0 )
-                runq_tickle(ops, next_on_runq);
+                runq_tickle(rqd, next_on_runq);
         }
         else if ( __test_and_clear_bit(__RTDS_depleted, &svc->flags) &&
                   vcpu_on_q(svc) )
-            runq_tickle(ops, svc);
+            runq_tickle(rqd, svc);
 
         list_del(&svc->replq_elem);
         deadline_replq_insert(svc, &svc->replq_elem, replq);
@@ -1535,9 +1858,9 @@ static void repl_timer_handler(void *data){
      * the one in the front.
      */
     if ( !list_empty(replq) )
-        set_timer(&prv->repl_timer, replq_elem(replq->next)->cur_deadline);
+        set_timer(&rqd->repl_timer, replq_elem(replq->next)->cur_deadline);
 
-    spin_unlock_irq(&prv->lock);
+    spin_unlock_irq(&rqd->lock);
 }
 
 static const struct scheduler sched_rtds_def = {
@@ -1550,9 +1873,11 @@ static const struct scheduler sched_rtds_def = {
     .dump_settings  = rt_dump,
     .init           = rt_init,
     .deinit         = rt_deinit,
+    .alloc_pdata    = rt_alloc_pdata,
     .init_pdata     = rt_init_pdata,
     .switch_sched   = rt_switch_sched,
     .deinit_pdata   = rt_deinit_pdata,
+    .free_pdata     = rt_free_pdata,
     .alloc_domdata  = rt_alloc_domdata,
     .free_domdata   = rt_free_domdata,
     .alloc_vdata    = rt_alloc_vdata,
@@ -54,6 +54,24 @@ boolean_param("sched_smt_power_savings", sched_smt_power_savings);
  * */
 int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
 integer_param("sched_ratelimit_us", sched_ratelimit_us);
+
+/* Scheduling granularity: co-schedule vcpus of a domain on cores/sockets. */
+enum sched_gran __read_mostly opt_sched_granularity = SCHED_GRAN_cpu;
+
+static int __init parse_sched_granularity(const char *str)
+{
+    if ( !strcmp(str, "cpu") )
+        opt_sched_granularity = SCHED_GRAN_cpu;
+    else if ( !strcmp(str, "core") )
+        opt_sched_granularity = SCHED_GRAN_core;
+    else if ( !strcmp(str, "socket") )
+        opt_sched_granularity = SCHED_GRAN_socket;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+custom_param("sched-gran", parse_sched_granularity);
 /* Various timer handlers. */
 static void s_timer_fn(void *unused);
 static void vcpu_periodic_timer_fn(void *data);
@@ -1793,6 +1811,29 @@ void __init scheduler_init(void)
         printk("Using '%s' (%s)\n", ops.name, ops.opt_name);
     }
 
+    /* Only credit2 enforces a scheduling granularity other than cpu. */
+    if ( opt_sched_granularity != SCHED_GRAN_cpu &&
+         ops.sched_id != XEN_SCHEDULER_CREDIT2 )
+    {
+        for ( i = 0; i < NUM_SCHEDULERS; i++ )
+            if ( schedulers[i] &&
+                 schedulers[i]->sched_id == XEN_SCHEDULER_CREDIT2 )
+                break;
+        if ( i < NUM_SCHEDULERS )
+        {
+            printk("sched-gran needs credit2, using it instead of %s\n",
+                   ops.opt_name);
+            ops = *schedulers[i];
+        }
+        else
+        {
+            printk(XENLOG_WARNING
+                   "sched-gran needs credit2, which is not available: "
+                   "ignoring it\n");
+            opt_sched_granularity = SCHED_GRAN_cpu;
+        }
+    }
+
     if ( cpu_schedule_up(0) )
         BUG();
     register_cpu_notifier(&cpu_schedule_nfb);
@@ -1940,6 +1981,12 @@ struct scheduler *scheduler_alloc(unsigned int sched_id, int *perr)
     return NULL;
 
  found:
+    /* Other schedulers would let a unit run several domains at once. */
+    *perr = -EOPNOTSUPP;
+    if ( opt_sched_granularity != SCHED_GRAN_cpu &&
+         sched_id != XEN_SCHEDULER_CREDIT2 )
+        return NULL;
+
     *perr = -ENOMEM;
     if ( (sched = xmalloc(struct scheduler)) == NULL )
         return NULL;
@@ -17,6 +17,7 @@
 #include <xen/trace.h>
 #include <xen/console.h>
 #include <xen/iocap.h>
+#include <xen/grant_table.h>
 #include <xen/guest_access.h>
 #include <xen/keyhandler.h>
 #include <asm/current.h>
@@ -502,6 +503,35 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
         break;
     }
 
+    case XEN_SYSCTL_gnttab_stats:
+    {
+        struct xen_sysctl_gnttab_stats *stats = &op->u.gnttab_stats;
+        struct domain *d;
+
+        if ( stats->pad[0] || stats->pad[1] || stats->pad[2] )
+        {
+            ret = -EINVAL;
+            break;
+        }
+
+        d = rcu_lock_domain_by_id(stats->domid);
+        if ( d == NULL )
+        {
+            ret = -ESRCH;
+            break;
+        }
+
+        ret = xsm_getdomaininfo(XSM_HOOK, d);
+        if ( !ret )
+        {
+            gnttab_get_stats(d, stats);
+            copyback = 1;
+        }
+
+        rcu_unlock_domain(d);
+        break;
+    }
+
     default:
         ret = arch_do_sysctl(op, u_sysctl);
         copyback = 0;
@@ -178,6 +178,15 @@ struct log_dirty_domain {
     unsigned int   fault_count;
     unsigned int   dirty_count;
 
+    /*
+     * pfns newly marked dirty since they were last cleaned, in the order they
+     * were marked, for XEN_DOMCTL_SHADOW_OP_CLEAN_LIST.  Once full, only the
+     * bitmap is kept up to date until the next XEN_DOMCTL_SHADOW_OP_CLEAN.
+     */
+    uint64_t      *list, *spare_list;
+    unsigned int   list_count;
+    bool           list_overflow;
+
     /* functions which are paging mode specific */
     const struct log_dirty_ops {
         int        (*enable  )(struct domain *d, bool log_global);
@@ -211,6 +220,9 @@ struct paging_domain {
                 unsigned long i4:PAGETABLE_ORDER;
                 unsigned long i3:PAGETABLE_ORDER;
             } log_dirty;
+            struct {
+                unsigned int done, count;
+            } log_dirty_list;
         };
     } preempt;
 
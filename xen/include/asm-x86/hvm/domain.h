@@ -51,6 +51,18 @@ struct hvm_ioreq_vcpu {
 #define NR_IO_RANGE_TYPES (XEN_DMOP_IO_RANGE_PCI + 1)
 #define MAX_NR_IO_RANGES  256
 
+/* A range of addresses of one type, and the server it goes to */
+struct hvm_ioreq_range {
+    unsigned long start, end;
+    unsigned int  id;
+};
+
+struct hvm_ioreq_index {
+    struct hvm_ioreq_range *ranges;    /* sorted by start, not overlapping */
+    unsigned int           nr;
+    bool                   valid;
+};
+
 struct hvm_ioreq_server {
     struct domain          *target, *emulator;
 
@@ -103,6 +115,10 @@ struct hvm_domain {
     struct {
         spinlock_t              lock;
         struct hvm_ioreq_server *server[MAX_NR_IOREQ_SERVERS];
+
+        /* Ranges of the enabled servers, for hvm_select_ioreq_server() */
+        rwlock_t                index_lock;
+        struct hvm_ioreq_index  index[NR_IO_RANGE_TYPES];
     } ioreq_server;
 
     /* Cached CF8 for guest PCI config cycles */
@@ -172,6 +172,18 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * Return a list of the pfns dirtied since they were last returned or
+  * cleaned, and clean them in the internal copy.  dirty_bitmap points at an
+  * array of uint64_t pfns, of 'pages' entries, and 'pages' is updated with
+  * the number returned.  The cost is proportional to the number of dirty
+  * pages rather than to the size of the guest.
+  *
+  * Fails with -ENOBUFS if more pages have been dirtied than Xen could
+  * record, or than fit in the array; the bitmap is left untouched, and
+  * OP_CLEAN must be used for this round.  Only available with HAP.
+  */
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_LIST  13
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -209,7 +221,7 @@ struct xen_domctl_getpageframeinfo3 {
   */
 #define XEN_DOMCTL_SHADOW_ENABLE_EXTERNAL  (1 << 4)
 
-/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK}. */
+/* Mode flags for XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK,CLEAN_LIST}. */
  /*
   * This is the final iteration: Requesting to include pages mapped
   * writably by the hypervisor in the dirty bitmap.
@@ -226,13 +238,13 @@ struct xen_domctl_shadow_op {
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
 
     /* OP_ENABLE: XEN_DOMCTL_SHADOW_ENABLE_* */
-    /* OP_PEAK / OP_CLEAN: XEN_DOMCTL_SHADOW_LOGDIRTY_* */
+    /* OP_PEAK / OP_CLEAN / OP_CLEAN_LIST: XEN_DOMCTL_SHADOW_LOGDIRTY_* */
     uint32_t       mode;
 
     /* OP_GET_ALLOCATION / OP_SET_ALLOCATION */
     uint32_t       mb;       /* Shadow memory allocation in MB */
 
-    /* OP_PEEK / OP_CLEAN */
+    /* OP_PEEK / OP_CLEAN / OP_CLEAN_LIST */
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
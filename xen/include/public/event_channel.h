@@ -74,6 +74,7 @@
 #define EVTCHNOP_init_control    11
 #define EVTCHNOP_expand_array    12
 #define EVTCHNOP_set_priority    13
+#define EVTCHNOP_set_coalesce    14
 /* ` } */
 
 typedef uint32_t evtchn_port_t;
@@ -312,6 +313,25 @@ struct evtchn_set_priority {
 };
 typedef struct evtchn_set_priority evtchn_set_priority_t;
 
+/*
+ * EVTCHNOP_set_coalesce: coalesce the notifications on a local event
+ * channel (FIFO ABI only).
+ * Up to <max_events> - 1 notifications that would each raise an upcall are
+ * held back, for at most <max_delay_us> microseconds since the first one,
+ * and then delivered as a single event. Setting <max_events> to 0 or 1
+ * disables coalescing (which is the default). The setting is reset when
+ * the port is bound again, and held back events are delivered right away
+ * when the port is unmasked. Only bound ports can be set up.
+ */
+#define EVTCHN_COALESCE_MAX_DELAY_US 10000
+struct evtchn_set_coalesce {
+    /* IN parameters. */
+    uint32_t port;
+    uint32_t max_events;
+    uint32_t max_delay_us;
+};
+typedef struct evtchn_set_coalesce evtchn_set_coalesce_t;
+
 /*
  * ` enum neg_errnoval
  * ` HYPERVISOR_event_channel_op_compat(struct evtchn_op *op)
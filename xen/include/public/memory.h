@@ -391,6 +391,7 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+#define XENMEM_paging_op_discard            3
 
 struct xen_mem_paging_op {
     uint8_t     op;         /* XENMEM_paging_op_* */
@@ -482,6 +483,20 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
 #define XENMEM_sharing_op_add_physmap       6
 #define XENMEM_sharing_op_audit             7
 #define XENMEM_sharing_op_range_share       8
+/*
+ * As XENMEM_sharing_op_share, but the pages are only shared if their contents
+ * are identical, and the op fails with -ENODATA otherwise.  As nominated
+ * pages cannot be written without invalidating their handle, this lets a
+ * tool pick candidates by hash without racing with the guest.
+ */
+#define XENMEM_sharing_op_share_identical   9
+/*
+ * Nominate and share an array of (source gfn, client domain, client gfn)
+ * tuples in one call.  Each entry's result is written back to its rc field,
+ * and the op itself only fails for errors affecting the whole batch.  The
+ * op is preemptible; opaque is used for the continuation and must be 0.
+ */
+#define XENMEM_sharing_op_share_batch       10
 
 #define XENMEM_SHARING_OP_S_HANDLE_INVALID  (-10)
 #define XENMEM_SHARING_OP_C_HANDLE_INVALID  (-9)
@@ -492,6 +507,19 @@ DEFINE_XEN_GUEST_HANDLE(xen_mem_access_op_t);
  * to grant references, and this allows sharing of the grefs */
 #define XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG   (xen_mk_ullong(1) << 62)
 
+/* Only share batch entries whose page contents are identical. */
+#define XENMEM_SHARING_BATCH_IDENTICAL      (1u << 0)
+
+struct xen_mem_sharing_batch_entry {
+    uint64_aligned_t source_gfn;    /* IN: the gfn of the source page */
+    uint64_aligned_t client_gfn;    /* IN: the client gfn */
+    domid_t  client_domain;         /* IN: the client domain id */
+    uint16_t _pad;                  /* Must be set to 0 */
+    int32_t  rc;                    /* OUT: 0 or a negative error code */
+};
+typedef struct xen_mem_sharing_batch_entry xen_mem_sharing_batch_entry_t;
+DEFINE_XEN_GUEST_HANDLE(xen_mem_sharing_batch_entry_t);
+
 #define XENMEM_SHARING_OP_FIELD_MAKE_GREF(field, val)  \
     (field) = (XENMEM_SHARING_OP_FIELD_IS_GREF_FLAG | val)
 #define XENMEM_SHARING_OP_FIELD_IS_GREF(field)         \
@@ -511,7 +539,7 @@ struct xen_mem_sharing_op {
             } u;
             uint64_aligned_t  handle;     /* OUT: the handle           */
         } nominate;
-        struct mem_sharing_op_share {     /* OP_SHARE/ADD_PHYSMAP */
+        struct mem_sharing_op_share {     /* OP_SHARE[_IDENTICAL]/ADD_PHYSMAP */
             uint64_aligned_t source_gfn;    /* IN: the gfn of the source page */
             uint64_aligned_t source_handle; /* IN: handle to the source page */
             uint64_aligned_t client_gfn;    /* IN: the client gfn */
@@ -525,6 +553,13 @@ struct xen_mem_sharing_op {
             domid_t client_domain;           /* IN: the client domain id */
             uint16_t _pad[3];                /* Must be set to 0 */
         } range;
+        struct mem_sharing_op_batch {         /* OP_SHARE_BATCH */
+            XEN_GUEST_HANDLE_64(xen_mem_sharing_batch_entry_t) entries;
+                                             /* IN/OUT: the entries */
+            uint32_t nr_entries;             /* IN: number of entries */
+            uint32_t flags;                  /* IN: XENMEM_SHARING_BATCH_* */
+            uint64_aligned_t opaque;         /* Must be set to 0 */
+        } batch;
         struct mem_sharing_op_debug {     /* OP_DEBUG_xxx */
             union {
                 uint64_aligned_t gfn;      /* IN: gfn to debug          */
@@ -1100,6 +1100,26 @@ typedef struct xen_sysctl_cpu_policy xen_sysctl_cpu_policy_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_cpu_policy_t);
 #endif
 
+/*
+ * XEN_SYSCTL_gnttab_stats
+ *
+ * Return the grant table usage statistics of a domain.  All counters are
+ * cumulative since the domain was created, and count the operations the
+ * domain did itself (i.e. as the mapping or copying side).
+ */
+struct xen_sysctl_gnttab_stats {
+    domid_t domid;                /* IN */
+    uint16_t pad[3];              /* IN: MUST be zero. */
+    uint64_aligned_t maps;        /* OUT: successful GNTTABOP_map_grant_ref */
+    uint64_aligned_t unmaps;      /* OUT: successful unmap operations */
+    uint64_aligned_t copies;      /* OUT: successful GNTTABOP_copy */
+    uint64_aligned_t copy_bytes;  /* OUT: bytes copied by GNTTABOP_copy */
+    uint64_aligned_t transfers;   /* OUT: successful GNTTABOP_transfer */
+    uint64_aligned_t iommu_ops;   /* OUT: IOMMU updates for mappings */
+    uint64_aligned_t maptrack_steals; /* OUT: maptrack handles taken from
+                                       * another VCPU's free list */
+};
+
 struct xen_sysctl {
     uint32_t cmd;
 #define XEN_SYSCTL_readconsole                    1
@@ -1130,6 +1150,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_livepatch_op                  27
 #define XEN_SYSCTL_set_parameter                 28
 #define XEN_SYSCTL_get_cpu_policy                29
+#define XEN_SYSCTL_gnttab_stats                  30
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -1162,6 +1183,7 @@ struct xen_sysctl {
 #if defined(__i386__) || defined(__x86_64__)
         struct xen_sysctl_cpu_policy        cpu_policy;
 #endif
+        struct xen_sysctl_gnttab_stats      gnttab_stats;
         uint8_t                             pad[128];
     } u;
 };
@@ -169,6 +169,8 @@ struct evtchn_port_ops {
     bool (*is_busy)(const struct domain *d, evtchn_port_t port);
     int (*set_priority)(struct domain *d, struct evtchn *evtchn,
                         unsigned int priority);
+    int (*set_coalesce)(struct domain *d, struct evtchn *evtchn,
+                        unsigned int max_events, unsigned int max_delay_us);
     void (*print_state)(struct domain *d, const struct evtchn *evtchn);
 };
 
@@ -225,6 +227,17 @@ static inline int evtchn_port_set_priority(struct domain *d,
     return d->evtchn_port_ops->set_priority(d, evtchn, priority);
 }
 
+static inline int evtchn_port_set_coalesce(struct domain *d,
+                                           struct evtchn *evtchn,
+                                           unsigned int max_events,
+                                           unsigned int max_delay_us)
+{
+    if ( !d->evtchn_port_ops->set_coalesce )
+        return -ENOSYS;
+    return d->evtchn_port_ops->set_coalesce(d, evtchn, max_events,
+                                            max_delay_us);
+}
+
 static inline void evtchn_port_print_state(struct domain *d,
                                            const struct evtchn *evtchn)
 {
@@ -30,6 +30,7 @@
 #include <asm/grant_table.h>
 
 struct grant_table;
+struct xen_sysctl_gnttab_stats;
 
 extern unsigned int opt_max_grant_frames;
 extern unsigned int opt_max_maptrack_frames;
@@ -41,6 +42,10 @@ void grant_table_destroy(
     struct domain *d);
 void grant_table_init_vcpu(struct vcpu *v);
 
+/* Sum up the grant usage statistics of a domain. */
+void gnttab_get_stats(struct domain *d,
+                      struct xen_sysctl_gnttab_stats *stats);
+
 /*
  * Check if domain has active grants and log first 10 of them.
  */
@@ -77,6 +77,18 @@ PERFCOUNTER(credit_reset,           "csched2: credit_reset")
 PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
+PERFCOUNTER(unit_switch,            "csched2: unit_switch")
+
+/* rtds specific counters */
+PERFCOUNTER(rtds_push,              "rtds: push")
+PERFCOUNTER(rtds_pull,              "rtds: pull")
+
+/* grant table maptrack counters */
+PERFCOUNTER(maptrack_refill,        "maptrack: refill")
+PERFCOUNTER(maptrack_flush,         "maptrack: flush")
+PERFCOUNTER(maptrack_grow,          "maptrack: grow")
+PERFCOUNTER(maptrack_steal,         "maptrack: steal")
+PERFCOUNTER(maptrack_exhausted,     "maptrack: exhausted")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
@@ -10,6 +10,7 @@
 
 #include <xen/percpu.h>
 #include <xen/err.h>
+#include <xen/smp.h>
 
 /* A global pointer to the initial cpupool (POOL0). */
 extern struct cpupool *cpupool0;
@@ -22,6 +23,32 @@ extern cpumask_t cpupool_free_cpus;
 #define SCHED_DEFAULT_RATELIMIT_US 1000
 extern int sched_ratelimit_us;
 
+/*
+ * Scheduling granularity: all pCPUs of a scheduling unit (a core or a
+ * socket) only ever run vCPUs of one domain at a time, or idle.  This is
+ * up to the scheduler to enforce, and only credit2 does so.
+ */
+enum sched_gran {
+    SCHED_GRAN_cpu,
+    SCHED_GRAN_core,
+    SCHED_GRAN_socket,
+};
+extern enum sched_gran opt_sched_granularity;
+
+/* The pCPUs which are in the same scheduling unit as cpu. */
+static inline const cpumask_t *sched_unit_mask(unsigned int cpu)
+{
+    switch ( opt_sched_granularity )
+    {
+    case SCHED_GRAN_core:
+        return per_cpu(cpu_sibling_mask, cpu);
+    case SCHED_GRAN_socket:
+        return per_cpu(cpu_core_mask, cpu);
+    default:
+        return cpumask_of(cpu);
+    }
+}
+
 
 /*
  * In order to allow a scheduler to remap the lock->cpu mapping,